@@ -4,50 +4,98 @@
 
 # Add inputs and outputs from these tool invocations to the build variables 
 C_SRCS += \
+../Sources/Benchmark.c \
 ../Sources/Calc.c \
+../Sources/Conditioning.c \
+../Sources/Decimator.c \
+../Sources/Deadline.c \
+../Sources/Demand.c \
 ../Sources/Events.c \
 ../Sources/FIFO.c \
 ../Sources/FTM.c \
 ../Sources/FixedPoint.c \
+../Sources/Frequency.c \
 ../Sources/Flash.c \
+../Sources/Harmonic.c \
 ../Sources/HMI.c \
+../Sources/Idle.c \
 ../Sources/LEDs.c \
+../Sources/LoadProfile.c \
+../Sources/Mailbox.c \
 ../Sources/PIT.c \
+../Sources/PowerQuality.c \
+../Sources/Profile.c \
 ../Sources/RTC.c \
+../Sources/SelfTest.c \
+../Sources/Stack.c \
 ../Sources/Switch.c \
+../Sources/Tariff.c \
 ../Sources/UART.c \
+../Sources/Waveform.c \
 ../Sources/main.c \
 ../Sources/packet.c 
 
 OBJS += \
+./Sources/Benchmark.o \
 ./Sources/Calc.o \
+./Sources/Conditioning.o \
+./Sources/Decimator.o \
+./Sources/Deadline.o \
+./Sources/Demand.o \
 ./Sources/Events.o \
 ./Sources/FIFO.o \
 ./Sources/FTM.o \
 ./Sources/FixedPoint.o \
+./Sources/Frequency.o \
 ./Sources/Flash.o \
+./Sources/Harmonic.o \
 ./Sources/HMI.o \
+./Sources/Idle.o \
 ./Sources/LEDs.o \
+./Sources/LoadProfile.o \
+./Sources/Mailbox.o \
 ./Sources/PIT.o \
+./Sources/PowerQuality.o \
+./Sources/Profile.o \
 ./Sources/RTC.o \
+./Sources/SelfTest.o \
+./Sources/Stack.o \
 ./Sources/Switch.o \
+./Sources/Tariff.o \
 ./Sources/UART.o \
+./Sources/Waveform.o \
 ./Sources/main.o \
 ./Sources/packet.o 
 
 C_DEPS += \
+./Sources/Benchmark.d \
 ./Sources/Calc.d \
+./Sources/Conditioning.d \
+./Sources/Decimator.d \
+./Sources/Deadline.d \
+./Sources/Demand.d \
 ./Sources/Events.d \
 ./Sources/FIFO.d \
 ./Sources/FTM.d \
 ./Sources/FixedPoint.d \
+./Sources/Frequency.d \
 ./Sources/Flash.d \
+./Sources/Harmonic.d \
 ./Sources/HMI.d \
+./Sources/Idle.d \
 ./Sources/LEDs.d \
+./Sources/LoadProfile.d \
+./Sources/Mailbox.d \
 ./Sources/PIT.d \
+./Sources/PowerQuality.d \
+./Sources/Profile.d \
 ./Sources/RTC.d \
+./Sources/SelfTest.d \
+./Sources/Stack.d \
 ./Sources/Switch.d \
+./Sources/Tariff.d \
 ./Sources/UART.d \
+./Sources/Waveform.d \
 ./Sources/main.d \
 ./Sources/packet.d 
 
@@ -56,7 +104,7 @@ C_DEPS += \
 Sources/%.o: ../Sources/%.c
 	@echo 'Building file: $<'
 	@echo 'Invoking: Cross ARM C Compiler'
-	arm-none-eabi-gcc -mcpu=cortex-m4 -mthumb -mfloat-abi=hard -mfpu=fpv4-sp-d16 -O0 -fmessage-length=0 -fsigned-char -ffunction-sections -fdata-sections  -g3 -I"C:\Users\13093012\Desktop\02\Library" -I"C:/Users/13093012/Desktop/02/Static_Code/IO_Map" -I"C:/Users/13093012/Desktop/02/Sources" -I"C:/Users/13093012/Desktop/02/Generated_Code" -I"C:/Users/13093012/Desktop/02/Static_Code/PDD" -std=c99 -MMD -MP -MF"$(@:%.o=%.d)" -MT"$@" -c -o "$@" "$<"
+	arm-none-eabi-gcc -mcpu=cortex-m4 -mthumb -mfloat-abi=hard -mfpu=fpv4-sp-d16 -O0 -fmessage-length=0 -fsigned-char -ffunction-sections -fdata-sections -fstack-usage  -g3 -I"C:\Users\13093012\Desktop\02\Library" -I"C:/Users/13093012/Desktop/02/Static_Code/IO_Map" -I"C:/Users/13093012/Desktop/02/Sources" -I"C:/Users/13093012/Desktop/02/Generated_Code" -I"C:/Users/13093012/Desktop/02/Static_Code/PDD" -std=c99 -MMD -MP -MF"$(@:%.o=%.d)" -MT"$@" -c -o "$@" "$<"
 	@echo 'Finished building: $<'
 	@echo ' '
 
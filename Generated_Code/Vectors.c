@@ -163,7 +163,7 @@ void __attribute__ ((interrupt)) LPTimer_ISR(void);
     (tIsrFunc)&Cpu_Interrupt,          /* 0x4F  0x0000013C   -   ivINT_FTM1                     unused by PE */
     (tIsrFunc)&Cpu_Interrupt,          /* 0x50  0x00000140   -   ivINT_FTM2                     unused by PE */
     (tIsrFunc)&Cpu_Interrupt,          /* 0x51  0x00000144   -   ivINT_CMT                      unused by PE */
-    (tIsrFunc)&Cpu_Interrupt,          /* 0x52  0x00000148   -   ivINT_RTC                      unused by PE */
+    (tIsrFunc)&RTC_AlarmISR,           /* 0x52  0x00000148   -   ivINT_RTC                      unused by PE */
     (tIsrFunc)&RTC_ISR,                /* 0x53  0x0000014C   -   ivINT_RTC_Seconds              unused by PE */
     (tIsrFunc)&PIT_ISR,                /* 0x54  0x00000150   -   ivINT_PIT0                     unused by PE */
     (tIsrFunc)&Cpu_Interrupt,          /* 0x55  0x00000154   -   ivINT_PIT1                     unused by PE */
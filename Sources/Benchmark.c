@@ -0,0 +1,223 @@
+/*! @file Benchmark.c
+ *
+ *  @brief FixedPoint micro-benchmarks for the DEM
+ *
+ *  This contains the routines to time the FixedPoint routines one by one, the conditioning of each ADC sample and
+ *  the finishing of an RMS value, with the DWT cycle counter over operands of three sizes. Each
+ *  kernel is called as the calculation thread calls it, from RAM, so the cycles include the call. The benchmarks only
+ *  exist when PROFILE_ENABLE is defined for the build; Tools/benchmark.py runs them and writes the results as CSV.
+ *
+ *  @author Rohan
+ *  @date 2019-11-27
+ */
+
+#include "Benchmark.h"
+
+#ifdef PROFILE_ENABLE
+
+// Calculations, the conditioning and the fixed-point routines timed
+#include "Calc.h"
+// DWT cycle counter
+#include "MK70F12.h"
+// Core clock
+#include "Cpu.h"
+
+#define NB_OPERANDS 8    /*!< Operands cycled through in each pass, a power of 2 */
+
+typedef int32_t (*TBenchmarkKernel)(int32_t a, int32_t b);
+
+/*!
+ * @struct TBenchmarkOperands
+ */
+typedef struct
+{
+  int32_t a[NB_OPERANDS];    /*!< First operand, the radicand or the voltage in ADC counts */
+  int32_t b[NB_OPERANDS];    /*!< Second operand, never 0 as it may be a divisor or a guess, or the current in ADC counts */
+} TBenchmarkOperands;
+
+// 32Q16, except where an operand is taken as unsigned or as the words of a 64-bit radicand
+static const TBenchmarkOperands Operands[BENCHMARK_NB_RANGES] =
+{
+  // BENCHMARK_RANGE_SMALL
+  {
+    { 16384, 32768, 98304, 131072, 216269, 262144, 327680, -163840 },
+    { 65536, 131072, 196608, -98304, 49152, 327680, 655360, -262144 }
+  },
+  // BENCHMARK_RANGE_MAINS
+  {
+    { 15073280, 15728640, -13565952, 16580608, -21299200, 6553600, 10485760, -19660800 },
+    { 655360, 6553600, 15073280, -3276800, 196608, 15728640, -655360, 3932160 }
+  },
+  // BENCHMARK_RANGE_FULL
+  {
+    { 0x7FFF0000, -0x7FFF0000, 0x40000000, 0x7FFFFFFF, -0x40000000, 0x12345678, -0x7FFFFFFF, 0x55555555 },
+    { 1, 3, 0x7FFFFFFF, -0x7FFFFFFF, 0x00010000, -7, 0x40000000, 0x00010001 }
+  }
+};
+
+// ADC counts of the voltage and current for BENCHMARK_CONDITIONING; 10650 is the peak of 325 V, 23170 of 5 A
+static const TBenchmarkOperands AdcOperands[BENCHMARK_NB_RANGES] =
+{
+  // BENCHMARK_RANGE_SMALL
+  {
+    { 12, -40, 85, -130, 200, -260, 310, -16 },
+    { 3, -7, 20, -35, 48, -60, 75, -4 }
+  },
+  // BENCHMARK_RANGE_MAINS
+  {
+    { 7500, -7500, 10650, -10650, 5000, -3000, 9000, -6700 },
+    { 16384, -16384, 23170, -23170, 8867, -4500, 21406, -12039 }
+  },
+  // BENCHMARK_RANGE_FULL
+  {
+    { 32767, -32768, 32000, -32000, 30000, -30000, 16384, -16384 },
+    { -32768, 32767, -32000, 32000, -30000, 30000, -16384, 16384 }
+  }
+};
+
+// Takes each result, so the calls are not optimised away
+static volatile int32_t Sink;
+
+// Filter state of BENCHMARK_CONDITIONING, so the filters of the meter never see the operands
+static TConditioningState ConditioningState;
+
+/*! @brief The loop alone, timed to be taken off the kernels.
+ */
+static int32_t RAMFUNC Overhead(int32_t a, int32_t b)
+{
+  return a ^ b;
+}
+
+static int32_t RAMFUNC Multiply(int32_t a, int32_t b)
+{
+  return FixedPoint_Multiply(a, b);
+}
+
+static int32_t RAMFUNC MultiplyU(int32_t a, int32_t b)
+{
+  return (int32_t) FixedPoint_MultiplyU((uint32_t) a, b);
+}
+
+static int32_t RAMFUNC Divide(int32_t a, int32_t b)
+{
+  return FixedPoint_Divide(a, b);
+}
+
+static int32_t RAMFUNC DivideU(int32_t a, int32_t b)
+{
+  return (int32_t) FixedPoint_DivideU((uint32_t) a, (uint32_t) b);
+}
+
+static int32_t RAMFUNC SquareRoot(int32_t a, int32_t b)
+{
+  return FixedPoint_SquareRoot(a, b, 1);
+}
+
+static int32_t RAMFUNC SquareRootU64(int32_t a, int32_t b)
+{
+  return (int32_t) FixedPoint_SquareRootU64(((uint64_t) (uint32_t) a << 32) | (uint32_t) b);
+}
+
+/*! @brief Conditions a pair of ADC samples to volts and amps, as the calculation thread does with each sample, on a
+ *  filter state of its own.
+ */
+static int32_t RAMFUNC ConditionSample(int32_t a, int32_t b)
+{
+  int32_t voltage, current;
+
+  Conditioning_Filter(&ConditioningState, a << CONDITIONING_INPUT_FRACTION_BITS, b << CONDITIONING_INPUT_FRACTION_BITS,
+                      &voltage, &current);
+
+  return voltage ^ current;
+}
+
+/*! @brief Takes the root of a mean square from the last RMS value and scales it up, as Calc_Vrms ends a cycle.
+ */
+static int32_t RAMFUNC RmsFinalisation(int32_t a, int32_t b)
+{
+  return FixedPoint_Multiply(FixedPoint_SquareRoot(a, b, 1), 10 << 16);
+}
+
+static const TBenchmarkKernel Kernels[BENCHMARK_NB_KERNELS] =
+{
+  Multiply,
+  MultiplyU,
+  Divide,
+  DivideU,
+  SquareRoot,
+  SquareRootU64,
+  ConditionSample,
+  RmsFinalisation
+};
+
+/*! @brief Times one pass of a kernel over the operands.
+ *
+ *  @return uint32_t - Cycles taken by the pass.
+ */
+static uint32_t RAMFUNC Pass(const TBenchmarkKernel kernel, const TBenchmarkOperands* const operands)
+{
+  uint32_t start;
+  uint16_t n;
+
+  start = DWT_CYCCNT;
+
+  for (n = 0; n < BENCHMARK_NB_OPERATIONS; n++)
+    Sink = kernel(operands->a[n & (NB_OPERANDS - 1)], operands->b[n & (NB_OPERANDS - 1)]);
+
+  return DWT_CYCCNT - start;
+}
+
+/*! @brief Times the passes of a kernel.
+ *
+ *  @param best is where the cycles of the quickest pass are put.
+ *  @param worst is where the cycles of the slowest pass are put.
+ */
+static void Passes(const TBenchmarkKernel kernel, const TBenchmarkOperands* const operands,
+                   uint32_t* const best, uint32_t* const worst)
+{
+  uint32_t cycles;
+  uint8_t pass;
+
+  *best = UINT32_MAX;
+  *worst = 0;
+
+  for (pass = 0; pass < BENCHMARK_NB_PASSES; pass++)
+  {
+    cycles = Pass(kernel, operands);
+
+    if (cycles < *best)
+      *best = cycles;
+
+    if (cycles > *worst)
+      *worst = cycles;
+  }
+}
+
+bool Benchmark_Run(const uint8_t kernel, const uint8_t range, TBenchmarkResult* const result)
+{
+  const TBenchmarkOperands* operands;
+  uint32_t overhead, unused, best, worst;
+
+  if (kernel >= BENCHMARK_NB_KERNELS || range >= BENCHMARK_NB_RANGES)
+    return false;
+
+  operands = (kernel == BENCHMARK_CONDITIONING) ? &AdcOperands[range] : &Operands[range];
+
+  // Each run starts the filters afresh, so runs compare
+  Conditioning_InitState(&ConditioningState);
+
+  Passes(Overhead, operands, &overhead, &unused);
+  Passes(Kernels[kernel], operands, &best, &worst);
+
+  result->kernel = kernel;
+  result->range = range;
+  result->operations = BENCHMARK_NB_OPERATIONS;
+  result->bestCycles = (best > overhead) ? best - overhead : 0;
+  result->worstCycles = (worst > overhead) ? worst - overhead : 0;
+  result->overheadCycles = overhead;
+  result->coreClock = CPU_CORE_CLK_HZ;
+
+  return true;
+}
+
+#endif
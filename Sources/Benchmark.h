@@ -0,0 +1,65 @@
+/*! @file Benchmark.h
+ *
+ *  @brief FixedPoint micro-benchmarks for the DEM
+ *
+ *  This contains the routines to time the FixedPoint routines one by one, the conditioning of each ADC sample and
+ *  the finishing of an RMS value, with the DWT cycle counter over operands of three sizes. Each
+ *  kernel is called as the calculation thread calls it, from RAM, so the cycles include the call. The benchmarks only
+ *  exist when PROFILE_ENABLE is defined for the build; Tools/benchmark.py runs them and writes the results as CSV.
+ *
+ *  @author Rohan
+ *  @date 2019-11-27
+ */
+
+#ifndef SOURCES_BENCHMARK_H_
+#define SOURCES_BENCHMARK_H_
+
+// new types
+#include "types.h"
+
+#define BENCHMARK_MULTIPLY 0           /*!< FixedPoint_Multiply */
+#define BENCHMARK_MULTIPLY_U 1         /*!< FixedPoint_MultiplyU */
+#define BENCHMARK_DIVIDE 2             /*!< FixedPoint_Divide */
+#define BENCHMARK_DIVIDE_U 3           /*!< FixedPoint_DivideU */
+#define BENCHMARK_SQUARE_ROOT 4        /*!< FixedPoint_SquareRoot, one iteration as after the first cycle */
+#define BENCHMARK_SQUARE_ROOT_U64 5    /*!< FixedPoint_SquareRootU64 */
+#define BENCHMARK_CONDITIONING 6       /*!< The DC blocker, delay and gain of each sample, on a filter state of its own */
+#define BENCHMARK_RMS_FINALISATION 7   /*!< The square root and scaling that end a cycle in Calc_Vrms */
+#define BENCHMARK_NB_KERNELS 8
+
+#define BENCHMARK_RANGE_SMALL 0        /*!< Operands of a few units, as currents */
+#define BENCHMARK_RANGE_MAINS 1        /*!< Operands of hundreds of units, as mains volts */
+#define BENCHMARK_RANGE_FULL 2         /*!< Operands near the limits of 32Q16 and of the ADC */
+#define BENCHMARK_NB_RANGES 3
+
+#define BENCHMARK_NB_OPERATIONS 64     /*!< Calls of the kernel in each pass */
+#define BENCHMARK_NB_PASSES 8          /*!< Passes, of which the quickest is kept */
+
+/*!
+ * @struct TBenchmarkResult
+ *
+ * The cycles taken by a pass of BENCHMARK_NB_OPERATIONS calls of a kernel, less those of the loop around it.
+ */
+typedef struct
+{
+  uint8_t kernel;            /*!< Kernel timed */
+  uint8_t range;             /*!< Range of its operands */
+  uint16_t operations;       /*!< Calls of the kernel in each pass */
+  uint32_t bestCycles;       /*!< Cycles of the quickest pass */
+  uint32_t worstCycles;      /*!< Cycles of the slowest pass, which includes any thread or interrupt that ran */
+  uint32_t overheadCycles;   /*!< Cycles of the loop alone, already taken off the other two */
+  uint32_t coreClock;        /*!< Frequency of the CPU core clock in Hz, to turn cycles into time */
+} TBenchmarkResult;
+
+/*! @brief Times a kernel over the operands of a range.
+ *
+ *  @param kernel is the kernel to time, BENCHMARK_MULTIPLY to BENCHMARK_RMS_FINALISATION.
+ *  @param range is the range of its operands, BENCHMARK_RANGE_SMALL to BENCHMARK_RANGE_FULL.
+ *  @param result is where the cycles taken are put.
+ *  @return bool - TRUE if the kernel and range exist.
+ *  @note Needs the cycle counter started by Profile_Init. The passes are not protected from other threads, so it is
+ *  best run from a low priority thread, which the quickest pass leaves out.
+ */
+bool Benchmark_Run(const uint8_t kernel, const uint8_t range, TBenchmarkResult* const result);
+
+#endif /* SOURCES_BENCHMARK_H_ */
@@ -19,11 +19,21 @@ const int32_t MAX_ADC_OUTPUT_32Q16 = (1UL<<31)-(1UL<<16);
 const int32_t ADC_VOLTAGE_RANGE_32Q16 = 10 << 16;
 
 // Thread prototypes
-static void Calc_CalculationThread (void* pData);
+static void RAMFUNC Calc_CalculationThread (void* pData);
 
 // Create Thread Stack
 static uint32_t CalculationThreadStack[THREAD_STACK_SIZE] __attribute__ ((aligned(0x08)));
 
+// 2^56 / 10^9, to convert a period in nanoseconds to seconds without dividing
+#define SECONDS_PER_NS_Q56 72057594ULL
+
+// The voltage a quarter of a cycle ago lags by 90 degrees, so multiplying it with the current gives the reactive power
+#define DELAY_LINE_SIZE (ANALOG_WINDOW_SIZE / 4)
+
+// Lifetime four-quadrant energy and cost, as whole units and the remainder still to be carried
+static uint64_t EnergyWh[CALC_NB_REGISTERS], EnergyRemainderWs[CALC_NB_REGISTERS];
+static uint64_t CostCents, CostRemainder;
+
 bool Calc_Init()
 {
   OS_ERROR error;
@@ -33,186 +43,253 @@ bool Calc_Init()
   // Clear Time usage at start
 
 
-  // Load the tariffs
-  // The tariff rates are stored in 32Q16
-  /* Mode | Non-ToU |   Peak  | Shoulder | Off Peak
-   *  1   |    0    |  22.235 |   4.400  |  2.109
-   *  2   |  1.713  |    0    |    0     |    0
-   *  3   |  4.100  |    0    |    0     |    0
-   */
-  TTariff tariffChartLocal[NB_TARIFF_MODE] =
-  {
-    { .peakRate = 1457193,
-      .shoulderRate = 288350,
-      .offPeakRate = 138216
-    },
-    {
-      .peakRate = 112264,
-      .shoulderRate = 0,
-      .offPeakRate = 0
-    },
-    {
-      .peakRate = 268698,
-      .shoulderRate = 0,
-      .offPeakRate = 0
-    }
-  };
-
-  *TariffChart = *tariffChartLocal;
-
   // Initialize the global variables to be 0
   AveragePowerW   = 0;
+  ReactivePowerVar = 0;
+  ApparentPowerVA = 0;
   TotalEnergykWh  = 0;
   TotalCostDollars = 0;
   FrequencyTimes10 = 0;
   Vrms = 0;
   Irms = 0;
 
+  // Load the calibration of the conditioning stage, with the nominal scaling of each channel in V or A per count, Q32
+  if (!Conditioning_Init((int32_t) (((int64_t) ADC_VOLTAGE_RANGE_32Q16 * VOLTAGE_RAW_ADC_RATIO_32Q16) / (MAX_ADC_OUTPUT_32Q16 >> 16)),
+                         (int32_t) (((int64_t) ADC_VOLTAGE_RANGE_32Q16 * CURRENT_RAW_ADC_RATIO_32Q16) / (MAX_ADC_OUTPUT_32Q16 >> 16))))
+    return false;
+
+  // Start tracking from the period the PIT was started with
+  if (!Frequency_Init(MAX_SAMPLE_PERIOD, ANALOG_WINDOW_SIZE_LOG2, ANALOG_OVERSAMPLE_LOG2))
+    return false;
+
+  // Hand the samples from the PIT to the thread through the mailbox
+  if (!Mailbox_Init())
+    return false;
+
+  // The mailbox drops rather than overwrites, but an oversampled block not yet taken is overwritten at once
+  if (!Deadline_Init((ANALOG_OVERSAMPLE_LOG2) ? 1 : MAILBOX_SIZE))
+    return false;
+
   // Create threads
-  error = OS_ThreadCreate(Calc_CalculationThread,
-                          NULL,
-                          &CalculationThreadStack[THREAD_STACK_SIZE - 1],
-                          CALCULATION_THREAD_PRIORITY);
+  error = Stack_ThreadCreate(Calc_CalculationThread,
+                             NULL,
+                             CalculationThreadStack,
+                             THREAD_STACK_SIZE,
+                             CALCULATION_THREAD_PRIORITY);
   if (error)
     PE_DEBUGHALT();
 
   return true;
 }
 
-int32_t Calc_ConvertADCtoVolts (int16_t outputADC)
+int32_t RAMFUNC Calc_CycleMean (int64_t sum, uint16_t count)
 {
-  //convert the ADC output to 32Q16 format
-  int32_t output32Q16 = FixedPoint_Convert32Q16(outputADC);
+  if (count == 0)
+    return 0;
 
-  //Calculate the ratio of the ADC output
-  int32_t ratio32Q16 = FixedPoint_Divide(output32Q16, MAX_ADC_OUTPUT_32Q16);
+  // A cycle of a power of two samples, the usual case when the frequency is tracked, is a shift
+  if ((count & (count - 1)) == 0)
+    return (int32_t) (sum >> __builtin_ctz(count));
+
+  return (int32_t) (sum / count);
+}
 
-  // Multiply the ratio with the max voltage
-  int32_t volts32Q16 = FixedPoint_Multiply(ADC_VOLTAGE_RANGE_32Q16, ratio32Q16);
+int64_t Calc_CycleEnergy (int64_t sum, uint32_t samplePeriod)
+{
+  // Ts (in s) 32Q32 = Ts (in ns) * 2^56 / 10^9 / 2^24
+  uint64_t samplePeriodSeconds = ((uint64_t) samplePeriod * SECONDS_PER_NS_Q56) >> 24;
 
-  return volts32Q16;
+  // Energy 64Q16 = Sum_power 64Q16 * Ts 32Q32 / 2^32
+  return (sum * (int64_t) samplePeriodSeconds) >> 32;
 }
 
-void Calc_TotalCost (uint32_t energyPerCycleWs)
+/*! @brief Converts the sum of a cycle of power samples to energy, sped up in test mode
+ *
+ *  @param sum is the sum of the power samples, 64Q16.
+ *  @param samplePeriod is the sample period in nanoseconds.
+ *  @return int64_t - the energy in Ws (or vars for reactive power), 64Q16.
+ */
+static int64_t CycleEnergy (int64_t sum, uint32_t samplePeriod)
 {
-    uint32_t currentRate;
+  int64_t energy = Calc_CycleEnergy(sum, samplePeriod);
 
-    uint8_t days, hours, minutes, seconds;
+  if (TestModeEnabled)
+    energy *= 3600;
+
+  return energy;
+}
 
-    RTC_Get (&days, &hours, &minutes, &seconds);
+int32_t RAMFUNC Calc_VoltageSquared (int32_t instVoltage)
+{
+  // Scale down the raw voltage by 10 to avoid overflow
+  int32_t instVoltsScaledDown = FixedPoint_Divide(instVoltage, 10<<16);
 
-    static uint32_t accumulatedCentsScaledUp = 0;
-    static uint32_t accumulatedCents = 0;
+  return FixedPoint_Multiply(instVoltsScaledDown, instVoltsScaledDown);
+}
 
-    switch ((uint8) NvTariffMode->l)
-    {
-      // Tariff Mode 1
-      case 1:
-        // Peak Period
-        if (hours >= 14 && hours <=20)
-          currentRate = TariffChart[0].peakRate;
-        else if ((hours >= 7 && hours <= 14) || (hours >=20 && hours <= 22))
-          currentRate = TariffChart[0].shoulderRate;
-        else
-          currentRate = TariffChart[0].offPeakRate;
-        break;
-
-      // Tariff Mode 2
-      case 2:
-        currentRate = TariffChart[1].nonToUrate;
-        break;
-
-      // Tariff Mode 3
-      case 3:
-        currentRate = TariffChart[2].nonToUrate;
-        break;
-    }
+int32_t RAMFUNC Calc_CurrentSquared (int32_t instCurrent)
+{
+  // Scale up the raw current by 10 to increase precision
+  int32_t instCurrentScaledUp = FixedPoint_Multiply(instCurrent, 10<<16);
 
-    // cents/k = cents/kWh * Ws / 3600
-    uint32_t centsPerCycleScaledUp = FixedPoint_Divide(FixedPoint_Multiply(currentRate, energyPerCycleWs), 3600 << 16);
+  return FixedPoint_Multiply(instCurrentScaledUp, instCurrentScaledUp);
+}
 
-    // accumulate the scaled down cents
-    accumulatedCentsScaledUp += centsPerCycleScaledUp;
+int32_t Calc_RootMeanSquare (int64_t sumSquares, uint16_t count, int32_t previousRoot)
+{
+  // Divide the sum of squares by the number of samples in the cycle
+  int32_t ratio = Calc_CycleMean(sumSquares, count);
 
-    if (accumulatedCentsScaledUp >= (1000 << 16))
-    {
-      accumulatedCents += FixedPoint_Divide(accumulatedCentsScaledUp, 1000 << 16);
-      accumulatedCentsScaledUp = 0;
-    }
+  // Take the square root of the ratio
+  // if the previous root is 1 (first cycle), run the iteration 15 times
+  uint8_t interationNb = (previousRoot == 1<<16) ? 15 : 1;
 
-    if (accumulatedCents >= (1000 << 16))
-    {
-      TotalCostDollars += FixedPoint_Divide(accumulatedCents, 100 << 16);
-      accumulatedCents = 0;
-    }
+  //initial guess for the next cycle is the current root
+  return FixedPoint_SquareRoot (ratio, previousRoot, interationNb);
 }
 
-uint32_t Calc_TotalEnergy (int32_t instPower, uint32_t samplePeriod, bool risingEdgeDetected)
+uint32_t Calc_VrmsFromRoot (int32_t root)
 {
-  static int32_t summationInstPower = 0;
-  uint32_t energyPerCycleWs;
+  // Scale up by 10, undoing Calc_VoltageSquared
+  return (uint32_t) FixedPoint_Multiply(root, 10<<16);
+}
 
-  static uint32_t tempAccumulatedEnergyWs = 0;
+uint32_t Calc_IrmsFromRoot (int32_t root)
+{
+  // Scale down by 10, undoing Calc_CurrentSquared
+  return (uint32_t) FixedPoint_Divide(root, 10<<16);
+}
+
+uint64_t Calc_CycleCost (uint32_t rate, uint64_t energyPerCycleWs)
+{
+  // cents = cents/kWh * Ws / 3600000
+  // Keep the product and carry whole cents out of it, so no fraction of a cent is ever lost
+  return (uint64_t) rate * energyPerCycleWs;
+}
+
+void Calc_TotalCost (uint64_t energyPerCycleWs)
+{
+    // The active rate only changes at a schedule boundary
+    uint8_t rate = Tariff_GetActiveRate();
+
+    uint64_t costPerCycle = Calc_CycleCost(Tariff_GetRate(rate), energyPerCycleWs);
+
+    // bill the cycle to the registers of the active rate
+    Tariff_Accumulate(rate, energyPerCycleWs, costPerCycle);
+
+    if (FixedPoint_AccumulateCarry(&CostCents, &CostRemainder, costPerCycle, TARIFF_COST_PER_CENT))
+      // dollars = cents / 100, 32Q16
+      TotalCostDollars = (uint32_t) ((CostCents << 16) / 100);
+}
+
+int64_t RAMFUNC Calc_TotalEnergy (int32_t instPower, uint32_t samplePeriod, bool risingEdgeDetected)
+{
+  static int64_t summationInstPower = 0;
+  int64_t energyPerCycleWs = 0;
 
   // risingEdgeDetected flag is set on receiving the first sample of the next cycle
   // but samplePeriod stores the value of Ts for the previous cycle
   if (risingEdgeDetected)
   {
     /* Energy (in Ws) = (Sum(instPower) * Ts(in s) */
+    energyPerCycleWs = CycleEnergy(summationInstPower, samplePeriod);
 
-    // Ts (in nanoseconds) / 10e5 = Ts * 10e-4 seconds
-    samplePeriod = samplePeriod / 100000;
+    // reset the sum of instantaneous power for the next cycle
+    summationInstPower = 0;
+  }
 
-    // convert samplePeriod to 32Q16
-    int32_t samplePeriod32Q16 = samplePeriod << 16;
+  summationInstPower += instPower;
 
-    /* Energy (Ws) = (Sum_power * Ts * 10e-4)
-     *             =  Sum_power * Ts/10e4
-     */
-    energyPerCycleWs = FixedPoint_MultiplyU(summationInstPower, FixedPoint_DivideU(samplePeriod32Q16, 10000U << 16));
+  return energyPerCycleWs;
+}
 
-    if (TestModeEnabled)
-        energyPerCycleWs = FixedPoint_MultiplyU(energyPerCycleWs, 3600U<<16);
+int64_t RAMFUNC Calc_ReactiveEnergy (int32_t instVoltage, int32_t instCurrent, uint32_t samplePeriod, bool risingEdgeDetected)
+{
+  static int32_t delayLine[DELAY_LINE_SIZE];
+  static uint8_t delayIndex = 0;
 
-    // add the total energy Ws in an a temporary variable
-    tempAccumulatedEnergyWs += energyPerCycleWs;
+  static int64_t sumReactivePower = 0;
+  static uint16_t counter = 0;
 
-    // 1 Wh = 3600 Ws (0.001 kWh = 3600 Ws)
-    // We want a precision of 0.001 kWh, therefore every time the accumulated energy is greater than 3600 Ws,
-    // we add 0.001 kWh energy to the TotalEnergykWh
-    // Avoids overflow and increases maximum amount to be stored
-    if (tempAccumulatedEnergyWs >= (3600<<16))
-    {
-      // convert tempAccumulatedEnergy Ws to Wh (tempEnergyWs / 3600)
-      // convert tempAcummulatedEnergy from Wh to kWh (divide by 1000)
-      TotalEnergykWh += FixedPoint_Divide( FixedPoint_Divide(tempAccumulatedEnergyWs, (3600<<16)), (1000<<16));
+  int64_t reactiveEnergy = 0;
 
-      // reset the accumulatedEnergy
-      tempAccumulatedEnergyWs = 0;
-    }
+  int32_t delayedVoltage;
 
-    // reset the sum of instantaneous power for the next cycle
-    summationInstPower = 0;
+  if (risingEdgeDetected)
+  {
+    // Q = sum(v(t - T/4) * i(t)) / sampleNbPerCycle, positive when the current lags
+    ReactivePowerVar = Calc_CycleMean(sumReactivePower, counter);
+
+    reactiveEnergy = CycleEnergy(sumReactivePower, samplePeriod);
+
+    sumReactivePower = 0;
+    counter = 0;
   }
 
-  summationInstPower += instPower;
+  // The delay line is in samples, so it stays a quarter of a cycle while the sample period tracks the mains
+  delayedVoltage = delayLine[delayIndex];
+  delayLine[delayIndex] = instVoltage;
+  delayIndex = (delayIndex + 1) & (DELAY_LINE_SIZE - 1);
 
-  return energyPerCycleWs;
+  sumReactivePower += FixedPoint_Multiply(delayedVoltage, instCurrent);
+
+  counter++;
+
+  return reactiveEnergy;
+}
+
+uint64_t Calc_QuadrantEnergy (int64_t activeEnergyWs, int64_t reactiveEnergyWs)
+{
+  uint64_t importedWs = 0;
+
+  // 1 Wh = 3600 Ws (0.001 kWh = 3600 Ws)
+  // Every whole Wh is carried into its register and the rest is kept for the next cycle
+  if (activeEnergyWs >= 0)
+  {
+    importedWs = (uint64_t) activeEnergyWs;
+
+    if (FixedPoint_AccumulateCarry(&EnergyWh[CALC_REGISTER_IMPORT], &EnergyRemainderWs[CALC_REGISTER_IMPORT], importedWs, TARIFF_WS_PER_WH))
+      // kWh = Wh / 1000, 32Q16
+      TotalEnergykWh = (uint32_t) ((EnergyWh[CALC_REGISTER_IMPORT] << 16) / 1000);
+  }
+  else
+    (void) FixedPoint_AccumulateCarry(&EnergyWh[CALC_REGISTER_EXPORT], &EnergyRemainderWs[CALC_REGISTER_EXPORT], (uint64_t) -activeEnergyWs, TARIFF_WS_PER_WH);
+
+  if (reactiveEnergyWs >= 0)
+    (void) FixedPoint_AccumulateCarry(&EnergyWh[CALC_REGISTER_LAGGING], &EnergyRemainderWs[CALC_REGISTER_LAGGING], (uint64_t) reactiveEnergyWs, TARIFF_WS_PER_WH);
+  else
+    (void) FixedPoint_AccumulateCarry(&EnergyWh[CALC_REGISTER_LEADING], &EnergyRemainderWs[CALC_REGISTER_LEADING], (uint64_t) -reactiveEnergyWs, TARIFF_WS_PER_WH);
+
+  // Only imported energy is billed
+  return importedWs;
 }
 
-int32_t Calc_AveragePower(int32_t instPower, bool risingEdgeDetected)
+bool Calc_GetEnergyRegister (uint8_t index, uint64_t* const energyWh)
 {
-  static uint8_t counter = 0;
+  if (index >= CALC_NB_REGISTERS || !energyWh)
+    return false;
+
+  // The registers are 64 bits and written by the calculation thread, so keep a reader from seeing half an update
+  OS_DisableInterrupts();
+  *energyWh = EnergyWh[index];
+  OS_EnableInterrupts();
+
+  return true;
+}
+
+int32_t RAMFUNC Calc_AveragePower(int32_t instPower, bool risingEdgeDetected)
+{
+  static uint16_t counter = 0;
 
   int32_t averagePower = 0;
 
-  static int32_t sumInstPower = 0;
+  static int64_t sumInstPower = 0;
 
 
   if (risingEdgeDetected)
   {
     // average Power = sum(instantaneous Power) / sampleNbPerCycle
-    averagePower = FixedPoint_Divide(sumInstPower, (int32_t) counter << 16);
+    averagePower = Calc_CycleMean(sumInstPower, counter);
 
     // Update the Global Variable
     AveragePowerW = averagePower;
@@ -229,41 +306,25 @@ int32_t Calc_AveragePower(int32_t instPower, bool risingEdgeDetected)
   return averagePower;
 }
 
-int32_t Calc_Vrms (int32_t instVoltage, bool risingEdgeDetected)
+int32_t RAMFUNC Calc_Vrms (int32_t instVoltage, bool risingEdgeDetected)
 {
-  // Scale down the raw voltage by 10 to avoid overflow
-  int32_t instVoltsScaledDown = FixedPoint_Divide(instVoltage, 10<<16);
-
   // stores the Vrms from the previous cycle
-  static uint32_t oldVrms = 1<<16;
-
-  // Iteration number for square root algorithm
-  uint8_t interationNb;
+  static int32_t oldVrms = 1<<16;
 
   // The number of samples collected in the current cycle
-  static uint8_t sampleCount = 0;
+  static uint16_t sampleCount = 0;
 
   // sum of squared voltage
-  static int32_t sumSquaredVolts = 0;
+  static int64_t sumSquaredVolts = 0;
 
   // if rising edge is detected, it means the start of a new cycle
   if (risingEdgeDetected)
   {
-    // Divide the sum of squared voltage by the number of samples in current cycle
-    int32_t ratio = FixedPoint_Divide(sumSquaredVolts, sampleCount << 16);
-
-    // Take the square root of the ratio
-    // if the previous Vrms is 1 (first cycle), run the iteration 15 times
-    if (oldVrms == 1<<16)
-      interationNb = 15;
-    else
-      interationNb = 1;
-
-    //initial guess for the next cycle is the current Vrms
-    oldVrms = FixedPoint_SquareRoot (ratio, oldVrms, interationNb);
+    // The root of the mean of the squared voltage, from the Vrms of the cycle before
+    oldVrms = Calc_RootMeanSquare(sumSquaredVolts, sampleCount, oldVrms);
 
     // Load the global variable after scalling up by 10
-    Vrms = (uint32_t) FixedPoint_Multiply(oldVrms, 10<<16);
+    Vrms = Calc_VrmsFromRoot(oldVrms);
 
     //reset the counter
     sampleCount = 0;
@@ -272,7 +333,7 @@ int32_t Calc_Vrms (int32_t instVoltage, bool risingEdgeDetected)
   }
 
   // accumulate the squared voltage after every sample
-  sumSquaredVolts += FixedPoint_Multiply(instVoltsScaledDown, instVoltsScaledDown);
+  sumSquaredVolts += Calc_VoltageSquared(instVoltage);
 
   // increment the sampleCount;
   sampleCount++;
@@ -280,41 +341,25 @@ int32_t Calc_Vrms (int32_t instVoltage, bool risingEdgeDetected)
   return oldVrms;
 }
 
-int32_t Calc_Irms (int32_t instCurrent, bool risingEdgeDetected)
+int32_t RAMFUNC Calc_Irms (int32_t instCurrent, bool risingEdgeDetected)
 {
-  // Scale up the raw current by 10 to increase precision
-  int32_t instCurrentScaledUp = FixedPoint_Multiply(instCurrent, 10<<16);
-
   // stores the Irms from the previous cycle
-  static uint32_t oldIrms = 1<<16;
-
-  // Iteration number for square root algorithm
-  uint8_t interationNb;
+  static int32_t oldIrms = 1<<16;
 
   // The number of samples collected in the current cycle
-  static uint8_t sampleCount = 0;
+  static uint16_t sampleCount = 0;
 
   // sum of squared currents
-  static int32_t sumSquaredCurrents = 0;
+  static int64_t sumSquaredCurrents = 0;
 
   // if rising edge is detected, it means the start of a new cycle
   if (risingEdgeDetected)
   {
-    // Divide the sum of squared current by the number of samples in current cycle
-    int32_t ratio = FixedPoint_Divide(sumSquaredCurrents, sampleCount << 16);
-
-    // Take the square root of the ratio
-    // if the previous Irms is 1 (first cycle), run the iteration 15 times
-    if (oldIrms == 1<<16)
-      interationNb = 15;
-    else
-      interationNb = 1;
-
-    //initial guess for the next cycle is the current Irms
-    oldIrms = FixedPoint_SquareRoot (ratio, oldIrms, interationNb);
+    // The root of the mean of the squared current, from the Irms of the cycle before
+    oldIrms = Calc_RootMeanSquare(sumSquaredCurrents, sampleCount, oldIrms);
 
     // Load the global variable with the scaled down value
-    Irms = (uint32_t) FixedPoint_Divide(oldIrms, 10<<16);
+    Irms = Calc_IrmsFromRoot(oldIrms);
 
     //reset the counter
     sampleCount = 0;
@@ -323,7 +368,7 @@ int32_t Calc_Irms (int32_t instCurrent, bool risingEdgeDetected)
   }
 
   // accumulate the squared voltage after every sample
-  sumSquaredCurrents += FixedPoint_Multiply(instCurrentScaledUp, instCurrentScaledUp);
+  sumSquaredCurrents += Calc_CurrentSquared(instCurrent);
 
   // increment the sampleCount;
   sampleCount++;
@@ -335,116 +380,32 @@ void Calc_PowerFactor (int32_t vRMS, int32_t iRMS, int32_t avgPower)
 {
   uint32_t vRMSiRMS = FixedPoint_Multiply(Vrms, Irms);
 
+  ApparentPowerVA = vRMSiRMS;
+
   if (vRMSiRMS != 0)
   {
+    // Signed, so the power factor is negative while exporting
     int32_t powerFactor = FixedPoint_Divide(AveragePowerW, vRMSiRMS);
 
-    PowerFactor = (uint32_t) powerFactor;
-  }
-}
-
-bool Calc_FrequencyTracking (int32_t sample, uint32_t* samplePeriod)
-{
-  static bool firstSampleCaptured = false;  // flag to indicate if the first sample has been captured
-
-  static bool startCounter = false;         // flag to turn on or off the counter
-  static bool resetCounter = true;          // flag to reset the counter
-
-  static uint8_t periodSampleCount = 0;     // The number of samples captured for the current cycle
-
-  static int32_t sampleOld;                 // variable to store the last sample from the window
-
-  static uint32_t oldSamplePeriod = 1315790;  // variable to store the sample rate of the current samples
-  uint32_t newSamplePeriod;                   // Variable to store the sample rate of the next samples
-
-  static uint32_t zeroCrossing, firstZeroCrossing, secondZeroCrossing;
-
-  bool risingEdgeDetected = false;                // flag to indicate if the sample is the first one from a new cycle
-
-  // return the current sample period
-  // the current sample period is the oldSample Period
-  *samplePeriod = oldSamplePeriod;
-
-  if (firstSampleCaptured)
-  {
-    // Start frequency tracking if a positive edge is detected
-    // Rising is detected if the old sample value is negative
-    // and current sample value is positive or zero
-    if (sampleOld < 0 && sample >= 0)
-    {
-      // start the counter if a positive edge detected
-      startCounter = true;
-
-      //Interpolate the first zeroCrossing from left to the right
-      // x = (+)a/(+)a-(-)b * 1000 (multiply by 1000 to avoid floating point)
-      zeroCrossing = ((int32_t)sample * 1000) / ((int32_t) sample - (int32_t) sampleOld);
-
-      // reset the counter when the rising edge of a new cycle is detected
-      resetCounter = !resetCounter;
-
-      // set the flag to indicate beginning of a new cycle
-      risingEdgeDetected = true;
-    }
-
-    if (startCounter)
-    {
-      // Counter is reset when rising edge of new cycle is detected
-      if (resetCounter)
-      {
-        // clear the reset flag
-        resetCounter = false;
-
-        // Interpolate the second zeroCrossing
-        secondZeroCrossing = 1000 - zeroCrossing;
+    // Rounding can put |P| just over S
+    if (powerFactor > (1 << 16))
+      powerFactor = 1 << 16;
+    else if (powerFactor < -(1 << 16))
+      powerFactor = -(1 << 16);
 
-        // T0 = Period_n x Ts
-        // frequency = 1 / T0
-        // new Ts = T0 / 16 = (Ts / 16) * Period_n
-        newSamplePeriod =  (oldSamplePeriod >> 4) * periodSampleCount;
-
-        // add the interpolated parts
-        if (firstZeroCrossing <= 1000  && secondZeroCrossing <= 1000)
-          newSamplePeriod += ((firstZeroCrossing + secondZeroCrossing) * (oldSamplePeriod >> 16)) / 1000;
-
-         PIT_Set (newSamplePeriod, true);
-
-         // Calculate the frequency
-         // freq = 10e9 / (16 * new Ts (in nS))
-         // freqTimes10 = freq * 10
-         FrequencyTimes10 = 1e9 / (16 * (newSamplePeriod/10));
-
-         oldSamplePeriod = newSamplePeriod;
-
-         //Packet_Put(0, periodSampleCount, 0, 0);
-
-        // reset the counter to zero
-        periodSampleCount = 0;
-      }
-
-      if (zeroCrossing <= 1000)
-        // set the first ZeroCrossing
-        firstZeroCrossing = zeroCrossing;
-
-      // Increment the sample count
-      periodSampleCount++;
-    }
+    PowerFactor = powerFactor;
   }
-
-  // Set flag to indicate that first sample has been captured
-  // Start frequency tracking from second sample
-  firstSampleCaptured = true;
-
-  // store the current sample, which is the old sample for next call
-  sampleOld = sample;
-
-  return risingEdgeDetected;
 }
 
-static void Calc_CalculationThread (void* pData)
+static void RAMFUNC Calc_CalculationThread (void* pData)
 {
   OS_ERROR error;
 
-  static uint8_t sampleNb = 0;
+  // The sample handed over by the PIT, and the index expected next
+  TMailboxSample sample;
+  uint32_t nextIndex = 0;
+
+  uint8_t sampleNb;
 
   // Instantaneous voltage, current and power
   int32_t instVoltage, instCurrent, instPower;
@@ -453,11 +414,27 @@ static void Calc_CalculationThread (void* pData)
 
   uint32_t samplePeriod;
 
-  uint32_t energyPerCycleWs;
+  uint64_t energyPerCycleWs;
+
+  // Signed energy of the cycle just completed
+  int64_t activeEnergyWs, reactiveEnergyWs;
 
   // flag to indicate if the sample is from a new cycle
   bool risingEdgeDetected;
 
+  // Samples in ADC counts with extra resolution
+  int32_t voltageCounts, currentCounts;
+
+#if ANALOG_OVERSAMPLE_LOG2
+  static TDecimator voltageDecimator, currentDecimator;
+
+  // The block filled by the PIT before the one it is filling now
+  uint8_t block;
+
+  Decimator_Init(&voltageDecimator);
+  Decimator_Init(&currentDecimator);
+#endif
+
   for (;;)
   {
     // Wait for analog data to be captured
@@ -466,27 +443,72 @@ static void Calc_CalculationThread (void* pData)
     if (error)
       PE_DEBUGHALT();
 
-    /* Convert raw ADC output to voltage and current in 32Q16 notation */
-    int32_t volts32Q16 = Calc_ConvertADCtoVolts (Voltage_ADC[sampleNb]);
+    PROFILE_LATENCY(PROFILE_PROBE_PIT_LATENCY);
+
+    // Each signal has its sample waiting in the mailbox
+    if (!Mailbox_Get(&sample))
+      PE_DEBUGHALT();
 
-    instVoltage = FixedPoint_Multiply(volts32Q16, VOLTAGE_RAW_ADC_RATIO_32Q16);
+    // Count the sample against the ones signalled, to see if the thread has fallen behind
+    (void) Deadline_Take();
 
-    volts32Q16 = Calc_ConvertADCtoVolts (Current_ADC[sampleNb]);
+    // A jump in the index means the PIT dropped samples while the mailbox was full
+    if (sample.index != nextIndex)
+      Deadline_Missed(sample.index - nextIndex);
 
-    instCurrent = FixedPoint_Multiply(volts32Q16, CURRENT_RAW_ADC_RATIO_32Q16);
+    nextIndex = sample.index + 1;
+
+    PROFILE_BEGIN(PROFILE_PROBE_CALC);
+
+    // Place the sample in the window by its index, so the window stays aligned in time across a gap
+    sampleNb = (uint8_t) (sample.index & (ANALOG_WINDOW_SIZE - 1));
+
+#if ANALOG_OVERSAMPLE_LOG2
+    // The blocks alternate, so the index also tells which one was filled
+    block = (uint8_t) (sample.index & 1);
+
+    // Decimate the block of oversampled ADC values into one sample
+    voltageCounts = Decimator_Block (&voltageDecimator, Voltage_Oversample[block], ANALOG_OVERSAMPLE_LOG2, CONDITIONING_INPUT_FRACTION_BITS);
+    currentCounts = Decimator_Block (&currentDecimator, Current_Oversample[block], ANALOG_OVERSAMPLE_LOG2, CONDITIONING_INPUT_FRACTION_BITS);
+
+    // Keep the window of samples for the harmonic analysis
+    Voltage_ADC[sampleNb] = (int16_t) (voltageCounts >> CONDITIONING_INPUT_FRACTION_BITS);
+    Current_ADC[sampleNb] = (int16_t) (currentCounts >> CONDITIONING_INPUT_FRACTION_BITS);
+#else
+    Voltage_ADC[sampleNb] = sample.voltage;
+    Current_ADC[sampleNb] = sample.current;
+
+    voltageCounts = (int32_t) Voltage_ADC[sampleNb] << CONDITIONING_INPUT_FRACTION_BITS;
+    currentCounts = (int32_t) Current_ADC[sampleNb] << CONDITIONING_INPUT_FRACTION_BITS;
+#endif
+
+    /* Remove the DC offset, correct the phase and convert raw ADC output to voltage and current in 32Q16 notation */
+    Conditioning_Sample (voltageCounts, currentCounts, &instVoltage, &instCurrent);
 
     // Calculate Instantaneous Power
     instPower = FixedPoint_Multiply(instVoltage, instCurrent);
 
-    risingEdgeDetected = Calc_FrequencyTracking (instVoltage, &samplePeriod);
+    risingEdgeDetected = Frequency_Track (instVoltage, &samplePeriod);
+
+    if (risingEdgeDetected)
+      FrequencyTimes10 = Frequency_GetTimes10();
+
+    // Half-cycle RMS voltage and sag/swell/interruption detection
+    PowerQuality_Sample (instVoltage, samplePeriod, risingEdgeDetected);
 
     avgPower = Calc_AveragePower (instPower, risingEdgeDetected);
 
-    energyPerCycleWs = Calc_TotalEnergy(instPower, samplePeriod, risingEdgeDetected);
+    activeEnergyWs = Calc_TotalEnergy(instPower, samplePeriod, risingEdgeDetected);
 
-    // Calculate cost every cycle
+    reactiveEnergyWs = Calc_ReactiveEnergy(instVoltage, instCurrent, samplePeriod, risingEdgeDetected);
+
+    // Calculate the four-quadrant energy and cost every cycle
     if (risingEdgeDetected)
+    {
+      energyPerCycleWs = Calc_QuadrantEnergy (activeEnergyWs, reactiveEnergyWs);
+
       Calc_TotalCost (energyPerCycleWs);
+    }
 
     vRMS = Calc_Vrms (instVoltage, risingEdgeDetected);
 
@@ -495,11 +517,23 @@ static void Calc_CalculationThread (void* pData)
     if (vRMS != 0 && iRMS !=0)
       Calc_PowerFactor (vRMS, iRMS, avgPower);
 
-    // Increment Sample Number
-    sampleNb++;
+    // Capture the raw samples for the harmonic analysis, unless the thread is catching up
+    if (!Deadline_IsBehind())
+      Harmonic_Update (Voltage_ADC[sampleNb], Current_ADC[sampleNb], risingEdgeDetected);
+
+    // Keep the raw samples in the waveform capture, which may trigger on a step
+    Waveform_Sample (Voltage_ADC[sampleNb], Current_ADC[sampleNb]);
+
+    // Add the completed cycle to the load profile interval and the demand sub-interval
+    if (risingEdgeDetected)
+    {
+      LoadProfile_Update (energyPerCycleWs, Vrms, PowerFactor);
+      Demand_Update (energyPerCycleWs);
+      PowerQuality_Cycle (Vrms);
+      Waveform_Cycle (Vrms, Irms);
+      Deadline_Cycle ();
+    }
 
-    // Wrap pointer if necessary
-    if (sampleNb == ANALOG_WINDOW_SIZE)
-      sampleNb = 0;
+    PROFILE_END(PROFILE_PROBE_CALC);
   }
 }
@@ -26,55 +26,134 @@
 #include "packet.h"
 // RTC Module to get the time
 #include "RTC.h"
+// Load profile to record the cycle measurements
+#include "LoadProfile.h"
+// Demand register fed with the cycle energy
+#include "Demand.h"
+// Tariff engine to bill the cycle energy
+#include "Tariff.h"
+// Frequency tracker to find the cycles and set the sample period
+#include "Frequency.h"
+// Harmonic analysis fed with the raw samples of each cycle
+#include "Harmonic.h"
+// DC removal, phase compensation and scaling of the samples
+#include "Conditioning.h"
+// Decimation of the oversampled ADC values
+#include "Decimator.h"
+// Power quality events and aggregation
+#include "PowerQuality.h"
+// Triggered capture of the raw samples
+#include "Waveform.h"
+// Cycle counts of the hot paths
+#include "Profile.h"
+// Painted thread stacks
+#include "Stack.h"
+// Sample deadline monitor
+#include "Deadline.h"
+// Sample mailbox
+#include "Mailbox.h"
+
+/*! Log2 of the number of samples taken in each mains cycle; 4, 5, 6 or 7 for 16 to 128 samples.
+ *  Can be set for the build, e.g. -DANALOG_WINDOW_SIZE_LOG2=6 */
+#ifndef ANALOG_WINDOW_SIZE_LOG2
+#define ANALOG_WINDOW_SIZE_LOG2 4
+#endif
+
+#if ANALOG_WINDOW_SIZE_LOG2 < 4 || ANALOG_WINDOW_SIZE_LOG2 > 7
+#error "ANALOG_WINDOW_SIZE_LOG2 must be between 4 and 7"
+#endif
+
+#define ANALOG_WINDOW_SIZE (1 << ANALOG_WINDOW_SIZE_LOG2)   /*!< Samples per mains cycle */
+
+/*! Log2 of the number of ADC values decimated into each sample; 0 for no oversampling, 2 or 3 for 4x or 8x.
+ *  Can be set for the build, e.g. -DANALOG_OVERSAMPLE_LOG2=3 */
+#ifndef ANALOG_OVERSAMPLE_LOG2
+#define ANALOG_OVERSAMPLE_LOG2 0
+#endif
+
+#if ANALOG_OVERSAMPLE_LOG2 != 0 && ANALOG_OVERSAMPLE_LOG2 != 2 && ANALOG_OVERSAMPLE_LOG2 != 3
+#error "ANALOG_OVERSAMPLE_LOG2 must be 0, 2 or 3"
+#endif
+
+// The PIT interrupt and two ADC reads must fit in each oversampled period
+#if ANALOG_WINDOW_SIZE_LOG2 + ANALOG_OVERSAMPLE_LOG2 > 8
+#error "ANALOG_WINDOW_SIZE_LOG2 + ANALOG_OVERSAMPLE_LOG2 must not be more than 8"
+#endif
+
+#define ANALOG_OVERSAMPLE (1 << ANALOG_OVERSAMPLE_LOG2)     /*!< ADC values per sample */
+
+#define ANALOG_MAX_CYCLE_NS 21052640    /*!< The longest mains cycle (47.5 Hz) in nanoseconds, which sets the initial sample period */
+
+#define CALC_REGISTER_IMPORT  0   /*!< Active energy imported, in Wh */
+#define CALC_REGISTER_EXPORT  1   /*!< Active energy exported, in Wh */
+#define CALC_REGISTER_LAGGING 2   /*!< Reactive energy while the current lags, in varh */
+#define CALC_REGISTER_LEADING 3   /*!< Reactive energy while the current leads, in varh */
+#define CALC_NB_REGISTERS     4
 
-#define ANALOG_WINDOW_SIZE 16
-#define NB_TARIFF_MODE 3
-
-
-typedef struct Tariff
-{
-  uint32_t nonToUrate;
-  uint32_t peakRate;
-  uint32_t shoulderRate;
-  uint32_t offPeakRate;
-}TTariff;
-
-TTariff TariffChart[NB_TARIFF_MODE];
 
 extern const uint32_t MAX_SAMPLE_PERIOD;      /*! The sample rate for the analog input in nanoseconds */
 
+extern const int32_t VOLTAGE_RAW_ADC_RATIO_32Q16;   /*! Mains volts per volt at the ADC input */
+extern const int32_t CURRENT_RAW_ADC_RATIO_32Q16;   /*! Amps per volt at the ADC input */
+
 extern const uint8_t CALCULATION_THREAD_PRIORITY;   //Extern declared thread priority
 extern OS_ECB *AnalogGetSemaphore;                  //Extern declared global semaphore
 
 extern int16_t Voltage_ADC [ANALOG_WINDOW_SIZE];
 extern int16_t Current_ADC [ANALOG_WINDOW_SIZE];
 
-extern volatile uint16union_t *NvTariffMode;
+#if ANALOG_OVERSAMPLE_LOG2
+// Blocks of oversampled ADC values; the PIT fills one while the calculation thread decimates the other
+extern int16_t Voltage_Oversample [2][ANALOG_OVERSAMPLE];
+extern int16_t Current_Oversample [2][ANALOG_OVERSAMPLE];
+#endif
 
 extern volatile bool TestModeEnabled;
 
-uint32_t AveragePowerW;
+int32_t AveragePowerW;
+int32_t ReactivePowerVar;
+uint32_t ApparentPowerVA;
 uint32_t TotalEnergykWh;
 uint32_t TotalCostDollars;
 uint32_t FrequencyTimes10;
 uint32_t Vrms;
 uint32_t Irms;
-uint32_t PowerFactor;
+int32_t PowerFactor;
 
 bool Calc_Init();
 
-int32_t Calc_ConvertADCtoVolts (int16_t outputADC);
+void Calc_TotalCost (uint64_t energyPerCycleWs);
+
+// Stateless steps of the per-sample and per-cycle arithmetic, shared by the calculation thread and the self-test
+
+int32_t RAMFUNC Calc_CycleMean (int64_t sum, uint16_t count);
+
+int64_t Calc_CycleEnergy (int64_t sum, uint32_t samplePeriod);
+
+int32_t RAMFUNC Calc_VoltageSquared (int32_t instVoltage);
+
+int32_t RAMFUNC Calc_CurrentSquared (int32_t instCurrent);
+
+int32_t Calc_RootMeanSquare (int64_t sumSquares, uint16_t count, int32_t previousRoot);
+
+uint32_t Calc_VrmsFromRoot (int32_t root);
+
+uint32_t Calc_IrmsFromRoot (int32_t root);
+
+uint64_t Calc_CycleCost (uint32_t rate, uint64_t energyPerCycleWs);
+
+int32_t RAMFUNC Calc_AveragePower(int32_t instPower, bool risingEdgeDetected);
 
-void Calc_TotalCost (uint32_t energyPerCycle);
+int64_t RAMFUNC Calc_TotalEnergy (int32_t instPower, uint32_t samplePeriod, bool risingEdgeDetected);
 
-int32_t Calc_AveragePower(int32_t instPower, bool risingEdgeDetected);
+int64_t RAMFUNC Calc_ReactiveEnergy (int32_t instVoltage, int32_t instCurrent, uint32_t samplePeriod, bool risingEdgeDetected);
 
-uint32_t Calc_TotalEnergy (int32_t instPower, uint32_t samplePeriod, bool risingEdgeDetected);
+uint64_t Calc_QuadrantEnergy (int64_t activeEnergyWs, int64_t reactiveEnergyWs);
 
-bool Calc_FrequencyTracking (int32_t sample, uint32_t* samplePeriod);
+bool Calc_GetEnergyRegister (uint8_t index, uint64_t* const energyWh);
 
-int32_t Calc_Vrms (int32_t instVoltage, bool risingEdgeDetected);
+int32_t RAMFUNC Calc_Vrms (int32_t instVoltage, bool risingEdgeDetected);
 
-int32_t Calc_Irms (int32_t instCurrent, bool risingEdgeDetected);
+int32_t RAMFUNC Calc_Irms (int32_t instCurrent, bool risingEdgeDetected);
 
 #endif /* SOURCES_CALC_H_ */
@@ -0,0 +1,266 @@
+/*! @file Conditioning.c
+ *
+ *  @brief Signal conditioning for the DEM
+ *
+ *  This contains the per-sample stage in front of the measurements, which removes the DC offset of each channel,
+ *  corrects the phase error between the channels with a fractional delay and scales the ADC counts to volts and amps.
+ *  The calibration is kept in the Flash.
+ *
+ *  @author Rohan
+ *  @date 2019-11-20
+ */
+
+#include "Conditioning.h"
+// RTOS
+#include "OS.h"
+
+#define CONDITIONING_VERSION 1
+
+// The filters work on ADC counts with this many fraction bits, which leaves headroom for the DC blocker output
+#define FRACTION_BITS 12
+
+// Calibration in the Flash, and the copy being edited
+static volatile TConditioningCalibration *NvCalibration;
+static TConditioningCalibration Calibration;
+
+static int32_t NominalGain[CONDITIONING_NB_CHANNELS];
+
+// Active coefficients, read by the calculation thread
+static int32_t Gain[CONDITIONING_NB_CHANNELS];        // V or A per count, Q32, with the trim applied
+static uint8_t DCShift[CONDITIONING_NB_CHANNELS];
+static uint8_t DelayChannel;
+static int32_t DelayFraction;                         // Q15
+
+// Filter state of the meter, only used by the calculation thread
+static TConditioningState State;
+
+/*! @brief Works out the active coefficients from the calibration.
+ *
+ *  @note Must be called with interrupts disabled once the calculation thread is running.
+ */
+static void Apply(void)
+{
+  uint8_t channel;
+
+  for (channel = 0; channel < CONDITIONING_NB_CHANNELS; channel++)
+  {
+    Gain[channel] = (int32_t) (((int64_t) NominalGain[channel] * Calibration.gainTrim[channel]) >> 14);
+
+    // A bypassed blocker leaves its estimate at 0, so the samples pass straight through
+    if (DCShift[channel] != Calibration.dcShift[channel])
+      State.dc[channel] = 0;
+
+    DCShift[channel] = Calibration.dcShift[channel];
+  }
+
+  if (Calibration.phase >= 0)
+  {
+    DelayChannel = CONDITIONING_CHANNEL_CURRENT;
+    DelayFraction = Calibration.phase;
+  }
+  else
+  {
+    DelayChannel = CONDITIONING_CHANNEL_VOLTAGE;
+    DelayFraction = -(int32_t) Calibration.phase;
+  }
+
+  State.previous = 0;
+}
+
+/*! @brief Removes the DC offset of a sample with a single-pole high-pass filter.
+ *
+ *  The estimate follows the input with a time constant of 2^DCShift samples: dc += (x - dc) / 2^DCShift.
+ *  @param state is the filter state.
+ *  @param channel is the channel of the sample.
+ *  @param sampleCounts is the sample in counts with CONDITIONING_INPUT_FRACTION_BITS.
+ *  @return int32_t - the sample less its DC offset, in counts with FRACTION_BITS.
+ */
+static inline int32_t DCBlock(TConditioningState* const state, const uint8_t channel, const int32_t sampleCounts)
+{
+  int32_t output = (sampleCounts << (FRACTION_BITS - CONDITIONING_INPUT_FRACTION_BITS)) - state->dc[channel];
+
+  if (DCShift[channel])
+    state->dc[channel] += output >> DCShift[channel];
+
+  return output;
+}
+
+/*! @brief Delays a sample by a fraction of a sample, by linear interpolation with the one before.
+ *
+ *  @param state is the filter state.
+ *  @param sample is the sample, in counts with FRACTION_BITS.
+ *  @return int32_t - the delayed sample.
+ */
+static inline int32_t Delay(TConditioningState* const state, const int32_t sample)
+{
+  int32_t output = sample + (int32_t) (((int64_t) (state->previous - sample) * DelayFraction) >> 15);
+
+  state->previous = sample;
+
+  return output;
+}
+
+bool Conditioning_Init(const int32_t voltageGain, const int32_t currentGain)
+{
+  NominalGain[CONDITIONING_CHANNEL_VOLTAGE] = voltageGain;
+  NominalGain[CONDITIONING_CHANNEL_CURRENT] = currentGain;
+
+  if (!Flash_AllocateRecord(FLASH_RECORD_CALIBRATION, CONDITIONING_VERSION, sizeof(*NvCalibration), (volatile void**) &NvCalibration))
+    return false;
+
+  Calibration = *NvCalibration;
+
+  // Write the default calibration if the record is erased
+  if (Calibration.gainTrim[CONDITIONING_CHANNEL_VOLTAGE] == 0xFFFF)
+  {
+    Calibration.gainTrim[CONDITIONING_CHANNEL_VOLTAGE] = CONDITIONING_GAIN_UNITY;
+    Calibration.gainTrim[CONDITIONING_CHANNEL_CURRENT] = CONDITIONING_GAIN_UNITY;
+    Calibration.phase = 0;
+    Calibration.dcShift[CONDITIONING_CHANNEL_VOLTAGE] = CONDITIONING_DEFAULT_DC_SHIFT;
+    Calibration.dcShift[CONDITIONING_CHANNEL_CURRENT] = CONDITIONING_DEFAULT_DC_SHIFT;
+
+    if (!Flash_WriteRecord(FLASH_RECORD_CALIBRATION, &Calibration))
+      return false;
+  }
+
+  Conditioning_InitState(&State);
+
+  Apply();
+
+  return true;
+}
+
+/*! @brief Scales a filtered sample to volts or amps.
+ *
+ *  @param sample is the sample, in counts with FRACTION_BITS.
+ *  @param gain is the gain of its channel, in V or A per count, Q32.
+ *  @return int32_t - the sample in V or A, 32Q16.
+ */
+static inline int32_t Scale(const int32_t sample, const int32_t gain)
+{
+  // One multiply per channel in place of the divide of the old conversion
+  return (int32_t) (((int64_t) sample * gain) >> (16 + FRACTION_BITS));
+}
+
+/*! @brief Conditions a pair of ADC samples on a filter state: DC blocker, delay and gain.
+ *
+ *  @param state is the filter state.
+ *  @param voltageCounts is the voltage in ADC counts with CONDITIONING_INPUT_FRACTION_BITS.
+ *  @param currentCounts is the current in ADC counts with CONDITIONING_INPUT_FRACTION_BITS.
+ *  @param voltage is where the voltage in V, 32Q16, is stored.
+ *  @param current is where the current in A, 32Q16, is stored.
+ */
+static inline void Filter(TConditioningState* const state, const int32_t voltageCounts, const int32_t currentCounts,
+                          int32_t* const voltage, int32_t* const current)
+{
+  int32_t voltageFiltered = DCBlock(state, CONDITIONING_CHANNEL_VOLTAGE, voltageCounts);
+  int32_t currentFiltered = DCBlock(state, CONDITIONING_CHANNEL_CURRENT, currentCounts);
+
+  if (DelayChannel == CONDITIONING_CHANNEL_CURRENT)
+    currentFiltered = Delay(state, currentFiltered);
+  else
+    voltageFiltered = Delay(state, voltageFiltered);
+
+  *voltage = Scale(voltageFiltered, Gain[CONDITIONING_CHANNEL_VOLTAGE]);
+  *current = Scale(currentFiltered, Gain[CONDITIONING_CHANNEL_CURRENT]);
+}
+
+void RAMFUNC Conditioning_Sample(const int32_t voltageCounts, const int32_t currentCounts, int32_t* const voltage, int32_t* const current)
+{
+  Filter(&State, voltageCounts, currentCounts, voltage, current);
+}
+
+void Conditioning_InitState(TConditioningState* const state)
+{
+  state->dc[CONDITIONING_CHANNEL_VOLTAGE] = 0;
+  state->dc[CONDITIONING_CHANNEL_CURRENT] = 0;
+  state->previous = 0;
+}
+
+void RAMFUNC Conditioning_Filter(TConditioningState* const state, const int32_t voltageCounts, const int32_t currentCounts,
+                                 int32_t* const voltage, int32_t* const current)
+{
+  Filter(state, voltageCounts, currentCounts, voltage, current);
+}
+
+int32_t Conditioning_ScaleNominal(const uint8_t channel, const int32_t counts)
+{
+  return Scale(counts << (FRACTION_BITS - CONDITIONING_INPUT_FRACTION_BITS), NominalGain[channel]);
+}
+
+bool Conditioning_GetItem(const uint8_t item, uint16_t* const value)
+{
+  switch (item)
+  {
+    case CONDITIONING_ITEM_GAIN_VOLTAGE:
+      *value = Calibration.gainTrim[CONDITIONING_CHANNEL_VOLTAGE];
+      return true;
+
+    case CONDITIONING_ITEM_GAIN_CURRENT:
+      *value = Calibration.gainTrim[CONDITIONING_CHANNEL_CURRENT];
+      return true;
+
+    case CONDITIONING_ITEM_PHASE:
+      *value = (uint16_t) Calibration.phase;
+      return true;
+
+    case CONDITIONING_ITEM_DC_VOLTAGE:
+      *value = Calibration.dcShift[CONDITIONING_CHANNEL_VOLTAGE];
+      return true;
+
+    case CONDITIONING_ITEM_DC_CURRENT:
+      *value = Calibration.dcShift[CONDITIONING_CHANNEL_CURRENT];
+      return true;
+  }
+
+  return false;
+}
+
+bool Conditioning_SetItem(const uint8_t item, const uint16_t value)
+{
+  TConditioningCalibration calibration = Calibration;
+
+  switch (item)
+  {
+    case CONDITIONING_ITEM_GAIN_VOLTAGE:
+    case CONDITIONING_ITEM_GAIN_CURRENT:
+      // 0xFFFF would read back as an erased record
+      if (value == 0 || value == 0xFFFF)
+        return false;
+
+      calibration.gainTrim[item - CONDITIONING_ITEM_GAIN_VOLTAGE] = value;
+      break;
+
+    case CONDITIONING_ITEM_PHASE:
+      // -32768 cannot be negated into a Q15 fraction
+      if ((int16_t) value == INT16_MIN)
+        return false;
+
+      calibration.phase = (int16_t) value;
+      break;
+
+    case CONDITIONING_ITEM_DC_VOLTAGE:
+    case CONDITIONING_ITEM_DC_CURRENT:
+      if (value > CONDITIONING_MAX_DC_SHIFT)
+        return false;
+
+      calibration.dcShift[item - CONDITIONING_ITEM_DC_VOLTAGE] = (uint8_t) value;
+      break;
+
+    default:
+      return false;
+  }
+
+  if (!Flash_WriteRecord(FLASH_RECORD_CALIBRATION, &calibration))
+    return false;
+
+  // The calculation thread reads the coefficients
+  OS_DisableInterrupts();
+
+  Calibration = calibration;
+  Apply();
+
+  OS_EnableInterrupts();
+
+  return true;
+}
@@ -0,0 +1,125 @@
+/*! @file Conditioning.h
+ *
+ *  @brief Signal conditioning for the DEM
+ *
+ *  This contains the per-sample stage in front of the measurements, which removes the DC offset of each channel,
+ *  corrects the phase error between the channels with a fractional delay and scales the ADC counts to volts and amps.
+ *  The calibration is kept in the Flash.
+ *
+ *  @author Rohan
+ *  @date 2019-11-20
+ */
+
+#ifndef SOURCES_CONDITIONING_H_
+#define SOURCES_CONDITIONING_H_
+
+// new types
+#include "types.h"
+// Flash to keep the calibration
+#include "Flash.h"
+
+#define CONDITIONING_CHANNEL_VOLTAGE 0
+#define CONDITIONING_CHANNEL_CURRENT 1
+#define CONDITIONING_NB_CHANNELS 2
+
+#define CONDITIONING_INPUT_FRACTION_BITS 4    /*!< Fraction bits of the samples in ADC counts; room for the resolution gained by oversampling */
+
+#define CONDITIONING_GAIN_UNITY (1 << 14)     /*!< Gain trim of 1.0, Q14 */
+#define CONDITIONING_DEFAULT_DC_SHIFT 10      /*!< Default time constant of the DC blocker, 2^10 samples */
+#define CONDITIONING_MAX_DC_SHIFT 15
+
+#define CONDITIONING_ITEM_GAIN_VOLTAGE 0      /*!< Calibration item: voltage gain trim, Q14 */
+#define CONDITIONING_ITEM_GAIN_CURRENT 1      /*!< Calibration item: current gain trim, Q14 */
+#define CONDITIONING_ITEM_PHASE 2             /*!< Calibration item: phase correction in samples, signed Q15 */
+#define CONDITIONING_ITEM_DC_VOLTAGE 3        /*!< Calibration item: log2 of the voltage DC blocker time constant, 0 to bypass */
+#define CONDITIONING_ITEM_DC_CURRENT 4        /*!< Calibration item: log2 of the current DC blocker time constant, 0 to bypass */
+#define CONDITIONING_NB_ITEMS 5
+
+/*!
+ * @struct TConditioningCalibration
+ *
+ * The calibration as it is kept in the Flash.
+ */
+typedef struct
+{
+  uint16_t gainTrim[CONDITIONING_NB_CHANNELS];  /*!< Gain of each channel relative to the nominal one, Q14 */
+  int16_t phase;                                /*!< Fraction of a sample to delay the current by, or the voltage if negative, Q15 */
+  uint8_t dcShift[CONDITIONING_NB_CHANNELS];    /*!< Log2 of the time constant of each DC blocker in samples, 0 to bypass */
+} TConditioningCalibration;
+
+/*!
+ * @struct TConditioningState
+ *
+ * The state the filters carry from one sample to the next.
+ */
+typedef struct
+{
+  int32_t dc[CONDITIONING_NB_CHANNELS];   /*!< DC estimate of each channel, in counts with the fraction bits of the filters */
+  int32_t previous;                       /*!< Last output of the DC blocker of the delayed channel */
+} TConditioningState;
+
+/*! @brief Loads the calibration from the Flash, writing the default calibration if there is none.
+ *
+ *  @param voltageGain is the nominal voltage per ADC count, in V per count, Q32.
+ *  @param currentGain is the nominal current per ADC count, in A per count, Q32.
+ *  @note A Q32 gain must stay under 0.5 per count after the trim, to fit an int32_t.
+ *  @return bool - TRUE if the conditioning was initialized successfully.
+ *  @note Assumes Flash has been initialized.
+ */
+bool Conditioning_Init(const int32_t voltageGain, const int32_t currentGain);
+
+/*! @brief Conditions a pair of ADC samples with the filters of the meter.
+ *
+ *  @param voltageCounts is the voltage in ADC counts with CONDITIONING_INPUT_FRACTION_BITS.
+ *  @param currentCounts is the current in ADC counts with CONDITIONING_INPUT_FRACTION_BITS.
+ *  @param voltage is where the voltage in V, 32Q16, is stored.
+ *  @param current is where the current in A, 32Q16, is stored.
+ *  @note Called from the calculation thread for every sample; no other thread may call it.
+ */
+void RAMFUNC Conditioning_Sample(const int32_t voltageCounts, const int32_t currentCounts, int32_t* const voltage, int32_t* const current);
+
+/*! @brief Clears a filter state, as the filters of the meter start.
+ *
+ *  @param state is the state to clear.
+ */
+void Conditioning_InitState(TConditioningState* const state);
+
+/*! @brief Conditions a pair of ADC samples as Conditioning_Sample does, with the active calibration, on a state of
+ *  the caller's own.
+ *
+ *  @param state is the filter state, which is updated.
+ *  @param voltageCounts is the voltage in ADC counts with CONDITIONING_INPUT_FRACTION_BITS.
+ *  @param currentCounts is the current in ADC counts with CONDITIONING_INPUT_FRACTION_BITS.
+ *  @param voltage is where the voltage in V, 32Q16, is stored.
+ *  @param current is where the current in A, 32Q16, is stored.
+ *  @note Leaves the filters of the meter alone, so it can be called from any thread, e.g. to time the conditioning.
+ */
+void RAMFUNC Conditioning_Filter(TConditioningState* const state, const int32_t voltageCounts, const int32_t currentCounts,
+                                 int32_t* const voltage, int32_t* const current);
+
+/*! @brief Scales a sample as Conditioning_Sample does with a unity gain trim, without the DC blocker or the delay.
+ *
+ *  @param channel is CONDITIONING_CHANNEL_VOLTAGE or CONDITIONING_CHANNEL_CURRENT.
+ *  @param counts is the sample in ADC counts with CONDITIONING_INPUT_FRACTION_BITS.
+ *  @return int32_t - the sample in V or A, 32Q16.
+ *  @note Keeps no state, so the self-test can check the scaling while the meter runs.
+ */
+int32_t Conditioning_ScaleNominal(const uint8_t channel, const int32_t counts);
+
+/*! @brief Gets a calibration item.
+ *
+ *  @param item is the CONDITIONING_ITEM to get.
+ *  @param value is where the value of the item is stored.
+ *  @return bool - TRUE if the item is valid.
+ */
+bool Conditioning_GetItem(const uint8_t item, uint16_t* const value);
+
+/*! @brief Sets a calibration item and saves the calibration in the Flash.
+ *
+ *  @param item is the CONDITIONING_ITEM to set.
+ *  @param value is the new value of the item.
+ *  @return bool - TRUE if the item and value are valid and the calibration was saved successfully.
+ */
+bool Conditioning_SetItem(const uint8_t item, const uint16_t value);
+
+#endif /* SOURCES_CONDITIONING_H_ */
@@ -0,0 +1,130 @@
+/*! @file Deadline.c
+ *
+ *  @brief Sample deadline monitor for the DEM
+ *
+ *  This contains the routines to count the samples signalled by the PIT against the samples taken by the calculation
+ *  thread, so a thread that falls behind is seen. The monitor counts the late samples, the samples overwritten or
+ *  dropped before they were processed and the late cycles, and reports the meter as behind for a while after, so the
+ *  optional analytics can be skipped until it catches up.
+ *
+ *  @author Rohan
+ *  @date 2019-11-25
+ */
+
+#include "Deadline.h"
+// RTOS
+#include "OS.h"
+
+static uint16_t Depth;
+
+// Written by the PIT interrupt, read by the calculation thread; both wrap together
+static volatile uint32_t Signalled;
+static uint32_t Taken;
+
+static bool CycleLate;
+static uint8_t CyclesOnTime;
+
+static volatile bool Behind;
+static TDeadlineCounters Counters;
+
+bool Deadline_Init(const uint16_t depth)
+{
+  TDeadlineCounters cleared = { 0 };
+
+  if (depth == 0)
+    return false;
+
+  Depth = depth;
+  Signalled = 0;
+  Taken = 0;
+  CycleLate = false;
+  CyclesOnTime = DEADLINE_RECOVERY_CYCLES;
+  Behind = false;
+
+  // Interrupts are still off while the tower is set up
+  Counters = cleared;
+
+  return true;
+}
+
+void RAMFUNC Deadline_Signal(void)
+{
+  Signalled++;
+}
+
+uint16_t RAMFUNC Deadline_Take(void)
+{
+  uint32_t backlog;
+
+  Taken++;
+  backlog = Signalled - Taken;
+
+  Counters.samples++;
+
+  if (backlog == 0)
+    return 0;
+
+  Counters.lateSamples++;
+  CycleLate = true;
+
+  // The PIT has gone round the buffer and written over this sample
+  if (backlog >= Depth)
+    Counters.overwrittenSamples++;
+
+  if (backlog > 0xFFFF)
+    backlog = 0xFFFF;
+
+  if (backlog > Counters.maxBacklog)
+    Counters.maxBacklog = (uint16_t) backlog;
+
+  return (uint16_t) backlog;
+}
+
+void Deadline_Missed(const uint32_t count)
+{
+  Counters.missedSamples += count;
+  CycleLate = true;
+}
+
+void Deadline_Cycle(void)
+{
+  if (CycleLate)
+  {
+    Counters.lateCycles++;
+    CyclesOnTime = 0;
+  }
+  else if (CyclesOnTime < DEADLINE_RECOVERY_CYCLES)
+    CyclesOnTime++;
+
+  CycleLate = false;
+
+  Behind = (CyclesOnTime < DEADLINE_RECOVERY_CYCLES);
+
+  if (Behind)
+    Counters.skippedCycles++;
+}
+
+bool Deadline_IsBehind(void)
+{
+  return Behind;
+}
+
+void Deadline_GetCounters(TDeadlineCounters* const counters)
+{
+  // The calculation thread has a higher priority than the reader
+  OS_DisableInterrupts();
+  *counters = Counters;
+  OS_EnableInterrupts();
+
+  counters->behind = Behind;
+  counters->reserved = 0;
+}
+
+void Deadline_ResetCounters(void)
+{
+  TDeadlineCounters cleared = { 0 };
+
+  OS_DisableInterrupts();
+  Counters = cleared;
+  OS_EnableInterrupts();
+}
@@ -0,0 +1,87 @@
+/*! @file Deadline.h
+ *
+ *  @brief Sample deadline monitor for the DEM
+ *
+ *  This contains the routines to count the samples signalled by the PIT against the samples taken by the calculation
+ *  thread, so a thread that falls behind is seen. The monitor counts the late samples, the samples overwritten or
+ *  dropped before they were processed and the late cycles, and reports the meter as behind for a while after, so the
+ *  optional analytics can be skipped until it catches up.
+ *
+ *  @author Rohan
+ *  @date 2019-11-25
+ */
+
+#ifndef SOURCES_DEADLINE_H_
+#define SOURCES_DEADLINE_H_
+
+// new types
+#include "types.h"
+
+#define DEADLINE_RECOVERY_CYCLES 10    /*!< Cycles on time before the meter is no longer behind */
+
+/*!
+ * @struct TDeadlineCounters
+ */
+typedef struct
+{
+  uint32_t samples;              /*!< Samples taken by the calculation thread */
+  uint32_t lateSamples;          /*!< Samples taken after the next one had already been signalled */
+  uint32_t overwrittenSamples;   /*!< Samples overwritten by the PIT before they were taken */
+  uint32_t missedSamples;        /*!< Samples dropped by the PIT because the mailbox was full */
+  uint32_t lateCycles;           /*!< Cycles with at least one late sample */
+  uint32_t skippedCycles;        /*!< Cycles the optional analytics were skipped for */
+  uint16_t maxBacklog;           /*!< Most samples waiting behind the one being taken */
+  uint8_t behind;                /*!< 1 while the optional analytics are being skipped */
+  uint8_t reserved;
+} TDeadlineCounters;
+
+/*! @brief Sets up the monitor and clears the counters.
+ *
+ *  @param depth is the number of samples the PIT can signal before it overwrites the oldest one not yet taken.
+ *  @return bool - TRUE if the monitor was initialized successfully.
+ */
+bool Deadline_Init(const uint16_t depth);
+
+/*! @brief Counts a sample signalled by the PIT.
+ *
+ *  @note Called from the PIT interrupt just before the calculation thread is signalled.
+ */
+void RAMFUNC Deadline_Signal(void);
+
+/*! @brief Counts a sample taken by the calculation thread, and checks it against the samples signalled.
+ *
+ *  @return uint16_t - the number of samples waiting behind the one taken.
+ *  @note Called from the calculation thread once its wait returns.
+ */
+uint16_t RAMFUNC Deadline_Take(void);
+
+/*! @brief Counts samples that never reached the calculation thread.
+ *
+ *  @param count is the number of samples missing between the one taken and the one before.
+ *  @note Called from the calculation thread when it sees a gap in the sample indices.
+ */
+void Deadline_Missed(const uint32_t count);
+
+/*! @brief Closes a cycle, and works out whether the meter is behind.
+ *
+ *  @note Called from the calculation thread once per cycle.
+ */
+void Deadline_Cycle(void);
+
+/*! @brief Tells whether the optional analytics should be skipped so the meter can catch up.
+ *
+ *  @return bool - TRUE if there was a late sample in the last DEADLINE_RECOVERY_CYCLES cycles.
+ */
+bool Deadline_IsBehind(void);
+
+/*! @brief Gets the counters.
+ *
+ *  @param counters is where the counters are copied to.
+ */
+void Deadline_GetCounters(TDeadlineCounters* const counters);
+
+/*! @brief Resets the counters.
+ */
+void Deadline_ResetCounters(void);
+
+#endif /* SOURCES_DEADLINE_H_ */
@@ -0,0 +1,58 @@
+/*! @file Decimator.c
+ *
+ *  @brief CIC decimator for the DEM
+ *
+ *  This contains a third order cascaded integrator-comb filter, which turns a block of oversampled ADC values
+ *  into one metering sample with extra resolution. The integrators run at the oversampled rate
+ *  and the combs once per block, so there are no multiplies.
+ *
+ *  @author Rohan
+ *  @date 2019-11-21
+ */
+
+#include "Decimator.h"
+
+void Decimator_Init(TDecimator* const decimator)
+{
+  uint8_t stage;
+
+  for (stage = 0; stage < DECIMATOR_ORDER; stage++)
+  {
+    decimator->integrators[stage] = 0;
+    decimator->combs[stage] = 0;
+  }
+}
+
+int32_t RAMFUNC Decimator_Block(TDecimator* const decimator, const int16_t* const block, const uint8_t rateLog2, const uint8_t fractionBits)
+{
+  // Local copies keep the integrators in registers for the whole block
+  uint32_t integrator1 = decimator->integrators[0];
+  uint32_t integrator2 = decimator->integrators[1];
+  uint32_t integrator3 = decimator->integrators[2];
+  uint32_t output, delayed;
+  uint8_t index, stage;
+
+  for (index = 0; index < (1 << rateLog2); index++)
+  {
+    integrator1 += (uint32_t) (int32_t) block[index];
+    integrator2 += integrator1;
+    integrator3 += integrator2;
+  }
+
+  decimator->integrators[0] = integrator1;
+  decimator->integrators[1] = integrator2;
+  decimator->integrators[2] = integrator3;
+
+  // Each comb subtracts its input from the last block; the wrap-around of the integrators cancels out
+  output = integrator3;
+
+  for (stage = 0; stage < DECIMATOR_ORDER; stage++)
+  {
+    delayed = decimator->combs[stage];
+    decimator->combs[stage] = output;
+    output -= delayed;
+  }
+
+  // The gain of the filter is 2^(DECIMATOR_ORDER * rateLog2); the bits not shifted out are kept as a fraction
+  return (int32_t) output >> (DECIMATOR_ORDER * rateLog2 - fractionBits);
+}
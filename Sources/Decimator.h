@@ -0,0 +1,48 @@
+/*! @file Decimator.h
+ *
+ *  @brief CIC decimator for the DEM
+ *
+ *  This contains a third order cascaded integrator-comb filter, which turns a block of oversampled ADC values
+ *  into one metering sample with extra resolution. The integrators run at the oversampled rate
+ *  and the combs once per block, so there are no multiplies.
+ *
+ *  @author Rohan
+ *  @date 2019-11-21
+ */
+
+#ifndef SOURCES_DECIMATOR_H_
+#define SOURCES_DECIMATOR_H_
+
+// new types
+#include "types.h"
+
+#define DECIMATOR_ORDER 3    /*!< Number of integrator and comb stages */
+
+/*!
+ * @struct TDecimator
+ *
+ * The state of the filter of one channel. The stages wrap around, which the combs undo.
+ */
+typedef struct
+{
+  uint32_t integrators[DECIMATOR_ORDER];
+  uint32_t combs[DECIMATOR_ORDER];
+} TDecimator;
+
+/*! @brief Clears the state of a decimator.
+ *
+ *  @param decimator is the decimator to clear.
+ */
+void Decimator_Init(TDecimator* const decimator);
+
+/*! @brief Filters a block of oversampled values down to one sample.
+ *
+ *  @param decimator is the decimator of the channel.
+ *  @param block is 2^rateLog2 raw ADC values, oldest first.
+ *  @param rateLog2 is log2 of the decimation rate, 1 to 4.
+ *  @param fractionBits is the number of fraction bits of the output, up to DECIMATOR_ORDER * rateLog2.
+ *  @return int32_t - the filtered sample in ADC counts.
+ */
+int32_t RAMFUNC Decimator_Block(TDecimator* const decimator, const int16_t* const block, const uint8_t rateLog2, const uint8_t fractionBits);
+
+#endif /* SOURCES_DECIMATOR_H_ */
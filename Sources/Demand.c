@@ -0,0 +1,259 @@
+/*! @file Demand.c
+ *
+ *  @brief Maximum demand register for the DEM
+ *
+ *  This contains the routines to calculate block and rolling demand from the per-cycle energy,
+ *  and to keep the peak demand of each tariff period in the Flash.
+ *
+ *  @author Rohan
+ *  @date 2019-11-14
+ */
+
+#include "Demand.h"
+
+#define DEMAND_VERSION 2
+#define WINDOW_SECONDS (DEMAND_SUBINTERVAL_SECONDS * DEMAND_NB_SUBINTERVALS)
+
+typedef struct
+{
+  TDemandPeak peaks[DEMAND_NB_PERIODS];
+} TDemandRecord;
+
+// Peaks in the Flash, and the working copy in RAM
+static volatile TDemandRecord *NvDemand;
+static TDemandRecord Demand;
+static bool DemandChanged = false;
+
+// Energy of the current sub-interval in Ws 64Q16, written by the calculation thread
+static uint64_t SubIntervalEnergyWs;
+
+// Ring of the sub-interval energies in the window, and their running sum
+static uint64_t WindowEnergyWs[DEMAND_NB_SUBINTERVALS];
+static uint64_t WindowSumWs;
+static uint8_t WindowHead;
+static uint8_t WindowFill;
+
+// Monotonic deque of sub-interval demands; values decrease from front to back, so the front is the window maximum
+static struct
+{
+  uint32_t subInterval;
+  uint32_t demandW;
+} Deque[DEMAND_NB_SUBINTERVALS];
+static uint8_t DequeFront, DequeCount;
+
+static uint32_t RollingDemandW, BlockDemandW;
+
+static uint32_t CurrentSubInterval;
+static bool SubIntervalStarted = false;
+
+bool Demand_Init(void)
+{
+  uint8_t period;
+
+  if (!Flash_AllocateRecord(FLASH_RECORD_DEMAND, DEMAND_VERSION, sizeof(*NvDemand), (volatile void**) &NvDemand))
+    return false;
+
+  Demand = *NvDemand;
+
+  // An erased record has no peaks yet
+  for (period = 0; period < DEMAND_NB_PERIODS; period++)
+    if (Demand.peaks[period].timestamp == 0xFFFFFFFF)
+    {
+      Demand.peaks[period].demandW = 0;
+      Demand.peaks[period].timestamp = 0;
+    }
+
+  return true;
+}
+
+void Demand_Update(const uint64_t energyPerCycleWs)
+{
+  SubIntervalEnergyWs += energyPerCycleWs;
+}
+
+/*! @brief Pushes a sub-interval demand into the monotonic deque and drops the ones that left the window
+ *
+ *  Every sub-interval is pushed and popped at most once, so the maximum costs O(1) amortized.
+ *  @param subInterval is the number of the sub-interval
+ *  @param demandW is the average demand of the sub-interval in W
+ */
+static void DequePush(const uint32_t subInterval, const uint32_t demandW)
+{
+  // Drop the front once it is older than the window
+  while (DequeCount && subInterval - Deque[DequeFront].subInterval >= DEMAND_NB_SUBINTERVALS)
+  {
+    DequeFront = (DequeFront + 1) % DEMAND_NB_SUBINTERVALS;
+    DequeCount--;
+  }
+
+  // Smaller values at the back can never be the maximum again
+  while (DequeCount && Deque[(DequeFront + DequeCount - 1) % DEMAND_NB_SUBINTERVALS].demandW <= demandW)
+    DequeCount--;
+
+  Deque[(DequeFront + DequeCount) % DEMAND_NB_SUBINTERVALS].subInterval = subInterval;
+  Deque[(DequeFront + DequeCount) % DEMAND_NB_SUBINTERVALS].demandW = demandW;
+  DequeCount++;
+}
+
+/*! @brief Empties the window, when the clock has gone back or jumped past it
+ */
+static void ResetWindow(void)
+{
+  uint8_t index;
+
+  for (index = 0; index < DEMAND_NB_SUBINTERVALS; index++)
+    WindowEnergyWs[index] = 0;
+
+  WindowSumWs = 0;
+  WindowHead = 0;
+  WindowFill = 0;
+  DequeCount = 0;
+  RollingDemandW = 0;
+}
+
+/*! @brief Adds a closed sub-interval to the window and updates the demands and the peak of the period
+ *
+ *  @param subInterval is the number of the sub-interval
+ *  @param energyWs is the energy of the sub-interval in Ws 64Q16
+ *  @param period is the tariff period to keep the peak of
+ */
+static void CloseSubInterval(const uint32_t subInterval, const uint64_t energyWs, const uint8_t period)
+{
+  // O(1) ring-sum update: replace the oldest sub-interval with the newest
+  WindowSumWs += energyWs - WindowEnergyWs[WindowHead];
+  WindowEnergyWs[WindowHead] = energyWs;
+  WindowHead = (WindowHead + 1) % DEMAND_NB_SUBINTERVALS;
+
+  if (WindowFill < DEMAND_NB_SUBINTERVALS)
+    WindowFill++;
+
+  DequePush(subInterval, (uint32_t) ((energyWs / DEMAND_SUBINTERVAL_SECONDS) >> 16));
+
+  // Demand is only defined once the window is full
+  if (WindowFill == DEMAND_NB_SUBINTERVALS)
+  {
+    RollingDemandW = (uint32_t) ((WindowSumWs / WINDOW_SECONDS) >> 16);
+
+    // A fixed block ends on every window-aligned boundary
+    if ((subInterval + 1) % DEMAND_NB_SUBINTERVALS == 0)
+      BlockDemandW = RollingDemandW;
+
+    if (period < DEMAND_NB_PERIODS && RollingDemandW > Demand.peaks[period].demandW)
+    {
+      Demand.peaks[period].demandW = RollingDemandW;
+      Demand.peaks[period].timestamp = (subInterval + 1) * DEMAND_SUBINTERVAL_SECONDS;
+      DemandChanged = true;
+    }
+  }
+}
+
+bool Demand_Tick(const uint32_t seconds, const uint8_t period)
+{
+  uint32_t subInterval = seconds / DEMAND_SUBINTERVAL_SECONDS;
+  uint32_t skipped;
+  uint64_t energyWs;
+
+  if (!SubIntervalStarted)
+  {
+    CurrentSubInterval = subInterval;
+    SubIntervalStarted = true;
+    return true;
+  }
+
+  if (subInterval == CurrentSubInterval)
+    return true;
+
+  // Take the sub-interval energy, since the calculation thread has a higher priority
+  OS_DisableInterrupts();
+  energyWs = SubIntervalEnergyWs;
+  SubIntervalEnergyWs = 0;
+  OS_EnableInterrupts();
+
+  // A clock set back, or forward past the window, leaves nothing in the window that belongs there
+  if (subInterval < CurrentSubInterval || subInterval - CurrentSubInterval > DEMAND_NB_SUBINTERVALS)
+  {
+    ResetWindow();
+    CurrentSubInterval = subInterval;
+    return true;
+  }
+
+  CloseSubInterval(CurrentSubInterval, energyWs, period);
+
+  // Sub-intervals the clock jumped over had no energy; each may still end a block
+  for (skipped = CurrentSubInterval + 1; skipped < subInterval; skipped++)
+    CloseSubInterval(skipped, 0, period);
+
+  CurrentSubInterval = subInterval;
+
+  // Save at most once per sub-interval; a failed save stays due and is tried again when the next one closes
+  if (DemandChanged)
+  {
+    if (!Flash_WriteRecord(FLASH_RECORD_DEMAND, &Demand))
+      return false;
+
+    DemandChanged = false;
+  }
+
+  return true;
+}
+
+uint32_t Demand_GetRolling(void)
+{
+  return RollingDemandW;
+}
+
+uint32_t Demand_GetBlock(void)
+{
+  return BlockDemandW;
+}
+
+uint32_t Demand_GetWindowMax(void)
+{
+  if (!DequeCount)
+    return 0;
+
+  return Deque[DequeFront].demandW;
+}
+
+bool Demand_GetPeak(const uint8_t period, TDemandPeak* const peak)
+{
+  if (period >= DEMAND_NB_PERIODS || !peak)
+    return false;
+
+  OS_DisableInterrupts();
+  *peak = Demand.peaks[period];
+  OS_EnableInterrupts();
+
+  return true;
+}
+
+bool Demand_ResetPeak(const uint8_t period)
+{
+  TDemandRecord demand;
+  uint8_t first = period, last = period;
+
+  if (period > DEMAND_NB_PERIODS)
+    return false;
+
+  // DEMAND_NB_PERIODS selects every period
+  if (period == DEMAND_NB_PERIODS)
+  {
+    first = 0;
+    last = DEMAND_NB_PERIODS - 1;
+  }
+
+  OS_DisableInterrupts();
+
+  for (uint8_t index = first; index <= last; index++)
+  {
+    Demand.peaks[index].demandW = 0;
+    Demand.peaks[index].timestamp = 0;
+  }
+
+  // Save a copy, since the RTC thread may update a peak while the Flash is being written
+  demand = Demand;
+
+  OS_EnableInterrupts();
+
+  return Flash_WriteRecord(FLASH_RECORD_DEMAND, &demand);
+}
@@ -0,0 +1,95 @@
+/*! @file Demand.h
+ *
+ *  @brief Maximum demand register for the DEM
+ *
+ *  This contains the routines to calculate block and rolling demand from the per-cycle energy,
+ *  and to keep the peak demand of each tariff period in the Flash.
+ *
+ *  @author Rohan
+ *  @date 2019-11-14
+ */
+
+#ifndef SOURCES_DEMAND_H_
+#define SOURCES_DEMAND_H_
+
+// new types
+#include "types.h"
+// Flash to keep the peaks
+#include "Flash.h"
+// RTOS
+#include "OS.h"
+// Tariff rates, which keep their own peak
+#include "Tariff.h"
+
+#define DEMAND_SUBINTERVAL_SECONDS 60   /*!< Length of a sub-interval; the window slides by this much */
+#define DEMAND_NB_SUBINTERVALS 15       /*!< Number of sub-intervals in the demand window */
+#define DEMAND_NB_PERIODS TARIFF_NB_RATES   /*!< Number of tariff periods with their own peak, one per rate */
+
+/*!
+ * @struct TDemandPeak
+ */
+typedef struct
+{
+  uint32_t demandW;     /*!< Highest rolling demand in W */
+  uint32_t timestamp;   /*!< RTC seconds at the end of the window that set the peak */
+} TDemandPeak;
+
+/*! @brief Loads the peaks from the Flash and clears the demand window.
+ *
+ *  @return bool - TRUE if the demand register was initialized successfully.
+ *  @note Assumes Flash has been initialized.
+ */
+bool Demand_Init(void);
+
+/*! @brief Adds the energy of one mains cycle to the current sub-interval.
+ *
+ *  @param energyPerCycleWs is the energy of the cycle in Ws, 64Q16.
+ *  @note Called from the calculation thread once per cycle.
+ */
+void Demand_Update(const uint64_t energyPerCycleWs);
+
+/*! @brief Closes the current sub-interval if a boundary has passed, updating the window and the peaks.
+ *
+ *  @param seconds is the current RTC time in seconds.
+ *  @param period is the tariff period the closing sub-interval is billed in.
+ *  @return bool - TRUE if the peaks did not need saving or were saved successfully; peaks the Flash failed to save
+ *  are saved when the next sub-interval closes.
+ *  @note Sub-intervals the clock jumps over are added with no energy. If it jumps back, or forward past the whole
+ *  window, the window is emptied and the demand is undefined until it fills again.
+ */
+bool Demand_Tick(const uint32_t seconds, const uint8_t period);
+
+/*! @brief Gets the average demand over the last full window, updated every sub-interval.
+ *
+ *  @return uint32_t - the rolling demand in W.
+ */
+uint32_t Demand_GetRolling(void);
+
+/*! @brief Gets the average demand over the last completed fixed block.
+ *
+ *  @return uint32_t - the block demand in W.
+ */
+uint32_t Demand_GetBlock(void);
+
+/*! @brief Gets the highest sub-interval demand inside the current window.
+ *
+ *  @return uint32_t - the demand in W.
+ */
+uint32_t Demand_GetWindowMax(void);
+
+/*! @brief Gets the peak demand of a tariff period.
+ *
+ *  @param period is the tariff period.
+ *  @param peak is where the peak is copied to.
+ *  @return bool - TRUE if the period is valid.
+ */
+bool Demand_GetPeak(const uint8_t period, TDemandPeak* const peak);
+
+/*! @brief Clears the peak demand of a tariff period and saves it in the Flash.
+ *
+ *  @param period is the tariff period, or DEMAND_NB_PERIODS to clear every period.
+ *  @return bool - TRUE if the period is valid and the peaks were saved successfully.
+ */
+bool Demand_ResetPeak(const uint8_t period);
+
+#endif /* SOURCES_DEMAND_H_ */
@@ -16,7 +16,7 @@ inline int32_t FixedPoint_Convert32Q16 (int16_t integer)
   return (int32_t) integer << 16;
 }
 
-inline int32_t FixedPoint_Multiply (int32_t num1, int32_t num2)
+inline int32_t RAMFUNC FixedPoint_Multiply (int32_t num1, int32_t num2)
 {
   int64_t product64bit = (int64_t)num1 * (int64_t)num2;
 
@@ -25,7 +25,7 @@ inline int32_t FixedPoint_Multiply (int32_t num1, int32_t num2)
   return product32bit;
 }
 
-inline uint32_t FixedPoint_MultiplyU (uint32_t num1, int32_t num2)
+inline uint32_t RAMFUNC FixedPoint_MultiplyU (uint32_t num1, int32_t num2)
 {
   uint64_t product64bit = (uint64_t)num1 * (uint64_t)num2;
 
@@ -34,7 +34,7 @@ inline uint32_t FixedPoint_MultiplyU (uint32_t num1, int32_t num2)
   return product32bit;
 }
 
-inline int32_t FixedPoint_Divide (int32_t dividend, int32_t divisor)
+inline int32_t RAMFUNC FixedPoint_Divide (int32_t dividend, int32_t divisor)
 {
   if (divisor == 0)
     PE_DEBUGHALT();
@@ -44,7 +44,7 @@ inline int32_t FixedPoint_Divide (int32_t dividend, int32_t divisor)
   return quotient;
 }
 
-inline uint32_t FixedPoint_DivideU (uint32_t dividend, uint32_t divisor)
+inline uint32_t RAMFUNC FixedPoint_DivideU (uint32_t dividend, uint32_t divisor)
 {
   if (divisor == 0)
     PE_DEBUGHALT();
@@ -65,3 +65,48 @@ int32_t FixedPoint_SquareRoot (int32_t radicand, int32_t initialGuess, uint8_t n
 
   return xN;
 }
+
+bool FixedPoint_AccumulateCarry (uint64_t* const whole, uint64_t* const remainder, const uint64_t amount, const uint64_t unit)
+{
+  uint64_t units;
+
+  *remainder += amount;
+
+  if (*remainder < unit)
+    return false;
+
+  // Usually a single unit carries; only divide when more have built up
+  if (*remainder < 2 * unit)
+  {
+    *remainder -= unit;
+    (*whole)++;
+  }
+  else
+  {
+    units = *remainder / unit;
+    *remainder -= units * unit;
+    *whole += units;
+  }
+
+  return true;
+}
+
+uint32_t FixedPoint_SquareRootU64 (uint64_t radicand)
+{
+  uint64_t root = 0, bit = (uint64_t) 1 << 62;
+
+  while (bit)
+  {
+    if (radicand >= root + bit)
+    {
+      radicand -= root + bit;
+      root = (root >> 1) + bit;
+    }
+    else
+      root >>= 1;
+
+    bit >>= 2;
+  }
+
+  return (uint32_t) root;
+}
@@ -28,7 +28,7 @@ int32_t FixedPoint_Convert32Q16 (int16_t integer);
  *
  *  @return int32Q6 - result
  */
-int32_t FixedPoint_Multiply (int32_t num1, int32_t num2);
+int32_t RAMFUNC FixedPoint_Multiply (int32_t num1, int32_t num2);
 
 /*! @brief Multiplies two unsigned signed 32Q16 numbers
  *  @param num1 - one of the multiplicands
@@ -36,7 +36,7 @@ int32_t FixedPoint_Multiply (int32_t num1, int32_t num2);
  *
  *  @return uint32Q6 - result
  */
-uint32_t FixedPoint_MultiplyU (uint32_t num1, int32_t num2);
+uint32_t RAMFUNC FixedPoint_MultiplyU (uint32_t num1, int32_t num2);
 
 /*! @brief Divides two signed 32Q16 numbers
  *  @param dividend
@@ -44,7 +44,7 @@ uint32_t FixedPoint_MultiplyU (uint32_t num1, int32_t num2);
  *
  *  @return int32Q6 - converted number
  */
-int32_t FixedPoint_Divide (int32_t dividend, int32_t divisor);
+int32_t RAMFUNC FixedPoint_Divide (int32_t dividend, int32_t divisor);
 
 /*! @brief Divides two unsigned 32Q16 numbers
  *  @param dividend
@@ -52,7 +52,7 @@ int32_t FixedPoint_Divide (int32_t dividend, int32_t divisor);
  *
  *  @return int32Q6 - converted number
  */
-uint32_t FixedPoint_DivideU (uint32_t dividend, uint32_t divisor);
+uint32_t RAMFUNC FixedPoint_DivideU (uint32_t dividend, uint32_t divisor);
 
 /*! @brief Calculates the square root of a number using Newton's Method
  *  @param radicand - the number whose square root is to be calculated
@@ -63,4 +63,23 @@ uint32_t FixedPoint_DivideU (uint32_t dividend, uint32_t divisor);
  */
 int32_t FixedPoint_SquareRoot (int32_t radicand, int32_t initialGuess, uint8_t nIteration);
 
+/*! @brief Adds to a register kept as whole units and a remainder, carrying whole units out of the remainder
+ *  @param whole - the number of whole units
+ *  @param remainder - the part of a unit not yet carried
+ *  @param amount - the amount to add, in the same scale as the remainder
+ *  @param unit - the size of one unit, in the same scale as the remainder
+ *
+ *  @return bool - TRUE if the number of whole units changed
+ *  @note Nothing is discarded, so a register fed this way never drifts from the sum of the amounts
+ */
+bool FixedPoint_AccumulateCarry (uint64_t* const whole, uint64_t* const remainder, const uint64_t amount, const uint64_t unit);
+
+/*! @brief Calculates the square root of a 64-bit number bit by bit
+ *  @param radicand - the number whose square root is to be calculated
+ *
+ *  @return uint32_t - the square root, rounded down; the root of a 64Q32 number is 32Q16
+ *  @note Needs no initial guess, and takes the same time for any radicand
+ */
+uint32_t FixedPoint_SquareRootU64 (uint64_t radicand);
+
 #endif /* SOURCES_FIXEDPOINT_H_ */
@@ -10,10 +10,22 @@
 
 #include "Flash.h"
 #include "MK70F12.h"
+// RTOS functionality
+#include "OS.h"
+#include "CPU.h"
 
 #define CMD_FLASH_PROGRAM 	0x07u
 #define CMD_FLASH_ERASE_SECTOR 	0X09u
 
+#define SECTOR_MAGIC		0x4E4D4544u	/*!< "DEMN" - marks a sector that holds a complete record log */
+#define ERASED_ID		0xFFFFu		/*!< The identifier read from an unprogrammed record header */
+#define RING_MAGIC		0x474E4952u	/*!< "RING" - marks a formatted ring sector */
+
+/* Each record sector starts with a phrase holding SECTOR_MAGIC and a sequence number; the sector with the
+ * highest sequence number is active. Records are appended after it as a header phrase followed by the payload,
+ * so rewriting a record never erases the sector until it is full and the live records are compacted.
+ */
+
 // FCCOB registers 0-B represented as a struct
 typedef struct {
   uint8_t command;
@@ -30,11 +42,36 @@ typedef struct {
   uint8_t data7;
 } TFCCOB;
 
-bool Flash_Init()
-{
-  //Enable the Flash clock gate
-  return true;
-}
+// Header programmed in the phrase in front of every record; the payload follows in whole phrases
+typedef struct {
+  uint16_t id;
+  uint16_t size;
+  uint8_t version;
+  uint8_t reserved;
+  uint16_t checksum;
+} TRecordHeader;
+
+// RAM index entry for a record, giving O(1) lookups by identifier
+typedef struct {
+  uint32_t address;		/*!< Address of the latest valid payload, 0 if none */
+  uint16_t size;		/*!< Payload size in bytes */
+  uint8_t version;		/*!< Payload layout version */
+  volatile void** owner;	/*!< Pointer kept pointing at the payload, NULL if not allocated yet */
+} TRecordEntry;
+
+static TRecordEntry RecordIndex[FLASH_NB_RECORDS];	/*!< Index rebuilt from the Flash at boot */
+
+static uint32_t ActiveSector;		/*!< Sector holding the current record log */
+static uint32_t ActiveSequence;		/*!< Sequence number of the active sector */
+static uint32_t WriteAddress;		/*!< Next free phrase in the active sector */
+
+static OS_ECB *FlashAccessSemaphore;	/*!< Serializes Flash commands between threads */
+
+static bool RAMFUNC LaunchCommand(TFCCOB* commonCommandObject);
+static bool EraseSector(const uint32_t address);
+static bool WritePhrase(const uint32_t address, const uint64union_t phrase);
+static bool RebuildIndex(void);
+static bool FormatSector(const uint32_t sector, const uint32_t sequence);
  
 /*! @brief Tells the flash what command it should execute, with specific paramaters
  *
@@ -42,8 +79,9 @@ bool Flash_Init()
  *  to be writen to the FCCOB registers, which then executes the command
  *  @return bool - TRUE if the registers were accessed successfully
  *  @note Assumes Flash has been initialized.
+ *  @note Runs from RAM, so waiting out an erase does not stall on instruction fetches from the Flash.
  */
-static bool LaunchCommand(TFCCOB* commonCommandObject)
+static bool RAMFUNC LaunchCommand(TFCCOB* commonCommandObject)
 {
   //NULL check
   if (!commonCommandObject)
@@ -76,7 +114,8 @@ static bool LaunchCommand(TFCCOB* commonCommandObject)
   // Wait for command to finish executing
   while (!(FTFE_FSTAT & FTFE_FSTAT_CCIF_MASK));
 
-  return true;  
+  // The command failed if it raised an access error, a protection violation or a verify error
+  return !(FTFE_FSTAT & (FTFE_FSTAT_ACCERR_MASK | FTFE_FSTAT_FPVIOL_MASK | FTFE_FSTAT_MGSTAT0_MASK));
 }
 
 /*! @brief Erases a sector of flash memory, allowing it to be written to
@@ -128,210 +167,692 @@ static bool WritePhrase(const uint32_t address, const uint64union_t phrase)
   return LaunchCommand(&writeSector);
 }
 
-/*! @brief Allows the first 8 bytes of a sector to be modified, by clearing it and then writing back to it
+/*! @brief Calculates the number of bytes a record takes in the Flash, including its header
  *
- *  @param address is the address of the sector to be modified
- *  @param phrase is the new set of data to be written to the sector
- *  @return bool - TRUE if the phrase was modified successfully
- *  @note Assumes Flash has been initialized.
+ *  @param size is the size of the record payload in bytes
+ *  @return uint32_t - the number of bytes, rounded up to whole phrases
+ */
+static uint32_t RecordFootprint(const uint16_t size)
+{
+  return FLASH_PHRASE_SIZE + (((uint32_t) size + FLASH_PHRASE_SIZE - 1) & ~(FLASH_PHRASE_SIZE - 1));
+}
+
+/*! @brief Reads a header from the Flash
+ *
+ *  @param address is the address of a record header
+ *  @param header is the structure to be filled
+ */
+static void ReadHeader(const uint32_t address, TRecordHeader* const header)
+{
+  uint32union_t word;
+
+  word.l = _FW(address);
+  header->id = word.s.Lo;
+  header->size = word.s.Hi;
+
+  word.l = _FW(address + 4);
+  header->version = (uint8_t) word.s.Lo;
+  header->reserved = (uint8_t) (word.s.Lo >> 8);
+  header->checksum = word.s.Hi;
+}
+
+/*! @brief Calculates the checksum of a record payload held in the Flash
+ *
+ *  @param id is the identifier the record is stored with
+ *  @param address is the address of the payload
+ *  @param size is the size of the payload in bytes
+ *  @return uint16_t - the checksum
+ */
+static uint16_t Checksum(const uint16_t id, const uint32_t address, const uint16_t size)
+{
+  uint16_t checksum = id;
+  uint16_t index;
+
+  for (index = 0; index < size; index++)
+    checksum += _FB(address + index);
+
+  return checksum;
+}
+
+/*! @brief Gets one byte of the new copy of a record
+ *
+ *  @param entry is the index entry of the record
+ *  @param index is the offset of the byte in the record
+ *  @param patchOffset is the offset of the bytes being replaced
+ *  @param patchData is the replacement bytes
+ *  @param patchSize is the number of bytes being replaced
+ *  @return uint8_t - the patched byte if it lies in the patch, otherwise the stored byte, or 0xFF if there is no stored copy
+ */
+static uint8_t RecordByte(const TRecordEntry* const entry, const uint16_t index,
+                          const uint16_t patchOffset, const uint8_t* const patchData, const uint16_t patchSize)
+{
+  if (patchData && index >= patchOffset && index < patchOffset + patchSize)
+    return patchData[index - patchOffset];
+
+  if (entry->address)
+    return _FB(entry->address + index);
+
+  return 0xFF;
+}
+
+/*! @brief Programs a copy of a record, with an optional patch applied, at the given address
+ *
+ *  The header is programmed before the payload, so a copy interrupted by a reset fails its checksum
+ *  and the previous copy stays the valid one.
+ *  @param address is the address of an erased area large enough for the record
+ *  @param id is the identifier of the record
+ *  @param patchOffset is the offset of the bytes being replaced
+ *  @param patchData is the replacement bytes, NULL to copy the record unchanged
+ *  @param patchSize is the number of bytes being replaced
+ *  @return bool - TRUE if the record was programmed successfully
+ *  @note Leaves the index pointing at the previous copy; the caller moves it once the new copy is committed.
  */
-static bool ModifyPhrase(const uint32_t address, const uint64union_t phrase)
+static bool CopyRecord(const uint32_t address, const TFlashRecordID id,
+                       const uint16_t patchOffset, const uint8_t* const patchData, const uint16_t patchSize)
 {
-  //Erase the sector to be modified
-  if (!EraseSector(address))
+  TRecordEntry* const entry = &RecordIndex[id];
+  uint64union_t phrase;
+  uint16_t checksum = (uint16_t) id;
+  uint16_t index;
+
+  // The checksum covers the payload as it will be programmed
+  for (index = 0; index < entry->size; index++)
+    checksum += RecordByte(entry, index, patchOffset, patchData, patchSize);
+
+  phrase.s.Lo = (uint32_t) id | ((uint32_t) entry->size << 16);
+  phrase.s.Hi = (uint32_t) entry->version | (0xFFu << 8) | ((uint32_t) checksum << 16);
+
+  if (!WritePhrase(address, phrase))
     return false;
-  
-  //Write the new data to the flash
-  return WritePhrase(address, phrase);
+
+  // Program the payload one phrase at a time, padding the last phrase with erased bytes
+  for (index = 0; index < entry->size; index += FLASH_PHRASE_SIZE)
+  {
+    uint8_t byteNb;
+
+    phrase.l = 0;
+
+    for (byteNb = 0; byteNb < FLASH_PHRASE_SIZE; byteNb++)
+    {
+      uint8_t data = 0xFF;
+
+      if (index + byteNb < entry->size)
+        data = RecordByte(entry, index + byteNb, patchOffset, patchData, patchSize);
+
+      phrase.l |= (uint64_t) data << (8 * byteNb);
+    }
+
+    if (!WritePhrase(address + FLASH_PHRASE_SIZE + index, phrase))
+      return false;
+  }
+
+  return true;
 }
 
-/*! @brief Allocates space for a non-volatile variable in the Flash memory.
+/*! @brief Updates the owner's pointer of a record after the record has moved
  *
- *  @param variable is the address of a pointer to a variable that is to be allocated space in Flash memory.
- *         The pointer will be allocated to a relevant address:
- *         If the variable is a byte, then any address.
- *         If the variable is a half-word, then an even address.
- *         If the variable is a word, then an address divisible by 4.
- *         This allows the resulting variable to be used with the relevant Flash_Write function which assumes a certain memory address.
- *         e.g. a 16-bit variable will be on an even address
- *  @param size The size, in bytes, of the variable that is to be allocated space in the Flash memory. Valid values are 1, 2 and 4.
- *  @return bool - TRUE if the variable was allocated space in the Flash memory.
- *  @note Assumes Flash has been initialized.
+ *  @param entry is the index entry of the record
  */
-bool Flash_AllocateVar(volatile void** variable, const uint8_t size)
+static void UpdateOwner(const TRecordEntry* const entry)
 {
-  // NULL check
-  if (!variable)
+  if (entry->owner)
+    *entry->owner = (void*) entry->address;
+}
+
+/*! @brief Moves the latest copy of every record into the spare sector and erases the active one
+ *
+ *  @return bool - TRUE if the records were moved successfully; otherwise the index still points at the old sector
+ */
+static bool Compact(void)
+{
+  uint32_t spareSector = (ActiveSector == FLASH_RECORD_SECTOR_A) ? FLASH_RECORD_SECTOR_B : FLASH_RECORD_SECTOR_A;
+  uint32_t newAddress[FLASH_NB_RECORDS];
+  uint32_t address = spareSector + FLASH_PHRASE_SIZE;
+  uint32_t oldSector;
+  uint8_t id;
+
+  // Check the live records fit before anything is erased
+  for (id = 0; id < FLASH_NB_RECORDS; id++)
+    if (RecordIndex[id].address)
+      address += RecordFootprint(RecordIndex[id].size);
+
+  if (address > spareSector + FLASH_SECTOR_SIZE)
     return false;
 
-  //Index represents the 8 storage bytes like an array
-  static uint8_t memoryIndex = 0x00;
+  if (!EraseSector(spareSector))
+    return false;
 
-  //Count used to check position
-  uint8_t count;
+  address = spareSector + FLASH_PHRASE_SIZE;
 
-  //Checking for how many bytes must be stored, only accounts for 1, 2 and 4 bytes of data
-  switch (size)
+  // The index keeps pointing at the old copies until the new sector is committed
+  for (id = 0; id < FLASH_NB_RECORDS; id++)
   {
-    //1 byte of data
-    case 1:
-      //For loop checks for the first empty space available
-      for (count = 0; count < 8; count++)
-      {
-        //Check for empty space
-        if (!(memoryIndex & ((uint8_t) 0x01 << count)))
-        {
-          //Allocate the address of the variable to the empty space
-          *variable = (void *) FLASH_DATA_START + count;
+    newAddress[id] = 0;
 
-          //Setting the memory space as allocated in our "array"
-          memoryIndex |= (0x01 << count);
+    if (RecordIndex[id].address)
+    {
+      if (!CopyRecord(address, (TFlashRecordID) id, 0, NULL, 0))
+        return false;
 
-          return true;
-        }
-      }
+      newAddress[id] = address + FLASH_PHRASE_SIZE;
+      address += RecordFootprint(RecordIndex[id].size);
+    }
+  }
 
-      //If no space available, return false
-      return false;
+  // The sector header goes last so an interrupted compaction leaves the old sector active
+  if (!FormatSector(spareSector, ActiveSequence + 1))
+    return false;
 
-    //2 bytes of data
-    case 2:
+  oldSector = ActiveSector;
 
-      for (count = 0; count < 8; count+=2)
-      {
-        //Check that there are two consecutive empty spaces in flash
-        if (!(memoryIndex & ((uint8_t) 0x01 << count)) &&
-            !(memoryIndex & ((uint8_t) 0x01 << count + 1)))
-        {
-          //Allocate the address of the variable to the first empty space
-          *variable = (void *) FLASH_DATA_START + count;
-
-          //Setting the memory spaces as allocated in our "array"
-          memoryIndex |= (0x01 << count);
-          memoryIndex |= (0x01 << count+1);
-
-          return true;
-        }
-      }
+  ActiveSector = spareSector;
+  ActiveSequence++;
+  WriteAddress = address;
+
+  for (id = 0; id < FLASH_NB_RECORDS; id++)
+    RecordIndex[id].address = newAddress[id];
+
+  // Readers must be moved to the new copies before the old ones read as erased
+  for (id = 0; id < FLASH_NB_RECORDS; id++)
+    UpdateOwner(&RecordIndex[id]);
 
-      //If no spaces available, return false
+  // The new sector has the higher sequence number, so it stays active even if this erase fails
+  return EraseSector(oldSector);
+}
+
+/*! @brief Appends a new copy of a record to the active sector, compacting the sectors if it is full
+ *
+ *  @param id is the identifier of the record
+ *  @param patchOffset is the offset of the bytes being replaced
+ *  @param patchData is the replacement bytes, NULL to store the record unchanged
+ *  @param patchSize is the number of bytes being replaced
+ *  @return bool - TRUE if the record was written successfully
+ */
+static bool AppendRecord(const TFlashRecordID id, const uint16_t patchOffset, const uint8_t* const patchData, const uint16_t patchSize)
+{
+  uint32_t footprint = RecordFootprint(RecordIndex[id].size);
+
+  if (WriteAddress + footprint > ActiveSector + FLASH_SECTOR_SIZE)
+    if (!Compact() || (WriteAddress + footprint > ActiveSector + FLASH_SECTOR_SIZE))
       return false;
 
-    //4 bytes of data
-    case 4:
+  // Claim the space first; a failed program leaves garbage that the next compaction drops
+  uint32_t address = WriteAddress;
+  WriteAddress += footprint;
 
-      for (count = 0; count < 8; count+=4)
-      {
-        //Check that there are 4 consecutive empty spaces in flash
-        if (!(memoryIndex & ((uint8_t) 0x01 << count)) &&
-            !(memoryIndex & ((uint8_t) 0x01 << count + 1)) &&
-            !(memoryIndex & ((uint8_t) 0x01 << count + 2)) &&
-            !(memoryIndex & ((uint8_t) 0x01 << count + 3)))
-        {
-          //Allocate the address of the variable to the first empty space
-          *variable = (void *) FLASH_DATA_START + count;
-
-          //Setting the memory spaces as allocated in our array
-          memoryIndex |= (0x01 << count);
-          memoryIndex |= (0x01 << count+1);
-          memoryIndex |= (0x01 << count+2);
-          memoryIndex |= (0x01 << count+3);
-
-          return true;
-        }
-      }
+  if (!CopyRecord(address, id, patchOffset, patchData, patchSize))
+    return false;
+
+  RecordIndex[id].address = address + FLASH_PHRASE_SIZE;
+  UpdateOwner(&RecordIndex[id]);
+
+  return true;
+}
+
+/*! @brief Programs the header that marks a sector as holding a complete record log
+ *
+ *  @param sector is the address of the sector
+ *  @param sequence is the sequence number of the sector
+ *  @return bool - TRUE if the header was programmed successfully
+ */
+static bool FormatSector(const uint32_t sector, const uint32_t sequence)
+{
+  uint64union_t phrase;
+
+  phrase.s.Lo = SECTOR_MAGIC;
+  phrase.s.Hi = sequence;
 
-      //If no spaces available, return false
+  return WritePhrase(sector, phrase);
+}
+
+/*! @brief Finds the active sector and rebuilds the RAM index by scanning its record log once
+ *
+ *  @return bool - TRUE if the index was rebuilt successfully
+ */
+static bool RebuildIndex(void)
+{
+  bool validA = (_FW(FLASH_RECORD_SECTOR_A) == SECTOR_MAGIC);
+  bool validB = (_FW(FLASH_RECORD_SECTOR_B) == SECTOR_MAGIC);
+  uint32_t sequenceA = _FW(FLASH_RECORD_SECTOR_A + 4);
+  uint32_t sequenceB = _FW(FLASH_RECORD_SECTOR_B + 4);
+  uint32_t address, end;
+  TRecordHeader header;
+
+  if (!validA && !validB)
+  {
+    // Blank or foreign contents - start a new log
+    if (!EraseSector(FLASH_RECORD_SECTOR_A) || !EraseSector(FLASH_RECORD_SECTOR_B))
       return false;
 
-    default:
-      //If any data not of sizes 1,2 or 4, return false
+    if (!FormatSector(FLASH_RECORD_SECTOR_A, 1))
       return false;
+
+    validA = true;
+    sequenceA = 1;
+  }
+
+  if (validA && (!validB || sequenceA > sequenceB))
+  {
+    ActiveSector = FLASH_RECORD_SECTOR_A;
+    ActiveSequence = sequenceA;
+  }
+  else
+  {
+    ActiveSector = FLASH_RECORD_SECTOR_B;
+    ActiveSequence = sequenceB;
+  }
+
+  // A reset during compaction leaves both sectors formatted; the older one is stale
+  if (validA && validB)
+    if (!EraseSector((ActiveSector == FLASH_RECORD_SECTOR_A) ? FLASH_RECORD_SECTOR_B : FLASH_RECORD_SECTOR_A))
+      return false;
+
+  address = ActiveSector + FLASH_PHRASE_SIZE;
+  end = ActiveSector + FLASH_SECTOR_SIZE;
+
+  while (address + FLASH_PHRASE_SIZE <= end)
+  {
+    ReadHeader(address, &header);
+
+    // An erased header marks the end of the log
+    if (header.id == ERASED_ID && header.size == 0xFFFF)
+      break;
+
+    // A damaged header means the rest of the sector cannot be walked; force a compaction on the next write
+    if (header.size == 0 || header.size > FLASH_RECORD_MAX_SIZE || address + RecordFootprint(header.size) > end)
+    {
+      address = end;
+      break;
+    }
+
+    // Later copies supersede earlier ones
+    if (header.id < FLASH_NB_RECORDS &&
+        header.checksum == Checksum(header.id, address + FLASH_PHRASE_SIZE, header.size))
+    {
+      RecordIndex[header.id].address = address + FLASH_PHRASE_SIZE;
+      RecordIndex[header.id].size = header.size;
+      RecordIndex[header.id].version = header.version;
+    }
+
+    address += RecordFootprint(header.size);
   }
+
+  WriteAddress = address;
+
+  return true;
 }
 
-/*! @brief Writes a 32-bit number to Flash.
+/*! @brief Writes bytes into an allocated record
  *
- *  @param address The address of the data.
- *  @param data The 32-bit data to write.
- *  @return bool - TRUE if Flash was written successfully, FALSE if address is not aligned to a 4-byte boundary or if there is a programming error.
- *  @note Assumes Flash has been initialized.
+ *  @param address is the address of the bytes in the Flash
+ *  @param data is the new value of the bytes
+ *  @param size is the number of bytes to write
+ *  @return bool - TRUE if the record was written successfully, FALSE if the address is not inside an allocated record
  */
-bool Flash_Write32(volatile uint32_t* const address, const uint32_t data)
+static bool WriteData(const uint32_t address, const void* const data, const uint8_t size)
 {
-  // Check if the address is null
-  if (!address)
-    return false;
+  OS_ERROR error;
+  bool success = false;
+  uint8_t id;
 
-  //Copying the existing phrase in a temporary phrase buffer
-  uint64union_t phraseBuffer;
+  error = OS_SemaphoreWait(FlashAccessSemaphore, 0);
 
-  uint32_t addressBuffer = (uint32_t) address;
+  if (error)
+    PE_DEBUGHALT();
 
-  //If at address 0x00080004
-  if (addressBuffer % 8 == 4)
+  for (id = 0; id < FLASH_NB_RECORDS; id++)
   {
-    addressBuffer -= 4;
+    TRecordEntry* const entry = &RecordIndex[id];
+
+    if (entry->owner && entry->address &&
+        address >= entry->address && address + size <= entry->address + entry->size)
+    {
+      success = AppendRecord((TFlashRecordID) id, (uint16_t) (address - entry->address), (const uint8_t*) data, size);
+      break;
+    }
+  }
+
+  error = OS_SemaphoreSignal(FlashAccessSemaphore);
+
+  if (error)
+    PE_DEBUGHALT();
+
+  return success;
+}
 
-    //Store the new data in the high 4 bytes, and the already existing flash data in the low 4 bytes
-    phraseBuffer.s.Lo = _FW(addressBuffer);
-    phraseBuffer.s.Hi = data;
+bool Flash_Init()
+{
+  uint8_t id;
+
+  FlashAccessSemaphore = OS_SemaphoreCreate(1);
+
+  for (id = 0; id < FLASH_NB_RECORDS; id++)
+  {
+    RecordIndex[id].address = 0;
+    RecordIndex[id].owner = NULL;
   }
 
-  else if (addressBuffer % 8 == 0) //At address 0x00080000
+  return RebuildIndex();
+}
+
+/*! @brief Allocates a non-volatile record in the Flash memory.
+ *
+ *  @param id The stable identifier of the record.
+ *  @param version The layout version of the record. A stored record with a different version or size is discarded.
+ *  @param size The size, in bytes, of the record. Any value from 1 to FLASH_RECORD_MAX_SIZE is valid.
+ *  @param record is the address of a pointer that will point to the record in Flash memory.
+ *         The record is word aligned, so it can hold any structure and be used with the Flash_Write functions.
+ *         The pointer is kept up to date by the Flash module whenever the record is rewritten or moved.
+ *         If no valid record was found, the record reads as erased (all 0xFF).
+ *  @return bool - TRUE if the record was allocated space in the Flash memory.
+ *  @note Assumes Flash has been initialized.
+ */
+bool Flash_AllocateRecord(const TFlashRecordID id, const uint8_t version, const uint16_t size, volatile void** record)
+{
+  // NULL and range check
+  if (!record || id >= FLASH_NB_RECORDS || size == 0 || size > FLASH_RECORD_MAX_SIZE)
+    return false;
+
+  TRecordEntry* const entry = &RecordIndex[id];
+  OS_ERROR error;
+  bool success = true;
+
+  error = OS_SemaphoreWait(FlashAccessSemaphore, 0);
+
+  if (error)
+    PE_DEBUGHALT();
+
+  entry->owner = record;
+
+  // A stored copy with another layout cannot be interpreted; replace it with an erased one
+  if (!entry->address || entry->version != version || entry->size != size)
   {
-    //Store the new data in the low 4 bytes, and the already existing flash data in the high 4 bytes
-    phraseBuffer.s.Hi = _FW(addressBuffer + 4);
-    phraseBuffer.s.Lo = data;
+    entry->address = 0;
+    entry->version = version;
+    entry->size = size;
+
+    success = AppendRecord(id, 0, NULL, 0);
   }
+  else
+    UpdateOwner(entry);
+
+  error = OS_SemaphoreSignal(FlashAccessSemaphore);
 
-  else			// If offset is anything other than 0 or 4, return false
+  if (error)
+    PE_DEBUGHALT();
+
+  return success;
+}
+
+/*! @brief Writes a complete record to Flash.
+ *
+ *  @param id The stable identifier of the record.
+ *  @param data The address of the new contents of the record, which must be the size given when the record was allocated.
+ *  @return bool - TRUE if Flash was written successfully.
+ *  @note Assumes the record has been allocated.
+ */
+bool Flash_WriteRecord(const TFlashRecordID id, const void* const data)
+{
+  if (!data || id >= FLASH_NB_RECORDS || !RecordIndex[id].owner)
     return false;
 
+  OS_ERROR error;
 
-  //With new phrase, now erase flash and re-write phrase to flash
-  return ModifyPhrase(addressBuffer, phraseBuffer);
+  error = OS_SemaphoreWait(FlashAccessSemaphore, 0);
+
+  if (error)
+    PE_DEBUGHALT();
+
+  bool success = AppendRecord(id, 0, (const uint8_t*) data, RecordIndex[id].size);
+
+  error = OS_SemaphoreSignal(FlashAccessSemaphore);
+
+  if (error)
+    PE_DEBUGHALT();
+
+  return success;
 }
 
-/*! @brief Writes a 16-bit number to Flash.
+/*! @brief Gets the address of a sector of a ring
  *
- *  @param address The address of the data.
- *  @param data The 16-bit data to write.
- *  @return bool - TRUE if Flash was written successfully, FALSE if address is not aligned to a 2-byte boundary or if there is a programming error.
- *  @note Assumes Flash has been initialized.
+ *  @param ring is the ring
+ *  @param sectorNb is the position of the sector in the ring
+ *  @return uint32_t - the address of the sector
  */
-bool Flash_Write16(volatile uint16_t* const address, const uint16_t data)
+static uint32_t RingSector(const TFlashRing* const ring, const uint8_t sectorNb)
 {
-  // Check if the address is null
-  if (!address)
+  return ring->firstSector + (uint32_t) sectorNb * FLASH_SECTOR_SIZE;
+}
+
+/*! @brief Erases a sector of a ring and programs its header
+ *
+ *  @param ring is the ring
+ *  @param sectorNb is the position of the sector in the ring
+ *  @param firstIndex is the index of the first record to be written in the sector
+ *  @return bool - TRUE if the sector was formatted successfully
+ */
+static bool RingFormat(const TFlashRing* const ring, const uint8_t sectorNb, const uint32_t firstIndex)
+{
+  uint64union_t phrase;
+
+  if (!EraseSector(RingSector(ring, sectorNb)))
     return false;
 
-  uint32union_t wordBuffer;
+  phrase.s.Lo = RING_MAGIC;
+  phrase.s.Hi = firstIndex;
+
+  return WritePhrase(RingSector(ring, sectorNb), phrase);
+}
+
+/*! @brief Checks if a slot of a ring has not been programmed
+ *
+ *  @param ring is the ring
+ *  @param address is the address of the slot
+ *  @return bool - TRUE if every byte of the slot is erased
+ */
+static bool RingSlotErased(const TFlashRing* const ring, const uint32_t address)
+{
+  uint16_t offset;
+
+  for (offset = 0; offset < ring->recordSize; offset += 4)
+    if (_FW(address + offset) != 0xFFFFFFFFu)
+      return false;
+
+  return true;
+}
 
-  uint32_t addressBuffer = (uint32_t) address;
+bool Flash_RingInit(TFlashRing* const ring)
+{
+  uint8_t sectorNb;
+  bool found = false;
 
-  //At address' 0x00080002 || 0x00080006
-  if (addressBuffer % 4 == 2)
+  if (!ring || ring->nbSectors < 2 || ring->recordSize == 0 || (ring->recordSize % FLASH_PHRASE_SIZE))
+    return false;
+
+  ring->recordsPerSector = (FLASH_SECTOR_SIZE - FLASH_PHRASE_SIZE) / ring->recordSize;
+
+  // The head is in the sector with the highest first index and the oldest records in the lowest
+  for (sectorNb = 0; sectorNb < ring->nbSectors; sectorNb++)
   {
-    addressBuffer -= 2;
+    uint32_t sector = RingSector(ring, sectorNb);
+    uint32_t firstIndex = _FW(sector + 4);
+
+    if (_FW(sector) != RING_MAGIC)
+      continue;
+
+    if (!found || firstIndex > ring->nextIndex)
+    {
+      ring->headSector = sectorNb;
+      ring->nextIndex = ring->headFirstIndex = firstIndex;
+    }
 
-    //Store the new data in the high 2 bytes, and the already existing flash data in the low 2 bytes
-    wordBuffer.s.Lo = _FH(addressBuffer);
-    wordBuffer.s.Hi = data;
+    if (!found || firstIndex < ring->oldestIndex)
+    {
+      ring->oldestSector = sectorNb;
+      ring->oldestIndex = firstIndex;
+    }
+
+    found = true;
   }
 
-  else if (addressBuffer % 4 == 0)  //At address' 0x00080000 || 0x00080004
+  if (!found)
   {
-    //Store the new data in the low 2 bytes, and the already existing flash data in the high 2 bytes
-    wordBuffer.s.Hi = _FH(addressBuffer + 2);
-    wordBuffer.s.Lo = data;
+    ring->headSector = ring->oldestSector = 0;
+    ring->nextIndex = ring->oldestIndex = ring->headFirstIndex = 0;
+
+    return RingFormat(ring, 0, 0);
   }
 
-  else
-    return false;	// If address is not at offset 0, 2, 4, 6 and 8, return false
+  // Walk the head sector to the first erased slot
+  uint32_t address = RingSector(ring, ring->headSector) + FLASH_PHRASE_SIZE;
+  uint16_t slot;
+
+  for (slot = 0; slot < ring->recordsPerSector; slot++, address += ring->recordSize)
+  {
+    if (RingSlotErased(ring, address))
+      break;
 
-  //Take new 32 bits of data and call write32 to continue copying data
-  return Flash_Write32((uint32_t*) addressBuffer, wordBuffer.l);
+    ring->nextIndex++;
+  }
+
+  return true;
+}
+
+bool Flash_RingAppend(TFlashRing* const ring, const void* const record)
+{
+  const uint8_t* const data = (const uint8_t*) record;
+  OS_ERROR error;
+  bool success = true;
+
+  if (!ring || !record)
+    return false;
+
+  error = OS_SemaphoreWait(FlashAccessSemaphore, 0);
+
+  if (error)
+    PE_DEBUGHALT();
+
+  uint32_t slot = ring->nextIndex - ring->headFirstIndex;
+
+  // Move the head to the next sector, dropping the oldest records if the ring has wrapped
+  if (slot >= ring->recordsPerSector)
+  {
+    uint8_t headSector = (ring->headSector + 1) % ring->nbSectors;
+
+    // The ring is left as it was if the format fails, so the next append formats the same sector again
+    success = RingFormat(ring, headSector, ring->nextIndex);
+
+    if (success)
+    {
+      if (headSector == ring->oldestSector)
+      {
+        ring->oldestSector = (ring->oldestSector + 1) % ring->nbSectors;
+        ring->oldestIndex += ring->recordsPerSector;
+      }
+
+      ring->headSector = headSector;
+      ring->headFirstIndex = ring->nextIndex;
+      slot = 0;
+    }
+  }
+
+  bool formatted = success;
+
+  uint32_t address = RingSector(ring, ring->headSector) + FLASH_PHRASE_SIZE + (uint32_t) slot * ring->recordSize;
+  uint16_t offset;
+
+  // Program the record a whole phrase at a time
+  for (offset = 0; success && offset < ring->recordSize; offset += FLASH_PHRASE_SIZE)
+  {
+    uint64union_t phrase;
+    uint8_t byteNb;
+
+    phrase.l = 0;
+
+    for (byteNb = 0; byteNb < FLASH_PHRASE_SIZE; byteNb++)
+      phrase.l |= (uint64_t) data[offset + byteNb] << (8 * byteNb);
+
+    success = WritePhrase(address + offset, phrase);
+  }
+
+  // The slot is used even if programming failed, so the index stays in step with the Flash; a failed format used none
+  if (formatted)
+    ring->nextIndex++;
+
+  error = OS_SemaphoreSignal(FlashAccessSemaphore);
+
+  if (error)
+    PE_DEBUGHALT();
+
+  return success;
+}
+
+bool Flash_RingRead(const TFlashRing* const ring, const uint32_t index, void* const record)
+{
+  uint8_t* const data = (uint8_t*) record;
+  OS_ERROR error;
+  bool success = false;
+
+  if (!ring || !record)
+    return false;
+
+  // Hold off appends so the sector cannot be erased under the copy
+  error = OS_SemaphoreWait(FlashAccessSemaphore, 0);
+
+  if (error)
+    PE_DEBUGHALT();
+
+  if (index >= ring->oldestIndex && index < ring->nextIndex)
+  {
+    uint32_t offset = index - ring->oldestIndex;
+    uint8_t sectorNb = (ring->oldestSector + offset / ring->recordsPerSector) % ring->nbSectors;
+    uint32_t address = RingSector(ring, sectorNb) + FLASH_PHRASE_SIZE + (offset % ring->recordsPerSector) * ring->recordSize;
+    uint16_t byteNb;
+
+    for (byteNb = 0; byteNb < ring->recordSize; byteNb++)
+      data[byteNb] = _FB(address + byteNb);
+
+    success = true;
+  }
+
+  error = OS_SemaphoreSignal(FlashAccessSemaphore);
+
+  if (error)
+    PE_DEBUGHALT();
+
+  return success;
+}
+
+/*! @brief Writes a 32-bit number to Flash.
+ *
+ *  @param address The address of the data.
+ *  @param data The 32-bit data to write.
+ *  @return bool - TRUE if Flash was written successfully, FALSE if address is not aligned to a 4-byte boundary or if there is a programming error.
+ *  @note Assumes Flash has been initialized and the address lies in an allocated record.
+ */
+bool Flash_Write32(volatile uint32_t* const address, const uint32_t data)
+{
+  // Check if the address is null or not aligned
+  if (!address || ((uint32_t) address % 4))
+    return false;
+
+  return WriteData((uint32_t) address, &data, sizeof(data));
+}
+
+/*! @brief Writes a 16-bit number to Flash.
+ *
+ *  @param address The address of the data.
+ *  @param data The 16-bit data to write.
+ *  @return bool - TRUE if Flash was written successfully, FALSE if address is not aligned to a 2-byte boundary or if there is a programming error.
+ *  @note Assumes Flash has been initialized and the address lies in an allocated record.
+ */
+bool Flash_Write16(volatile uint16_t* const address, const uint16_t data)
+{
+  // Check if the address is null or not aligned
+  if (!address || ((uint32_t) address % 2))
+    return false;
+
+  return WriteData((uint32_t) address, &data, sizeof(data));
 }
 
 /*! @brief Writes an 8-bit number to Flash.
@@ -339,7 +860,7 @@ bool Flash_Write16(volatile uint16_t* const address, const uint16_t data)
  *  @param address The address of the data.
  *  @param data The 8-bit data to write.
  *  @return bool - TRUE if Flash was written successfully, FALSE if there is a programming error.
- *  @note Assumes Flash has been initialized.
+ *  @note Assumes Flash has been initialized and the address lies in an allocated record.
  */
 bool Flash_Write8(volatile uint8_t* const address, const uint8_t data)
 {
@@ -347,37 +868,45 @@ bool Flash_Write8(volatile uint8_t* const address, const uint8_t data)
   if(!address)
     return false;
 
-  uint16union_t halfWordBuffer;
-
-  uint32_t addressBuffer = (uint32_t) address;
-
-  //At address' 0x00080001 || 0x00080003 || 0x00080005 || 0x00080007
-  if (addressBuffer % 2)
-  {
-    addressBuffer -= 1;
-
-    //Store the new data in the high byte, and the already existing flash data in the low byte
-    halfWordBuffer.s.Lo = _FB(addressBuffer);
-    halfWordBuffer.s.Hi = data;
-  }
-  else  //At address' 0x00080000 || 0x00080002 || 0x00080004 || 0x00080006
-  {
-    //Store the new data in the low byte, and the already existing flash data in the high byte
-    halfWordBuffer.s.Hi = _FB(addressBuffer + 1);
-    halfWordBuffer.s.Lo = data;
-  }
-
-  //Take new 16 bits of data and call write16 to continue copying data
-  return Flash_Write16((uint16_t*) addressBuffer, halfWordBuffer.l);
+  return WriteData((uint32_t) address, &data, sizeof(data));
 }
 
-/*! @brief Erases the entire Flash sector.
+/*! @brief Erases all the records from the Flash.
  *
- *  @return bool - TRUE if the Flash "data" sector was erased successfully.
+ *  @return bool - TRUE if the Flash "data" sectors were erased successfully.
  *  @note Assumes Flash has been initialized.
  */
 bool Flash_Erase(void)
 {
-  //Erase block 2 sector 0 at address 0x00080000
-  return EraseSector(FLASH_DATA_START);
+  OS_ERROR error;
+  bool success;
+  uint8_t id;
+
+  error = OS_SemaphoreWait(FlashAccessSemaphore, 0);
+
+  if (error)
+    PE_DEBUGHALT();
+
+  success = EraseSector(FLASH_RECORD_SECTOR_A) && EraseSector(FLASH_RECORD_SECTOR_B) &&
+            FormatSector(FLASH_RECORD_SECTOR_A, ActiveSequence + 1);
+
+  ActiveSector = FLASH_RECORD_SECTOR_A;
+  ActiveSequence++;
+  WriteAddress = FLASH_RECORD_SECTOR_A + FLASH_PHRASE_SIZE;
+
+  // Allocated records now read as erased
+  for (id = 0; id < FLASH_NB_RECORDS; id++)
+  {
+    RecordIndex[id].address = 0;
+
+    if (success && RecordIndex[id].owner)
+      success = AppendRecord((TFlashRecordID) id, 0, NULL, 0);
+  }
+
+  error = OS_SemaphoreSignal(FlashAccessSemaphore);
+
+  if (error)
+    PE_DEBUGHALT();
+
+  return success;
 }
@@ -33,7 +33,61 @@
 /*!< Address of the start of the Flash block we are using for data storage */
 #define FLASH_DATA_START 0x00080000LU
 /*!< Address of the end of the Flash block we are using for data storage */
-#define FLASH_DATA_END   0x00080007LU
+#define FLASH_DATA_END   0x00093FFFLU
+
+#define FLASH_SECTOR_SIZE 0x1000LU		/*!< Size of an erasable Flash sector in bytes */
+#define FLASH_PHRASE_SIZE 8			/*!< Size of a programmable Flash phrase in bytes */
+
+/*!< The two sectors used by the record store; one is active while the other is kept erased for compaction */
+#define FLASH_RECORD_SECTOR_A FLASH_DATA_START
+#define FLASH_RECORD_SECTOR_B (FLASH_DATA_START + FLASH_SECTOR_SIZE)
+
+/*!< The largest record payload that can be stored, in bytes */
+#define FLASH_RECORD_MAX_SIZE 1024
+
+/*!< Sectors holding the load profile ring */
+#define FLASH_LOAD_PROFILE_START      (FLASH_DATA_START + 2 * FLASH_SECTOR_SIZE)
+#define FLASH_LOAD_PROFILE_NB_SECTORS 16
+
+/*!< Sectors holding the power quality event ring */
+#define FLASH_POWER_QUALITY_START      (FLASH_LOAD_PROFILE_START + FLASH_LOAD_PROFILE_NB_SECTORS * FLASH_SECTOR_SIZE)
+#define FLASH_POWER_QUALITY_NB_SECTORS 2
+
+/*! @brief Stable identifiers of the non-volatile records.
+ *
+ *  The identifier is stored with each record in the Flash, so values must never be reused or reordered.
+ *  New records are appended before FLASH_NB_RECORDS.
+ */
+typedef enum
+{
+  FLASH_RECORD_TARIFF_MODE = 0,		/*!< Tariff mode selected by the PC */
+  FLASH_RECORD_LOAD_PROFILE = 1,	/*!< Load profile interval */
+  FLASH_RECORD_DEMAND = 2,		/*!< Peak demand of each tariff period */
+  FLASH_RECORD_TARIFF_SCHEDULE = 3,	/*!< Time-of-use tariff schedule */
+  FLASH_RECORD_CALIBRATION = 4,		/*!< Signal conditioning calibration */
+  FLASH_NB_RECORDS
+} TFlashRecordID;
+
+/*!
+ * @struct TFlashRing
+ *
+ * A ring of fixed-size records spread over consecutive Flash sectors.
+ * Every record has an absolute index that stays the same while it is in the ring.
+ * Each sector starts with a phrase holding the index of its first record, so the oldest sector is
+ * erased as a whole when the ring wraps and the head is found at boot without a sequence number per record.
+ */
+typedef struct
+{
+  uint32_t firstSector;		/*!< Address of the first sector of the ring */
+  uint8_t nbSectors;		/*!< Number of sectors in the ring */
+  uint16_t recordSize;		/*!< Size of a record in bytes, a multiple of FLASH_PHRASE_SIZE */
+  uint16_t recordsPerSector;	/*!< Number of records that fit in a sector after its header */
+  uint8_t oldestSector;		/*!< Sector holding the oldest record */
+  uint8_t headSector;		/*!< Sector holding the next record to be written */
+  uint32_t oldestIndex;		/*!< Index of the oldest record in the ring */
+  uint32_t nextIndex;		/*!< Index the next record will be written with */
+  uint32_t headFirstIndex;	/*!< Index of the first record of the head sector, kept so a failed format cannot lose it */
+} TFlashRing;
 
 /*! @brief Enables the Flash module.
  *
@@ -41,20 +95,55 @@
  */
 bool Flash_Init(void);
  
-/*! @brief Allocates space for a non-volatile variable in the Flash memory.
- *
- *  @param variable is the address of a pointer to a variable that is to be allocated space in Flash memory.
- *         The pointer will be allocated to a relevant address:
- *         If the variable is a byte, then any address.
- *         If the variable is a half-word, then an even address.
- *         If the variable is a word, then an address divisible by 4.
- *         This allows the resulting variable to be used with the relevant Flash_Write function which assumes a certain memory address.
- *         e.g. a 16-bit variable will be on an even address
- *  @param size The size, in bytes, of the variable that is to be allocated space in the Flash memory. Valid values are 1, 2 and 4.
- *  @return bool - TRUE if the variable was allocated space in the Flash memory.
+/*! @brief Allocates a non-volatile record in the Flash memory.
+ *
+ *  @param id The stable identifier of the record.
+ *  @param version The layout version of the record. A stored record with a different version or size is discarded.
+ *  @param size The size, in bytes, of the record. Any value from 1 to FLASH_RECORD_MAX_SIZE is valid.
+ *  @param record is the address of a pointer that will point to the record in Flash memory.
+ *         The record is word aligned, so it can hold any structure and be used with the Flash_Write functions.
+ *         The pointer is kept up to date by the Flash module whenever the record is rewritten or moved.
+ *         If no valid record was found, the record reads as erased (all 0xFF).
+ *  @return bool - TRUE if the record was allocated space in the Flash memory.
  *  @note Assumes Flash has been initialized.
  */
-bool Flash_AllocateVar(volatile void** variable, const uint8_t size);
+bool Flash_AllocateRecord(const TFlashRecordID id, const uint8_t version, const uint16_t size, volatile void** record);
+
+/*! @brief Writes a complete record to Flash.
+ *
+ *  @param id The stable identifier of the record.
+ *  @param data The address of the new contents of the record, which must be the size given when the record was allocated.
+ *  @return bool - TRUE if Flash was written successfully.
+ *  @note Assumes the record has been allocated.
+ */
+bool Flash_WriteRecord(const TFlashRecordID id, const void* const data);
+
+/*! @brief Sets up a ring of records and finds its head by reading the sector headers.
+ *
+ *  @param ring is the ring to set up. firstSector, nbSectors and recordSize must be filled in.
+ *  @return bool - TRUE if the ring was set up successfully.
+ *  @note Assumes Flash has been initialized.
+ */
+bool Flash_RingInit(TFlashRing* const ring);
+
+/*! @brief Appends a record to a ring, erasing the oldest sector when the ring is full.
+ *
+ *  @param ring is the ring to append to.
+ *  @param record is the record, recordSize bytes long.
+ *  @return bool - TRUE if the record was written successfully.
+ *  @note Assumes the ring has been set up.
+ */
+bool Flash_RingAppend(TFlashRing* const ring, const void* const record);
+
+/*! @brief Reads a record from a ring.
+ *
+ *  @param ring is the ring to read from.
+ *  @param index is the absolute index of the record, between oldestIndex and nextIndex - 1.
+ *  @param record is where the recordSize bytes of the record are copied to.
+ *  @return bool - TRUE if the record is in the ring and was copied.
+ *  @note Assumes the ring has been set up.
+ */
+bool Flash_RingRead(const TFlashRing* const ring, const uint32_t index, void* const record);
 
 /*! @brief Writes a 32-bit number to Flash.
  *
@@ -83,9 +172,9 @@ bool Flash_Write16(volatile uint16_t* const address, const uint16_t data);
  */
 bool Flash_Write8(volatile uint8_t* const address, const uint8_t data);
 
-/*! @brief Erases the entire Flash sector.
+/*! @brief Erases all the records from the Flash.
  *
- *  @return bool - TRUE if the Flash "data" sector was erased successfully.
+ *  @return bool - TRUE if the Flash "data" sectors were erased successfully.
  *  @note Assumes Flash has been initialized.
  */
 bool Flash_Erase(void);
@@ -0,0 +1,220 @@
+/*! @file Frequency.c
+ *
+ *  @brief Mains frequency tracker for the DEM
+ *
+ *  This contains the routines to find the rising zero crossings of the voltage, estimate the mains period
+ *  with a moving average and keep the sample period of the PIT locked to a fixed number of samples per cycle.
+ *
+ *  @author Rohan
+ *  @date 2019-11-18
+ */
+
+#include "Frequency.h"
+
+#define AVERAGE_CYCLES (1 << FREQUENCY_AVERAGE_LOG2)
+
+static uint8_t SamplesPerCycleLog2;
+static uint8_t OversampleLog2;
+static uint32_t NominalPeriod;
+
+// The PIT period of the interval that is running, and the one loaded for the next interval
+static uint32_t RunningPeriod, LoadedPeriod;
+
+static int32_t PreviousSample;
+static bool Armed = false;
+
+// Time since the sample of the last crossing, and how far before that sample the crossing was
+static uint32_t ElapsedNs;
+static uint32_t LastOffsetNs;
+static bool CrossingSeen = false;
+
+// Ring of the last cycle lengths, and their running sum
+static uint32_t CycleNs[AVERAGE_CYCLES];
+static uint32_t CycleSumNs;
+static uint8_t CycleHead, CycleFill;
+
+static uint8_t LockCount;
+static bool Locked = false;
+
+static uint32_t FrequencyTimes10;
+
+/*! @brief Forgets the measured cycles, so the average follows the next cycles quickly.
+ */
+static void Unlock(void)
+{
+  Locked = false;
+  LockCount = 0;
+  CycleSumNs = 0;
+  CycleHead = 0;
+  CycleFill = 0;
+}
+
+/*! @brief Loads a new sample period into the PIT if it has moved far enough.
+ *
+ *  @param period is the wanted sample period in nanoseconds.
+ */
+static void SetPeriod(const uint32_t period)
+{
+  uint32_t difference = (period > LoadedPeriod) ? period - LoadedPeriod : LoadedPeriod - period;
+
+  // Compare over a whole cycle, so the threshold does not depend on the samples per cycle
+  if ((difference << SamplesPerCycleLog2) <= FREQUENCY_UPDATE_NS)
+    return;
+
+  // The new period takes effect from the next trigger, so the sample being taken is not disturbed
+  if (PIT_Set(period >> OversampleLog2, false))
+    LoadedPeriod = period;
+}
+
+/*! @brief Adds a measured cycle to the average and steers the sample period.
+ *
+ *  @param cycleNs is the length of the cycle in nanoseconds.
+ */
+static void AddCycle(const uint32_t cycleNs)
+{
+  uint32_t averageNs, deviation;
+
+  if (CycleFill)
+  {
+    averageNs = CycleSumNs / CycleFill;
+    deviation = (cycleNs > averageNs) ? cycleNs - averageNs : averageNs - cycleNs;
+
+    // A step in frequency; start averaging again from this cycle so the tracker follows it quickly
+    if (deviation > FREQUENCY_UNLOCK_NS)
+      Unlock();
+
+    else if (!Locked)
+    {
+      if (deviation < FREQUENCY_LOCK_NS)
+      {
+        if (++LockCount >= FREQUENCY_LOCK_CYCLES)
+          Locked = true;
+      }
+      else
+        LockCount = 0;
+    }
+  }
+
+  // Replace the oldest cycle in the ring
+  if (CycleFill == AVERAGE_CYCLES)
+    CycleSumNs -= CycleNs[CycleHead];
+  else
+    CycleFill++;
+
+  CycleNs[CycleHead] = cycleNs;
+  CycleSumNs += cycleNs;
+  CycleHead = (CycleHead + 1) & (AVERAGE_CYCLES - 1);
+
+  // The ring is full once locked, so this is usually a shift
+  if (CycleFill == AVERAGE_CYCLES)
+    averageNs = CycleSumNs >> FREQUENCY_AVERAGE_LOG2;
+  else
+    averageNs = CycleSumNs / CycleFill;
+
+  FrequencyTimes10 = Frequency_Times10FromCycle(averageNs);
+
+  SetPeriod(averageNs >> SamplesPerCycleLog2);
+}
+
+uint32_t Frequency_Times10FromCycle(const uint32_t cycleNs)
+{
+  // freqTimes10 = 10e9 / (T0 / 10)
+  return 1000000000U / (cycleNs / 10);
+}
+
+bool Frequency_Init(const uint32_t samplePeriod, const uint8_t samplesPerCycleLog2, const uint8_t oversampleLog2)
+{
+  SamplesPerCycleLog2 = samplesPerCycleLog2;
+  OversampleLog2 = oversampleLog2;
+  NominalPeriod = samplePeriod;
+  RunningPeriod = samplePeriod;
+  LoadedPeriod = samplePeriod;
+
+  Armed = false;
+  CrossingSeen = false;
+  ElapsedNs = 0;
+  FrequencyTimes10 = 0;
+
+  Unlock();
+
+  return true;
+}
+
+bool RAMFUNC Frequency_Track(const int32_t sample, uint32_t* const samplePeriod)
+{
+  bool newCycle = false;
+  uint32_t fraction, offsetNs, cycleNs;
+
+  // The interval that ended with this sample ran at the period that was running; the loaded one runs now
+  ElapsedNs += RunningPeriod;
+  RunningPeriod = LoadedPeriod;
+
+  *samplePeriod = RunningPeriod;
+
+  // Only count a rising crossing after the voltage has been clearly negative, so noise near zero cannot double-trigger
+  if (sample < -FREQUENCY_HYSTERESIS)
+    Armed = true;
+
+  else if (Armed && sample >= 0)
+  {
+    Armed = false;
+
+    // The crossing was this fraction of a sample before the sample, by linear interpolation
+    fraction = (uint32_t) FixedPoint_Divide(sample, sample - PreviousSample);
+    offsetNs = (uint32_t) (((uint64_t) fraction * RunningPeriod) >> 16);
+
+    if (!CrossingSeen)
+    {
+      CrossingSeen = true;
+      newCycle = true;
+    }
+    else
+    {
+      cycleNs = ElapsedNs - offsetNs + LastOffsetNs;
+
+      // A crossing too soon after the last one is noise, and is ignored
+      if (cycleNs >= FREQUENCY_MIN_CYCLE_NS)
+      {
+        newCycle = true;
+
+        // A crossing has been missed; the cycle is closed but not measured
+        if (cycleNs > FREQUENCY_MAX_CYCLE_NS)
+          Unlock();
+        else
+          AddCycle(cycleNs);
+      }
+    }
+
+    if (newCycle)
+    {
+      ElapsedNs = 0;
+      LastOffsetNs = offsetNs;
+    }
+  }
+
+  // No crossings; close the cycle anyway and fall back to the nominal period until the mains returns
+  if (!newCycle && ElapsedNs > 2 * FREQUENCY_MAX_CYCLE_NS)
+  {
+    newCycle = true;
+    CrossingSeen = false;
+    ElapsedNs = 0;
+    FrequencyTimes10 = 0;
+
+    Unlock();
+    SetPeriod(NominalPeriod);
+  }
+
+  PreviousSample = sample;
+
+  return newCycle;
+}
+
+uint32_t Frequency_GetTimes10(void)
+{
+  return FrequencyTimes10;
+}
+
+bool Frequency_IsLocked(void)
+{
+  return Locked;
+}
@@ -0,0 +1,68 @@
+/*! @file Frequency.h
+ *
+ *  @brief Mains frequency tracker for the DEM
+ *
+ *  This contains the routines to find the rising zero crossings of the voltage, estimate the mains period
+ *  with a moving average and keep the sample period of the PIT locked to a fixed number of samples per cycle.
+ *
+ *  @author Rohan
+ *  @date 2019-11-18
+ */
+
+#ifndef SOURCES_FREQUENCY_H_
+#define SOURCES_FREQUENCY_H_
+
+// new types
+#include "types.h"
+// fixed-point processing
+#include "FixedPoint.h"
+// PIT module to set the sample period
+#include "PIT.h"
+
+#define FREQUENCY_HYSTERESIS (5 << 16)          /*!< The voltage must fall below minus this, in V 32Q16, before a rising crossing counts */
+#define FREQUENCY_AVERAGE_LOG2 3                /*!< Log2 of the number of cycles averaged when locked; sets the bandwidth */
+#define FREQUENCY_MIN_CYCLE_NS 15384615         /*!< Shortest mains cycle tracked (65 Hz); shorter ones are noise */
+#define FREQUENCY_MAX_CYCLE_NS 22222222         /*!< Longest mains cycle tracked (45 Hz); longer ones have missed a crossing */
+#define FREQUENCY_LOCK_NS 100000                /*!< A cycle within this of the average counts towards lock */
+#define FREQUENCY_UNLOCK_NS 400000              /*!< A cycle further than this from the average loses lock */
+#define FREQUENCY_LOCK_CYCLES 8                 /*!< Cycles in a row within FREQUENCY_LOCK_NS needed to lock */
+#define FREQUENCY_UPDATE_NS 8000                /*!< The PIT is only set when the cycle it gives is out by more than this */
+
+/*! @brief Sets up the frequency tracker.
+ *
+ *  @param samplePeriod is the sample period the PIT has been started with, in nanoseconds.
+ *  @param samplesPerCycleLog2 is log2 of the number of samples to take in each mains cycle.
+ *  @param oversampleLog2 is log2 of the number of PIT periods in each sample.
+ *  @return bool - TRUE if the frequency tracker was initialized successfully.
+ */
+bool Frequency_Init(const uint32_t samplePeriod, const uint8_t samplesPerCycleLog2, const uint8_t oversampleLog2);
+
+/*! @brief Tracks the mains frequency with the next voltage sample.
+ *
+ *  @param sample is the voltage sample in V, 32Q16.
+ *  @param samplePeriod is where the current sample period in nanoseconds is stored; the PIT period times the oversampling.
+ *  @return bool - TRUE if the sample is the first one of a new cycle.
+ *  @note Called from the calculation thread for every sample.
+ */
+bool RAMFUNC Frequency_Track(const int32_t sample, uint32_t* const samplePeriod);
+
+/*! @brief Converts the length of a mains cycle to its frequency.
+ *
+ *  @param cycleNs is the length of the cycle in nanoseconds, at least 10.
+ *  @return uint32_t - the frequency in tenths of a Hz.
+ */
+uint32_t Frequency_Times10FromCycle(const uint32_t cycleNs);
+
+/*! @brief Gets the averaged mains frequency.
+ *
+ *  @return uint32_t - the frequency in tenths of a Hz, or 0 if no cycle has been measured.
+ */
+uint32_t Frequency_GetTimes10(void);
+
+/*! @brief Checks if the tracker is locked to the mains.
+ *
+ *  @return bool - TRUE if the last FREQUENCY_LOCK_CYCLES cycles agreed with the average.
+ */
+bool Frequency_IsLocked(void);
+
+#endif /* SOURCES_FREQUENCY_H_ */
@@ -66,15 +66,18 @@ void HMI_TimeState(void)
 
 void HMI_PowerState(void)
 {
-  uint32_t averagePowerW = round(AveragePowerW / 65536.0);
+  int32_t averagePowerW = round(AveragePowerW / 65536.0);
+
+  // Exported power is shown with a minus sign
+  uint32_t magnitudeW = (averagePowerW < 0) ? -averagePowerW : averagePowerW;
 
   char dataString [25];
 
-  if (averagePowerW > 999999)
+  if (magnitudeW > 999999)
     sprintf(dataString, "PPP.ppp\n");
 
   else
-    sprintf(dataString, "%03d.%03d kW\n", averagePowerW / 1000, averagePowerW % 1000);
+    sprintf(dataString, "%s%03d.%03d kW\n", (averagePowerW < 0) ? "-" : "", magnitudeW / 1000, magnitudeW % 1000);
 
   for (uint8_t i = 0; dataString[i] != '\0' ; i++)
     UART_OutChar(dataString[i]);
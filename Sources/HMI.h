@@ -27,7 +27,7 @@ typedef struct State
 
 
 extern uint32_t TimeUsage;
-extern uint32_t AveragePowerW;
+extern int32_t AveragePowerW;
 extern uint32_t TotalEnergykWh;
 extern uint32_t TotalCostDollars;
 
@@ -0,0 +1,330 @@
+/*! @file Harmonic.c
+ *
+ *  @brief Harmonic analysis for the DEM
+ *
+ *  This contains the routines to capture a whole mains cycle of voltage and current samples and find the
+ *  harmonic levels and total harmonic distortion of both channels with a fixed-point FFT.
+ *  The FFT runs in its own low priority thread, on one cycle in every few, and its results are double buffered.
+ *
+ *  @author Rohan
+ *  @date 2019-11-19
+ */
+
+#include "Harmonic.h"
+// Samples per cycle
+#include "Calc.h"
+
+#define THREAD_STACK_SIZE 500
+
+#define NB_POINTS ANALOG_WINDOW_SIZE
+#define NB_HARMONICS (NB_POINTS / 2)
+
+// The twiddle tables cover the largest window; smaller windows step through them
+#define TWIDDLE_POINTS 128
+
+/*!
+ * @struct THarmonicResult
+ */
+typedef struct
+{
+  uint16_t levels[HARMONIC_NB_CHANNELS][NB_HARMONICS + 1];  /*!< RMS of each harmonic in thousandths of the fundamental */
+  uint16_t thd[HARMONIC_NB_CHANNELS];                       /*!< THD in tenths of a percent */
+} THarmonicResult;
+
+// cos(2 pi k / 128) and sin(2 pi k / 128) for the first half turn, Q15
+static const int16_t COS_Q15[TWIDDLE_POINTS / 2] =
+{
+   32767,  32728,  32609,  32412,  32137,  31785,  31356,  30852,
+   30273,  29621,  28898,  28105,  27245,  26319,  25329,  24279,
+   23170,  22005,  20787,  19519,  18204,  16846,  15446,  14010,
+   12539,  11039,   9512,   7962,   6393,   4808,   3212,   1608,
+       0,  -1608,  -3212,  -4808,  -6393,  -7962,  -9512, -11039,
+  -12539, -14010, -15446, -16846, -18204, -19519, -20787, -22005,
+  -23170, -24279, -25329, -26319, -27245, -28105, -28898, -29621,
+  -30273, -30852, -31356, -31785, -32137, -32412, -32609, -32728
+};
+
+static const int16_t SIN_Q15[TWIDDLE_POINTS / 2] =
+{
+       0,   1608,   3212,   4808,   6393,   7962,   9512,  11039,
+   12539,  14010,  15446,  16846,  18204,  19519,  20787,  22005,
+   23170,  24279,  25329,  26319,  27245,  28105,  28898,  29621,
+   30273,  30852,  31356,  31785,  32137,  32412,  32609,  32728,
+   32767,  32728,  32609,  32412,  32137,  31785,  31356,  30852,
+   30273,  29621,  28898,  28105,  27245,  26319,  25329,  24279,
+   23170,  22005,  20787,  19519,  18204,  16846,  15446,  14010,
+   12539,  11039,   9512,   7962,   6393,   4808,   3212,   1608
+};
+
+static void HarmonicThread(void* pData);
+
+static uint32_t HarmonicThreadStack[THREAD_STACK_SIZE] __attribute__ ((aligned(0x08)));
+
+static OS_ECB *HarmonicSemaphore;
+
+static uint8_t BitReverse[NB_POINTS];
+
+// The cycle being captured by the calculation thread
+static int16_t CaptureVoltage[NB_POINTS];
+static int16_t CaptureCurrent[NB_POINTS];
+static uint16_t CaptureCount;
+static bool Capturing = false;
+
+// Set while the harmonic thread owns the captured cycle
+static volatile bool Busy = false;
+
+static volatile uint8_t Decimation = HARMONIC_DEFAULT_DECIMATION;
+static uint8_t CycleCount;
+
+// FFT working arrays; the voltage is the real part and the current the imaginary part
+static int32_t Re[NB_POINTS];
+static int32_t Im[NB_POINTS];
+
+static uint32_t Magnitude[HARMONIC_NB_CHANNELS][NB_HARMONICS + 1];
+
+// The results being read, and the ones being written by the harmonic thread
+static THarmonicResult Results[2];
+static volatile uint8_t Front;
+
+/*! @brief Runs an in-place radix-2 FFT on the working arrays, which are loaded in bit-reversed order.
+ *
+ *  Each stage halves its outputs so nothing can overflow, which scales the result by 1 / NB_POINTS.
+ */
+static void FFT(void)
+{
+  uint16_t size, half, stride, start, m, a, b;
+  int32_t wr, wi, tr, ti;
+
+  for (size = 2; size <= NB_POINTS; size <<= 1)
+  {
+    half = size >> 1;
+    stride = TWIDDLE_POINTS / size;
+
+    for (m = 0; m < half; m++)
+    {
+      // e^(-j 2 pi m / size)
+      wr = COS_Q15[m * stride];
+      wi = -SIN_Q15[m * stride];
+
+      for (start = 0; start < NB_POINTS; start += size)
+      {
+        a = start + m;
+        b = a + half;
+
+        // Each product fits in 32 bits on its own, but their sum may not
+        tr = ((Re[b] * wr) >> 15) - ((Im[b] * wi) >> 15);
+        ti = ((Re[b] * wi) >> 15) + ((Im[b] * wr) >> 15);
+
+        Re[b] = (Re[a] - tr) >> 1;
+        Im[b] = (Im[a] - ti) >> 1;
+        Re[a] = (Re[a] + tr) >> 1;
+        Im[a] = (Im[a] + ti) >> 1;
+      }
+    }
+  }
+}
+
+/*! @brief Separates the two channels from the FFT and finds their harmonic levels and THD.
+ *
+ *  @param result is where the levels and THD are stored.
+ */
+static void Analyze(THarmonicResult* const result)
+{
+  uint64_t power[HARMONIC_NB_CHANNELS], distortion[HARMONIC_NB_CHANNELS] = { 0, 0 };
+  int64_t re, im;
+  uint32_t level;
+  uint8_t k, mirror, channel;
+
+  for (k = 1; k <= NB_HARMONICS; k++)
+  {
+    mirror = (NB_POINTS - k) & (NB_POINTS - 1);
+
+    // Both inputs are real, so the voltage is (Z[k] + Z*[N-k]) / 2 and the current is (Z[k] - Z*[N-k]) / 2j;
+    // the common factor of 2 cancels out of the levels
+    re = (int64_t) Re[k] + Re[mirror];
+    im = (int64_t) Im[k] - Im[mirror];
+    power[HARMONIC_CHANNEL_VOLTAGE] = (uint64_t) (re * re + im * im);
+
+    re = (int64_t) Im[k] + Im[mirror];
+    im = (int64_t) Re[k] - Re[mirror];
+    power[HARMONIC_CHANNEL_CURRENT] = (uint64_t) (re * re + im * im);
+
+    for (channel = 0; channel < HARMONIC_NB_CHANNELS; channel++)
+    {
+      Magnitude[channel][k] = FixedPoint_SquareRootU64(power[channel]);
+
+      if (k > 1)
+        distortion[channel] += power[channel];
+    }
+  }
+
+  for (channel = 0; channel < HARMONIC_NB_CHANNELS; channel++)
+  {
+    // No fundamental, so there is nothing to compare the harmonics to
+    if (Magnitude[channel][1] == 0)
+    {
+      for (k = 0; k <= NB_HARMONICS; k++)
+        result->levels[channel][k] = 0;
+
+      result->thd[channel] = 0;
+      continue;
+    }
+
+    result->levels[channel][0] = 0;
+
+    for (k = 1; k <= NB_HARMONICS; k++)
+    {
+      level = (uint32_t) (((uint64_t) Magnitude[channel][k] * 1000) / Magnitude[channel][1]);
+      result->levels[channel][k] = (level > 0xFFFF) ? 0xFFFF : (uint16_t) level;
+    }
+
+    level = (uint32_t) (((uint64_t) FixedPoint_SquareRootU64(distortion[channel]) * 1000) / Magnitude[channel][1]);
+    result->thd[channel] = (level > 0xFFFF) ? 0xFFFF : (uint16_t) level;
+  }
+}
+
+bool Harmonic_Init(void)
+{
+  OS_ERROR error;
+  uint8_t index, bit, reversed;
+
+  for (index = 0; index < NB_POINTS; index++)
+  {
+    reversed = 0;
+
+    for (bit = 0; bit < ANALOG_WINDOW_SIZE_LOG2; bit++)
+      if (index & (1 << bit))
+        reversed |= 1 << (ANALOG_WINDOW_SIZE_LOG2 - 1 - bit);
+
+    BitReverse[index] = reversed;
+  }
+
+  Capturing = false;
+  Busy = false;
+  CycleCount = 0;
+  Front = 0;
+
+  HarmonicSemaphore = OS_SemaphoreCreate(0);
+
+  if (!HarmonicSemaphore)
+    return false;
+
+  error = Stack_ThreadCreate(HarmonicThread,
+                             NULL,
+                             HarmonicThreadStack,
+                             THREAD_STACK_SIZE,
+                             HARMONIC_THREAD_PRIORITY);
+
+  return (error == OS_NO_ERROR);
+}
+
+void Harmonic_Update(const int16_t voltage, const int16_t current, const bool newCycle)
+{
+  OS_ERROR error;
+
+  if (newCycle)
+  {
+    // A cycle that was not exactly one sample per point would smear the harmonics, so it is dropped
+    if (Capturing && CaptureCount == NB_POINTS)
+    {
+      Busy = true;
+
+      error = OS_SemaphoreSignal(HarmonicSemaphore);
+
+      if (error)
+        PE_DEBUGHALT();
+    }
+
+    Capturing = false;
+
+    // Skipped cycles cost nothing more than this count
+    if (Decimation && ++CycleCount >= Decimation && !Busy)
+    {
+      CycleCount = 0;
+      CaptureCount = 0;
+      Capturing = true;
+    }
+  }
+
+  if (!Capturing)
+    return;
+
+  if (CaptureCount < NB_POINTS)
+  {
+    CaptureVoltage[CaptureCount] = voltage;
+    CaptureCurrent[CaptureCount] = current;
+  }
+
+  // Counts one past the window, so a long cycle is seen and dropped
+  if (CaptureCount <= NB_POINTS)
+    CaptureCount++;
+}
+
+void Harmonic_SetDecimation(const uint8_t cycles)
+{
+  Decimation = cycles;
+}
+
+uint8_t Harmonic_GetDecimation(void)
+{
+  return Decimation;
+}
+
+uint8_t Harmonic_GetNbHarmonics(void)
+{
+  return NB_HARMONICS;
+}
+
+uint16_t Harmonic_GetLevel(const uint8_t channel, const uint8_t harmonic)
+{
+  if (channel >= HARMONIC_NB_CHANNELS || harmonic == 0 || harmonic > NB_HARMONICS)
+    return 0;
+
+  // The reader runs at a higher priority than the harmonic thread, so the front results cannot change under it
+  return Results[Front].levels[channel][harmonic];
+}
+
+uint16_t Harmonic_GetTHD(const uint8_t channel)
+{
+  if (channel >= HARMONIC_NB_CHANNELS)
+    return 0;
+
+  return Results[Front].thd[channel];
+}
+
+/*! @brief Analyzes each cycle handed over by the calculation thread.
+ *
+ *  @param pData is not used but is required by the OS to create a thread.
+ */
+static void HarmonicThread(void* pData)
+{
+  OS_ERROR error;
+  uint8_t index;
+
+  for (;;)
+  {
+    error = OS_SemaphoreWait(HarmonicSemaphore, 0);
+
+    if (error)
+      PE_DEBUGHALT();
+
+    PROFILE_BEGIN(PROFILE_PROBE_HARMONIC);
+
+    // Both channels are real, so they share one complex FFT
+    for (index = 0; index < NB_POINTS; index++)
+    {
+      Re[BitReverse[index]] = CaptureVoltage[index];
+      Im[BitReverse[index]] = CaptureCurrent[index];
+    }
+
+    FFT();
+
+    Analyze(&Results[Front ^ 1]);
+    Front ^= 1;
+
+    PROFILE_END(PROFILE_PROBE_HARMONIC);
+
+    // The capture buffer is free for the next cycle
+    Busy = false;
+  }
+}
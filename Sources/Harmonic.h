@@ -0,0 +1,79 @@
+/*! @file Harmonic.h
+ *
+ *  @brief Harmonic analysis for the DEM
+ *
+ *  This contains the routines to capture a whole mains cycle of voltage and current samples and find the
+ *  harmonic levels and total harmonic distortion of both channels with a fixed-point FFT.
+ *  The FFT runs in its own low priority thread, on one cycle in every few, and its results are double buffered.
+ *
+ *  @author Rohan
+ *  @date 2019-11-19
+ */
+
+#ifndef SOURCES_HARMONIC_H_
+#define SOURCES_HARMONIC_H_
+
+// new types
+#include "types.h"
+// RTOS
+#include "OS.h"
+
+#define HARMONIC_CHANNEL_VOLTAGE 0       /*!< Channel number of the voltage */
+#define HARMONIC_CHANNEL_CURRENT 1       /*!< Channel number of the current */
+#define HARMONIC_NB_CHANNELS 2
+
+#define HARMONIC_DEFAULT_DECIMATION 10   /*!< Default number of cycles between analyses */
+
+extern const uint8_t HARMONIC_THREAD_PRIORITY;
+
+/*! @brief Sets up the harmonic analysis and creates its thread.
+ *
+ *  @return bool - TRUE if the harmonic analysis was initialized successfully.
+ */
+bool Harmonic_Init(void);
+
+/*! @brief Captures the next voltage and current sample of the cycle.
+ *
+ *  When a new cycle starts, the cycle just captured is handed to the harmonic thread if it is due for analysis,
+ *  had exactly one sample per FFT point and the thread has finished with the last one.
+ *  @param voltage is the raw ADC value of the voltage.
+ *  @param current is the raw ADC value of the current.
+ *  @param newCycle is TRUE if the sample is the first one of a new cycle.
+ *  @note Called from the calculation thread for every sample.
+ */
+void Harmonic_Update(const int16_t voltage, const int16_t current, const bool newCycle);
+
+/*! @brief Sets how often the cycles are analyzed.
+ *
+ *  @param cycles is the number of cycles between analyses, or 0 to stop the analysis.
+ */
+void Harmonic_SetDecimation(const uint8_t cycles);
+
+/*! @brief Gets how often the cycles are analyzed.
+ *
+ *  @return uint8_t - the number of cycles between analyses, or 0 if the analysis is stopped.
+ */
+uint8_t Harmonic_GetDecimation(void);
+
+/*! @brief Gets the number of harmonics found by the analysis.
+ *
+ *  @return uint8_t - the highest harmonic, which is half the samples per cycle.
+ */
+uint8_t Harmonic_GetNbHarmonics(void);
+
+/*! @brief Gets the level of a harmonic in the last analyzed cycle.
+ *
+ *  @param channel is HARMONIC_CHANNEL_VOLTAGE or HARMONIC_CHANNEL_CURRENT.
+ *  @param harmonic is the harmonic number, 1 for the fundamental.
+ *  @return uint16_t - the RMS of the harmonic in thousandths of the fundamental, or 0 if the channel or harmonic is not valid.
+ */
+uint16_t Harmonic_GetLevel(const uint8_t channel, const uint8_t harmonic);
+
+/*! @brief Gets the total harmonic distortion in the last analyzed cycle.
+ *
+ *  @param channel is HARMONIC_CHANNEL_VOLTAGE or HARMONIC_CHANNEL_CURRENT.
+ *  @return uint16_t - the THD in tenths of a percent, or 0 if the channel is not valid.
+ */
+uint16_t Harmonic_GetTHD(const uint8_t channel);
+
+#endif /* SOURCES_HARMONIC_H_ */
@@ -0,0 +1,131 @@
+/*! @file Idle.c
+ *
+ *  @brief Idle thread and CPU load for the DEM
+ *
+ *  This contains an idle thread that sleeps the CPU with WFI whenever no other thread is ready, and the routines
+ *  to work out the CPU load each second from the cycles the CPU spent awake outside the idle thread.
+ *
+ *  @author Rohan
+ *  @date 2019-11-26
+ */
+
+#include "Idle.h"
+// RTOS
+#include "OS.h"
+// Stack painting
+#include "Stack.h"
+// DWT cycle counter
+#include "MK70F12.h"
+// WFI
+#include "PE_Types.h"
+
+#define IDLE_THREAD_STACK_SIZE 100
+
+#define DEMCR_TRCENA_MASK 0x01000000u    /*!< Enables the DWT */
+#define DWT_CTRL_CYCCNTENA_MASK 0x1u     /*!< Starts the cycle counter */
+
+static uint32_t IdleThreadStack[IDLE_THREAD_STACK_SIZE] __attribute__ ((aligned(0x08)));
+
+static uint32_t CoreClock;
+
+// Cycles counted in the idle thread, only written with interrupts off
+static volatile uint32_t IdleCycles;
+
+static uint32_t SecondStart;
+
+static TIdleStats Stats;
+
+/*! @brief Sleeps until an interrupt is pending, counting the cycles that pass.
+ *
+ *  The cycle counter stops while the core clock is gated in WAIT mode, so it only counts the sleep when a debugger
+ *  keeps the clock running; the load is worked out from the cycles awake, which is right either way.
+ *  @param pData is not used but is required by the OS to create a thread.
+ */
+static void IdleThread(void* pData)
+{
+  uint32_t start;
+
+  for (;;)
+  {
+    // Masked, the pending interrupt still wakes the CPU, but is only taken once the sleep has been counted
+    __asm ("CPSID i");
+
+    start = DWT_CYCCNT;
+
+    PE_WFI();
+
+    IdleCycles += DWT_CYCCNT - start;
+
+    __asm ("CPSIE i");
+  }
+}
+
+bool Idle_Init(const uint32_t coreClock)
+{
+  TIdleStats cleared = { 0 };
+  OS_ERROR error;
+
+  if (coreClock == 0)
+    return false;
+
+  CoreClock = coreClock;
+  IdleCycles = 0;
+  Stats = cleared;
+
+  DEMCR |= DEMCR_TRCENA_MASK;
+  DWT_CTRL |= DWT_CTRL_CYCCNTENA_MASK;
+
+  SecondStart = DWT_CYCCNT;
+
+  error = Stack_ThreadCreate(IdleThread,
+                             NULL,
+                             IdleThreadStack,
+                             IDLE_THREAD_STACK_SIZE,
+                             IDLE_THREAD_PRIORITY);
+
+  return (error == OS_NO_ERROR);
+}
+
+void Idle_Second(void)
+{
+  uint32_t now, awake, idle, busy, load;
+
+  OS_DisableInterrupts();
+  now = DWT_CYCCNT;
+  idle = IdleCycles;
+  IdleCycles = 0;
+  OS_EnableInterrupts();
+
+  awake = now - SecondStart;
+  SecondStart = now;
+
+  // Cycles counted asleep are idle too, so the busy cycles are the ones awake less those in the idle thread
+  busy = (awake > idle) ? awake - idle : 0;
+
+  if (busy > CoreClock)
+    busy = CoreClock;
+
+  load = (uint32_t) (((uint64_t) busy * 1000) / CoreClock);
+
+  Stats.loadPerMille = (uint16_t) load;
+  Stats.busyCycles = busy;
+  Stats.idleCycles = CoreClock - busy;
+
+  if (Stats.loadPerMille > Stats.peakPerMille)
+    Stats.peakPerMille = Stats.loadPerMille;
+}
+
+void Idle_Get(TIdleStats* const stats)
+{
+  // The RTC thread has a higher priority than the reader
+  OS_DisableInterrupts();
+  *stats = Stats;
+  OS_EnableInterrupts();
+}
+
+void Idle_ResetPeak(void)
+{
+  OS_DisableInterrupts();
+  Stats.peakPerMille = Stats.loadPerMille;
+  OS_EnableInterrupts();
+}
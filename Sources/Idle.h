@@ -0,0 +1,55 @@
+/*! @file Idle.h
+ *
+ *  @brief Idle thread and CPU load for the DEM
+ *
+ *  This contains an idle thread that sleeps the CPU with WFI whenever no other thread is ready, and the routines
+ *  to work out the CPU load each second from the cycles the CPU spent awake outside the idle thread.
+ *
+ *  @author Rohan
+ *  @date 2019-11-26
+ */
+
+#ifndef SOURCES_IDLE_H_
+#define SOURCES_IDLE_H_
+
+// new types
+#include "types.h"
+
+extern const uint8_t IDLE_THREAD_PRIORITY;
+
+/*!
+ * @struct TIdleStats
+ */
+typedef struct
+{
+  uint16_t loadPerMille;     /*!< CPU load over the last second, in tenths of a percent */
+  uint16_t peakPerMille;     /*!< Highest load over a second since the peak was reset */
+  uint32_t busyCycles;       /*!< Cycles the CPU was busy over the last second */
+  uint32_t idleCycles;       /*!< Cycles of the last second spent idle, asleep or not */
+} TIdleStats;
+
+/*! @brief Creates the idle thread, and starts the cycle counter used to time it.
+ *
+ *  @param coreClock is the frequency of the CPU core clock in Hz.
+ *  @return bool - TRUE if the idle thread was created successfully.
+ *  @note The idle thread runs at IDLE_THREAD_PRIORITY, just above the RTOS's own idle thread, which it never lets run.
+ */
+bool Idle_Init(const uint32_t coreClock);
+
+/*! @brief Closes the second, working out the CPU load over it.
+ *
+ *  @note Called once a second from the RTC thread.
+ */
+void Idle_Second(void);
+
+/*! @brief Gets the CPU load.
+ *
+ *  @param stats is where the load is copied to.
+ */
+void Idle_Get(TIdleStats* const stats);
+
+/*! @brief Resets the peak load.
+ */
+void Idle_ResetPeak(void);
+
+#endif /* SOURCES_IDLE_H_ */
@@ -0,0 +1,256 @@
+/*! @file LoadProfile.c
+ *
+ *  @brief Interval load profile recorder for the DEM
+ *
+ *  This contains the routines to accumulate the per-cycle measurements over a configurable interval
+ *  and store one compact record per interval in a ring in the Flash.
+ *
+ *  @author Rohan
+ *  @date 2019-11-12
+ */
+
+#include "LoadProfile.h"
+
+#define LOAD_PROFILE_VERSION 1
+
+// The ring of records in the Flash
+static TFlashRing Ring =
+{
+  .firstSector = FLASH_LOAD_PROFILE_START,
+  .nbSectors = FLASH_LOAD_PROFILE_NB_SECTORS,
+  .recordSize = LOAD_PROFILE_RECORD_SIZE
+};
+
+// Non-volatile interval in minutes
+static volatile uint8_t *NvInterval;
+
+// Accumulators for the current interval, written by the calculation thread
+static uint64_t IntervalEnergyWs;     // 64Q16
+static int64_t IntervalPowerFactor;   // sum of 32Q16 values
+static uint32_t IntervalMinVrms;      // 32Q16
+static uint32_t IntervalMaxVrms;      // 32Q16
+static uint32_t IntervalNbCycles;
+
+// Interval number (RTC seconds / interval length) being accumulated
+static uint32_t CurrentInterval;
+static bool IntervalStarted = false;
+
+// RTC seconds when the current interval started being accumulated
+static uint32_t OpenedSeconds;
+
+// Closed records waiting to be stored, so a failed Flash write is tried again on a later tick
+static TLoadProfileRecord Pending[LOAD_PROFILE_NB_PENDING];
+static uint8_t PendingHead, PendingTail;
+
+/*! @brief Clears the accumulators for a new interval
+ *
+ *  @note Must be called with interrupts disabled once the calculation thread is running.
+ */
+static void ResetAccumulators(void)
+{
+  IntervalEnergyWs = 0;
+  IntervalPowerFactor = 0;
+  IntervalMinVrms = 0xFFFFFFFF;
+  IntervalMaxVrms = 0;
+  IntervalNbCycles = 0;
+}
+
+/*! @brief Queues a closed record to be stored
+ *
+ *  @param record is the record; it is dropped if the queue is full.
+ */
+static void Queue(const TLoadProfileRecord* const record)
+{
+  uint8_t next = (PendingHead + 1) & (LOAD_PROFILE_NB_PENDING - 1);
+
+  if (next == PendingTail)
+    return;
+
+  Pending[PendingHead] = *record;
+  PendingHead = next;
+}
+
+/*! @brief Stores the queued records in order
+ *
+ *  @return bool - TRUE if the queue was emptied; FALSE if the Flash failed, leaving the rest queued for the next tick.
+ */
+static bool Store(void)
+{
+  while (PendingTail != PendingHead)
+  {
+    if (!Flash_RingAppend(&Ring, &Pending[PendingTail]))
+      return false;
+
+    PendingTail = (PendingTail + 1) & (LOAD_PROFILE_NB_PENDING - 1);
+  }
+
+  return true;
+}
+
+bool LoadProfile_Init(void)
+{
+  if (!Flash_AllocateRecord(FLASH_RECORD_LOAD_PROFILE, LOAD_PROFILE_VERSION, sizeof(*NvInterval), (volatile void**) &NvInterval))
+    return false;
+
+  // Check if the flash is erased or holds an invalid interval
+  if (*NvInterval != 1 && *NvInterval != 5 && *NvInterval != 15 && *NvInterval != 30)
+    if (!Flash_Write8((uint8_t *) NvInterval, LOAD_PROFILE_DEFAULT_INTERVAL))
+      return false;
+
+  ResetAccumulators();
+
+  PendingHead = 0;
+  PendingTail = 0;
+
+  return Flash_RingInit(&Ring);
+}
+
+void LoadProfile_Update(const uint64_t energyPerCycleWs, const uint32_t vRMS, const int32_t powerFactor)
+{
+  IntervalEnergyWs += energyPerCycleWs;
+  IntervalPowerFactor += powerFactor;
+
+  if (vRMS < IntervalMinVrms)
+    IntervalMinVrms = vRMS;
+
+  if (vRMS > IntervalMaxVrms)
+    IntervalMaxVrms = vRMS;
+
+  IntervalNbCycles++;
+}
+
+bool LoadProfile_Tick(const uint32_t seconds)
+{
+  uint32_t intervalSeconds = (uint32_t) *NvInterval * 60;
+  uint32_t interval = seconds / intervalSeconds;
+
+  TLoadProfileRecord record;
+  uint64_t energyWs;
+  int64_t powerFactor;
+  uint32_t minVrms, maxVrms, nbCycles, intervalEnd, elapsed, gap;
+
+  // The first tick only starts the interval
+  if (!IntervalStarted)
+  {
+    CurrentInterval = interval;
+    OpenedSeconds = seconds;
+    IntervalStarted = true;
+    return true;
+  }
+
+  if (interval == CurrentInterval)
+    return Store();
+
+  // Take the accumulators as one snapshot, since the calculation thread has a higher priority
+  OS_DisableInterrupts();
+
+  energyWs = IntervalEnergyWs;
+  powerFactor = IntervalPowerFactor;
+  minVrms = IntervalMinVrms;
+  maxVrms = IntervalMaxVrms;
+  nbCycles = IntervalNbCycles;
+
+  ResetAccumulators();
+
+  OS_EnableInterrupts();
+
+  // The clock was set back; the open interval cannot be placed, so it is dropped
+  if (interval < CurrentInterval)
+  {
+    CurrentInterval = interval;
+    OpenedSeconds = seconds;
+    return Store();
+  }
+
+  record.timestamp = CurrentInterval * intervalSeconds;
+
+  // The interval may have been opened part way through, or the clock may have jumped past its end,
+  // so the average is over the seconds it was open for
+  intervalEnd = record.timestamp + intervalSeconds;
+  elapsed = ((seconds < intervalEnd) ? seconds : intervalEnd) - OpenedSeconds;
+
+  if (elapsed == 0 || elapsed > intervalSeconds)
+    elapsed = intervalSeconds;
+
+  // mWh = Ws * 1000 / 3600
+  record.energymWh = (uint32_t) (((energyWs * 1000) / 3600) >> 16);
+  record.averagePowerW = (uint16_t) ((energyWs / elapsed) >> 16);
+
+  if (nbCycles)
+  {
+    record.minVrmsTimes10 = (uint16_t) (((uint64_t) minVrms * 10) >> 16);
+    record.maxVrmsTimes10 = (uint16_t) (((uint64_t) maxVrms * 10) >> 16);
+    record.powerFactorTimes1000 = (int16_t) (((powerFactor / nbCycles) * 1000) >> 16);
+  }
+  else
+  {
+    record.minVrmsTimes10 = 0;
+    record.maxVrmsTimes10 = 0;
+    record.powerFactorTimes1000 = 0;
+  }
+
+  gap = interval - CurrentInterval - 1;
+  CurrentInterval = interval;
+  OpenedSeconds = interval * intervalSeconds;
+
+  Queue(&record);
+
+  // Intervals jumped over are stored empty so the ring has no holes, unless the jump is too long to fill,
+  // e.g. the clock being set, when the timestamps show the gap
+  if (gap > LOAD_PROFILE_MAX_GAP)
+    return Store();
+
+  record.energymWh = 0;
+  record.averagePowerW = 0;
+  record.minVrmsTimes10 = 0;
+  record.maxVrmsTimes10 = 0;
+  record.powerFactorTimes1000 = 0;
+
+  for (; gap > 0; gap--)
+  {
+    record.timestamp = (interval - gap) * intervalSeconds;
+    Queue(&record);
+  }
+
+  return Store();
+}
+
+uint8_t LoadProfile_GetInterval(void)
+{
+  return *NvInterval;
+}
+
+bool LoadProfile_SetInterval(const uint8_t minutes)
+{
+  if (minutes != 1 && minutes != 5 && minutes != 15 && minutes != 30)
+    return false;
+
+  if (minutes == *NvInterval)
+    return true;
+
+  if (!Flash_Write8((uint8_t *) NvInterval, minutes))
+    return false;
+
+  // Start a fresh interval on the next tick with the new length
+  OS_DisableInterrupts();
+  ResetAccumulators();
+  IntervalStarted = false;
+  OS_EnableInterrupts();
+
+  return true;
+}
+
+uint32_t LoadProfile_OldestIndex(void)
+{
+  return Ring.oldestIndex;
+}
+
+uint32_t LoadProfile_NextIndex(void)
+{
+  return Ring.nextIndex;
+}
+
+bool LoadProfile_Read(const uint32_t index, TLoadProfileRecord* const record)
+{
+  return Flash_RingRead(&Ring, index, record);
+}
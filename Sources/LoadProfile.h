@@ -0,0 +1,102 @@
+/*! @file LoadProfile.h
+ *
+ *  @brief Interval load profile recorder for the DEM
+ *
+ *  This contains the routines to accumulate the per-cycle measurements over a configurable interval
+ *  and store one compact record per interval in a ring in the Flash.
+ *
+ *  @author Rohan
+ *  @date 2019-11-12
+ */
+
+#ifndef SOURCES_LOADPROFILE_H_
+#define SOURCES_LOADPROFILE_H_
+
+// new types
+#include "types.h"
+// Flash ring to store the records
+#include "Flash.h"
+// RTOS
+#include "OS.h"
+
+#define LOAD_PROFILE_RECORD_SIZE 16        /*!< Size of a record in bytes; two Flash phrases */
+#define LOAD_PROFILE_DEFAULT_INTERVAL 15   /*!< Interval in minutes used until one is set */
+#define LOAD_PROFILE_MAX_GAP 4             /*!< Most intervals jumped over by the clock that are stored empty */
+#define LOAD_PROFILE_NB_PENDING 8          /*!< Closed records that can wait in RAM to be stored, a power of 2 */
+
+/*!
+ * @struct TLoadProfileRecord
+ *
+ * One interval of the load profile. 255 records fit in a Flash sector after the sector header.
+ */
+typedef struct
+{
+  uint32_t timestamp;             /*!< RTC seconds at the start of the interval */
+  uint32_t energymWh;             /*!< Energy consumed during the interval in mWh */
+  uint16_t averagePowerW;         /*!< Average power over the interval in W */
+  uint16_t minVrmsTimes10;        /*!< Lowest per-cycle Vrms in 0.1 V */
+  uint16_t maxVrmsTimes10;        /*!< Highest per-cycle Vrms in 0.1 V */
+  int16_t powerFactorTimes1000;   /*!< Average power factor x 1000 */
+} TLoadProfileRecord;
+
+/*! @brief Allocates the load profile settings and finds the newest record in the Flash.
+ *
+ *  @return bool - TRUE if the load profile was initialized successfully.
+ *  @note Assumes Flash has been initialized.
+ */
+bool LoadProfile_Init(void);
+
+/*! @brief Adds the measurements of one mains cycle to the current interval.
+ *
+ *  @param energyPerCycleWs is the energy of the cycle in Ws, 64Q16.
+ *  @param vRMS is the Vrms of the cycle in V, 32Q16.
+ *  @param powerFactor is the power factor of the cycle, 32Q16.
+ *  @note Called from the calculation thread once per cycle.
+ */
+void LoadProfile_Update(const uint64_t energyPerCycleWs, const uint32_t vRMS, const int32_t powerFactor);
+
+/*! @brief Closes the current interval and stores its record if an interval boundary has passed.
+ *
+ *  @param seconds is the current RTC time in seconds.
+ *  @return bool - TRUE if every closed record has been stored; FALSE if the Flash failed, in which case the records
+ *  wait in RAM and are tried again on the next tick.
+ *  @note If the clock jumps over intervals, up to LOAD_PROFILE_MAX_GAP of them are stored as empty records; if it
+ *  goes back, the open interval is dropped and a new one started. A record closed while LOAD_PROFILE_NB_PENDING
+ *  records are waiting is dropped.
+ */
+bool LoadProfile_Tick(const uint32_t seconds);
+
+/*! @brief Gets the length of the recording interval.
+ *
+ *  @return uint8_t - the interval in minutes.
+ */
+uint8_t LoadProfile_GetInterval(void);
+
+/*! @brief Sets the length of the recording interval and saves it in the Flash.
+ *
+ *  @param minutes is the interval in minutes; 1, 5, 15 or 30.
+ *  @return bool - TRUE if the interval is valid and was saved successfully.
+ */
+bool LoadProfile_SetInterval(const uint8_t minutes);
+
+/*! @brief Gets the index of the oldest record still stored.
+ *
+ *  @return uint32_t - the interval index.
+ */
+uint32_t LoadProfile_OldestIndex(void);
+
+/*! @brief Gets the index the next record will be stored with.
+ *
+ *  @return uint32_t - the interval index.
+ */
+uint32_t LoadProfile_NextIndex(void);
+
+/*! @brief Reads a record from the Flash.
+ *
+ *  @param index is the interval index of the record.
+ *  @param record is where the record is copied to.
+ *  @return bool - TRUE if the record is stored and was read successfully.
+ */
+bool LoadProfile_Read(const uint32_t index, TLoadProfileRecord* const record);
+
+#endif /* SOURCES_LOADPROFILE_H_ */
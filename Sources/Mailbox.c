@@ -0,0 +1,92 @@
+/*! @file Mailbox.c
+ *
+ *  @brief Sample mailbox for the DEM
+ *
+ *  This contains a fixed-size lock-free queue that carries each sample from the PIT interrupt to the calculation
+ *  thread with its index and the time it was taken. The interrupt is the only writer and the thread the only reader,
+ *  so neither has to disable interrupts. The thread still waits on a semaphore signalled once per sample posted.
+ *
+ *  @author Rohan
+ *  @date 2019-11-25
+ */
+
+#include "Mailbox.h"
+// DWT cycle counter
+#include "MK70F12.h"
+
+#define DEMCR_TRCENA_MASK 0x01000000u    /*!< Enables the DWT */
+#define DWT_CTRL_CYCCNTENA_MASK 0x1u     /*!< Starts the cycle counter */
+
+#define INDEX_MASK (MAILBOX_SIZE - 1)
+
+// Stops the compiler moving memory accesses across it; one core needs no more to order the interrupt and the thread
+#define BARRIER() __asm volatile ("" ::: "memory")
+
+static TMailboxSample Samples[MAILBOX_SIZE];
+
+// Head is only moved by the interrupt and Tail only by the thread; each only moves once its slot is done with
+static volatile uint16_t Head, Tail;
+
+static uint32_t NextIndex;
+
+bool Mailbox_Init(void)
+{
+  Head = 0;
+  Tail = 0;
+  NextIndex = 0;
+
+  DEMCR |= DEMCR_TRCENA_MASK;
+  DWT_CTRL |= DWT_CTRL_CYCCNTENA_MASK;
+
+  return true;
+}
+
+bool RAMFUNC Mailbox_Post(const int16_t voltage, const int16_t current)
+{
+  uint16_t head = Head;
+  TMailboxSample* sample;
+
+  // The index moves on even for a dropped sample, so the reader sees the gap
+  uint32_t index = NextIndex++;
+
+  if (((head + 1) & INDEX_MASK) == Tail)
+    return false;
+
+  sample = &Samples[head];
+
+  sample->index = index;
+  sample->timestamp = DWT_CYCCNT;
+  sample->voltage = voltage;
+  sample->current = current;
+
+  // The slot must be written before it is published
+  BARRIER();
+
+  Head = (head + 1) & INDEX_MASK;
+
+  return true;
+}
+
+bool RAMFUNC Mailbox_Get(TMailboxSample* const sample)
+{
+  uint16_t tail = Tail;
+
+  if (tail == Head)
+    return false;
+
+  // The slot must not be read before Head says it is full, nor handed back before it has been read
+  BARRIER();
+
+  *sample = Samples[tail];
+
+  BARRIER();
+
+  Tail = (tail + 1) & INDEX_MASK;
+
+  return true;
+}
+
+uint16_t Mailbox_Count(void)
+{
+  return (Head - Tail) & INDEX_MASK;
+}
@@ -0,0 +1,67 @@
+/*! @file Mailbox.h
+ *
+ *  @brief Sample mailbox for the DEM
+ *
+ *  This contains a fixed-size lock-free queue that carries each sample from the PIT interrupt to the calculation
+ *  thread with its index and the time it was taken. The interrupt is the only writer and the thread the only reader,
+ *  so neither has to disable interrupts. The thread still waits on a semaphore signalled once per sample posted.
+ *
+ *  @author Rohan
+ *  @date 2019-11-25
+ */
+
+#ifndef SOURCES_MAILBOX_H_
+#define SOURCES_MAILBOX_H_
+
+// new types
+#include "types.h"
+
+/*! Log2 of the number of samples the mailbox holds.
+ *  Can be set for the build, e.g. -DMAILBOX_SIZE_LOG2=5 */
+#ifndef MAILBOX_SIZE_LOG2
+#define MAILBOX_SIZE_LOG2 4
+#endif
+
+#define MAILBOX_SIZE (1 << MAILBOX_SIZE_LOG2)    /*!< Samples the mailbox holds */
+
+/*!
+ * @struct TMailboxSample
+ */
+typedef struct
+{
+  uint32_t index;       /*!< Index of the sample, counting every sample taken including any dropped */
+  uint32_t timestamp;   /*!< CPU cycle count when the sample was posted */
+  int16_t voltage;      /*!< Raw ADC value of the voltage */
+  int16_t current;      /*!< Raw ADC value of the current */
+} TMailboxSample;
+
+/*! @brief Empties the mailbox and starts the cycle counter used for the timestamps.
+ *
+ *  @return bool - TRUE if the mailbox was initialized successfully.
+ */
+bool Mailbox_Init(void);
+
+/*! @brief Posts a sample with the next index and the time.
+ *
+ *  @param voltage is the raw ADC value of the voltage.
+ *  @param current is the raw ADC value of the current.
+ *  @return bool - TRUE if the sample was posted; FALSE if the mailbox was full, leaving a gap in the indices.
+ *  @note Called from the PIT interrupt only.
+ */
+bool RAMFUNC Mailbox_Post(const int16_t voltage, const int16_t current);
+
+/*! @brief Gets the oldest sample.
+ *
+ *  @param sample is where the sample is copied to.
+ *  @return bool - TRUE if there was a sample.
+ *  @note Called from the calculation thread only.
+ */
+bool RAMFUNC Mailbox_Get(TMailboxSample* const sample);
+
+/*! @brief Gets the number of samples waiting.
+ *
+ *  @return uint16_t - the number of samples.
+ */
+uint16_t Mailbox_Count(void);
+
+#endif /* SOURCES_MAILBOX_H_ */
@@ -10,11 +10,17 @@
 
 // Included header files
 #include "PIT.h"
+// Cycle counts of the callback
+#include "Profile.h"
 
 //Private Global Variables
 static void* UserArguments;			/*!< Private global pointer to the user arguments of the callback function */
 static void (*UserFunction)(void* );		/*!< Private global pointer to the PIT user callback function */
-static uint32_t ModuleClk;			/*!< Private global variable to store the value of the module clock */
+static uint64_t TicksPerNs;			/*!< Private global variable to store the module clock ticks per nanosecond, 32Q32 */
+static volatile uint32_t PeriodTicks;		/*!< Private global variable to store the period in ticks, with PIT_TICKS_FRACTION_BITS fractional bits */
+static uint32_t Phase;				/*!< Private global variable to store the fractional ticks carried between periods */
+
+#define TICKS_FRACTION_MASK ((1UL << PIT_TICKS_FRACTION_BITS) - 1)
 
 /*! @brief Sets up the PIT before first use.
  *
@@ -31,8 +37,8 @@ bool PIT_Init(const uint32_t moduleClk, void (*userFunction)(void*), void* userA
   // Point the private global callback function pointer to the address of the userFunction
   UserFunction = userFunction;
 
-  // Make the moduleClk globally (private) available
-  ModuleClk = moduleClk;
+  // Work out the ticks per nanosecond once, so setting a period needs no division
+  TicksPerNs = ((uint64_t) moduleClk << 32) / 1000000000U;
 
   // Enable the clock gating to the PIT module
   SIM_SCGC6 |= SIM_SCGC6_PIT_MASK;
@@ -63,29 +69,65 @@ bool PIT_Init(const uint32_t moduleClk, void (*userFunction)(void*), void* userA
  *  @param period The desired value of the timer period in nanoseconds.
  *  @param restart TRUE if the PIT is disabled, a new value set, and then enabled.
  *                 FALSE if the PIT will use the new value after a trigger event.
+ *  @return bool - TRUE if the period was set, FALSE if it is out of range and the PIT was left as it was.
+ *  @note The function will enable the timer and interrupts for the PIT.
+ *  @note The period must be from one tick up to PIT_MAX_TICKS whole ticks, about 279 ms with a 60 MHz module clock.
+ */
+bool PIT_Set(const uint32_t period, const bool restart)
+{
+  // ticks = period * ticks per nanosecond, keeping PIT_TICKS_FRACTION_BITS of the fraction
+  uint64_t ticks = ((uint64_t) period * TicksPerNs) >> (32 - PIT_TICKS_FRACTION_BITS);
+
+  // A longer period would wrap in 32 bits and load a much shorter one
+  if (ticks > UINT32_MAX)
+    return false;
+
+  return PIT_SetTicks((uint32_t) ticks, restart);
+}
+
+/*! @brief Sets the period of the PIT in timer ticks, with a fractional part.
+ *
+ *  The reload value is dithered between the whole numbers of ticks either side of the period,
+ *  so the average period is exact.
+ *  @param ticks The desired timer period in module clock ticks, with PIT_TICKS_FRACTION_BITS fractional bits.
+ *  @param restart TRUE if the PIT is disabled, a new value set, and then enabled.
+ *                 FALSE if the PIT will use the new value after a trigger event.
+ *  @return bool - TRUE if the period was set, FALSE if it is shorter than one tick.
  *  @note The function will enable the timer and interrupts for the PIT.
  */
-void PIT_Set(const uint32_t period, const bool restart)
+bool PIT_SetTicks(const uint32_t ticks, const bool restart)
 {
-  // Calculate the value to be loaded in the timer
-  uint32_t timerValue = (ModuleClk / (1e9/period)) - 1;
+  uint32_t primask;
+
+  // Check the period is at least one tick
+  if (!(ticks >> PIT_TICKS_FRACTION_BITS))
+    return false;
+
+  // The ISR must not run between the two writes, or the reload value it loads with a carried tick is overwritten
+  // Interrupts are only enabled again if they were, since the PIT is first set while the tower is being initialized
+  __asm volatile ("MRS %0, PRIMASK" : "=r" (primask));
+  OS_DisableInterrupts();
+
+  PeriodTicks = ticks;
 
-  // Check if the timerValue is less than 0xFFFFFFFF
-  if (timerValue <= 0xFFFFFFFF)
+  // Load the whole part in Timer0; the ISR adds the carried fraction from the next trigger
+  PIT_LDVAL0 = (ticks >> PIT_TICKS_FRACTION_BITS) - 1;
+
+  if (restart)
   {
-    // Load the value in Timer0
-    PIT_LDVAL0 = timerValue;
+    Phase = 0;
 
-    if (restart)
-    {
-      // Disable Timer0 to abort the current cycle, if any
-      PIT_Enable(false);
+    // Disable Timer0 to abort the current cycle, if any
+    PIT_Enable(false);
 
-      // Enable Timer0 to restart the cycle
-      PIT_Enable (true);
-    }
+    // Enable Timer0 to restart the cycle
+    PIT_Enable (true);
   }
 
+  if (!primask)
+    OS_EnableInterrupts();
+
+  return true;
 }
 
 /*! @brief Enables or disables the PIT.
@@ -109,7 +151,7 @@ void PIT_Enable(const bool enable)
  *  The user callback function will be called.
  *  @note Assumes the PIT has been initialized.
  */
-void __attribute__ ((interrupt)) PIT_ISR(void)
+void __attribute__ ((interrupt)) RAMFUNC PIT_ISR(void)
 {
   OS_ISREnter();
 
@@ -119,9 +161,26 @@ void __attribute__ ((interrupt)) PIT_ISR(void)
     // Clear the interrupt flag once interrupt is handle
     PIT_TFLG0 |= PIT_TFLG_TIF_MASK;
 
+    uint32_t ticks = PeriodTicks;
+
+    // Accumulate the fractional ticks and stretch the next period by one tick when they carry
+    // The reload value only takes effect after the period that has just started
+    if (ticks & TICKS_FRACTION_MASK)
+    {
+      Phase += ticks & TICKS_FRACTION_MASK;
+      PIT_LDVAL0 = (ticks >> PIT_TICKS_FRACTION_BITS) - 1 + (Phase >> PIT_TICKS_FRACTION_BITS);
+      Phase &= TICKS_FRACTION_MASK;
+    }
+
     if(UserFunction)	// Null Check
-    	// Call the user function
-    	(*UserFunction) (UserArguments);
+    {
+      PROFILE_BEGIN(PROFILE_PROBE_PIT);
+
+      // Call the user function
+      (*UserFunction) (UserArguments);
+
+      PROFILE_END(PROFILE_PROBE_PIT);
+    }
   }
 
   OS_ISRExit();
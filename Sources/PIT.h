@@ -23,6 +23,9 @@
 #include "OS.h"
 #include "CPU.h"
 
+#define PIT_TICKS_FRACTION_BITS 8	/*!< Number of fractional bits in a period given in timer ticks */
+#define PIT_MAX_TICKS (UINT32_MAX >> PIT_TICKS_FRACTION_BITS)	/*!< Longest period in whole timer ticks, so the fraction still fits */
+
 /*! @brief Sets up the PIT before first use.
  *
  *  Enables the PIT and freezes the timer when debugging.
@@ -37,9 +40,23 @@ bool PIT_Init(const uint32_t moduleClk, void (*userFunction)(void*), void* userA
  *  @param period The desired value of the timer period in nanoseconds.
  *  @param restart TRUE if the PIT is disabled, a new value set, and then enabled.
  *                 FALSE if the PIT will use the new value after a trigger event.
+ *  @return bool - TRUE if the period was set, FALSE if it is out of range and the PIT was left as it was.
+ *  @note The function will enable the timer and interrupts for the PIT.
+ *  @note The period must be from one tick up to PIT_MAX_TICKS whole ticks, about 279 ms with a 60 MHz module clock.
+ */
+bool PIT_Set(const uint32_t period, const bool restart);
+
+/*! @brief Sets the period of the PIT in timer ticks, with a fractional part.
+ *
+ *  The reload value is dithered between the whole numbers of ticks either side of the period,
+ *  so the average period is exact.
+ *  @param ticks The desired timer period in module clock ticks, with PIT_TICKS_FRACTION_BITS fractional bits.
+ *  @param restart TRUE if the PIT is disabled, a new value set, and then enabled.
+ *                 FALSE if the PIT will use the new value after a trigger event.
+ *  @return bool - TRUE if the period was set, FALSE if it is shorter than one tick.
  *  @note The function will enable the timer and interrupts for the PIT.
  */
-void PIT_Set(const uint32_t period, const bool restart);
+bool PIT_SetTicks(const uint32_t ticks, const bool restart);
 
 /*! @brief Enables or disables the PIT.
  *
@@ -53,7 +70,7 @@ void PIT_Enable(const bool enable);
  *  The user callback function will be called.
  *  @note Assumes the PIT has been initialized.
  */
-void __attribute__ ((interrupt)) PIT_ISR(void);
+void __attribute__ ((interrupt)) RAMFUNC PIT_ISR(void);
 
 #endif
 
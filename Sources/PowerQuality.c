@@ -0,0 +1,314 @@
+/*! @file PowerQuality.c
+ *
+ *  @brief Power quality monitor for the DEM
+ *
+ *  This contains the routines to find the one-cycle RMS voltage refreshed every half cycle, detect sags, swells and
+ *  interruptions from it, and aggregate the per-cycle RMS voltage over 10/12 cycles, 150/180 cycles and 10 minutes.
+ *  Finished events are queued in RAM by the calculation thread, then stored in a ring in the Flash and sent to the PC.
+ *
+ *  @author Rohan
+ *  @date 2019-11-22
+ */
+
+#include "PowerQuality.h"
+// Samples per cycle
+#include "Calc.h"
+
+#define AGGREGATION_CYCLES ((POWER_QUALITY_NOMINAL_HZ == 60) ? 12 : 10)
+#define HALF_CYCLE_SAMPLES (ANALOG_WINDOW_SIZE / 2)
+
+#define THRESHOLD(percent) ((uint32_t) (((uint64_t) POWER_QUALITY_DECLARED_VRMS * (percent)) / 100))
+
+#define SAG_START          THRESHOLD(POWER_QUALITY_SAG_PERCENT)
+#define SAG_END            THRESHOLD(POWER_QUALITY_SAG_PERCENT + POWER_QUALITY_HYSTERESIS_PERCENT)
+#define SWELL_START        THRESHOLD(POWER_QUALITY_SWELL_PERCENT)
+#define SWELL_END          THRESHOLD(POWER_QUALITY_SWELL_PERCENT - POWER_QUALITY_HYSTERESIS_PERCENT)
+#define INTERRUPTION_START THRESHOLD(POWER_QUALITY_INTERRUPTION_PERCENT)
+
+// The ring of events in the Flash
+static TFlashRing Ring =
+{
+  .firstSector = FLASH_POWER_QUALITY_START,
+  .nbSectors = FLASH_POWER_QUALITY_NB_SECTORS,
+  .recordSize = POWER_QUALITY_RECORD_SIZE
+};
+
+// Sums of the squared samples of this half cycle and the one before, 64Q32
+static uint64_t HalfSum, PreviousHalfSum;
+static uint16_t HalfCount, PreviousHalfCount;
+static uint32_t HalfNs;
+
+// The event in progress
+static bool EventActive = false;
+static TPowerQualityEvent Event;
+static uint32_t ExtremeVrms;
+static uint64_t EventNs;
+
+// Finished events, written by the calculation thread and stored by the RTC thread
+static TPowerQualityEvent Pending[POWER_QUALITY_NB_PENDING];
+static volatile uint8_t PendingHead, PendingTail;
+
+// Running sums of the squared RMS voltages, 64Q32
+static uint64_t ShortSum, MediumSum, LongSum;
+static uint8_t ShortCount, MediumCount;
+static uint32_t LongCount;
+
+// Set when an event overlaps the aggregation in progress
+static bool ShortFlag, MediumFlag, LongFlag;
+
+// 10-minute period (RTC seconds / POWER_QUALITY_LONG_SECONDS) being aggregated
+static uint32_t CurrentPeriod;
+static bool PeriodStarted = false;
+
+static volatile uint32_t AggregateVrms[POWER_QUALITY_NB_AGGREGATES];
+static volatile bool AggregateFlagged[POWER_QUALITY_NB_AGGREGATES];
+
+/*! @brief Queues a finished event to be stored.
+ *
+ *  An event is dropped if the queue is full, so the calculation thread never waits for the Flash.
+ */
+static void FinishEvent(void)
+{
+  uint8_t next = (PendingHead + 1) & (POWER_QUALITY_NB_PENDING - 1);
+
+  EventActive = false;
+
+  if (next == PendingTail)
+    return;
+
+  Event.durationMs = (uint32_t) (EventNs / 1000000);
+  Event.extremeVrmsTimes10 = (uint16_t) (((uint64_t) ExtremeVrms * 10) >> 16);
+
+  Pending[PendingHead] = Event;
+  PendingHead = next;
+}
+
+/*! @brief Starts, follows and finishes the events with the RMS voltage of each half cycle.
+ *
+ *  @param vRMS is the one-cycle RMS voltage ending with the half cycle, in V 32Q16.
+ *  @param halfNs is the length of the half cycle in nanoseconds.
+ */
+static void Detect(const uint32_t vRMS, const uint32_t halfNs)
+{
+  uint8_t type;
+
+  if (!EventActive)
+  {
+    if (vRMS < SAG_START)
+      type = (vRMS < INTERRUPTION_START) ? POWER_QUALITY_INTERRUPTION : POWER_QUALITY_SAG;
+    else if (vRMS > SWELL_START)
+      type = POWER_QUALITY_SWELL;
+    else
+      return;
+
+    EventActive = true;
+    Event.type = type;
+    Event.timestamp = RTC_GetSeconds();
+    ExtremeVrms = vRMS;
+    EventNs = halfNs;
+
+    ShortFlag = MediumFlag = LongFlag = true;
+    return;
+  }
+
+  EventNs += halfNs;
+
+  // An event only ends once the voltage is back past its threshold by the hysteresis
+  if (Event.type == POWER_QUALITY_SWELL)
+  {
+    if (vRMS > ExtremeVrms)
+      ExtremeVrms = vRMS;
+
+    if (vRMS >= SWELL_END)
+      return;
+  }
+  else
+  {
+    if (vRMS < ExtremeVrms)
+      ExtremeVrms = vRMS;
+
+    if (vRMS < INTERRUPTION_START)
+      Event.type = POWER_QUALITY_INTERRUPTION;
+
+    if (vRMS <= SAG_END)
+      return;
+  }
+
+  FinishEvent();
+}
+
+/*! @brief Works out the one-cycle RMS voltage at the end of a half cycle, and checks it for events.
+ */
+static void HalfCycle(void)
+{
+  uint16_t count = PreviousHalfCount + HalfCount;
+  uint64_t sum = PreviousHalfSum + HalfSum;
+  uint32_t vRMS;
+
+  if (count)
+  {
+    // A locked cycle is a shift
+    if (count == ANALOG_WINDOW_SIZE)
+      vRMS = FixedPoint_SquareRootU64(sum >> ANALOG_WINDOW_SIZE_LOG2);
+    else
+      vRMS = FixedPoint_SquareRootU64(sum / count);
+
+    Detect(vRMS, HalfNs);
+
+    AggregateVrms[POWER_QUALITY_HALF_CYCLE] = vRMS;
+    AggregateFlagged[POWER_QUALITY_HALF_CYCLE] = EventActive;
+  }
+
+  PreviousHalfSum = HalfSum;
+  PreviousHalfCount = HalfCount;
+
+  HalfSum = 0;
+  HalfCount = 0;
+  HalfNs = 0;
+}
+
+bool PowerQuality_Init(void)
+{
+  uint8_t aggregate;
+
+  for (aggregate = 0; aggregate < POWER_QUALITY_NB_AGGREGATES; aggregate++)
+  {
+    AggregateVrms[aggregate] = 0;
+    AggregateFlagged[aggregate] = false;
+  }
+
+  PendingHead = 0;
+  PendingTail = 0;
+
+  // Reserved bytes are left erased in the Flash
+  for (aggregate = 0; aggregate < sizeof(Event.reserved); aggregate++)
+    Event.reserved[aggregate] = 0xFF;
+
+  return Flash_RingInit(&Ring);
+}
+
+void PowerQuality_Sample(const int32_t instVoltage, const uint32_t samplePeriod, const bool newCycle)
+{
+  // A new cycle ends the second half of the last one; a locked cycle also splits in the middle
+  if (newCycle || HalfCount >= HALF_CYCLE_SAMPLES)
+    HalfCycle();
+
+  HalfSum += (uint64_t) ((int64_t) instVoltage * instVoltage);
+  HalfCount++;
+  HalfNs += samplePeriod;
+}
+
+void PowerQuality_Cycle(const uint32_t vRMS)
+{
+  uint64_t meanSquare;
+
+  ShortSum += (uint64_t) vRMS * vRMS;
+
+  if (++ShortCount < AGGREGATION_CYCLES)
+    return;
+
+  // The longer aggregations add up the mean squares of the short ones, so no roots are taken of roots
+  meanSquare = ShortSum / AGGREGATION_CYCLES;
+
+  AggregateVrms[POWER_QUALITY_SHORT] = FixedPoint_SquareRootU64(meanSquare);
+  AggregateFlagged[POWER_QUALITY_SHORT] = ShortFlag;
+
+  ShortSum = 0;
+  ShortCount = 0;
+  ShortFlag = EventActive;
+
+  MediumSum += meanSquare;
+  LongSum += meanSquare;
+  LongCount++;
+
+  if (++MediumCount < POWER_QUALITY_MEDIUM_BLOCKS)
+    return;
+
+  AggregateVrms[POWER_QUALITY_MEDIUM] = FixedPoint_SquareRootU64(MediumSum / POWER_QUALITY_MEDIUM_BLOCKS);
+  AggregateFlagged[POWER_QUALITY_MEDIUM] = MediumFlag;
+
+  MediumSum = 0;
+  MediumCount = 0;
+  MediumFlag = EventActive;
+}
+
+void PowerQuality_Tick(const uint32_t seconds)
+{
+  uint32_t period = seconds / POWER_QUALITY_LONG_SECONDS;
+  uint64_t sum;
+  uint32_t count;
+  bool flag;
+
+  // The first tick only starts the period
+  if (!PeriodStarted)
+  {
+    CurrentPeriod = period;
+    PeriodStarted = true;
+    return;
+  }
+
+  if (period == CurrentPeriod)
+    return;
+
+  // Take the sums as one snapshot, since the calculation thread has a higher priority
+  OS_DisableInterrupts();
+
+  sum = LongSum;
+  count = LongCount;
+  flag = LongFlag;
+
+  LongSum = 0;
+  LongCount = 0;
+  LongFlag = EventActive;
+
+  OS_EnableInterrupts();
+
+  if (count)
+  {
+    AggregateVrms[POWER_QUALITY_LONG] = FixedPoint_SquareRootU64(sum / count);
+    AggregateFlagged[POWER_QUALITY_LONG] = flag;
+  }
+
+  CurrentPeriod = period;
+}
+
+bool PowerQuality_Log(TPowerQualityEvent* const event)
+{
+  if (PendingTail == PendingHead)
+    return false;
+
+  *event = Pending[PendingTail];
+
+  // Keep the event queued if the Flash fails, so it is tried again on the next tick
+  if (!Flash_RingAppend(&Ring, event))
+    return false;
+
+  PendingTail = (PendingTail + 1) & (POWER_QUALITY_NB_PENDING - 1);
+
+  return true;
+}
+
+uint32_t PowerQuality_GetVrms(const uint8_t aggregate, bool* const flagged)
+{
+  if (aggregate >= POWER_QUALITY_NB_AGGREGATES)
+    return 0;
+
+  *flagged = AggregateFlagged[aggregate];
+
+  return AggregateVrms[aggregate];
+}
+
+uint32_t PowerQuality_OldestIndex(void)
+{
+  return Ring.oldestIndex;
+}
+
+uint32_t PowerQuality_NextIndex(void)
+{
+  return Ring.nextIndex;
+}
+
+bool PowerQuality_Read(const uint32_t index, TPowerQualityEvent* const event)
+{
+  return Flash_RingRead(&Ring, index, event);
+}
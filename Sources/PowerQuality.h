@@ -0,0 +1,126 @@
+/*! @file PowerQuality.h
+ *
+ *  @brief Power quality monitor for the DEM
+ *
+ *  This contains the routines to find the one-cycle RMS voltage refreshed every half cycle, detect sags, swells and
+ *  interruptions from it, and aggregate the per-cycle RMS voltage over 10/12 cycles, 150/180 cycles and 10 minutes.
+ *  Finished events are queued in RAM by the calculation thread, then stored in a ring in the Flash and sent to the PC.
+ *
+ *  @author Rohan
+ *  @date 2019-11-22
+ */
+
+#ifndef SOURCES_POWERQUALITY_H_
+#define SOURCES_POWERQUALITY_H_
+
+// new types
+#include "types.h"
+// Flash ring to keep the events
+#include "Flash.h"
+// RTC to timestamp the events
+#include "RTC.h"
+// RTOS
+#include "OS.h"
+// Root mean squares
+#include "FixedPoint.h"
+
+#define POWER_QUALITY_NOMINAL_HZ 50               /*!< Nominal mains frequency; 50 aggregates over 10 cycles, 60 over 12 */
+#define POWER_QUALITY_DECLARED_VRMS (230 << 16)   /*!< Declared supply voltage the thresholds are relative to, in V 32Q16 */
+#define POWER_QUALITY_SAG_PERCENT 90              /*!< A sag starts below this percentage of the declared voltage */
+#define POWER_QUALITY_SWELL_PERCENT 110           /*!< A swell starts above this percentage of the declared voltage */
+#define POWER_QUALITY_INTERRUPTION_PERCENT 5      /*!< A sag becomes an interruption below this percentage of the declared voltage */
+#define POWER_QUALITY_HYSTERESIS_PERCENT 2        /*!< An event only ends once the voltage is back past its threshold by this much */
+#define POWER_QUALITY_MEDIUM_BLOCKS 15            /*!< 10/12-cycle values in a 150/180-cycle value */
+#define POWER_QUALITY_LONG_SECONDS 600            /*!< Length of the long aggregation, aligned to the RTC */
+#define POWER_QUALITY_NB_PENDING 8                /*!< Finished events that can wait in RAM to be stored */
+
+#define POWER_QUALITY_RECORD_SIZE 16              /*!< Size of an event in the Flash; two Flash phrases */
+
+#define POWER_QUALITY_SAG 1
+#define POWER_QUALITY_SWELL 2
+#define POWER_QUALITY_INTERRUPTION 3
+
+#define POWER_QUALITY_HALF_CYCLE 0                /*!< One-cycle RMS refreshed every half cycle */
+#define POWER_QUALITY_SHORT 1                     /*!< 10/12-cycle aggregation */
+#define POWER_QUALITY_MEDIUM 2                    /*!< 150/180-cycle aggregation */
+#define POWER_QUALITY_LONG 3                      /*!< 10-minute aggregation */
+#define POWER_QUALITY_NB_AGGREGATES 4
+
+/*!
+ * @struct TPowerQualityEvent
+ *
+ * One sag, swell or interruption. 255 events fit in a Flash sector after the sector header.
+ */
+typedef struct
+{
+  uint32_t timestamp;             /*!< RTC seconds at the start of the event */
+  uint32_t durationMs;            /*!< Length of the event in ms */
+  uint16_t extremeVrmsTimes10;    /*!< Lowest half-cycle RMS voltage of a sag or interruption, or highest of a swell, in 0.1 V */
+  uint8_t type;                   /*!< POWER_QUALITY_SAG, POWER_QUALITY_SWELL or POWER_QUALITY_INTERRUPTION */
+  uint8_t reserved[5];
+} TPowerQualityEvent;
+
+/*! @brief Finds the newest event in the Flash.
+ *
+ *  @return bool - TRUE if the power quality monitor was initialized successfully.
+ */
+bool PowerQuality_Init(void);
+
+/*! @brief Adds a voltage sample to the half-cycle RMS, and checks for events every half cycle.
+ *
+ *  @param instVoltage is the voltage sample in V, 32Q16.
+ *  @param samplePeriod is the sample period in nanoseconds.
+ *  @param newCycle is TRUE if the sample is the first one of a new cycle.
+ *  @note Called from the calculation thread for every sample.
+ */
+void PowerQuality_Sample(const int32_t instVoltage, const uint32_t samplePeriod, const bool newCycle);
+
+/*! @brief Adds the RMS voltage of a cycle to the 10/12-cycle and 150/180-cycle aggregations.
+ *
+ *  @param vRMS is the RMS voltage of the cycle in V, 32Q16.
+ *  @note Called from the calculation thread once per cycle.
+ */
+void PowerQuality_Cycle(const uint32_t vRMS);
+
+/*! @brief Closes the 10-minute aggregation on a 10-minute boundary of the RTC.
+ *
+ *  @param seconds is the RTC time in seconds.
+ */
+void PowerQuality_Tick(const uint32_t seconds);
+
+/*! @brief Stores the oldest finished event in the Flash.
+ *
+ *  @param event is where a copy of the event is stored.
+ *  @return bool - TRUE if an event was stored; FALSE if there was none, or it is kept to try again.
+ */
+bool PowerQuality_Log(TPowerQualityEvent* const event);
+
+/*! @brief Gets an aggregated RMS voltage.
+ *
+ *  @param aggregate is POWER_QUALITY_HALF_CYCLE, POWER_QUALITY_SHORT, POWER_QUALITY_MEDIUM or POWER_QUALITY_LONG.
+ *  @param flagged is set if an event overlapped the aggregation, so it should not be trusted.
+ *  @return uint32_t - the RMS voltage in V, 32Q16, or 0 if the aggregate is not valid.
+ */
+uint32_t PowerQuality_GetVrms(const uint8_t aggregate, bool* const flagged);
+
+/*! @brief Gets the index of the oldest event in the Flash.
+ *
+ *  @return uint32_t - the index.
+ */
+uint32_t PowerQuality_OldestIndex(void);
+
+/*! @brief Gets the index the next event will be stored with.
+ *
+ *  @return uint32_t - the index.
+ */
+uint32_t PowerQuality_NextIndex(void);
+
+/*! @brief Reads an event from the Flash.
+ *
+ *  @param index is the index of the event.
+ *  @param event is where the event is copied to.
+ *  @return bool - TRUE if the event is in the ring.
+ */
+bool PowerQuality_Read(const uint32_t index, TPowerQualityEvent* const event);
+
+#endif /* SOURCES_POWERQUALITY_H_ */
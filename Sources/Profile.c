@@ -0,0 +1,170 @@
+/*! @file Profile.c
+ *
+ *  @brief Cycle-count profiler for the DEM
+ *
+ *  This contains the probes that time the hot paths with the DWT cycle counter, keeping the count, minimum, maximum,
+ *  mean and a log2 histogram of the cycles taken by each probe. Latency probes time the hand-off from an interrupt
+ *  to the thread it signals instead. The probes only exist when PROFILE_ENABLE is defined for the build,
+ *  e.g. -DPROFILE_ENABLE; otherwise the PROFILE macros compile to nothing.
+ *
+ *  @author Rohan
+ *  @date 2019-11-24
+ */
+
+#include "Profile.h"
+
+#ifdef PROFILE_ENABLE
+
+// RTOS
+#include "OS.h"
+// RTC to time the worst case
+#include "RTC.h"
+
+#define DEMCR_TRCENA_MASK 0x01000000u    /*!< Enables the DWT */
+#define DWT_CTRL_CYCCNTENA_MASK 0x1u     /*!< Starts the cycle counter */
+
+/*!
+ * @struct TProfileSlot
+ */
+typedef struct
+{
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint32_t maxSeconds;
+  uint64_t total;
+  uint32_t histogram[PROFILE_NB_BINS];
+} TProfileSlot;
+
+static TProfileSlot Slots[PROFILE_NB_PROBES];
+
+// When each latency probe was last marked, and whether that mark is still to be recorded
+static volatile uint32_t Stamps[PROFILE_NB_PROBES];
+static volatile bool Pending[PROFILE_NB_PROBES];
+
+/*! @brief Clears a slot, with the minimum set so the first measurement replaces it.
+ *
+ *  @param slot is the slot to clear.
+ */
+static void ClearSlot(TProfileSlot* const slot)
+{
+  uint8_t bin;
+
+  slot->count = 0;
+  slot->min = 0xFFFFFFFF;
+  slot->max = 0;
+  slot->maxSeconds = 0;
+  slot->total = 0;
+
+  for (bin = 0; bin < PROFILE_NB_BINS; bin++)
+    slot->histogram[bin] = 0;
+}
+
+bool Profile_Init(void)
+{
+  uint8_t probe;
+
+  for (probe = 0; probe < PROFILE_NB_PROBES; probe++)
+  {
+    ClearSlot(&Slots[probe]);
+    Pending[probe] = false;
+  }
+
+  // The DWT is off until trace is enabled
+  DEMCR |= DEMCR_TRCENA_MASK;
+  DWT_CYCCNT = 0;
+  DWT_CTRL |= DWT_CTRL_CYCCNTENA_MASK;
+
+  return true;
+}
+
+void Profile_Record(const uint8_t probe, const uint32_t cycles)
+{
+  TProfileSlot* const slot = &Slots[probe];
+  int8_t bin;
+
+  slot->count++;
+  slot->total += cycles;
+
+  if (cycles < slot->min)
+    slot->min = cycles;
+
+  if (cycles > slot->max)
+  {
+    slot->max = cycles;
+    slot->maxSeconds = RTC_GetSeconds();
+  }
+
+  // One CLZ finds the bin
+  bin = 31 - __builtin_clz(cycles | 1) - PROFILE_FIRST_BIN_LOG2;
+
+  if (bin < 0)
+    bin = 0;
+  else if (bin >= PROFILE_NB_BINS)
+    bin = PROFILE_NB_BINS - 1;
+
+  slot->histogram[bin]++;
+}
+
+void Profile_Stamp(const uint8_t probe)
+{
+  if (Pending[probe])
+    return;
+
+  Stamps[probe] = DWT_CYCCNT;
+  Pending[probe] = true;
+}
+
+void Profile_Latency(const uint8_t probe)
+{
+  uint32_t now = DWT_CYCCNT;
+  uint32_t stamp;
+
+  if (!Pending[probe])
+    return;
+
+  // The interrupt runs at a higher priority, so the stamp is read before the next one is allowed
+  stamp = Stamps[probe];
+  Pending[probe] = false;
+
+  Profile_Record(probe, now - stamp);
+}
+
+bool Profile_Get(const uint8_t probe, TProfileStats* const stats)
+{
+  TProfileSlot slot;
+  uint8_t bin;
+
+  if (probe >= PROFILE_NB_PROBES)
+    return false;
+
+  // Take a copy, since the probes are recorded from interrupts and higher priority threads
+  OS_DisableInterrupts();
+  slot = Slots[probe];
+  OS_EnableInterrupts();
+
+  stats->count = slot.count;
+  stats->min = slot.count ? slot.min : 0;
+  stats->max = slot.max;
+  stats->mean = slot.count ? (uint32_t) (slot.total / slot.count) : 0;
+  stats->maxSeconds = slot.maxSeconds;
+
+  for (bin = 0; bin < PROFILE_NB_BINS; bin++)
+    stats->histogram[bin] = slot.histogram[bin];
+
+  return true;
+}
+
+bool Profile_Reset(const uint8_t probe)
+{
+  if (probe >= PROFILE_NB_PROBES)
+    return false;
+
+  OS_DisableInterrupts();
+  ClearSlot(&Slots[probe]);
+  OS_EnableInterrupts();
+
+  return true;
+}
+
+#endif
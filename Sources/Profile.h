@@ -0,0 +1,123 @@
+/*! @file Profile.h
+ *
+ *  @brief Cycle-count profiler for the DEM
+ *
+ *  This contains the probes that time the hot paths with the DWT cycle counter, keeping the count, minimum, maximum,
+ *  mean and a log2 histogram of the cycles taken by each probe. Latency probes time the hand-off from an interrupt
+ *  to the thread it signals instead. The probes only exist when PROFILE_ENABLE is defined for the build,
+ *  e.g. -DPROFILE_ENABLE; otherwise the PROFILE macros compile to nothing.
+ *
+ *  @author Rohan
+ *  @date 2019-11-24
+ */
+
+#ifndef SOURCES_PROFILE_H_
+#define SOURCES_PROFILE_H_
+
+// new types
+#include "types.h"
+
+#define PROFILE_PROBE_CALC 0          /*!< Processing of one sample by the calculation thread */
+#define PROFILE_PROBE_PIT 1           /*!< PIT callback taking the ADC samples */
+#define PROFILE_PROBE_UART 2          /*!< UART interrupt */
+#define PROFILE_PROBE_HMI 3           /*!< Rendering of the HMI state */
+#define PROFILE_PROBE_HARMONIC 4      /*!< FFT and analysis of one cycle */
+#define PROFILE_PROBE_PIT_LATENCY 5   /*!< From the PIT callback signalling a sample to the calculation thread taking it */
+#define PROFILE_PROBE_UART_LATENCY 6  /*!< From the UART interrupt signalling a byte to the receive thread taking it */
+#define PROFILE_PROBE_RTC_LATENCY 7   /*!< From the RTC interrupt signalling a second to the RTC thread taking it */
+#define PROFILE_NB_PROBES 8
+
+#define PROFILE_NB_BINS 16          /*!< Bin n counts from 2^(n + PROFILE_FIRST_BIN_LOG2) cycles up to twice that */
+#define PROFILE_FIRST_BIN_LOG2 4    /*!< The first bin also counts anything shorter, and the last anything longer */
+
+/*!
+ * @struct TProfileStats
+ *
+ * The cycles taken by a probe since it was last reset.
+ */
+typedef struct
+{
+  uint32_t count;                       /*!< Number of measurements */
+  uint32_t min;                         /*!< Fewest cycles taken */
+  uint32_t max;                         /*!< Most cycles taken */
+  uint32_t mean;                        /*!< Mean cycles taken */
+  uint32_t maxSeconds;                  /*!< RTC seconds when the most cycles were taken */
+  uint32_t histogram[PROFILE_NB_BINS];  /*!< Measurements in each log2 bin */
+} TProfileStats;
+
+#ifdef PROFILE_ENABLE
+
+// DWT cycle counter
+#include "MK70F12.h"
+
+/*! @brief Starts timing a probe; must be followed by PROFILE_END for the same probe in the same block.
+ *
+ *  The time includes any interrupts and higher priority threads that run before PROFILE_END.
+ */
+#define PROFILE_BEGIN(probe) const uint32_t profileStart##probe = DWT_CYCCNT
+
+/*! @brief Stops timing a probe and records the cycles taken.
+ */
+#define PROFILE_END(probe) Profile_Record((probe), DWT_CYCCNT - profileStart##probe)
+
+/*! @brief Marks an interrupt signalling a thread, for a latency probe.
+ */
+#define PROFILE_STAMP(probe) Profile_Stamp(probe)
+
+/*! @brief Records the latency since the interrupt marked the probe, once the signalled thread runs.
+ */
+#define PROFILE_LATENCY(probe) Profile_Latency(probe)
+
+#else
+
+#define PROFILE_BEGIN(probe)
+#define PROFILE_END(probe)
+#define PROFILE_STAMP(probe)
+#define PROFILE_LATENCY(probe)
+
+#endif
+
+/*! @brief Starts the DWT cycle counter and resets all the probes.
+ *
+ *  @return bool - TRUE if the profiler was initialized successfully.
+ */
+bool Profile_Init(void);
+
+/*! @brief Records a measurement of a probe.
+ *
+ *  @param probe is the PROFILE_PROBE measured.
+ *  @param cycles is the number of cycles taken.
+ *  @note Each probe must only be recorded from one thread or interrupt.
+ */
+void Profile_Record(const uint8_t probe, const uint32_t cycles);
+
+/*! @brief Marks the time an interrupt signals a thread.
+ *
+ *  Only the first signal the thread has not yet taken is marked, so a backlog shows as the latency of its oldest signal.
+ *  @param probe is the PROFILE_PROBE of the hand-off.
+ */
+void Profile_Stamp(const uint8_t probe);
+
+/*! @brief Records the cycles since the last mark of a probe, if it has not been recorded yet.
+ *
+ *  @param probe is the PROFILE_PROBE of the hand-off.
+ *  @note Called by the signalled thread once its wait returns.
+ */
+void Profile_Latency(const uint8_t probe);
+
+/*! @brief Gets the statistics of a probe.
+ *
+ *  @param probe is the PROFILE_PROBE to get.
+ *  @param stats is where the statistics are copied to.
+ *  @return bool - TRUE if the probe is valid.
+ */
+bool Profile_Get(const uint8_t probe, TProfileStats* const stats);
+
+/*! @brief Resets the statistics of a probe.
+ *
+ *  @param probe is the PROFILE_PROBE to reset.
+ *  @return bool - TRUE if the probe is valid.
+ */
+bool Profile_Reset(const uint8_t probe);
+
+#endif /* SOURCES_PROFILE_H_ */
@@ -10,15 +10,117 @@
 
 //Included header files
 #include "RTC.h"
+// Latency of the hand-off to the RTC thread
+#include "Profile.h"
+
+static void* UserArguments;			/*!< Private global pointer to the user arguments of the alarm callback function */
+static void (*UserFunction)(void* );		/*!< Private global pointer to the RTC alarm callback function */
+
+static volatile TRTCCalendar Calendar;		/*!< Calendar kept by the seconds interrupt */
+static volatile uint32_t CalendarSequence;	/*!< Odd while the calendar is being written */
+
+#define RTC_IRQ_MASK ((1 << 2) | (1 << 3))	/*!< NVIC bits of the alarm (IRQ 66) and seconds (IRQ 67) interrupts */
+
+/*! @brief Checks for a leap year.
+ *
+ *  @param year The year.
+ *  @return bool - TRUE if the year has 366 days.
+ */
+static bool IsLeapYear(const uint16_t year)
+{
+  return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
+
+/*! @brief Gets the number of days in a month.
+ *
+ *  @param year The year.
+ *  @param month The month (1-12).
+ *  @return uint8_t - the number of days in the month.
+ */
+static uint8_t DaysInMonth(const uint16_t year, const uint8_t month)
+{
+  static const uint8_t DAYS[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+  if (month == 2 && IsLeapYear(year))
+    return 29;
+
+  return DAYS[month - 1];
+}
+
+/*! @brief Advances the calendar by one second without any divisions.
+ *
+ *  @param calendar The calendar to advance.
+ */
+static void NextSecond(volatile TRTCCalendar* const calendar)
+{
+  calendar->epoch++;
+
+  if (++calendar->seconds < 60)
+    return;
+  calendar->seconds = 0;
+
+  if (++calendar->minutes < 60)
+    return;
+  calendar->minutes = 0;
+
+  if (++calendar->hours < 24)
+    return;
+  calendar->hours = 0;
+
+  calendar->days++;
+  calendar->dayOfYear++;
+
+  if (++calendar->weekday == 7)
+    calendar->weekday = 0;
+
+  if (++calendar->day <= DaysInMonth(calendar->year, calendar->month))
+    return;
+  calendar->day = 1;
+
+  if (++calendar->month <= 12)
+    return;
+  calendar->month = 1;
+
+  calendar->year++;
+  calendar->dayOfYear = 0;
+}
+
+/*! @brief Updates the calendar to a new RTC value, so readers see either the old or the new calendar.
+ *
+ *  @param seconds The new value of the RTC.
+ *  @note Must only be called from the seconds interrupt, or with the RTC interrupts disabled.
+ */
+static void PublishCalendar(const uint32_t seconds)
+{
+  TRTCCalendar calendar;
+
+  CalendarSequence++;
+
+  // The usual case is one second later, which only needs a few increments
+  if (seconds == Calendar.epoch + 1)
+    NextSecond(&Calendar);
+  else
+  {
+    RTC_ToCalendar(seconds, &calendar);
+    Calendar = calendar;
+  }
+
+  CalendarSequence++;
+}
 
 /*! @brief Initializes the RTC before first use.
  *
  *  Sets up the control register for the RTC and locks it.
  *  Enables the RTC and sets an interrupt every second.
+ *  @param userFunction is a pointer to a user callback function called by the alarm interrupt.
+ *  @param userArguments is a pointer to the user arguments to use with the user callback function.
  *  @return bool - TRUE if the RTC was successfully initialized.
  */
-bool RTC_Init()
+bool RTC_Init(void (*userFunction)(void*), void* userArguments)
 {
+  UserArguments = userArguments;
+  UserFunction = userFunction;
+
   //Enable clock gate for RTC
   SIM_SCGC6 |= SIM_SCGC6_RTC_MASK;
   
@@ -43,87 +145,221 @@ bool RTC_Init()
   //Enable the time seconds interrupt
   RTC_IER |= RTC_IER_TSIE_MASK;
 
+  //The alarm is not armed until RTC_SetAlarm is called
+  RTC_TAR = 0xFFFFFFFF;
+
+  //Enable the time alarm interrupt
+  RTC_IER |= RTC_IER_TAIE_MASK;
+
   RTC_SR |= RTC_SR_TCE_MASK;
 
   //Clear current pending interrupts on the RTC
-  NVICICPR2 |= NVIC_ICPR_CLRPEND(1 << 3);
+  NVICICPR2 |= NVIC_ICPR_CLRPEND(RTC_IRQ_MASK);
 
   //Enable interrupts
-  NVICISER2 |= NVIC_ISER_SETENA(1 << 3);
+  NVICISER2 |= NVIC_ISER_SETENA(RTC_IRQ_MASK);
 
   // Create Semaphore to be signaled by the ISR
   RTC_Semaphore = OS_SemaphoreCreate(0);
 
+  // Start the calendar at the epoch
+  PublishCalendar(0);
+
   return true;
 }
 
 /*! @brief Sets the value of the real time clock.
  *
+ *  @param days The desired number of days since the epoch.
  *  @param hours The desired value of the real time clock hours (0-23).
  *  @param minutes The desired value of the real time clock minutes (0-59).
  *  @param seconds The desired value of the real time clock seconds (0-59).
  *  @note Assumes that the RTC module has been initialized and all input parameters are in range.
  */
-void RTC_Set(const uint8_t days, const uint8_t hours, const uint8_t minutes, const uint8_t seconds)
+void RTC_Set(const uint32_t days, const uint8_t hours, const uint8_t minutes, const uint8_t seconds)
 {
-  //Disable the clock to write to it
-  RTC_SR &= ~(RTC_SR_TCE_MASK);
+  //Store the desired time in seconds
+  RTC_SetSeconds((days * 86400) + ((uint32_t) hours * 3600) + (minutes * 60) + seconds);
+}
 
-  //A variable to store the desired time in
-  uint32_t time = 0;
+/*! @brief Sets the value of the real time clock in seconds.
+ *
+ *  @param seconds The desired number of seconds since the epoch.
+ *  @note Assumes that the RTC module has been initialized.
+ */
+void RTC_SetSeconds(const uint32_t seconds)
+{
+  //Keep the RTC interrupts out while the time and the calendar change
+  NVICICER2 = NVIC_ICER_CLRENA(RTC_IRQ_MASK);
 
-  //Store the desired time in seconds
-  time = (days * 86400) + (hours * 3600) + (minutes * 60) + seconds;
+  //Disable the clock to write to it
+  RTC_SR &= ~(RTC_SR_TCE_MASK);
 
   //Set the time
-  RTC_TSR = time;
+  RTC_TSR = seconds;
 
   //Re-enable the clock to begin counting again
   RTC_SR |= RTC_SR_TCE_MASK;
+
+  PublishCalendar(seconds);
+
+  NVICISER2 = NVIC_ISER_SETENA(RTC_IRQ_MASK);
+
+  //The alarm was set against the old time, so let the alarm callback set it again
+  NVICISPR2 = NVIC_ISPR_SETPEND(1 << 2);
+}
+
+/*! @brief Sets the date of the real time clock, keeping the time of day.
+ *
+ *  @param year The desired year, from RTC_EPOCH_YEAR.
+ *  @param month The desired month (1-12).
+ *  @param day The desired day of the month (1-31).
+ *  @return bool - TRUE if the date is valid and was set.
+ *  @note Assumes that the RTC module has been initialized.
+ */
+bool RTC_SetDate(const uint16_t year, const uint8_t month, const uint8_t day)
+{
+  TRTCCalendar calendar;
+  uint32_t days = 0;
+  uint16_t y;
+  uint8_t m;
+
+  //The RTC holds up to 136 years of seconds
+  if (year < RTC_EPOCH_YEAR || year >= RTC_EPOCH_YEAR + 136 || month < 1 || month > 12 || day < 1 || day > DaysInMonth(year, month))
+    return false;
+
+  for (y = RTC_EPOCH_YEAR; y < year; y++)
+    days += IsLeapYear(y) ? 366 : 365;
+
+  for (m = 1; m < month; m++)
+    days += DaysInMonth(year, m);
+
+  days += day - 1;
+
+  //Keep the time of day
+  RTC_GetCalendar(&calendar);
+
+  RTC_SetSeconds(days * 86400 + calendar.epoch % 86400);
+
+  return true;
 }
 
 /*! @brief Gets the value of the real time clock.
  *
+ *  @param days The address of a variable to store the number of days since the epoch.
  *  @param hours The address of a variable to store the real time clock hours.
  *  @param minutes The address of a variable to store the real time clock minutes.
  *  @param seconds The address of a variable to store the real time clock seconds.
  *  @note Assumes that the RTC module has been initialized.
  */
-void RTC_Get(uint8_t* days, uint8_t* const hours, uint8_t* const minutes, uint8_t* const seconds)
+void RTC_Get(uint32_t* const days, uint8_t* const hours, uint8_t* const minutes, uint8_t* const seconds)
+{
+  TRTCCalendar calendar;
+
+  RTC_GetCalendar(&calendar);
+
+  *days = calendar.days;
+  *hours = calendar.hours;
+  *minutes = calendar.minutes;
+  *seconds = calendar.seconds;
+}
+
+/*! @brief Gets the value of the real time clock in seconds.
+ *
+ *  @return uint32_t - the number of seconds counted by the real time clock.
+ *  @note Assumes that the RTC module has been initialized.
+ */
+uint32_t RTC_GetSeconds(void)
 {
-  //Set time to the value of the time seconds register
   uint32_t time = RTC_TSR;
 
   //Check indefinitely until double read matches
   while (time != RTC_TSR)
     time = RTC_TSR;
-  
-  //Store days
-  *days = (time - (time % 86400)) / 86400;
 
-  //Remove days from time
-  time %= 86400;
+  return time;
+}
 
-  //Store hours 
-  *hours = (time - (time % 3600)) / 3600;
+/*! @brief Gets the calendar kept by the RTC interrupt.
+ *
+ *  This only copies the calendar, so it is cheap enough for the hot path.
+ *  @param calendar is where the calendar is copied to.
+ *  @note Assumes the RTC has been initialized. Must not be called from an interrupt that can preempt the RTC interrupts.
+ */
+void RTC_GetCalendar(TRTCCalendar* const calendar)
+{
+  uint32_t sequence;
 
-  //Remove hours from time
-  time %= 3600;
+  //Copy again if the calendar was written while it was being copied
+  do
+  {
+    sequence = CalendarSequence;
+    *calendar = Calendar;
+  } while ((sequence & 1) || sequence != CalendarSequence);
+}
 
-  //Store minutes
-  *minutes = (time - (time % 60)) / 60;
+/*! @brief Breaks a number of seconds since the epoch down into a calendar.
+ *
+ *  @param seconds The number of seconds since the epoch.
+ *  @param calendar is where the calendar is stored.
+ */
+void RTC_ToCalendar(const uint32_t seconds, TRTCCalendar* const calendar)
+{
+  uint32_t days = seconds / 86400;
+  uint32_t time = seconds % 86400;
+  uint16_t daysInYear;
+  uint8_t daysInMonth;
+
+  calendar->epoch = seconds;
+  calendar->days = days;
+  calendar->weekday = (days + RTC_EPOCH_WEEKDAY) % 7;
+
+  calendar->hours = time / 3600;
+  calendar->minutes = (time % 3600) / 60;
+  calendar->seconds = time % 60;
+
+  //Count off whole years, then whole months
+  calendar->year = RTC_EPOCH_YEAR;
+  daysInYear = 365 + IsLeapYear(calendar->year);
+
+  while (days >= daysInYear)
+  {
+    days -= daysInYear;
+    calendar->year++;
+    daysInYear = 365 + IsLeapYear(calendar->year);
+  }
+
+  calendar->dayOfYear = days;
+
+  calendar->month = 1;
+  daysInMonth = DaysInMonth(calendar->year, calendar->month);
 
-  //Remove minutes from time
-  time %= 60;
+  while (days >= daysInMonth)
+  {
+    days -= daysInMonth;
+    calendar->month++;
+    daysInMonth = DaysInMonth(calendar->year, calendar->month);
+  }
 
-  //The remainder is in seconds
-  *seconds = time;
+  calendar->day = days + 1;
+}
+
+/*! @brief Sets the time of the alarm.
+ *
+ *  @param seconds is the RTC time in seconds at which the alarm interrupt occurs.
+ *  @note Setting the time also causes an alarm interrupt, so the alarm can be set again against the new time.
+ */
+void RTC_SetAlarm(const uint32_t seconds)
+{
+  //The alarm flag is set when the seconds register increments past the alarm register
+  //Writing the alarm register also clears the flag
+  RTC_TAR = seconds - 1;
 }
 
 /*! @brief Interrupt service routine for the RTC.
  *
  *  The RTC has incremented one second.
- *  The user callback function will be called.
+ *  The calendar is advanced and the RTC semaphore is signaled.
  *  @note Assumes the RTC has been initialized.
  */
 void __attribute__ ((interrupt)) RTC_ISR(void)
@@ -132,6 +368,10 @@ void __attribute__ ((interrupt)) RTC_ISR(void)
 
   OS_ERROR error;
 
+  PublishCalendar(RTC_GetSeconds());
+
+  PROFILE_STAMP(PROFILE_PROBE_RTC_LATENCY);
+
   error = OS_SemaphoreSignal(RTC_Semaphore);
 
   if (error)
@@ -139,3 +379,22 @@ void __attribute__ ((interrupt)) RTC_ISR(void)
 
   OS_ISRExit();
 }
+
+/*! @brief Interrupt service routine for the RTC alarm.
+ *
+ *  The RTC has reached the alarm time, or the time has been set.
+ *  The user callback function will be called.
+ *  @note Assumes the RTC has been initialized.
+ */
+void __attribute__ ((interrupt)) RTC_AlarmISR(void)
+{
+  OS_ISREnter();
+
+  //Clear the alarm flag by writing the alarm register
+  RTC_TAR = RTC_TAR;
+
+  if (UserFunction)	// Null Check
+    (*UserFunction) (UserArguments);
+
+  OS_ISRExit();
+}
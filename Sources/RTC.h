@@ -27,40 +27,120 @@
 
 extern OS_ECB *RTC_Semaphore;	/*! Binary Semaphore for updating the RTC clock */
 
+#define RTC_EPOCH_YEAR 2000	/*!< The RTC counts seconds from 00:00:00 on the 1st of January of this year */
+#define RTC_EPOCH_WEEKDAY 5	/*!< Day of the week of the epoch; the 1st of January 2000 was a Saturday */
+
+/*!
+ * @struct TRTCCalendar
+ *
+ * The time of the RTC broken down into a date and a time of day.
+ */
+typedef struct
+{
+  uint32_t epoch;	/*!< Seconds since the epoch, the value of the RTC */
+  uint32_t days;	/*!< Days since the epoch */
+  uint16_t year;	/*!< Year, from RTC_EPOCH_YEAR */
+  uint16_t dayOfYear;	/*!< Day of the year (0-365) */
+  uint8_t month;	/*!< Month (1-12) */
+  uint8_t day;		/*!< Day of the month (1-31) */
+  uint8_t weekday;	/*!< Day of the week (0-6), Monday first */
+  uint8_t hours;	/*!< Hours (0-23) */
+  uint8_t minutes;	/*!< Minutes (0-59) */
+  uint8_t seconds;	/*!< Seconds (0-59) */
+} TRTCCalendar;
+
 /*! @brief Initializes the RTC before first use.
  *
  *  Sets up the control register for the RTC and locks it.
  *  Enables the RTC and sets an interrupt every second.
+ *  @param userFunction is a pointer to a user callback function called by the alarm interrupt.
+ *  @param userArguments is a pointer to the user arguments to use with the user callback function.
  *  @return bool - TRUE if the RTC was successfully initialized.
  */
-bool RTC_Init();
+bool RTC_Init(void (*userFunction)(void*), void* userArguments);
 
 /*! @brief Sets the value of the real time clock.
  *
+ *  @param days The desired number of days since the epoch.
  *  @param hours The desired value of the real time clock hours (0-23).
  *  @param minutes The desired value of the real time clock minutes (0-59).
  *  @param seconds The desired value of the real time clock seconds (0-59).
  *  @note Assumes that the RTC module has been initialized and all input parameters are in range.
  */
-void RTC_Set(const uint8_t days, const uint8_t hours, const uint8_t minutes, const uint8_t seconds);
+void RTC_Set(const uint32_t days, const uint8_t hours, const uint8_t minutes, const uint8_t seconds);
+
+/*! @brief Sets the value of the real time clock in seconds.
+ *
+ *  @param seconds The desired number of seconds since the epoch.
+ *  @note Assumes that the RTC module has been initialized.
+ */
+void RTC_SetSeconds(const uint32_t seconds);
+
+/*! @brief Sets the date of the real time clock, keeping the time of day.
+ *
+ *  @param year The desired year, from RTC_EPOCH_YEAR.
+ *  @param month The desired month (1-12).
+ *  @param day The desired day of the month (1-31).
+ *  @return bool - TRUE if the date is valid and was set.
+ *  @note Assumes that the RTC module has been initialized.
+ */
+bool RTC_SetDate(const uint16_t year, const uint8_t month, const uint8_t day);
 
 /*! @brief Gets the value of the real time clock.
  *
+ *  @param days The address of a variable to store the number of days since the epoch.
  *  @param hours The address of a variable to store the real time clock hours.
  *  @param minutes The address of a variable to store the real time clock minutes.
  *  @param seconds The address of a variable to store the real time clock seconds.
  *  @note Assumes that the RTC module has been initialized.
  */
-void RTC_Get(uint8_t* days, uint8_t* const hours, uint8_t* const minutes, uint8_t* const seconds);
+void RTC_Get(uint32_t* const days, uint8_t* const hours, uint8_t* const minutes, uint8_t* const seconds);
+
+/*! @brief Gets the value of the real time clock in seconds.
+ *
+ *  @return uint32_t - the number of seconds counted by the real time clock.
+ *  @note Assumes that the RTC module has been initialized.
+ */
+uint32_t RTC_GetSeconds(void);
+
+/*! @brief Gets the calendar kept by the RTC interrupt.
+ *
+ *  This only copies the calendar, so it is cheap enough for the hot path.
+ *  @param calendar is where the calendar is copied to.
+ *  @note Assumes the RTC has been initialized. Must not be called from an interrupt that can preempt the RTC interrupts.
+ */
+void RTC_GetCalendar(TRTCCalendar* const calendar);
+
+/*! @brief Breaks a number of seconds since the epoch down into a calendar.
+ *
+ *  @param seconds The number of seconds since the epoch.
+ *  @param calendar is where the calendar is stored.
+ */
+void RTC_ToCalendar(const uint32_t seconds, TRTCCalendar* const calendar);
+
+/*! @brief Sets the time of the alarm.
+ *
+ *  @param seconds is the RTC time in seconds at which the alarm interrupt occurs.
+ *  @note Setting the time also causes an alarm interrupt, so the alarm can be set again against the new time.
+ */
+void RTC_SetAlarm(const uint32_t seconds);
 
 /*! @brief Interrupt service routine for the RTC.
  *
  *  The RTC has incremented one second.
- *  The user callback function will be called.
+ *  The calendar is advanced and the RTC semaphore is signaled.
  *  @note Assumes the RTC has been initialized.
  */
 void __attribute__ ((interrupt)) RTC_ISR(void);
 
+/*! @brief Interrupt service routine for the RTC alarm.
+ *
+ *  The RTC has reached the alarm time, or the time has been set.
+ *  The user callback function will be called.
+ *  @note Assumes the RTC has been initialized.
+ */
+void __attribute__ ((interrupt)) RTC_AlarmISR(void);
+
 #endif
 
 /*!
@@ -0,0 +1,270 @@
+/*! @file SelfTest.c
+ *
+ *  @brief Metering arithmetic self-test for the DEM
+ *
+ *  This contains the routines to check the 32Q16 arithmetic the bill rests on against stored vectors: the FixedPoint
+ *  routines one by one, whole cycles of ADC samples taken through the scaling, RMS, power, energy, Wh carry and cost
+ *  carry steps of the calculation thread, and the conversion of a cycle length to a frequency. Each step is the one
+ *  the metering code itself calls, with a unity gain trim. The expected values are bit-exact, from
+ *  Tools/golden_model.py, so any change to the arithmetic that changes a result fails the self-test until the vectors
+ *  are made again. The cycles taken are kept too, so a change that slows the arithmetic is seen with one that
+ *  changes it.
+ *
+ *  @author Rohan
+ *  @date 2019-11-26
+ */
+
+#include "SelfTest.h"
+// Calculations and the fixed-point routines under test
+#include "Calc.h"
+// DWT cycle counter
+#include "MK70F12.h"
+
+#define SELFTEST_MULTIPLY        0
+#define SELFTEST_MULTIPLY_U      1
+#define SELFTEST_DIVIDE          2
+#define SELFTEST_DIVIDE_U        3
+#define SELFTEST_SQUARE_ROOT     4
+#define SELFTEST_SQUARE_ROOT_U64 5
+
+#define SQUARE_ROOT_ITERATIONS 15       /*!< For the FixedPoint_SquareRoot vectors */
+#define FIRST_ROOT (1 << 16)            /*!< The guess of the first cycle, for which Calc_RootMeanSquare iterates 15 times */
+#define SAMPLE_PERIOD_NS 1250000        /*!< 16 samples of a 50 Hz cycle */
+#define RATE 1671168                    /*!< 25.5 cents/kWh, 32Q16, the rate the cycles are billed at */
+#define NB_CARRY_CYCLES 3600            /*!< Cycles of energy carried into Wh */
+#define NB_COST_CYCLES 36000            /*!< Cycles of imported energy billed, enough to carry whole cents */
+
+/*!
+ * @struct TSelfTestPrimitive
+ */
+typedef struct
+{
+  uint8_t operation;
+  int32_t a;            /*!< First operand, or the high word of a 64-bit radicand */
+  int32_t b;            /*!< Second operand, the first guess of a square root, or the low word of a 64-bit radicand */
+  int32_t expected;
+} TSelfTestPrimitive;
+
+/*!
+ * @struct TSelfTestCycle
+ */
+typedef struct
+{
+  int16_t voltage[SELFTEST_NB_SAMPLES];    /*!< ADC counts of the voltage */
+  int16_t current[SELFTEST_NB_SAMPLES];    /*!< ADC counts of the current */
+  int32_t vrms;                            /*!< V 32Q16 */
+  int32_t irms;                            /*!< A 32Q16 */
+  int32_t power;                           /*!< Average power, W 32Q16 */
+  int64_t energy;                          /*!< Energy of the cycle, Ws 64Q16 */
+  uint32_t wh;                             /*!< Wh carried after NB_CARRY_CYCLES cycles */
+  uint64_t remainder;                      /*!< Ws 64Q16 left to carry after NB_CARRY_CYCLES cycles */
+  uint32_t cents;                          /*!< Cents carried after NB_COST_CYCLES cycles billed at RATE */
+  uint64_t costRemainder;                  /*!< Cost left to carry after NB_COST_CYCLES cycles, 64Q32 */
+} TSelfTestCycle;
+
+/*!
+ * @struct TSelfTestFrequency
+ */
+typedef struct
+{
+  uint32_t cycleNs;                        /*!< Length of the cycle in ns */
+  uint32_t frequency;                      /*!< Hz x 10 */
+} TSelfTestFrequency;
+
+// Made by Tools/golden_model.py --c
+static const TSelfTestPrimitive Primitives[] =
+{
+  { SELFTEST_MULTIPLY, 196608, 327680, 983040 },
+  { SELFTEST_MULTIPLY, -196608, 327680, -983040 },
+  { SELFTEST_MULTIPLY, -32768, 1, -1 },
+  { SELFTEST_MULTIPLY, 2147483647, 65536, 2147483647 },
+  { SELFTEST_MULTIPLY, 1540096, -1540096, -36192256 },
+  { SELFTEST_MULTIPLY_U, (int32_t) 0xFFFFFFFF, 32768, 2147483647 },
+  { SELFTEST_MULTIPLY_U, 15073280, 196608, 45219840 },
+  { SELFTEST_DIVIDE, 65536, 196608, 21845 },
+  { SELFTEST_DIVIDE, -65536, 196608, -21845 },
+  { SELFTEST_DIVIDE, 21299200, -655360, -2129920 },
+  { SELFTEST_DIVIDE, 7, 65536, 7 },
+  { SELFTEST_DIVIDE_U, (int32_t) 0xFFFFFFFF, 2147483647, 131072 },
+  { SELFTEST_DIVIDE_U, 65536000, 196608, 21845333 },
+  { SELFTEST_SQUARE_ROOT, 34668544, 65536, 1507328 },
+  { SELFTEST_SQUARE_ROOT, 131072, 65536, 92681 },
+  { SELFTEST_SQUARE_ROOT, 163840000, 3276800, 3276800 },
+  { SELFTEST_SQUARE_ROOT_U64, 0, 2, 1 },
+  { SELFTEST_SQUARE_ROOT_U64, 225, 0, 983040 },
+  { SELFTEST_SQUARE_ROOT_U64, 65535, (int32_t) 0xFFFFFFFF, 16777215 },
+  { SELFTEST_SQUARE_ROOT_U64, 1073741823, (int32_t) 0xFFFFFFFF, 2147483647 },
+};
+
+static const TSelfTestCycle Cycles[] =
+{
+  // 230 V, 5 A, unity
+  {
+    { 0, 4079, 7536, 9847, 10658, 9847, 7536, 4079, 0, -4079, -7536, -9847, -10658, -9847, -7536, -4079 },
+    { 0, 8867, 16384, 21406, 23170, 21406, 16384, 8867, 0, -8867, -16384, -21406, -23170, -21406, -16384, -8867 },
+    15073260, 327683, 75367217, 1507344LL, 23, 57600ULL, 5, 13375490752512000ULL
+  },
+  // 240 V, 3 A, lagging 60
+  {
+    { 0, 4256, 7864, 10275, 11121, 10275, 7864, 4256, 0, -4256, -7864, -10275, -11121, -10275, -7864, -4256 },
+    { -12039, -8463, -3598, 1815, 6951, 11029, 13428, 13783, 12039, 8463, 3598, -1815, -6951, -11029, -13428, -13783 },
+    15728470, 196606, 23593006, 471860LL, 7, 47188800ULL, 1, 12926181703680000ULL
+  },
+  // 207 V sag, 2 A, exporting
+  {
+    { 0, 3671, 6783, 8862, 9592, 8862, 6783, 3671, 0, -3671, -6783, -8862, -9592, -8862, -6783, -3671 },
+    { 0, -3547, -6553, -8562, -9268, -8562, -6553, -3547, 0, 3547, 6553, 8562, 9268, 8562, 6553, 3547 },
+    13565940, 131068, -27131140, -542623LL, 8, 66006000ULL, 0, 0ULL
+  },
+  // 253 V swell, 4 A, 30% 3rd harmonic
+  {
+    { 0, 4487, 8290, 10831, 11724, 10831, 8290, 4487, 0, -4487, -8290, -10831, -11724, -10831, -8290, -4487 },
+    { 0, 11715, 16320, 14364, 12428, 14364, 16320, 11715, 0, -11715, -16320, -14364, -12428, -14364, -16320, -11715 },
+    16580420, 262140, 63524252, 1270485LL, 19, 91083600ULL, 4, 14587450490880000ULL
+  },
+};
+
+static const TSelfTestFrequency Frequencies[] =
+{
+  { 20000000, 500 },
+  { 16666667, 600 },
+  { 22222222, 450 },
+  { 15384615, 650 },
+  { 19999999, 500 },
+  { 20000001, 500 },
+  { 21052631, 475 },
+};
+
+#define NB_PRIMITIVES (sizeof(Primitives) / sizeof(Primitives[0]))
+#define NB_CYCLES (sizeof(Cycles) / sizeof(Cycles[0]))
+#define NB_FREQUENCIES (sizeof(Frequencies) / sizeof(Frequencies[0]))
+
+static TSelfTestResult Result = { 0, 0, SELFTEST_NONE, 0, 0, 0 };
+
+/*! @brief Counts a check, and notes it if it failed.
+ *
+ *  @param result is the result being built up.
+ *  @param passed tells whether the check passed.
+ */
+static void Check(TSelfTestResult* const result, const bool passed)
+{
+  if (!passed)
+  {
+    if (result->failures == 0)
+      result->firstFailure = result->tests;
+
+    result->failures++;
+  }
+
+  result->tests++;
+}
+
+/*! @brief Works out one FixedPoint vector.
+ *
+ *  @param vector is the vector.
+ *  @return int32_t - the result of the routine.
+ */
+static int32_t Primitive(const TSelfTestPrimitive* const vector)
+{
+  switch (vector->operation)
+  {
+    case SELFTEST_MULTIPLY:
+      return FixedPoint_Multiply(vector->a, vector->b);
+
+    case SELFTEST_MULTIPLY_U:
+      return (int32_t) FixedPoint_MultiplyU((uint32_t) vector->a, vector->b);
+
+    case SELFTEST_DIVIDE:
+      return FixedPoint_Divide(vector->a, vector->b);
+
+    case SELFTEST_DIVIDE_U:
+      return (int32_t) FixedPoint_DivideU((uint32_t) vector->a, (uint32_t) vector->b);
+
+    case SELFTEST_SQUARE_ROOT:
+      return FixedPoint_SquareRoot(vector->a, vector->b, SQUARE_ROOT_ITERATIONS);
+
+    default:
+      return (int32_t) FixedPoint_SquareRootU64(((uint64_t) (uint32_t) vector->a << 32) | (uint32_t) vector->b);
+  }
+}
+
+/*! @brief Takes one cycle vector through the arithmetic of the calculation thread, and checks each result.
+ *
+ *  @param vector is the vector.
+ *  @param result is the result being built up.
+ */
+static void Cycle(const TSelfTestCycle* const vector, TSelfTestResult* const result)
+{
+  int64_t sumSquaredVolts = 0, sumSquaredCurrents = 0, sumPower = 0;
+  int32_t voltage, current, power;
+  uint32_t vrms, irms;
+  int64_t energy;
+  uint64_t wh = 0, remainder = 0, cents = 0, costRemainder = 0, cost;
+  uint16_t n;
+
+  for (n = 0; n < SELFTEST_NB_SAMPLES; n++)
+  {
+    voltage = Conditioning_ScaleNominal(CONDITIONING_CHANNEL_VOLTAGE,
+                                        (int32_t) vector->voltage[n] << CONDITIONING_INPUT_FRACTION_BITS);
+    current = Conditioning_ScaleNominal(CONDITIONING_CHANNEL_CURRENT,
+                                        (int32_t) vector->current[n] << CONDITIONING_INPUT_FRACTION_BITS);
+
+    sumSquaredVolts += Calc_VoltageSquared(voltage);
+    sumSquaredCurrents += Calc_CurrentSquared(current);
+    sumPower += FixedPoint_Multiply(voltage, current);
+  }
+
+  vrms = Calc_VrmsFromRoot(Calc_RootMeanSquare(sumSquaredVolts, SELFTEST_NB_SAMPLES, FIRST_ROOT));
+  irms = Calc_IrmsFromRoot(Calc_RootMeanSquare(sumSquaredCurrents, SELFTEST_NB_SAMPLES, FIRST_ROOT));
+  power = Calc_CycleMean(sumPower, SELFTEST_NB_SAMPLES);
+  energy = Calc_CycleEnergy(sumPower, SAMPLE_PERIOD_NS);
+
+  for (n = 0; n < NB_CARRY_CYCLES; n++)
+    (void) FixedPoint_AccumulateCarry(&wh, &remainder, (uint64_t) ((energy < 0) ? -energy : energy), TARIFF_WS_PER_WH);
+
+  // Only the imported energy is billed
+  cost = Calc_CycleCost(RATE, (uint64_t) ((energy > 0) ? energy : 0));
+
+  for (n = 0; n < NB_COST_CYCLES; n++)
+    (void) FixedPoint_AccumulateCarry(&cents, &costRemainder, cost, TARIFF_COST_PER_CENT);
+
+  Check(result, (int32_t) vrms == vector->vrms);
+  Check(result, (int32_t) irms == vector->irms);
+  Check(result, power == vector->power);
+  Check(result, energy == vector->energy);
+  Check(result, wh == vector->wh && remainder == vector->remainder);
+  Check(result, cents == vector->cents && costRemainder == vector->costRemainder);
+}
+
+bool SelfTest_Run(void)
+{
+  TSelfTestResult result = { 0, 0, SELFTEST_NONE, 0, 0, 0 };
+  uint32_t start;
+  uint8_t index;
+
+  start = DWT_CYCCNT;
+
+  for (index = 0; index < NB_PRIMITIVES; index++)
+    Check(&result, Primitive(&Primitives[index]) == Primitives[index].expected);
+
+  result.primitiveCycles = DWT_CYCCNT - start;
+
+  start = DWT_CYCCNT;
+
+  for (index = 0; index < NB_CYCLES; index++)
+    Cycle(&Cycles[index], &result);
+
+  for (index = 0; index < NB_FREQUENCIES; index++)
+    Check(&result, Frequency_Times10FromCycle(Frequencies[index].cycleNs) == Frequencies[index].frequency);
+
+  result.cycleCycles = DWT_CYCCNT - start;
+
+  Result = result;
+
+  return (result.failures == 0);
+}
+
+void SelfTest_GetResult(TSelfTestResult* const result)
+{
+  *result = Result;
+}
@@ -0,0 +1,54 @@
+/*! @file SelfTest.h
+ *
+ *  @brief Metering arithmetic self-test for the DEM
+ *
+ *  This contains the routines to check the 32Q16 arithmetic the bill rests on against stored vectors: the FixedPoint
+ *  routines one by one, whole cycles of ADC samples taken through the scaling, RMS, power, energy, Wh carry and cost
+ *  carry steps of the calculation thread, and the conversion of a cycle length to a frequency. Each step is the one
+ *  the metering code itself calls, with a unity gain trim. The expected values are bit-exact, from
+ *  Tools/golden_model.py, so any change to the arithmetic that changes a result fails the self-test until the vectors
+ *  are made again. The cycles taken are kept too, so a change that slows the arithmetic is seen with one that
+ *  changes it.
+ *
+ *  @author Rohan
+ *  @date 2019-11-26
+ */
+
+#ifndef SOURCES_SELFTEST_H_
+#define SOURCES_SELFTEST_H_
+
+// new types
+#include "types.h"
+
+#define SELFTEST_NB_SAMPLES_LOG2 4                        /*!< Log2 of the samples in each cycle vector */
+#define SELFTEST_NB_SAMPLES (1 << SELFTEST_NB_SAMPLES_LOG2)
+#define SELFTEST_NONE 0xFFFF                              /*!< No test has failed */
+
+/*!
+ * @struct TSelfTestResult
+ */
+typedef struct
+{
+  uint16_t tests;              /*!< Number of checks made */
+  uint16_t failures;           /*!< Number of checks that failed */
+  uint16_t firstFailure;       /*!< Number of the first check to fail, or SELFTEST_NONE */
+  uint16_t reserved;
+  uint32_t primitiveCycles;    /*!< CPU cycles taken by the FixedPoint vectors */
+  uint32_t cycleCycles;        /*!< CPU cycles taken by the cycle and frequency vectors */
+} TSelfTestResult;
+
+/*! @brief Runs the self-test and keeps the result.
+ *
+ *  @return bool - TRUE if every check passed.
+ *  @note Uses the nominal gains of Conditioning, so it must be called after Calc_Init. It changes none of the meter's
+ *  measurements, so it can be run while the meter runs; it is run from the packet thread, which also reads the result.
+ */
+bool SelfTest_Run(void);
+
+/*! @brief Gets the result of the last self-test.
+ *
+ *  @param result is where the result is copied to.
+ */
+void SelfTest_GetResult(TSelfTestResult* const result);
+
+#endif /* SOURCES_SELFTEST_H_ */
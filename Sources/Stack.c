@@ -0,0 +1,74 @@
+/*! @file Stack.c
+ *
+ *  @brief Thread stack usage for the DEM
+ *
+ *  This contains the routines to paint each thread stack with a known pattern when the thread is created,
+ *  and to find the high-water mark of a stack later from how much of the pattern is left.
+ *
+ *  @author Rohan
+ *  @date 2019-11-24
+ */
+
+#include "Stack.h"
+
+/*!
+ * @struct TStackEntry
+ */
+typedef struct
+{
+  const uint32_t* stack;
+  uint16_t sizeWords;
+  uint8_t priority;
+} TStackEntry;
+
+static TStackEntry Stacks[STACK_MAX_THREADS];
+static uint8_t NbStacks = 0;
+
+OS_ERROR Stack_ThreadCreate(void (*thread)(void* pd), void* pData, uint32_t* const stack, const uint16_t sizeWords, const uint8_t priority)
+{
+  OS_ERROR error;
+  uint16_t index;
+
+  // Paint before the OS puts the first frame at the top
+  for (index = 0; index < sizeWords; index++)
+    stack[index] = STACK_PAINT;
+
+  error = OS_ThreadCreate(thread, pData, &stack[sizeWords - 1], priority);
+
+  if (error == OS_NO_ERROR && NbStacks < STACK_MAX_THREADS)
+  {
+    Stacks[NbStacks].stack = stack;
+    Stacks[NbStacks].sizeWords = sizeWords;
+    Stacks[NbStacks].priority = priority;
+    NbStacks++;
+  }
+
+  return error;
+}
+
+bool Stack_GetUsage(const uint8_t priority, TStackUsage* const usage)
+{
+  const TStackEntry* entry;
+  uint8_t entryNb;
+  uint16_t untouched;
+
+  for (entryNb = 0; entryNb < NbStacks; entryNb++)
+  {
+    entry = &Stacks[entryNb];
+
+    if (entry->priority != priority)
+      continue;
+
+    // The stack grows down, so the paint left at the bottom has never been used
+    for (untouched = 0; untouched < entry->sizeWords && entry->stack[untouched] == STACK_PAINT; untouched++);
+
+    usage->priority = priority;
+    usage->reserved = 0;
+    usage->sizeWords = entry->sizeWords;
+    usage->usedWords = entry->sizeWords - untouched;
+
+    return true;
+  }
+
+  return false;
+}
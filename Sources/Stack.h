@@ -0,0 +1,55 @@
+/*! @file Stack.h
+ *
+ *  @brief Thread stack usage for the DEM
+ *
+ *  This contains the routines to paint each thread stack with a known pattern when the thread is created,
+ *  and to find the high-water mark of a stack later from how much of the pattern is left.
+ *
+ *  @author Rohan
+ *  @date 2019-11-24
+ */
+
+#ifndef SOURCES_STACK_H_
+#define SOURCES_STACK_H_
+
+// new types
+#include "types.h"
+// RTOS
+#include "OS.h"
+
+#define STACK_PAINT 0xDEADBEEFu    /*!< Pattern the unused words of a stack keep */
+#define STACK_MAX_THREADS 8        /*!< Threads whose stacks can be tracked */
+
+/*!
+ * @struct TStackUsage
+ */
+typedef struct
+{
+  uint8_t priority;       /*!< Priority of the thread */
+  uint8_t reserved;
+  uint16_t sizeWords;     /*!< Size of the stack in words */
+  uint16_t usedWords;     /*!< Most words of the stack used so far */
+} TStackUsage;
+
+/*! @brief Paints a thread stack and creates the thread on it.
+ *
+ *  @param thread is the thread's code.
+ *  @param pData is passed to the thread when it is created.
+ *  @param stack is the lowest word of the stack.
+ *  @param sizeWords is the size of the stack in words.
+ *  @param priority is the priority of the thread.
+ *  @return OS_ERROR - the error from OS_ThreadCreate.
+ *  @note Must not be called on the stack of a running thread. The stack is only tracked if there is room
+ *        for it in STACK_MAX_THREADS.
+ */
+OS_ERROR Stack_ThreadCreate(void (*thread)(void* pd), void* pData, uint32_t* const stack, const uint16_t sizeWords, const uint8_t priority);
+
+/*! @brief Gets the high-water mark of a thread stack.
+ *
+ *  @param priority is the priority of the thread.
+ *  @param usage is where the usage is stored.
+ *  @return bool - TRUE if the stack of a thread at that priority is tracked.
+ */
+bool Stack_GetUsage(const uint8_t priority, TStackUsage* const usage);
+
+#endif /* SOURCES_STACK_H_ */
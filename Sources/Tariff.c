@@ -0,0 +1,318 @@
+/*! @file Tariff.c
+ *
+ *  @brief Time-of-use tariff engine for the DEM
+ *
+ *  This contains the tariff schedule, which maps every half hour of the week to a rate, with holiday and
+ *  season overrides. The schedule is kept in the Flash and uploaded by the PC into a staging copy.
+ *  The active rate is cached and only recomputed by the RTC alarm at a schedule boundary.
+ *  Each rate has its own energy and cost registers.
+ *
+ *  @author Rohan
+ *  @date 2019-11-16
+ */
+
+#include "Tariff.h"
+
+#define TARIFF_SCHEDULE_VERSION 1
+
+// Rates of the default schedule
+#define RATE_PEAK     0
+#define RATE_SHOULDER 1
+#define RATE_OFF_PEAK 2
+#define RATE_FLAT_2   (TARIFF_NB_RATES - 2)   // billed in tariff mode 2
+#define RATE_FLAT_3   (TARIFF_NB_RATES - 1)   // billed in tariff mode 3
+
+// Schedule in the Flash, the active copy read by the alarm interrupt, and the copy being uploaded by the PC
+static volatile TTariffSchedule *NvSchedule;
+static TTariffSchedule Schedule;
+static TTariffSchedule Staging;
+
+static uint8_t TariffMode;
+static volatile uint8_t ActiveRate;
+
+// Energy and cost registers of each rate
+static TTariffRegister TariffChart[TARIFF_NB_RATES];
+
+/*! @brief Fills in the default schedule: peak 14:00-20:00, shoulder 07:00-14:00 and 20:00-22:00, off peak otherwise.
+ *
+ *  @param schedule is the schedule to fill in.
+ */
+static void DefaultSchedule(TTariffSchedule* const schedule)
+{
+  // The tariff rates are stored in 32Q16
+  /*   Peak  | Shoulder | Off Peak | Mode 2 | Mode 3
+   *  22.235 |   4.400  |  2.109   | 1.713  | 4.100
+   */
+  static const uint32_t DEFAULT_RATES[TARIFF_NB_RATES] = { 1457193, 288350, 138216, 112264, 268698 };
+
+  uint8_t day, slot, rate, season;
+
+  for (rate = 0; rate < TARIFF_NB_RATES; rate++)
+    schedule->rates[rate] = DEFAULT_RATES[rate];
+
+  for (slot = 0; slot < TARIFF_NB_SLOTS; slot++)
+  {
+    // Each period starts on the hour and ends where the next one starts
+    if (slot >= 14 * 2 && slot < 20 * 2)
+      rate = RATE_PEAK;
+    else if ((slot >= 7 * 2 && slot < 14 * 2) || (slot >= 20 * 2 && slot < 22 * 2))
+      rate = RATE_SHOULDER;
+    else
+      rate = RATE_OFF_PEAK;
+
+    for (day = 0; day < TARIFF_NB_DAYS; day++)
+      schedule->week[day][slot] = rate;
+
+    schedule->holiday[slot] = RATE_OFF_PEAK;
+  }
+
+  for (day = 0; day < TARIFF_NB_HOLIDAYS; day++)
+    schedule->holidays[day] = TARIFF_NO_DAY;
+
+  for (season = 0; season < TARIFF_NB_SEASONS; season++)
+  {
+    schedule->seasonStart[season] = TARIFF_NO_DAY;
+
+    for (rate = 0; rate < TARIFF_NB_RATES; rate++)
+      schedule->seasonRates[season][rate] = rate;
+  }
+}
+
+/*! @brief Finds the season a day falls in.
+ *
+ *  @param dayOfYear is the day of the year.
+ *  @return uint8_t - the season, or TARIFF_NB_SEASONS if no seasons are set.
+ */
+static uint8_t FindSeason(const uint16_t dayOfYear)
+{
+  uint8_t season, found = TARIFF_NB_SEASONS, latest = TARIFF_NB_SEASONS;
+  uint16_t start;
+
+  for (season = 0; season < TARIFF_NB_SEASONS; season++)
+  {
+    start = Schedule.seasonStart[season];
+
+    if (start == TARIFF_NO_DAY)
+      continue;
+
+    if (start <= dayOfYear && (found == TARIFF_NB_SEASONS || start > Schedule.seasonStart[found]))
+      found = season;
+
+    if (latest == TARIFF_NB_SEASONS || start > Schedule.seasonStart[latest])
+      latest = season;
+  }
+
+  // Before the first season of the year starts, the last season of the previous year still applies
+  if (found == TARIFF_NB_SEASONS)
+    return latest;
+
+  return found;
+}
+
+/*! @brief Looks up the rate of a time in the active schedule.
+ *
+ *  @param seconds is the RTC time in seconds.
+ *  @return uint8_t - the index of the rate.
+ */
+static uint8_t ScheduledRate(const uint32_t seconds)
+{
+  TRTCCalendar calendar;
+  uint8_t slot, index, rate, season;
+
+  RTC_ToCalendar(seconds, &calendar);
+
+  slot = ((uint32_t) calendar.hours * 3600 + calendar.minutes * 60) / TARIFF_SLOT_SECONDS;
+
+  rate = Schedule.week[calendar.weekday][slot];
+
+  for (index = 0; index < TARIFF_NB_HOLIDAYS; index++)
+    if (Schedule.holidays[index] == calendar.dayOfYear)
+    {
+      rate = Schedule.holiday[slot];
+      break;
+    }
+
+  season = FindSeason(calendar.dayOfYear);
+
+  if (season < TARIFF_NB_SEASONS)
+    rate = Schedule.seasonRates[season][rate];
+
+  return rate;
+}
+
+/*! @brief Recomputes the active rate and arms the alarm for the next slot.
+ *
+ *  @note Must be called from the alarm interrupt or with interrupts disabled.
+ */
+static void Recompute(void)
+{
+  uint32_t seconds = RTC_GetSeconds();
+
+  switch (TariffMode)
+  {
+    case TARIFF_MODE_SCHEDULE:
+      ActiveRate = ScheduledRate(seconds);
+      break;
+
+    case 2:
+      ActiveRate = RATE_FLAT_2;
+      break;
+
+    default:
+      ActiveRate = RATE_FLAT_3;
+      break;
+  }
+
+  RTC_SetAlarm(seconds - (seconds % TARIFF_SLOT_SECONDS) + TARIFF_SLOT_SECONDS);
+}
+
+bool Tariff_Init(void)
+{
+  if (!Flash_AllocateRecord(FLASH_RECORD_TARIFF_SCHEDULE, TARIFF_SCHEDULE_VERSION, sizeof(*NvSchedule), (volatile void**) &NvSchedule))
+    return false;
+
+  Staging = *NvSchedule;
+
+  // Write the default schedule if the record is erased
+  if (Staging.rates[0] == 0xFFFFFFFF)
+  {
+    DefaultSchedule(&Staging);
+
+    if (!Flash_WriteRecord(FLASH_RECORD_TARIFF_SCHEDULE, &Staging))
+      return false;
+  }
+
+  Schedule = Staging;
+
+  // Interrupts are still disabled during initialization
+  TariffMode = (uint8_t) NvTariffMode->l;
+  Recompute();
+
+  return true;
+}
+
+void Tariff_Update(void)
+{
+  OS_DisableInterrupts();
+
+  TariffMode = (uint8_t) NvTariffMode->l;
+  Recompute();
+
+  OS_EnableInterrupts();
+}
+
+void Tariff_AlarmCallback(void* arg)
+{
+  Recompute();
+}
+
+uint8_t Tariff_GetActiveRate(void)
+{
+  return ActiveRate;
+}
+
+uint32_t Tariff_GetRate(const uint8_t rate)
+{
+  if (rate >= TARIFF_NB_RATES)
+    return 0;
+
+  return Schedule.rates[rate];
+}
+
+void Tariff_Accumulate(const uint8_t rate, const uint64_t energyWs, const uint64_t cost)
+{
+  TTariffRegister* tariffRegister;
+
+  if (rate >= TARIFF_NB_RATES)
+    return;
+
+  tariffRegister = &TariffChart[rate];
+
+  // The registers are 64 bits, so keep a reader from seeing half an update
+  OS_DisableInterrupts();
+
+  (void) FixedPoint_AccumulateCarry(&tariffRegister->energyWh, &tariffRegister->energyRemainderWs, energyWs, TARIFF_WS_PER_WH);
+  (void) FixedPoint_AccumulateCarry(&tariffRegister->costCents, &tariffRegister->costRemainder, cost, TARIFF_COST_PER_CENT);
+
+  OS_EnableInterrupts();
+}
+
+bool Tariff_GetRegister(const uint8_t rate, TTariffRegister* const tariffRegister)
+{
+  if (rate >= TARIFF_NB_RATES || !tariffRegister)
+    return false;
+
+  OS_DisableInterrupts();
+  *tariffRegister = TariffChart[rate];
+  OS_EnableInterrupts();
+
+  return true;
+}
+
+bool Tariff_SetSlot(const uint16_t entry, const uint8_t rate)
+{
+  if (entry >= TARIFF_NB_SLOT_ENTRIES || rate >= TARIFF_NB_RATES)
+    return false;
+
+  // The holiday profile follows the last day of the week
+  if (entry >= TARIFF_NB_DAYS * TARIFF_NB_SLOTS)
+    Staging.holiday[entry - TARIFF_NB_DAYS * TARIFF_NB_SLOTS] = rate;
+  else
+    Staging.week[entry / TARIFF_NB_SLOTS][entry % TARIFF_NB_SLOTS] = rate;
+
+  return true;
+}
+
+bool Tariff_SetRate(const uint8_t rate, const uint16_t centsTimes1000)
+{
+  if (rate >= TARIFF_NB_RATES)
+    return false;
+
+  Staging.rates[rate] = ((uint32_t) centsTimes1000 << 16) / 1000;
+
+  return true;
+}
+
+bool Tariff_SetDay(const uint8_t entry, const uint16_t dayOfYear)
+{
+  if (entry >= TARIFF_NB_DAY_ENTRIES || (dayOfYear > 365 && dayOfYear != TARIFF_NO_DAY))
+    return false;
+
+  if (entry < TARIFF_NB_HOLIDAYS)
+    Staging.holidays[entry] = dayOfYear;
+  else
+    Staging.seasonStart[entry - TARIFF_NB_HOLIDAYS] = dayOfYear;
+
+  return true;
+}
+
+bool Tariff_SetSeasonRate(const uint8_t season, const uint8_t scheduledRate, const uint8_t seasonRate)
+{
+  if (season >= TARIFF_NB_SEASONS || scheduledRate >= TARIFF_NB_RATES || seasonRate >= TARIFF_NB_RATES)
+    return false;
+
+  Staging.seasonRates[season][scheduledRate] = seasonRate;
+
+  return true;
+}
+
+bool Tariff_Commit(void)
+{
+  if (!Flash_WriteRecord(FLASH_RECORD_TARIFF_SCHEDULE, &Staging))
+    return false;
+
+  // The alarm interrupt reads the active copy
+  OS_DisableInterrupts();
+
+  Schedule = Staging;
+  Recompute();
+
+  OS_EnableInterrupts();
+
+  return true;
+}
+
+void Tariff_Revert(void)
+{
+  Staging = Schedule;
+}
@@ -0,0 +1,168 @@
+/*! @file Tariff.h
+ *
+ *  @brief Time-of-use tariff engine for the DEM
+ *
+ *  This contains the tariff schedule, which maps every half hour of the week to a rate, with holiday and
+ *  season overrides. The schedule is kept in the Flash and uploaded by the PC into a staging copy.
+ *  The active rate is cached and only recomputed by the RTC alarm at a schedule boundary.
+ *  Each rate has its own energy and cost registers.
+ *
+ *  @author Rohan
+ *  @date 2019-11-16
+ */
+
+#ifndef SOURCES_TARIFF_H_
+#define SOURCES_TARIFF_H_
+
+// new types
+#include "types.h"
+// Flash to keep the schedule
+#include "Flash.h"
+// RTC alarm for the schedule boundaries
+#include "RTC.h"
+// RTOS
+#include "OS.h"
+// Carrying accumulators for the registers
+#include "FixedPoint.h"
+
+#define TARIFF_NB_RATES 5           /*!< Number of rates in the register bank */
+#define TARIFF_NB_DAYS 7            /*!< Days in the weekly schedule, Monday first */
+#define TARIFF_NB_SLOTS 48          /*!< Slots in a day */
+#define TARIFF_SLOT_SECONDS 1800    /*!< Length of a slot; rates can only change on a slot boundary */
+#define TARIFF_NB_HOLIDAYS 16       /*!< Number of holidays that follow the holiday profile */
+#define TARIFF_NB_SEASONS 4         /*!< Number of seasons with their own rate mapping */
+#define TARIFF_NO_DAY 0xFFFF        /*!< Marks an unused holiday or season */
+
+/*! Entries of the weekly table, then the holiday profile, addressed by Tariff_SetSlot */
+#define TARIFF_NB_SLOT_ENTRIES ((TARIFF_NB_DAYS + 1) * TARIFF_NB_SLOTS)
+
+/*! Holidays, then season start days, addressed by Tariff_SetDay */
+#define TARIFF_NB_DAY_ENTRIES (TARIFF_NB_HOLIDAYS + TARIFF_NB_SEASONS)
+
+#define TARIFF_WS_PER_WH ((uint64_t) 3600 << 16)           /*!< One Wh of energy in Ws, 64Q16 */
+#define TARIFF_COST_PER_CENT ((uint64_t) 3600000 << 32)    /*!< One cent as a rate in cents/kWh times an energy in Ws, 64Q32 */
+
+#define TARIFF_MODE_SCHEDULE 1      /*!< Tariff mode that follows the schedule; modes 2 and 3 bill the last two rates flat */
+
+/*!
+ * @struct TTariffSchedule
+ *
+ * The tariff schedule as it is kept in the Flash.
+ */
+typedef struct
+{
+  uint32_t rates[TARIFF_NB_RATES];                        /*!< Rates in cents/kWh, 32Q16 */
+  uint16_t holidays[TARIFF_NB_HOLIDAYS];                  /*!< Days of the year that follow the holiday profile */
+  uint16_t seasonStart[TARIFF_NB_SEASONS];                /*!< First day of the year of each season */
+  uint8_t seasonRates[TARIFF_NB_SEASONS][TARIFF_NB_RATES];/*!< Rate billed in place of each scheduled rate during a season */
+  uint8_t week[TARIFF_NB_DAYS][TARIFF_NB_SLOTS];          /*!< Rate of each slot of the week */
+  uint8_t holiday[TARIFF_NB_SLOTS];                       /*!< Rate of each slot of a holiday */
+} TTariffSchedule;
+
+/*!
+ * @struct TTariffRegister
+ */
+typedef struct
+{
+  uint64_t energyWh;            /*!< Energy billed at the rate in whole Wh */
+  uint64_t energyRemainderWs;   /*!< Energy billed at the rate not yet counted in energyWh, in Ws 64Q16 */
+  uint64_t costCents;           /*!< Cost billed at the rate in whole cents */
+  uint64_t costRemainder;       /*!< Cost billed at the rate not yet counted in costCents, in units of TARIFF_COST_PER_CENT */
+} TTariffRegister;
+
+extern volatile uint16union_t *NvTariffMode;
+
+/*! @brief Loads the schedule from the Flash, writing the default schedule if there is none.
+ *
+ *  @return bool - TRUE if the tariff engine was initialized successfully.
+ *  @note Assumes Flash and RTC have been initialized, the tariff mode has been allocated and interrupts are disabled.
+ */
+bool Tariff_Init(void);
+
+/*! @brief Recomputes the active rate and arms the RTC alarm for the next schedule boundary.
+ *
+ *  Called when the schedule or the tariff mode changes.
+ */
+void Tariff_Update(void);
+
+/*! @brief Recomputes the active rate and arms the RTC alarm for the next schedule boundary.
+ *
+ *  @param arg is not used.
+ *  @note Called from the RTC alarm interrupt.
+ */
+void Tariff_AlarmCallback(void* arg);
+
+/*! @brief Gets the rate that energy is being billed at.
+ *
+ *  @return uint8_t - the index of the active rate.
+ */
+uint8_t Tariff_GetActiveRate(void);
+
+/*! @brief Gets the price of a rate.
+ *
+ *  @param rate is the index of the rate.
+ *  @return uint32_t - the rate in cents/kWh, 32Q16, or 0 if the index is not valid.
+ */
+uint32_t Tariff_GetRate(const uint8_t rate);
+
+/*! @brief Adds the energy and cost of one mains cycle to the registers of a rate.
+ *
+ *  @param rate is the index of the rate.
+ *  @param energyWs is the energy in Ws, 64Q16.
+ *  @param cost is the rate in cents/kWh times the energy in Ws, 64Q32.
+ *  @note Called from the calculation thread once per cycle.
+ */
+void Tariff_Accumulate(const uint8_t rate, const uint64_t energyWs, const uint64_t cost);
+
+/*! @brief Gets a copy of the registers of a rate.
+ *
+ *  @param rate is the index of the rate.
+ *  @param tariffRegister is where the registers are copied to.
+ *  @return bool - TRUE if the index is valid.
+ */
+bool Tariff_GetRegister(const uint8_t rate, TTariffRegister* const tariffRegister);
+
+/*! @brief Sets a slot of the staged schedule.
+ *
+ *  @param entry is the slot, day * TARIFF_NB_SLOTS + slot for the week, followed by the holiday profile.
+ *  @param rate is the index of the rate billed in the slot.
+ *  @return bool - TRUE if the entry and rate are valid.
+ */
+bool Tariff_SetSlot(const uint16_t entry, const uint8_t rate);
+
+/*! @brief Sets the price of a rate in the staged schedule.
+ *
+ *  @param rate is the index of the rate.
+ *  @param centsTimes1000 is the rate in thousandths of a cent per kWh.
+ *  @return bool - TRUE if the index is valid.
+ */
+bool Tariff_SetRate(const uint8_t rate, const uint16_t centsTimes1000);
+
+/*! @brief Sets a holiday or the start of a season in the staged schedule.
+ *
+ *  @param entry is the holiday number, or TARIFF_NB_HOLIDAYS + the season number.
+ *  @param dayOfYear is the day of the year (0-365), or TARIFF_NO_DAY to clear the entry.
+ *  @return bool - TRUE if the entry and day are valid.
+ */
+bool Tariff_SetDay(const uint8_t entry, const uint16_t dayOfYear);
+
+/*! @brief Sets the rate billed in place of a scheduled rate during a season in the staged schedule.
+ *
+ *  @param season is the season number.
+ *  @param scheduledRate is the index of the rate in the weekly table or holiday profile.
+ *  @param seasonRate is the index of the rate billed instead.
+ *  @return bool - TRUE if the season and rates are valid.
+ */
+bool Tariff_SetSeasonRate(const uint8_t season, const uint8_t scheduledRate, const uint8_t seasonRate);
+
+/*! @brief Saves the staged schedule in the Flash and makes it active.
+ *
+ *  @return bool - TRUE if the schedule was saved successfully.
+ */
+bool Tariff_Commit(void);
+
+/*! @brief Discards the changes to the staged schedule.
+ */
+void Tariff_Revert(void);
+
+#endif /* SOURCES_TARIFF_H_ */
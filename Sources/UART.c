@@ -10,6 +10,10 @@
 
 
 #include "UART.h"
+// Cycle counts of the ISR
+#include "Profile.h"
+// Painted thread stacks
+#include "Stack.h"
 
 #define THREAD_STACK_SIZE 100
 
@@ -95,18 +99,20 @@ bool UART_Init(const uint32_t baudRate, const uint32_t moduleClk)
   TransmitSemaphore = OS_SemaphoreCreate(0);
 
   // Create Thread
-  error = OS_ThreadCreate(ReceiveThread, // 2nd highest priority
-			  NULL,
-			  &ReceiveThreadStack[THREAD_STACK_SIZE - 1],
-			  RECEIVE_THREAD_PRIORITY);
+  error = Stack_ThreadCreate(ReceiveThread, // 2nd highest priority
+			     NULL,
+			     ReceiveThreadStack,
+			     THREAD_STACK_SIZE,
+			     RECEIVE_THREAD_PRIORITY);
 
   if (error)
     PE_DEBUGHALT();
 
-  error = OS_ThreadCreate(TransmitThread, // 3rd highest priority
-			  NULL,
-			  &TransmitThreadStack[THREAD_STACK_SIZE - 1],
-			  TRANSMIT_THREAD_PRIORITY);
+  error = Stack_ThreadCreate(TransmitThread, // 3rd highest priority
+			     NULL,
+			     TransmitThreadStack,
+			     THREAD_STACK_SIZE,
+			     TRANSMIT_THREAD_PRIORITY);
 
   if (error)
     PE_DEBUGHALT();
@@ -167,6 +173,8 @@ static void ReceiveThread (void *pData)
     if (error)
       PE_DEBUGHALT();
 
+    PROFILE_LATENCY(PROFILE_PROBE_UART_LATENCY);
+
     FIFO_Put (&RxFIFO, ReceiveData);
   }
 }
@@ -206,8 +214,10 @@ static void TransmitThread (void *pData)
  *
  *  @note Assumes the transmit and receive FIFOs have been initialized.
  */
-void __attribute__ ((interrupt)) UART_ISR(void)
+void __attribute__ ((interrupt)) RAMFUNC UART_ISR(void)
 {
+  PROFILE_BEGIN(PROFILE_PROBE_UART);
+
   OS_ISREnter();
 
   OS_ERROR error;
@@ -217,6 +227,8 @@ void __attribute__ ((interrupt)) UART_ISR(void)
   {
     ReceiveData = (uint8_t) UART2_D;
 
+    PROFILE_STAMP(PROFILE_PROBE_UART_LATENCY);
+
     error = OS_SemaphoreSignal(ReceiveSemaphore);
 
     if (error)
@@ -240,6 +252,8 @@ void __attribute__ ((interrupt)) UART_ISR(void)
     }
   }
 
+  PROFILE_END(PROFILE_PROBE_UART);
+
   OS_ISRExit();
 
 }
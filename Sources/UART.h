@@ -55,7 +55,7 @@ bool UART_OutChar(const uint8_t data);
  *
  *  @note Assumes the transmit and receive FIFOs have been initialized.
  */
-void __attribute__ ((interrupt)) UART_ISR(void);
+void __attribute__ ((interrupt)) RAMFUNC UART_ISR(void);
 
 #endif
 
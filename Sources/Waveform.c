@@ -0,0 +1,268 @@
+/*! @file Waveform.c
+ *
+ *  @brief Triggered waveform capture for the DEM
+ *
+ *  This contains the routines to keep the last few cycles of raw voltage and current samples in a circular buffer,
+ *  and to freeze a window around a trigger for the PC to download. The trigger is an RMS level, a step change
+ *  from the cycle before or a command. Two buffers are swapped on a trigger, so a frozen window is never copied.
+ *
+ *  @author Rohan
+ *  @date 2019-11-23
+ */
+
+#include "Waveform.h"
+// Samples per cycle
+#include "Calc.h"
+
+#define NB_SAMPLES (WAVEFORM_NB_CYCLES * ANALOG_WINDOW_SIZE)
+#define INDEX_MASK (NB_SAMPLES - 1)
+
+#define NO_BUFFER 0xFF
+
+// Default levels: 90% and 110% of 230 V, with the current and step triggers off
+#define DEFAULT_SAG_V 207
+#define DEFAULT_SWELL_V 253
+
+/*!
+ * @struct TWaveformBuffer
+ */
+typedef struct
+{
+  int16_t voltage[NB_SAMPLES];    /*!< Raw voltage samples, written in a circle */
+  int16_t current[NB_SAMPLES];    /*!< Raw current samples, written in a circle */
+} TWaveformBuffer;
+
+static TWaveformBuffer Buffers[2];
+
+// The buffer written by the calculation thread, where the next sample goes and how many it holds
+static uint8_t Live;
+static uint16_t WriteIndex;
+static uint16_t Filled;
+
+// The buffer held for download, its oldest sample and its description
+static volatile uint8_t Frozen;
+static uint16_t FrozenStart;
+static TWaveformInfo Info;
+
+// Samples to take after the trigger, and how many are still to come, 0 while armed
+static uint16_t PostSamples, PostRemaining;
+static uint8_t Cause;
+static uint32_t TriggerTime;
+
+static volatile bool ManualTrigger;
+static volatile uint8_t PreCycles;
+static volatile uint16_t Levels[WAVEFORM_NB_LEVELS];
+
+/*! @brief Freezes the live buffer for download and carries on in the other one.
+ */
+static void Freeze(void)
+{
+  Info.timestamp = TriggerTime;
+  Info.nbSamples = Filled;
+  Info.triggerSample = Filled - 1 - PostSamples;
+  Info.cause = Cause;
+  Info.samplesPerCycle = ANALOG_WINDOW_SIZE;
+
+  // The oldest sample is the next one to be overwritten, or the first if the buffer never wrapped
+  FrozenStart = (Filled == NB_SAMPLES) ? WriteIndex : 0;
+
+  // Swap rather than copy; the frozen buffer is only read until it is released
+  Frozen = Live;
+  Live ^= 1;
+
+  WriteIndex = 0;
+  Filled = 0;
+  PostRemaining = 0;
+}
+
+/*! @brief Starts taking the samples after the trigger, unless a window is held or already being taken.
+ *
+ *  @param cause is the WAVEFORM_CAUSE of the trigger.
+ */
+static void Trigger(const uint8_t cause)
+{
+  uint16_t preSamples;
+
+  if (Frozen != NO_BUFFER || PostRemaining)
+    return;
+
+  Cause = cause;
+  TriggerTime = RTC_GetSeconds();
+
+  // The trigger sample is the newest; the cycles before it are kept as long as the trigger sample still fits
+  preSamples = PreCycles * ANALOG_WINDOW_SIZE;
+
+  if (preSamples > NB_SAMPLES - 1)
+    preSamples = NB_SAMPLES - 1;
+
+  // A short fill keeps what it has before the trigger and still takes the full count after it
+  PostSamples = NB_SAMPLES - 1 - preSamples;
+
+  if (PostSamples == 0)
+    Freeze();
+  else
+    PostRemaining = PostSamples;
+}
+
+bool Waveform_Init(void)
+{
+  uint8_t level;
+
+  Live = 0;
+  WriteIndex = 0;
+  Filled = 0;
+  Frozen = NO_BUFFER;
+  PostRemaining = 0;
+  ManualTrigger = false;
+  PreCycles = WAVEFORM_DEFAULT_PRE_CYCLES;
+
+  for (level = 0; level < WAVEFORM_NB_LEVELS; level++)
+    Levels[level] = 0;
+
+  Levels[WAVEFORM_LEVEL_SAG] = DEFAULT_SAG_V;
+  Levels[WAVEFORM_LEVEL_SWELL] = DEFAULT_SWELL_V;
+
+  return true;
+}
+
+void Waveform_Sample(const int16_t voltage, const int16_t current)
+{
+  TWaveformBuffer* const buffer = &Buffers[Live];
+  int32_t step = Levels[WAVEFORM_LEVEL_STEP];
+  bool stepped = false;
+  uint16_t lastCycle;
+  int32_t voltageStep, currentStep;
+
+  // Compare with the same point of the cycle before, before it can be overwritten
+  if (step && Filled >= ANALOG_WINDOW_SIZE)
+  {
+    lastCycle = (WriteIndex - ANALOG_WINDOW_SIZE) & INDEX_MASK;
+
+    voltageStep = (int32_t) voltage - buffer->voltage[lastCycle];
+    currentStep = (int32_t) current - buffer->current[lastCycle];
+
+    stepped = (voltageStep > step || voltageStep < -step || currentStep > step || currentStep < -step);
+  }
+
+  buffer->voltage[WriteIndex] = voltage;
+  buffer->current[WriteIndex] = current;
+
+  WriteIndex = (WriteIndex + 1) & INDEX_MASK;
+
+  if (Filled < NB_SAMPLES)
+    Filled++;
+
+  if (PostRemaining)
+  {
+    if (--PostRemaining == 0)
+      Freeze();
+
+    return;
+  }
+
+  if (ManualTrigger)
+  {
+    ManualTrigger = false;
+    Trigger(WAVEFORM_CAUSE_MANUAL);
+  }
+  else if (stepped)
+    Trigger(WAVEFORM_CAUSE_STEP);
+}
+
+void Waveform_Cycle(const uint32_t vRMS, const uint32_t iRMS)
+{
+  uint16_t sag = Levels[WAVEFORM_LEVEL_SAG];
+  uint16_t swell = Levels[WAVEFORM_LEVEL_SWELL];
+  uint16_t current = Levels[WAVEFORM_LEVEL_CURRENT];
+
+  if (sag && vRMS < ((uint32_t) sag << 16))
+    Trigger(WAVEFORM_CAUSE_SAG);
+  else if (swell && vRMS > ((uint32_t) swell << 16))
+    Trigger(WAVEFORM_CAUSE_SWELL);
+  else if (current && (((uint64_t) iRMS * 1000) >> 16) > current)
+    Trigger(WAVEFORM_CAUSE_CURRENT);
+}
+
+void Waveform_Trigger(void)
+{
+  ManualTrigger = true;
+}
+
+void Waveform_Release(void)
+{
+  Frozen = NO_BUFFER;
+}
+
+uint8_t Waveform_GetState(void)
+{
+  if (Frozen != NO_BUFFER)
+    return WAVEFORM_STATE_FROZEN;
+
+  if (PostRemaining)
+    return WAVEFORM_STATE_TRIGGERED;
+
+  return WAVEFORM_STATE_ARMED;
+}
+
+bool Waveform_SetPreCycles(const uint8_t cycles)
+{
+  if (cycles > WAVEFORM_NB_CYCLES)
+    return false;
+
+  PreCycles = cycles;
+  return true;
+}
+
+uint8_t Waveform_GetPreCycles(void)
+{
+  return PreCycles;
+}
+
+bool Waveform_GetLevel(const uint8_t level, uint16_t* const value)
+{
+  if (level >= WAVEFORM_NB_LEVELS)
+    return false;
+
+  *value = Levels[level];
+  return true;
+}
+
+bool Waveform_SetLevel(const uint8_t level, const uint16_t value)
+{
+  if (level >= WAVEFORM_NB_LEVELS)
+    return false;
+
+  Levels[level] = value;
+  return true;
+}
+
+bool Waveform_GetInfo(TWaveformInfo* const info)
+{
+  // The calculation thread only writes the description while no window is held
+  if (Frozen == NO_BUFFER)
+    return false;
+
+  *info = Info;
+  return true;
+}
+
+uint16_t Waveform_Read(const uint16_t first, const uint16_t nbSamples, int16_t* const samples)
+{
+  const TWaveformBuffer* buffer;
+  uint16_t count, index;
+
+  if (Frozen == NO_BUFFER || first >= Info.nbSamples)
+    return 0;
+
+  buffer = &Buffers[Frozen];
+
+  for (count = 0; count < nbSamples && first + count < Info.nbSamples; count++)
+  {
+    index = (FrozenStart + first + count) & INDEX_MASK;
+
+    samples[2 * count] = buffer->voltage[index];
+    samples[2 * count + 1] = buffer->current[index];
+  }
+
+  return count;
+}
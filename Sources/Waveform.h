@@ -0,0 +1,148 @@
+/*! @file Waveform.h
+ *
+ *  @brief Triggered waveform capture for the DEM
+ *
+ *  This contains the routines to keep the last few cycles of raw voltage and current samples in a circular buffer,
+ *  and to freeze a window around a trigger for the PC to download. The trigger is an RMS level, a step change
+ *  from the cycle before or a command. Two buffers are swapped on a trigger, so a frozen window is never copied.
+ *
+ *  @author Rohan
+ *  @date 2019-11-23
+ */
+
+#ifndef SOURCES_WAVEFORM_H_
+#define SOURCES_WAVEFORM_H_
+
+// new types
+#include "types.h"
+// RTC to timestamp the trigger
+#include "RTC.h"
+
+/*! Log2 of the number of cycles in a window; each of the two buffers takes 4 bytes per sample.
+ *  Can be set for the build, e.g. -DWAVEFORM_CYCLES_LOG2=2 */
+#ifndef WAVEFORM_CYCLES_LOG2
+#define WAVEFORM_CYCLES_LOG2 3
+#endif
+
+#if WAVEFORM_CYCLES_LOG2 > 5
+#error "WAVEFORM_CYCLES_LOG2 must not be more than 5"
+#endif
+
+#define WAVEFORM_NB_CYCLES (1 << WAVEFORM_CYCLES_LOG2)   /*!< Cycles in a window */
+
+#define WAVEFORM_DEFAULT_PRE_CYCLES (WAVEFORM_NB_CYCLES / 4)   /*!< Cycles kept before the trigger until set otherwise */
+
+#define WAVEFORM_STATE_ARMED 0        /*!< Waiting for a trigger */
+#define WAVEFORM_STATE_TRIGGERED 1    /*!< Taking the samples after the trigger */
+#define WAVEFORM_STATE_FROZEN 2       /*!< A window is held for download; triggers are ignored until it is released */
+
+#define WAVEFORM_CAUSE_MANUAL 1       /*!< Triggered by a command */
+#define WAVEFORM_CAUSE_SAG 2          /*!< Triggered by the cycle Vrms falling below its level */
+#define WAVEFORM_CAUSE_SWELL 3        /*!< Triggered by the cycle Vrms rising above its level */
+#define WAVEFORM_CAUSE_CURRENT 4      /*!< Triggered by the cycle Irms rising above its level */
+#define WAVEFORM_CAUSE_STEP 5         /*!< Triggered by a sample differing from the one a cycle before by more than its level */
+
+#define WAVEFORM_LEVEL_SAG 0          /*!< Trigger level: Vrms in V below which a cycle triggers, 0 to disable */
+#define WAVEFORM_LEVEL_SWELL 1        /*!< Trigger level: Vrms in V above which a cycle triggers, 0 to disable */
+#define WAVEFORM_LEVEL_CURRENT 2      /*!< Trigger level: Irms in mA above which a cycle triggers, 0 to disable */
+#define WAVEFORM_LEVEL_STEP 3         /*!< Trigger level: change in ADC counts from the cycle before, 0 to disable */
+#define WAVEFORM_NB_LEVELS 4
+
+/*!
+ * @struct TWaveformInfo
+ *
+ * Describes the frozen window.
+ */
+typedef struct
+{
+  uint32_t timestamp;             /*!< RTC seconds at the trigger */
+  uint16_t nbSamples;             /*!< Samples in the window; less than a full window if it triggered soon after starting */
+  uint16_t triggerSample;         /*!< Index in the window of the sample the trigger was seen on */
+  uint8_t cause;                  /*!< WAVEFORM_CAUSE of the trigger */
+  uint8_t samplesPerCycle;        /*!< Samples in each mains cycle */
+  uint8_t reserved[2];
+} TWaveformInfo;
+
+/*! @brief Sets up the capture with the default trigger levels.
+ *
+ *  @return bool - TRUE if the capture was initialized successfully.
+ */
+bool Waveform_Init(void);
+
+/*! @brief Stores the next pair of raw samples, and checks for a step or command trigger.
+ *
+ *  @param voltage is the raw ADC value of the voltage.
+ *  @param current is the raw ADC value of the current.
+ *  @note Called from the calculation thread for every sample.
+ */
+void Waveform_Sample(const int16_t voltage, const int16_t current);
+
+/*! @brief Checks the RMS values of the cycle just completed against the trigger levels.
+ *
+ *  @param vRMS is the Vrms of the cycle in V, 32Q16.
+ *  @param iRMS is the Irms of the cycle in A, 32Q16.
+ *  @note Called from the calculation thread once per cycle, after the last sample of the cycle.
+ */
+void Waveform_Cycle(const uint32_t vRMS, const uint32_t iRMS);
+
+/*! @brief Triggers the capture on the next sample.
+ */
+void Waveform_Trigger(void);
+
+/*! @brief Releases the frozen window, so the capture can trigger again.
+ */
+void Waveform_Release(void);
+
+/*! @brief Gets the state of the capture.
+ *
+ *  @return uint8_t - the WAVEFORM_STATE.
+ */
+uint8_t Waveform_GetState(void);
+
+/*! @brief Sets the number of whole cycles kept before the trigger; the rest of the window is taken after it.
+ *
+ *  @param cycles is the number of cycles, up to WAVEFORM_NB_CYCLES.
+ *  @return bool - TRUE if the number of cycles is valid.
+ *  @note The trigger sample is always kept, so WAVEFORM_NB_CYCLES keeps one sample fewer before it.
+ */
+bool Waveform_SetPreCycles(const uint8_t cycles);
+
+/*! @brief Gets the number of whole cycles kept before the trigger.
+ *
+ *  @return uint8_t - the number of cycles.
+ */
+uint8_t Waveform_GetPreCycles(void);
+
+/*! @brief Gets a trigger level.
+ *
+ *  @param level is the WAVEFORM_LEVEL to get.
+ *  @param value is where the value of the level is stored.
+ *  @return bool - TRUE if the level is valid.
+ */
+bool Waveform_GetLevel(const uint8_t level, uint16_t* const value);
+
+/*! @brief Sets a trigger level.
+ *
+ *  @param level is the WAVEFORM_LEVEL to set.
+ *  @param value is the new value of the level, 0 to disable it.
+ *  @return bool - TRUE if the level is valid.
+ */
+bool Waveform_SetLevel(const uint8_t level, const uint16_t value);
+
+/*! @brief Gets the description of the frozen window.
+ *
+ *  @param info is where the description is copied to.
+ *  @return bool - TRUE if a window is frozen.
+ */
+bool Waveform_GetInfo(TWaveformInfo* const info);
+
+/*! @brief Reads samples from the frozen window.
+ *
+ *  @param first is the index in the window of the first sample to read.
+ *  @param nbSamples is the most samples to read.
+ *  @param samples is where the samples are copied to, voltage and current interleaved.
+ *  @return uint16_t - the number of samples read, 0 if no window is frozen or first is past its end.
+ */
+uint16_t Waveform_Read(const uint16_t first, const uint16_t nbSamples, int16_t* const samples);
+
+#endif /* SOURCES_WAVEFORM_H_ */
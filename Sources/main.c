@@ -44,6 +44,14 @@
 #include "HMI.h"    // HMI - Human Machine Interaction
 #include "Switch.h"
 #include "FixedPoint.h"
+#include "LoadProfile.h" // Load Profile - interval records in the Flash
+#include "Demand.h"      // Demand - maximum demand register
+#include "Tariff.h"      // Tariff - time-of-use tariff engine
+#include "Profile.h"     // Profile - cycle counts of the hot paths
+#include "Stack.h"       // Stack - painted thread stacks and their high-water marks
+#include "Idle.h"        // Idle - sleeping idle thread and the CPU load
+#include "SelfTest.h"    // SelfTest - metering arithmetic against stored vectors
+#include "Benchmark.h"   // Benchmark - cycles taken by the FixedPoint routines
 
 /* Function Prototype */
 void FTM0Callback (const TFTMChannel* const aFTMChannel);
@@ -52,16 +60,15 @@ void HandlePackets();
 /***********************************************************************************************************
  * Global Variables and constants
  ************************************************************************************************************/
-#define ANALOG_WINDOW_SIZE 16
-
 const uint32_t BAUD_RATE = 115200;              /*! The Baud Rate to be set to communicate with the PC */
 
-const uint32_t MAX_SAMPLE_PERIOD = 1315790;      /*! The sample rate for the analog input in nanoseconds */
+const uint32_t MAX_SAMPLE_PERIOD = ANALOG_MAX_CYCLE_NS >> ANALOG_WINDOW_SIZE_LOG2;  /*! The sample rate for the analog input in nanoseconds */
 
 const uint8_t PACKET_ACK_MASK = 0x80;           /*! Acknowledgment bit mask */
 
-volatile uint16union_t *NvTariffMode;           /*! Non-volatile Tower Number */
-const uint16_t DEFAULT_TARIFF_MODE = 1;         /*! Initial constant Tower Number */
+volatile uint16union_t *NvTariffMode;           /*! Non-volatile Tariff Mode */
+const uint16_t DEFAULT_TARIFF_MODE = 1;         /*! Initial Tariff Mode */
+const uint8_t TARIFF_MODE_VERSION = 1;          /*! Layout version of the Tariff Mode record */
 
 volatile bool TestModeEnabled = false;
 
@@ -72,10 +79,18 @@ const uint8_t CURRENT_CHANNEL_NB = 1;
 
 static uint8_t HMITimeoutCounter = 0;
 
+static uint32_t FlashWriteFailures = 0;         /*! Ticks on which a record could not be saved; it is tried again on a later tick */
+
 int16_t Voltage_ADC [ANALOG_WINDOW_SIZE];
 
 int16_t Current_ADC [ANALOG_WINDOW_SIZE];
 
+#if ANALOG_OVERSAMPLE_LOG2
+int16_t Voltage_Oversample [2][ANALOG_OVERSAMPLE];
+
+int16_t Current_Oversample [2][ANALOG_OVERSAMPLE];
+#endif
+
 /***********************************************************************************************************
  * Packet Handler Commands
  ************************************************************************************************************/
@@ -90,19 +105,79 @@ int16_t Current_ADC [ANALOG_WINDOW_SIZE];
 #define CMD_VOLTAGE_RMS    0x18    /*!< Command for Flash - Read Byte */
 #define CMD_CURRENT_RMS    0x19    /*!< Command for Flash - Read Byte */
 #define CMD_POWER_FACTOR   0x1A    /*!< Command for Flash - Read Byte */
+#define CMD_LOAD_PROFILE   0x1B    /*!< Command for Load Profile - Get/Set Interval */
+#define CMD_LP_OLDEST      0x1C    /*!< Command for Load Profile - Oldest Interval Index */
+#define CMD_LP_NEXT        0x1D    /*!< Command for Load Profile - Next Interval Index */
+#define CMD_LP_READ        0x1E    /*!< Command for Load Profile - Read Records from an Interval Index */
+#define CMD_LP_DATA        0x1F    /*!< Command for Load Profile - Record Data */
+
+#define CMD_DEMAND_PEAK    0x20    /*!< Command for Demand - Get/Reset Peak Demand */
+#define CMD_DEMAND_TIME    0x21    /*!< Command for Demand - Peak Demand Timestamp */
+#define CMD_DEMAND         0x22    /*!< Command for Demand - Present Demand */
+
+#define CMD_TOU_SLOT       0x23    /*!< Command for Tariff - Set Staged Schedule Slot */
+#define CMD_TOU_RATE       0x24    /*!< Command for Tariff - Set Staged Rate */
+#define CMD_TOU_DAY        0x25    /*!< Command for Tariff - Set Staged Holiday or Season Start */
+#define CMD_TOU_SEASON     0x26    /*!< Command for Tariff - Set Staged Season Rate */
+#define CMD_TOU            0x27    /*!< Command for Tariff - Get Active Rate, Commit or Revert Staged Schedule */
+#define CMD_TOU_REGISTER   0x28    /*!< Command for Tariff - Energy and Cost Registers of a Rate */
+
+#define CMD_DATE           0x29    /*!< Command for Time - Get/Set Date */
+
+#define CMD_HARMONIC       0x2A    /*!< Command for Harmonics - Harmonic Level */
+#define CMD_THD            0x2B    /*!< Command for Harmonics - Get THD or Set Decimation */
+
+#define CMD_REACTIVE_POWER 0x2C    /*!< Command for Reactive Power */
+#define CMD_APPARENT_POWER 0x2D    /*!< Command for Apparent Power */
+#define CMD_ENERGY_REGISTER 0x2E   /*!< Command for Four-Quadrant Energy Register */
+
+#define CMD_CAL_GET        0x2F    /*!< Command for Calibration - Get Item */
+#define CMD_CAL_SET        0x30    /*!< Command for Calibration - Set Item */
+
+#define CMD_PQ_VRMS        0x31    /*!< Command for Power Quality - Aggregated RMS Voltage */
+#define CMD_PQ_OLDEST      0x32    /*!< Command for Power Quality - Oldest Event Index */
+#define CMD_PQ_NEXT        0x33    /*!< Command for Power Quality - Next Event Index */
+#define CMD_PQ_READ        0x34    /*!< Command for Power Quality - Read an Event */
+#define CMD_PQ_DATA        0x35    /*!< Command for Power Quality - Event Data */
+#define CMD_PQ_ALARM       0x36    /*!< Command for Power Quality - Event Alarm, sent when an event ends */
+
+#define CMD_WAVEFORM       0x37    /*!< Command for Waveform - Get State, Trigger, Release or Set Pre-Trigger Cycles */
+#define CMD_WAVEFORM_INFO  0x38    /*!< Command for Waveform - Frozen Window Description */
+#define CMD_WAVEFORM_LEVEL_GET 0x39  /*!< Command for Waveform - Get Trigger Level */
+#define CMD_WAVEFORM_LEVEL_SET 0x3A  /*!< Command for Waveform - Set Trigger Level */
+#define CMD_WAVEFORM_READ  0x3B    /*!< Command for Waveform - Read Samples from a Sample Index */
+#define CMD_WAVEFORM_DATA  0x3C    /*!< Command for Waveform - Sample Data */
+
+#define CMD_PROFILE        0x3D    /*!< Command for Profile - Get or Reset Probe Statistics */
+#define CMD_PROFILE_DATA   0x3E    /*!< Command for Profile - Probe Statistics */
+
+#define CMD_STACK          0x3F    /*!< Command for Stack - High-Water Mark of a Thread Stack */
+
+#define CMD_DEADLINE       0x40    /*!< Command for Deadline - Get or Reset the Sample Deadline Counters */
+
+#define CMD_IDLE           0x41    /*!< Command for Idle - Get the CPU Load or Reset its Peak */
+
+#define CMD_SELFTEST       0x42    /*!< Command for SelfTest - Get the Self-Test Result or Run it Again */
+
+#define CMD_BENCHMARK      0x43    /*!< Command for Benchmark - Time a FixedPoint Kernel over a Range of Operands */
+
+#define LOAD_PROFILE_BURST 16      /*!< Maximum number of records sent for one read request */
+#define WAVEFORM_BURST 32          /*!< Maximum number of samples sent for one read request */
 
 // ----------------------------------------
 // Thread set up
 // ----------------------------------------
-// Arbitrary thread stack size - big enough for stacking of interrupts and OS use.
-#define THREAD_STACK_SIZE 5000
+// Thread stack sizes in words, with room for stacking of interrupts and OS use;
+// the high-water mark of each can be read with CMD_STACK
+#define RTC_THREAD_STACK_SIZE 1000
+#define PACKET_THREAD_STACK_SIZE 1000
 #define NB_ANALOG_CHANNELS 2
 
 /***********************************************************************************************************
  * Thread Stacks
  ************************************************************************************************************/
-static uint32_t RTCThreadStack[THREAD_STACK_SIZE] __attribute__ ((aligned(0x08)));
-static uint32_t PacketReceiveThreadStack[THREAD_STACK_SIZE] __attribute__ ((aligned(0x08)));  /*! The stack for packet checker thread */
+static uint32_t RTCThreadStack[RTC_THREAD_STACK_SIZE] __attribute__ ((aligned(0x08)));
+static uint32_t PacketReceiveThreadStack[PACKET_THREAD_STACK_SIZE] __attribute__ ((aligned(0x08)));  /*! The stack for packet checker thread */
 
 /***********************************************************************************************************
  * Thread Priorities
@@ -113,6 +188,8 @@ const uint8_t TRANSMIT_THREAD_PRIORITY      = 1;
 const uint8_t CALCULATION_THREAD_PRIORITY   = 2;
 const uint8_t RTC_THREAD_PRIORITY           = 3;
 const uint8_t PACKETRECEIVE_THREAD_PRIORITY = 4;
+const uint8_t HARMONIC_THREAD_PRIORITY      = 5;
+const uint8_t IDLE_THREAD_PRIORITY          = OS_LOWEST_PRIORITY - 1;
 
 /***********************************************************************************************************
  * Global Semaphores
@@ -165,22 +242,41 @@ TState FSMState [NB_DISPLAY_STATES] =
  *
  *  Toggles the Green LED after timeout has occured
  */
-void PITCallback (void* arg)
+void RAMFUNC PITCallback (void* arg)
 {
   OS_ERROR error;
 
+  int16_t voltage, current;
+
+#if ANALOG_OVERSAMPLE_LOG2
   static uint8_t NbSamples = 0;
+  static uint8_t Block = 0;
+#endif
+
+  Analog_Get(VOLTAGE_CHANNEL_NB, &voltage);
 
-  Analog_Get(VOLTAGE_CHANNEL_NB, Voltage_ADC + NbSamples);
+  Analog_Get(CURRENT_CHANNEL_NB, &current);
 
-  Analog_Get(CURRENT_CHANNEL_NB, Current_ADC + NbSamples);
+#if ANALOG_OVERSAMPLE_LOG2
+  Voltage_Oversample[Block][NbSamples] = voltage;
+  Current_Oversample[Block][NbSamples] = current;
 
-  // Increment the window index
-  NbSamples++;
+  // Only wake the calculation thread once a block is full; it decimates the block while the other one fills
+  NbSamples = (NbSamples + 1) & (ANALOG_OVERSAMPLE - 1);
 
-  // Wrap index
-  if (NbSamples == ANALOG_WINDOW_SIZE)
-    NbSamples = 0;
+  if (NbSamples)
+    return;
+
+  Block ^= 1;
+#endif
+
+  // Hand the sample over with its index and time; a full mailbox drops it, and the thread sees the gap
+  if (!Mailbox_Post(voltage, current))
+    return;
+
+  PROFILE_STAMP(PROFILE_PROBE_PIT_LATENCY);
+
+  Deadline_Signal();
 
   error = OS_SemaphoreSignal(AnalogGetSemaphore);
 
@@ -249,6 +345,10 @@ void RTCThread (void *pData)
 {
   OS_ERROR error;
 
+  TRTCCalendar calendar;
+
+  TPowerQualityEvent event;
+
   for (;;)
   {
     // Wait for the semaphore to be signaled by the RTC ISR
@@ -257,29 +357,52 @@ void RTCThread (void *pData)
     if (error)
          PE_DEBUGHALT();
 
-    // Update the HMI display every second
-    HMI_DisplayCurrentState();
+    PROFILE_LATENCY(PROFILE_PROBE_RTC_LATENCY);
+
+    // Update the HMI display every second, unless the calculation thread is catching up
+    if (!Deadline_IsBehind())
+    {
+      PROFILE_BEGIN(PROFILE_PROBE_HMI);
+
+      HMI_DisplayCurrentState();
+
+      PROFILE_END(PROFILE_PROBE_HMI);
+    }
+
+    RTC_GetCalendar(&calendar);
 
     // Increment the time of usage
     if (TestModeEnabled)
     {
       TimeUsage += 3600;
 
-      uint8_t days, hours, minutes, seconds;
-
-      RTC_Get (&days, &hours, &minutes, &seconds);
-
-      // Increment the hours by 1 and decrement the seconds by 1
-      hours ++;
-      seconds--;
+      // Move the clock on by an hour, less the second that has just passed
+      RTC_SetSeconds(calendar.epoch + 3599);
 
-      // Set the accelerated time
-      RTC_Set(days, hours, minutes, seconds);
+      RTC_GetCalendar(&calendar);
     }
 
     else
       TimeUsage++;
 
+    // Store the load profile record when an interval ends; a record the Flash fails to take is kept for the next tick
+    if (!LoadProfile_Tick(calendar.epoch))
+      FlashWriteFailures++;
+
+    // Slide the demand window when a sub-interval ends; peaks the Flash fails to save are saved with the next one
+    if (!Demand_Tick(calendar.epoch, Tariff_GetActiveRate()))
+      FlashWriteFailures++;
+
+    // Close the 10-minute power quality aggregation on the clock
+    PowerQuality_Tick(calendar.epoch);
+
+    // Store the finished power quality events and raise an alarm for each
+    while (PowerQuality_Log(&event))
+      (void) Packet_PutBlock(CMD_PQ_ALARM, (uint8_t*) &event, sizeof(event));
+
+    // Work out the CPU load over the second
+    Idle_Second();
+
     // Toggle the yellow LED
     LEDs_Toggle(LED_YELLOW);
   }
@@ -292,6 +415,9 @@ void RTCThread (void *pData)
  */
 static void PacketReceiveThread(void* pData)
 {
+  // Check the metering arithmetic once, before the PC can ask for the result
+  (void) SelfTest_Run();
+
   for(;;)
   {
     // Check if a valid packet is received
@@ -335,29 +461,36 @@ bool HandleTariffPacket()
 
   else if (Packet_Parameter3 == 1)
     if (Packet_Parameter1 == 1 || Packet_Parameter1 == 2 || Packet_Parameter1 == 3)
-      return Flash_Write16((uint16_t *) NvTariffMode, (uint16_t)Packet_Parameter1);
+    {
+      if (!Flash_Write16((uint16_t *) NvTariffMode, (uint16_t)Packet_Parameter1))
+        return false;
+
+      // Switch to the rate of the new mode straight away
+      Tariff_Update();
+      return true;
+    }
 
   return false;
 }
 
 bool HandleTime1Packet()
 {
-  uint8_t days, hours, minutes, seconds;
+  TRTCCalendar calendar;
 
   // Get the current time
-  RTC_Get(&days, &hours, &minutes, &seconds);
+  RTC_GetCalendar(&calendar);
 
   if (Packet_Parameter3 == 0)
     // send the current time to the PC
-    return Packet_Put (CMD_TIME1, seconds, minutes, 0);
+    return Packet_Put (CMD_TIME1, calendar.seconds, calendar.minutes, 0);
 
   else if (Packet_Parameter3 == 1)
     if (Packet_Parameter1 >= 0 && Packet_Parameter1 <= 59 &&
         Packet_Parameter2 >= 0 && Packet_Parameter2 <= 59)
     {
-      // keep the current days and hours
+      // keep the current date and hours
       // Set the new seconds and minutes
-      RTC_Set(days, hours, Packet_Parameter2, Packet_Parameter1);
+      RTC_SetSeconds(calendar.epoch - (calendar.minutes * 60 + calendar.seconds) + (Packet_Parameter2 * 60 + Packet_Parameter1));
 
       return true;
     }
@@ -365,24 +498,38 @@ bool HandleTime1Packet()
   return false;
 }
 
+/*! @brief Gets or sets the hours and the day of the month
+ *
+ *  Parameter 1 is the hours and parameter 2 the day of the month, which may be 0 to keep the current day.
+ *  The month, year, minutes and seconds are kept; CMD_DATE sets the rest of the date.
+ *  @return bool - TRUE if the packet was handled successfully
+ */
 bool HandleTime2Packet()
 {
-  uint8_t days, hours, minutes, seconds;
+  TRTCCalendar calendar;
 
   // Get the current time
-  RTC_Get(&days, &hours, &minutes, &seconds);
+  RTC_GetCalendar(&calendar);
 
   if (Packet_Parameter3 == 0)
     // send the current time to the PC
-    return Packet_Put (CMD_TIME2, hours, days, 0);
+    return Packet_Put (CMD_TIME2, calendar.hours, calendar.day, 0);
 
   else if (Packet_Parameter3 == 1)
-    // As many days as wanted can be set
-    if (Packet_Parameter1 >=0 && Packet_Parameter1 <= 23)
+    if (Packet_Parameter1 <= 23)
     {
-      // Keep the current seconds and minutes
-      // Set the new days and hours
-      RTC_Set(Packet_Parameter2, Packet_Parameter1, minutes, seconds);
+      // Move to the new day of the current month, which checks the day is in it
+      if (Packet_Parameter2 != 0)
+      {
+        if (!RTC_SetDate(calendar.year, calendar.month, Packet_Parameter2))
+          return false;
+
+        RTC_GetCalendar(&calendar);
+      }
+
+      // Keep the date, minutes and seconds
+      // Set the new hours
+      RTC_SetSeconds(calendar.epoch - (uint32_t) calendar.hours * 3600 + (uint32_t) Packet_Parameter1 * 3600);
 
       return true;
     }
@@ -390,15 +537,90 @@ bool HandleTime2Packet()
   return false;
 }
 
+/*! @brief Gets or sets the date
+ *
+ *  Parameter 1 is the day of the month, parameter 2 the month and parameter 3 the years since RTC_EPOCH_YEAR.
+ *  A day of 0 requests the current date.
+ *  @return bool - TRUE if the packet was handled successfully
+ */
+bool HandleDatePacket()
+{
+  TRTCCalendar calendar;
+
+  if (Packet_Parameter1 == 0)
+  {
+    RTC_GetCalendar(&calendar);
+
+    return Packet_Put (CMD_DATE, calendar.day, calendar.month, (uint8_t) (calendar.year - RTC_EPOCH_YEAR));
+  }
+
+  return RTC_SetDate(RTC_EPOCH_YEAR + Packet_Parameter3, Packet_Parameter2, Packet_Parameter1);
+}
+
+/*! @brief Sends the average power in W, as a signed 16-bit value that is negative when exporting
+ *
+ *  @return bool - TRUE if the packet was sent successfully
+ */
 bool HandlePowerPacket()
 {
   uint16union_t powerUnion;
+  int32_t powerW = AveragePowerW >> 16;
 
-  powerUnion.l = (uint16_t) (AveragePowerW >> 16);
+  // Saturate rather than wrap into the opposite sign
+  if (powerW > INT16_MAX)
+    powerW = INT16_MAX;
+  else if (powerW < INT16_MIN)
+    powerW = INT16_MIN;
+
+  powerUnion.l = (uint16_t) powerW;
 
   return Packet_Put (CMD_POWER, powerUnion.s.Lo, powerUnion.s.Hi, 0);
 }
 
+/*! @brief Sends the reactive power in var, positive when the current lags
+ *
+ *  @return bool - TRUE if the packet was sent successfully
+ */
+bool HandleReactivePowerPacket()
+{
+  uint16union_t powerUnion;
+
+  powerUnion.l = (uint16_t) (ReactivePowerVar >> 16);
+
+  return Packet_Put (CMD_REACTIVE_POWER, powerUnion.s.Lo, powerUnion.s.Hi, 0);
+}
+
+/*! @brief Sends the apparent power in VA
+ *
+ *  @return bool - TRUE if the packet was sent successfully
+ */
+bool HandleApparentPowerPacket()
+{
+  uint16union_t powerUnion;
+
+  powerUnion.l = (uint16_t) (ApparentPowerVA >> 16);
+
+  return Packet_Put (CMD_APPARENT_POWER, powerUnion.s.Lo, powerUnion.s.Hi, 0);
+}
+
+/*! @brief Sends the four-quadrant energy register in parameter 1 (0 import, 1 export, 2 lagging, 3 leading)
+ *         in Wh or varh as a block
+ *
+ *  @return bool - TRUE if the packets were sent successfully
+ */
+bool HandleEnergyRegisterPacket()
+{
+  uint64_t energyWh;
+  uint32_t value;
+
+  if (!Calc_GetEnergyRegister(Packet_Parameter1, &energyWh))
+    return false;
+
+  value = (uint32_t) energyWh;
+
+  return Packet_PutBlock(CMD_ENERGY_REGISTER, (uint8_t*) &value, sizeof(value));
+}
+
 bool HandleEnergyPacket()
 {
   uint16union_t energyWhunion;
@@ -456,6 +678,559 @@ bool HandlePowerFactorPacket()
   return Packet_Put (CMD_POWER_FACTOR, pfunion.s.Lo, pfunion.s.Hi, 0);
 }
 
+/*! @brief Gets or sets the load profile interval
+ *
+ *  @return bool - TRUE if the packet was handled successfully
+ */
+bool HandleLoadProfilePacket()
+{
+  if (Packet_Parameter3 == 0)
+    return Packet_Put (CMD_LOAD_PROFILE, LoadProfile_GetInterval(), 0, 0);
+
+  else if (Packet_Parameter3 == 1)
+    return LoadProfile_SetInterval(Packet_Parameter1);
+
+  return false;
+}
+
+/*! @brief Sends a 24-bit interval index
+ *
+ *  @param command is the command to send the index with
+ *  @param index is the interval index
+ *  @return bool - TRUE if the packet was sent successfully
+ */
+static bool PutIntervalIndex(const uint8_t command, const uint32_t index)
+{
+  return Packet_Put (command, (uint8_t) index, (uint8_t) (index >> 8), (uint8_t) (index >> 16));
+}
+
+bool HandleLoadProfileOldestPacket()
+{
+  return PutIntervalIndex(CMD_LP_OLDEST, LoadProfile_OldestIndex());
+}
+
+bool HandleLoadProfileNextPacket()
+{
+  return PutIntervalIndex(CMD_LP_NEXT, LoadProfile_NextIndex());
+}
+
+/*! @brief Sends up to LOAD_PROFILE_BURST records starting at the requested interval index
+ *
+ *  The records are sent back to back, packed three bytes per CMD_LP_DATA packet.
+ *  @return bool - TRUE if the records were sent successfully
+ */
+bool HandleLoadProfileReadPacket()
+{
+  uint32_t index = Packet_Parameter1 | ((uint32_t) Packet_Parameter2 << 8) | ((uint32_t) Packet_Parameter3 << 16);
+  uint32_t nextIndex = LoadProfile_NextIndex();
+
+  TLoadProfileRecord records[LOAD_PROFILE_BURST];
+  uint8_t nbRecords = 0;
+
+  if (index < LoadProfile_OldestIndex() || index >= nextIndex)
+    return false;
+
+  while (nbRecords < LOAD_PROFILE_BURST && index + nbRecords < nextIndex)
+  {
+    if (!LoadProfile_Read(index + nbRecords, &records[nbRecords]))
+      break;
+
+    nbRecords++;
+  }
+
+  // Tell the PC where the burst starts, then send the records
+  if (!PutIntervalIndex(CMD_LP_READ, index))
+    return false;
+
+  return Packet_PutBlock(CMD_LP_DATA, (uint8_t*) records, nbRecords * sizeof(TLoadProfileRecord));
+}
+
+/*! @brief Gets or resets the peak demand of the tariff period in parameter 1
+ *
+ *  @return bool - TRUE if the packet was handled successfully
+ */
+bool HandleDemandPeakPacket()
+{
+  TDemandPeak peak;
+  uint16union_t demandUnion;
+
+  if (Packet_Parameter3 == 0)
+  {
+    if (!Demand_GetPeak(Packet_Parameter1, &peak))
+      return false;
+
+    demandUnion.l = (uint16_t) peak.demandW;
+
+    return Packet_Put (CMD_DEMAND_PEAK, demandUnion.s.Lo, demandUnion.s.Hi, Packet_Parameter1);
+  }
+
+  else if (Packet_Parameter3 == 1)
+    return Demand_ResetPeak(Packet_Parameter1);
+
+  return false;
+}
+
+/*! @brief Sends the RTC time of the peak demand of the tariff period in parameter 1 as a block
+ *
+ *  @return bool - TRUE if the packets were sent successfully
+ */
+bool HandleDemandTimePacket()
+{
+  TDemandPeak peak;
+
+  if (!Demand_GetPeak(Packet_Parameter1, &peak))
+    return false;
+
+  return Packet_PutBlock(CMD_DEMAND_TIME, (uint8_t*) &peak.timestamp, sizeof(peak.timestamp));
+}
+
+/*! @brief Sends the rolling demand (parameter 3 = 0), the block demand (1) or the window maximum (2)
+ *
+ *  @return bool - TRUE if the packet was sent successfully
+ */
+bool HandleDemandPacket()
+{
+  uint16union_t demandUnion;
+
+  switch (Packet_Parameter3)
+  {
+    case 0:
+      demandUnion.l = (uint16_t) Demand_GetRolling();
+      break;
+
+    case 1:
+      demandUnion.l = (uint16_t) Demand_GetBlock();
+      break;
+
+    case 2:
+      demandUnion.l = (uint16_t) Demand_GetWindowMax();
+      break;
+
+    default:
+      return false;
+  }
+
+  return Packet_Put (CMD_DEMAND, demandUnion.s.Lo, demandUnion.s.Hi, Packet_Parameter3);
+}
+
+/*! @brief Sets a slot of the staged tariff schedule
+ *
+ *  Parameters 1 and 2 are the slot entry, parameter 3 is the rate.
+ *  @return bool - TRUE if the slot was set
+ */
+bool HandleTOUSlotPacket()
+{
+  return Tariff_SetSlot(Packet_Parameter12, Packet_Parameter3);
+}
+
+/*! @brief Sets the rate in parameter 1 of the staged tariff schedule, in thousandths of a cent per kWh
+ *
+ *  @return bool - TRUE if the rate was set
+ */
+bool HandleTOURatePacket()
+{
+  return Tariff_SetRate(Packet_Parameter1, Packet_Parameter2 | ((uint16_t) Packet_Parameter3 << 8));
+}
+
+/*! @brief Sets the holiday or season start in parameter 1 of the staged tariff schedule
+ *
+ *  @return bool - TRUE if the day was set
+ */
+bool HandleTOUDayPacket()
+{
+  return Tariff_SetDay(Packet_Parameter1, Packet_Parameter2 | ((uint16_t) Packet_Parameter3 << 8));
+}
+
+/*! @brief Sets the rate billed in place of the rate in parameter 2 during the season in parameter 1
+ *
+ *  @return bool - TRUE if the season rate was set
+ */
+bool HandleTOUSeasonPacket()
+{
+  return Tariff_SetSeasonRate(Packet_Parameter1, Packet_Parameter2, Packet_Parameter3);
+}
+
+/*! @brief Sends the active rate (parameter 3 = 0), commits (1) or reverts (2) the staged tariff schedule
+ *
+ *  @return bool - TRUE if the packet was handled successfully
+ */
+bool HandleTOUPacket()
+{
+  switch (Packet_Parameter3)
+  {
+    case 0:
+      return Packet_Put (CMD_TOU, Tariff_GetActiveRate(), 0, 0);
+
+    case 1:
+      return Tariff_Commit();
+
+    case 2:
+      Tariff_Revert();
+      return true;
+  }
+
+  return false;
+}
+
+/*! @brief Sends the energy in Wh and the cost in cents billed at the rate in parameter 1 as a block
+ *
+ *  @return bool - TRUE if the packets were sent successfully
+ */
+bool HandleTOURegisterPacket()
+{
+  TTariffRegister tariffRegister;
+  uint32_t values[2];
+
+  if (!Tariff_GetRegister(Packet_Parameter1, &tariffRegister))
+    return false;
+
+  values[0] = (uint32_t) tariffRegister.energyWh;
+  values[1] = (uint32_t) tariffRegister.costCents;
+
+  return Packet_PutBlock(CMD_TOU_REGISTER, (uint8_t*) values, sizeof(values));
+}
+
+/*! @brief Sends the level of the harmonic in parameter 2 of the channel in parameter 1 (0 voltage, 1 current)
+ *
+ *  The level is in thousandths of the fundamental; parameter 3 of the reply is the channel in bit 7 and the harmonic.
+ *  @return bool - TRUE if the packet was sent successfully
+ */
+bool HandleHarmonicPacket()
+{
+  uint16union_t levelUnion;
+
+  if (Packet_Parameter1 >= HARMONIC_NB_CHANNELS || Packet_Parameter2 == 0 || Packet_Parameter2 > Harmonic_GetNbHarmonics())
+    return false;
+
+  levelUnion.l = Harmonic_GetLevel(Packet_Parameter1, Packet_Parameter2);
+
+  return Packet_Put (CMD_HARMONIC, levelUnion.s.Lo, levelUnion.s.Hi, (Packet_Parameter1 << 7) | Packet_Parameter2);
+}
+
+/*! @brief Sends the THD of the channel in parameter 1 in tenths of a percent (parameter 3 = 0),
+ *         or sets the number of cycles between analyses to parameter 1, 0 to stop (parameter 3 = 1)
+ *
+ *  @return bool - TRUE if the packet was handled successfully
+ */
+bool HandleTHDPacket()
+{
+  uint16union_t thdUnion;
+
+  switch (Packet_Parameter3)
+  {
+    case 0:
+      if (Packet_Parameter1 >= HARMONIC_NB_CHANNELS)
+        return false;
+
+      thdUnion.l = Harmonic_GetTHD(Packet_Parameter1);
+
+      return Packet_Put (CMD_THD, thdUnion.s.Lo, thdUnion.s.Hi, Packet_Parameter1);
+
+    case 1:
+      Harmonic_SetDecimation(Packet_Parameter1);
+      return true;
+  }
+
+  return false;
+}
+
+/*! @brief Sends the calibration item in parameter 1, with the value in the first two bytes
+ *
+ *  @return bool - TRUE if the packet was sent successfully
+ */
+bool HandleCalGetPacket()
+{
+  uint16union_t valueUnion;
+
+  if (!Conditioning_GetItem(Packet_Parameter1, &valueUnion.l))
+    return false;
+
+  return Packet_Put (CMD_CAL_GET, valueUnion.s.Lo, valueUnion.s.Hi, Packet_Parameter1);
+}
+
+/*! @brief Sets the calibration item in parameter 1 to parameters 2 and 3 and saves it in the Flash
+ *
+ *  @return bool - TRUE if the item was set
+ */
+bool HandleCalSetPacket()
+{
+  return Conditioning_SetItem(Packet_Parameter1, Packet_Parameter2 | ((uint16_t) Packet_Parameter3 << 8));
+}
+
+/*! @brief Sends the RMS voltage aggregated over the period in parameter 1
+ *         (0 half cycle, 1 10/12 cycles, 2 150/180 cycles, 3 10 minutes) in 0.1 V
+ *
+ *  Parameter 3 of the reply is the period, with bit 7 set if an event overlapped it.
+ *  @return bool - TRUE if the packet was sent successfully
+ */
+bool HandlePQVrmsPacket()
+{
+  uint16union_t vrmsUnion;
+  bool flagged;
+
+  if (Packet_Parameter1 >= POWER_QUALITY_NB_AGGREGATES)
+    return false;
+
+  vrmsUnion.l = (uint16_t) (((uint64_t) PowerQuality_GetVrms(Packet_Parameter1, &flagged) * 10) >> 16);
+
+  return Packet_Put (CMD_PQ_VRMS, vrmsUnion.s.Lo, vrmsUnion.s.Hi, Packet_Parameter1 | (flagged << 7));
+}
+
+bool HandlePQOldestPacket()
+{
+  return PutIntervalIndex(CMD_PQ_OLDEST, PowerQuality_OldestIndex());
+}
+
+bool HandlePQNextPacket()
+{
+  return PutIntervalIndex(CMD_PQ_NEXT, PowerQuality_NextIndex());
+}
+
+/*! @brief Sends the power quality event at the requested index
+ *
+ *  The event is packed three bytes per CMD_PQ_DATA packet.
+ *  @return bool - TRUE if the event was sent successfully
+ */
+bool HandlePQReadPacket()
+{
+  uint32_t index = Packet_Parameter1 | ((uint32_t) Packet_Parameter2 << 8) | ((uint32_t) Packet_Parameter3 << 16);
+  TPowerQualityEvent event;
+
+  if (!PowerQuality_Read(index, &event))
+    return false;
+
+  // Tell the PC which event follows, then send it
+  if (!PutIntervalIndex(CMD_PQ_READ, index))
+    return false;
+
+  return Packet_PutBlock(CMD_PQ_DATA, (uint8_t*) &event, sizeof(event));
+}
+
+/*! @brief Handles the waveform capture command in parameter 1
+ *
+ *  0 sends the state, cause of the frozen window and pre-trigger cycles, followed by a CMD_WAVEFORM_INFO block
+ *  if a window is frozen; 1 triggers a capture; 2 releases the frozen window; 3 sets the pre-trigger cycles to parameter 2.
+ *  @return bool - TRUE if the packet was handled successfully
+ */
+bool HandleWaveformPacket()
+{
+  TWaveformInfo info;
+  bool frozen;
+
+  switch (Packet_Parameter1)
+  {
+    case 0:
+      frozen = Waveform_GetInfo(&info);
+
+      if (!Packet_Put (CMD_WAVEFORM, Waveform_GetState(), frozen ? info.cause : 0, Waveform_GetPreCycles()))
+        return false;
+
+      if (!frozen)
+        return true;
+
+      return Packet_PutBlock(CMD_WAVEFORM_INFO, (uint8_t*) &info, sizeof(info));
+
+    case 1:
+      // A held window has to be released before the capture can trigger again
+      if (Waveform_GetState() == WAVEFORM_STATE_FROZEN)
+        return false;
+
+      Waveform_Trigger();
+      return true;
+
+    case 2:
+      Waveform_Release();
+      return true;
+
+    case 3:
+      return Waveform_SetPreCycles(Packet_Parameter2);
+  }
+
+  return false;
+}
+
+/*! @brief Sends the waveform trigger level in parameter 1, with the value in the first two bytes
+ *
+ *  @return bool - TRUE if the packet was sent successfully
+ */
+bool HandleWaveformLevelGetPacket()
+{
+  uint16union_t valueUnion;
+
+  if (!Waveform_GetLevel(Packet_Parameter1, &valueUnion.l))
+    return false;
+
+  return Packet_Put (CMD_WAVEFORM_LEVEL_GET, valueUnion.s.Lo, valueUnion.s.Hi, Packet_Parameter1);
+}
+
+/*! @brief Sets the waveform trigger level in parameter 1 to parameters 2 and 3
+ *
+ *  @return bool - TRUE if the level was set
+ */
+bool HandleWaveformLevelSetPacket()
+{
+  return Waveform_SetLevel(Packet_Parameter1, Packet_Parameter2 | ((uint16_t) Packet_Parameter3 << 8));
+}
+
+/*! @brief Sends up to the number of samples in parameter 3 (at most WAVEFORM_BURST) of the frozen window,
+ *         starting at the sample index in parameters 1 and 2
+ *
+ *  The index is echoed, then the voltage and current of each sample are sent interleaved, packed three bytes per CMD_WAVEFORM_DATA packet.
+ *  @return bool - TRUE if the samples were sent successfully
+ */
+bool HandleWaveformReadPacket()
+{
+  uint16_t first = Packet_Parameter1 | ((uint16_t) Packet_Parameter2 << 8);
+  uint16_t nbSamples = (Packet_Parameter3 > WAVEFORM_BURST) ? WAVEFORM_BURST : Packet_Parameter3;
+
+  int16_t samples[2 * WAVEFORM_BURST];
+
+  nbSamples = Waveform_Read(first, nbSamples, samples);
+
+  if (nbSamples == 0)
+    return false;
+
+  // Tell the PC where the burst starts and how long it is, then send the samples
+  if (!Packet_Put (CMD_WAVEFORM_READ, Packet_Parameter1, Packet_Parameter2, (uint8_t) nbSamples))
+    return false;
+
+  return Packet_PutBlock(CMD_WAVEFORM_DATA, (uint8_t*) samples, nbSamples * 2 * sizeof(int16_t));
+}
+
+/*! @brief Sends the stack usage of the thread at the priority in parameter 1
+ *
+ *  The priority, stack size and high-water mark in words are packed three bytes per CMD_STACK packet.
+ *  @return bool - TRUE if the packet was sent successfully
+ */
+bool HandleStackPacket()
+{
+  TStackUsage usage;
+
+  if (!Stack_GetUsage(Packet_Parameter1, &usage))
+    return false;
+
+  return Packet_PutBlock(CMD_STACK, (uint8_t*) &usage, sizeof(usage));
+}
+
+/*! @brief Sends the sample deadline counters (parameter 3 = 0), or resets them (parameter 3 = 1)
+ *
+ *  The counters are packed three bytes per CMD_DEADLINE packet.
+ *  @return bool - TRUE if the packet was handled successfully
+ */
+bool HandleDeadlinePacket()
+{
+  TDeadlineCounters counters;
+
+  switch (Packet_Parameter3)
+  {
+    case 0:
+      Deadline_GetCounters(&counters);
+      return Packet_PutBlock(CMD_DEADLINE, (uint8_t*) &counters, sizeof(counters));
+
+    case 1:
+      Deadline_ResetCounters();
+      return true;
+  }
+
+  return false;
+}
+
+/*! @brief Sends the CPU load over the last second and its peak (parameter 3 = 0), or resets the peak (parameter 3 = 1)
+ *
+ *  The load is packed three bytes per CMD_IDLE packet.
+ *  @return bool - TRUE if the packet was handled successfully
+ */
+bool HandleIdlePacket()
+{
+  TIdleStats stats;
+
+  switch (Packet_Parameter3)
+  {
+    case 0:
+      Idle_Get(&stats);
+      return Packet_PutBlock(CMD_IDLE, (uint8_t*) &stats, sizeof(stats));
+
+    case 1:
+      Idle_ResetPeak();
+      return true;
+  }
+
+  return false;
+}
+
+/*! @brief Sends the result of the last self-test (parameter 3 = 0), or runs the self-test again and sends its result
+ *  (parameter 3 = 1)
+ *
+ *  The result is packed three bytes per CMD_SELFTEST packet.
+ *  @return bool - TRUE if the packet was handled successfully
+ */
+bool HandleSelfTestPacket()
+{
+  TSelfTestResult result;
+
+  switch (Packet_Parameter3)
+  {
+    case 0:
+      break;
+
+    case 1:
+      (void) SelfTest_Run();
+      break;
+
+    default:
+      return false;
+  }
+
+  SelfTest_GetResult(&result);
+
+  return Packet_PutBlock(CMD_SELFTEST, (uint8_t*) &result, sizeof(result));
+}
+
+#ifdef PROFILE_ENABLE
+/*! @brief Sends the cycle statistics of the probe in parameter 1 (parameter 3 = 0), or resets them (parameter 3 = 1)
+ *
+ *  The reply echoes the probe and gives the number of histogram bins, then the statistics follow
+ *  packed three bytes per CMD_PROFILE_DATA packet.
+ *  @return bool - TRUE if the packet was handled successfully
+ */
+bool HandleProfilePacket()
+{
+  TProfileStats stats;
+
+  switch (Packet_Parameter3)
+  {
+    case 0:
+      if (!Profile_Get(Packet_Parameter1, &stats))
+        return false;
+
+      if (!Packet_Put (CMD_PROFILE, Packet_Parameter1, PROFILE_NB_BINS, 0))
+        return false;
+
+      return Packet_PutBlock(CMD_PROFILE_DATA, (uint8_t*) &stats, sizeof(stats));
+
+    case 1:
+      return Profile_Reset(Packet_Parameter1);
+  }
+
+  return false;
+}
+
+/*! @brief Times the FixedPoint kernel in parameter 1 over the range of operands in parameter 2, and sends the cycles
+ *  taken
+ *
+ *  The result is packed three bytes per CMD_BENCHMARK packet.
+ *  @return bool - TRUE if the packet was handled successfully
+ */
+bool HandleBenchmarkPacket()
+{
+  TBenchmarkResult result;
+
+  if (!Benchmark_Run(Packet_Parameter1, Packet_Parameter2, &result))
+    return false;
+
+  return Packet_PutBlock(CMD_BENCHMARK, (uint8_t*) &result, sizeof(result));
+}
+#endif
 
 /***********************************************************************************************************
  * Handle Packets
@@ -503,6 +1278,10 @@ void HandlePackets()
       success = HandleTime2Packet();
       break;
 
+    case CMD_DATE:
+      success = HandleDatePacket();
+      break;
+
     case CMD_POWER:
       success = HandlePowerPacket();
       break;
@@ -530,6 +1309,144 @@ void HandlePackets()
     case CMD_POWER_FACTOR:
       success = HandlePowerFactorPacket();
       break;
+
+    case CMD_LOAD_PROFILE:
+      success = HandleLoadProfilePacket();
+      break;
+
+    case CMD_LP_OLDEST:
+      success = HandleLoadProfileOldestPacket();
+      break;
+
+    case CMD_LP_NEXT:
+      success = HandleLoadProfileNextPacket();
+      break;
+
+    case CMD_LP_READ:
+      success = HandleLoadProfileReadPacket();
+      break;
+
+    case CMD_DEMAND_PEAK:
+      success = HandleDemandPeakPacket();
+      break;
+
+    case CMD_DEMAND_TIME:
+      success = HandleDemandTimePacket();
+      break;
+
+    case CMD_DEMAND:
+      success = HandleDemandPacket();
+      break;
+
+    case CMD_TOU_SLOT:
+      success = HandleTOUSlotPacket();
+      break;
+
+    case CMD_TOU_RATE:
+      success = HandleTOURatePacket();
+      break;
+
+    case CMD_TOU_DAY:
+      success = HandleTOUDayPacket();
+      break;
+
+    case CMD_TOU_SEASON:
+      success = HandleTOUSeasonPacket();
+      break;
+
+    case CMD_TOU:
+      success = HandleTOUPacket();
+      break;
+
+    case CMD_TOU_REGISTER:
+      success = HandleTOURegisterPacket();
+      break;
+
+    case CMD_HARMONIC:
+      success = HandleHarmonicPacket();
+      break;
+
+    case CMD_THD:
+      success = HandleTHDPacket();
+      break;
+
+    case CMD_REACTIVE_POWER:
+      success = HandleReactivePowerPacket();
+      break;
+
+    case CMD_APPARENT_POWER:
+      success = HandleApparentPowerPacket();
+      break;
+
+    case CMD_ENERGY_REGISTER:
+      success = HandleEnergyRegisterPacket();
+      break;
+
+    case CMD_CAL_GET:
+      success = HandleCalGetPacket();
+      break;
+
+    case CMD_CAL_SET:
+      success = HandleCalSetPacket();
+      break;
+
+    case CMD_PQ_VRMS:
+      success = HandlePQVrmsPacket();
+      break;
+
+    case CMD_PQ_OLDEST:
+      success = HandlePQOldestPacket();
+      break;
+
+    case CMD_PQ_NEXT:
+      success = HandlePQNextPacket();
+      break;
+
+    case CMD_PQ_READ:
+      success = HandlePQReadPacket();
+      break;
+
+    case CMD_WAVEFORM:
+      success = HandleWaveformPacket();
+      break;
+
+    case CMD_WAVEFORM_LEVEL_GET:
+      success = HandleWaveformLevelGetPacket();
+      break;
+
+    case CMD_WAVEFORM_LEVEL_SET:
+      success = HandleWaveformLevelSetPacket();
+      break;
+
+    case CMD_WAVEFORM_READ:
+      success = HandleWaveformReadPacket();
+      break;
+
+    case CMD_STACK:
+      success = HandleStackPacket();
+      break;
+
+    case CMD_DEADLINE:
+      success = HandleDeadlinePacket();
+      break;
+
+    case CMD_IDLE:
+      success = HandleIdlePacket();
+      break;
+
+    case CMD_SELFTEST:
+      success = HandleSelfTestPacket();
+      break;
+
+#ifdef PROFILE_ENABLE
+    case CMD_PROFILE:
+      success = HandleProfilePacket();
+      break;
+
+    case CMD_BENCHMARK:
+      success = HandleBenchmarkPacket();
+      break;
+#endif
     }
 
     //Handle Acknowledgement, if requested
@@ -558,20 +1475,38 @@ static bool TowerInit (void)
    // Disable Interrupts
   __DI();
 
+#ifdef PROFILE_ENABLE
+  // Start the cycle counter before anything is timed
+  if (!Profile_Init())
+    PE_DEBUGHALT();
+#endif
+
   // Initialize the Flash Module
   if (!Flash_Init())
     PE_DEBUGHALT();
 
-  // Allocate 16-bits memory in the Flash for Tariff Mode
-  if (!Flash_AllocateVar((void*) &NvTariffMode, sizeof(*NvTariffMode)))
+  // Allocate the Tariff Mode record in the Flash
+  if (!Flash_AllocateRecord(FLASH_RECORD_TARIFF_MODE, TARIFF_MODE_VERSION, sizeof(*NvTariffMode), (volatile void**) &NvTariffMode))
     PE_DEBUGHALT();
 
   //Check if the flash is erased or reprogrammed
   if (NvTariffMode->l == 0xFFFF)
-    //Write the initial tower number to the non-volatile memory
+    //Write the initial tariff mode to the non-volatile memory
     if (!Flash_Write16((uint16_t *) NvTariffMode, DEFAULT_TARIFF_MODE))
       PE_DEBUGHALT();
 
+  // Find the newest load profile record
+  if (!LoadProfile_Init())
+    PE_DEBUGHALT();
+
+  // Load the peak demands
+  if (!Demand_Init())
+    PE_DEBUGHALT();
+
+  // Find the newest power quality event
+  if (!PowerQuality_Init())
+    PE_DEBUGHALT();
+
   //Initialize the Packet module, which in turn initializes the UART module
   if (!Packet_Init(BAUD_RATE, CPU_BUS_CLK_HZ))
     PE_DEBUGHALT();
@@ -592,7 +1527,8 @@ static bool TowerInit (void)
   AnalogGetSemaphore = OS_SemaphoreCreate(0);
 
   // Start the PIT timer with a period of 10ms (10e6 ns)
-  PIT_Set(MAX_SAMPLE_PERIOD, true);
+  if (!PIT_Set(MAX_SAMPLE_PERIOD >> ANALOG_OVERSAMPLE_LOG2, true))
+    PE_DEBUGHALT();
 
   // Initialize the FTM Module
   if (!FTM_Init())
@@ -602,14 +1538,26 @@ static bool TowerInit (void)
   if (!FTM_Set(&FTMChannel))
     PE_DEBUGHALT();
 
-  // Initialize the RTC Module
-  if (!RTC_Init())
+  // Initialize the RTC Module, with the alarm marking the tariff schedule boundaries
+  if (!RTC_Init(&Tariff_AlarmCallback, NULL))
+    PE_DEBUGHALT();
+
+  // Load the tariff schedule and find the active rate
+  if (!Tariff_Init())
+    PE_DEBUGHALT();
+
+  // Set up the waveform capture before the calculation thread feeds it
+  if (!Waveform_Init())
     PE_DEBUGHALT();
 
   // Initialize the calculation threads
   if (!Calc_Init())
     PE_DEBUGHALT();
 
+  // Start the harmonic analysis thread
+  if (!Harmonic_Init())
+    PE_DEBUGHALT();
+
   if (!HMI_Init(FSMState))
     PE_DEBUGHALT();
 
@@ -649,22 +1597,26 @@ int main(void)
   if (!TowerInit())
     PE_DEBUGHALT();
 
-  error = OS_ThreadCreate(RTCThread,
-                          NULL,
-                          &RTCThreadStack[THREAD_STACK_SIZE - 1],
-                          RTC_THREAD_PRIORITY);
+  error = Stack_ThreadCreate(RTCThread,
+                             NULL,
+                             RTCThreadStack,
+                             RTC_THREAD_STACK_SIZE,
+                             RTC_THREAD_PRIORITY);
   if (error)
     PE_DEBUGHALT();
 
   // PacketReceiveThread; Lowest Priority
- error = OS_ThreadCreate(PacketReceiveThread,
-                         NULL,
-                         &PacketReceiveThreadStack[THREAD_STACK_SIZE - 1],
-                         PACKETRECEIVE_THREAD_PRIORITY);
+ error = Stack_ThreadCreate(PacketReceiveThread,
+                            NULL,
+                            PacketReceiveThreadStack,
+                            PACKET_THREAD_STACK_SIZE,
+                            PACKETRECEIVE_THREAD_PRIORITY);
  if (error)
    PE_DEBUGHALT();
 
-
+  // Idle thread; sleeps the CPU whenever no other thread is ready
+  if (!Idle_Init(CPU_CORE_CLK_HZ))
+    PE_DEBUGHALT();
 
   // Start multithreading - never returns!
   OS_Start();
@@ -203,3 +203,31 @@ bool Packet_Put(const uint8_t command, const uint8_t parameter1, const uint8_t p
   return true;
 }
 
+/*! @brief Sends a block of data as consecutive packets, three bytes per packet.
+ *
+ *  @param command The command of every packet.
+ *  @param data The address of the block.
+ *  @param size The number of bytes in the block. The last packet is padded with zeros.
+ *  @return bool - TRUE if all the packets were sent.
+ */
+bool Packet_PutBlock(const uint8_t command, const uint8_t* const data, const uint16_t size)
+{
+  uint16_t index;
+
+  if (!data)
+    return false;
+
+  for (index = 0; index < size; index += 3)
+  {
+    uint8_t parameters[3] = {0, 0, 0};
+    uint8_t byteNb;
+
+    for (byteNb = 0; byteNb < 3 && index + byteNb < size; byteNb++)
+      parameters[byteNb] = data[index + byteNb];
+
+    if (!Packet_Put(command, parameters[0], parameters[1], parameters[2]))
+      return false;
+  }
+
+  return true;
+}
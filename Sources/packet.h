@@ -91,6 +91,15 @@ bool Packet_Get(void);
  */
 bool Packet_Put(const uint8_t command, const uint8_t parameter1, const uint8_t parameter2, const uint8_t parameter3);
 
+/*! @brief Sends a block of data as consecutive packets, three bytes per packet.
+ *
+ *  @param command The command of every packet.
+ *  @param data The address of the block.
+ *  @param size The number of bytes in the block. The last packet is padded with zeros.
+ *  @return bool - TRUE if all the packets were sent.
+ */
+bool Packet_PutBlock(const uint8_t command, const uint8_t* const data, const uint16_t size);
+
 #endif
 
 /*!
@@ -14,6 +14,10 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+// Places a function in the .ramfunc section, which the startup copies to SRAM_U so it runs without Flash wait states.
+// Calls to it are made long, since RAM is out of branch range of the Flash.
+#define RAMFUNC __attribute__ ((section (".ramfunc"), long_call))
+
 // Unions to efficiently access hi and lo parts of integers and words
 typedef union
 {
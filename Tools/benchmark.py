@@ -0,0 +1,280 @@
+#!/usr/bin/env python3
+"""FixedPoint micro-benchmarks for the DEM, run on the tower over the serial link.
+
+Asks a tower built with -DPROFILE_ENABLE to time each kernel of Sources/Benchmark.c over
+each range of operands (CMD_BENCHMARK), and writes the cycles and nanoseconds per call
+as CSV, one row per kernel and range, so runs can be kept and compared over time.
+
+    python3 Tools/benchmark.py --port /dev/ttyUSB0 [--csv bench.csv] [--elf Debug/Project.elf]
+    python3 Tools/benchmark.py --elf Debug/Project.elf          # only check the inlining
+
+With --elf, the linked image is also checked for calls to each FixedPoint routine: a
+routine that is still called somewhere was not inlined there. The routines run from RAM
+are called through a register (long_call), so those calls are found from the address
+of the routine in the caller's literal pool. The kernels of Benchmark.c call each routine
+themselves, so check an image built without PROFILE_ENABLE to see how the metering code
+calls them.
+
+The cycles are the quickest of the passes less the loop around the calls; they are only
+as steady as the cache, so compare runs of the same build on the same tower.
+
+The serial link is opened with termios, so this runs on Linux or macOS.
+"""
+
+import argparse
+import csv
+import os
+import re
+import select
+import struct
+import subprocess
+import sys
+import termios
+import time
+
+CMD_BENCHMARK = 0x43
+
+# Sources/Benchmark.h
+KERNELS = ["multiply", "multiply_u", "divide", "divide_u", "square_root", "square_root_u64",
+           "conditioning", "rms_finalisation"]
+RANGES = ["small", "mains", "full"]
+
+# The FixedPoint routine each kernel times; the composite kernels are left out of the inlining check
+ROUTINES = {
+    "multiply": "FixedPoint_Multiply",
+    "multiply_u": "FixedPoint_MultiplyU",
+    "divide": "FixedPoint_Divide",
+    "divide_u": "FixedPoint_DivideU",
+    "square_root": "FixedPoint_SquareRoot",
+    "square_root_u64": "FixedPoint_SquareRootU64",
+}
+
+# TBenchmarkResult: kernel, range, operations, bestCycles, worstCycles, overheadCycles, coreClock
+RESULT = struct.Struct("<BBHIIII")
+
+BAUDS = {9600: termios.B9600, 19200: termios.B19200, 38400: termios.B38400,
+         57600: termios.B57600, 115200: termios.B115200}
+
+FUNCTION_RE = re.compile(r"^[0-9a-f]+ <([^>]+)>:$")
+SYMBOL_RE = re.compile(r"^([0-9a-f]+) .{6}F \S+\t[0-9a-f]+ (\S+)$")
+CALL_RE = re.compile(r"\tb(?:l|lx|\.w|)\s+[0-9a-f]+ <([^>+]+)>")
+WORD_RE = re.compile(r"\t\.word\t0x([0-9a-f]+)")
+
+FIELDS = ["time", "build", "kernel", "range", "operations", "cycles_per_op", "worst_cycles_per_op",
+          "ns_per_op", "overhead_cycles", "inlined"]
+
+
+class Tower:
+    """The serial link to the tower, sending and receiving 5-byte packets."""
+
+    def __init__(self, port, baud, timeout):
+        self.timeout = timeout
+
+        try:
+            self.fd = os.open(port, os.O_RDWR | os.O_NOCTTY)
+        except OSError as error:
+            sys.exit("Could not open {}: {}".format(port, error))
+
+        attributes = termios.tcgetattr(self.fd)
+        attributes[0] = 0                                                       # iflag
+        attributes[1] = 0                                                       # oflag
+        attributes[2] = termios.CS8 | termios.CREAD | termios.CLOCAL            # cflag, 8N1
+        attributes[3] = 0                                                       # lflag, raw
+        attributes[4] = attributes[5] = BAUDS[baud]
+        attributes[6][termios.VMIN] = 0
+        attributes[6][termios.VTIME] = 0
+        termios.tcsetattr(self.fd, termios.TCSANOW, attributes)
+        termios.tcflush(self.fd, termios.TCIOFLUSH)
+
+        self.received = bytearray()
+
+    def close(self):
+        os.close(self.fd)
+
+    def put(self, command, parameter1, parameter2, parameter3):
+        packet = bytes([command, parameter1, parameter2, parameter3])
+        os.write(self.fd, packet + bytes([packet[0] ^ packet[1] ^ packet[2] ^ packet[3]]))
+
+    def get(self, deadline):
+        """Returns the next packet as (command, p1, p2, p3), or None if none comes by the deadline."""
+        while True:
+            # Slide over bytes that do not start a packet, as Packet_Get does
+            while len(self.received) >= 5:
+                packet = self.received[:5]
+
+                if packet[0] ^ packet[1] ^ packet[2] ^ packet[3] == packet[4]:
+                    del self.received[:5]
+                    return tuple(packet[:4])
+
+                del self.received[0]
+
+            wait = deadline - time.monotonic()
+
+            if wait <= 0:
+                return None
+
+            if select.select([self.fd], [], [], wait)[0]:
+                self.received += os.read(self.fd, 64)
+
+    def benchmark(self, kernel, range_):
+        """Runs a kernel on the tower and returns its TBenchmarkResult fields."""
+        self.put(CMD_BENCHMARK, kernel, range_, 0)
+
+        data = bytearray()
+        deadline = time.monotonic() + self.timeout
+
+        while len(data) < RESULT.size:
+            packet = self.get(deadline)
+
+            if packet is None:
+                sys.exit("No result for {} over {}; is the tower built with -DPROFILE_ENABLE?".format(
+                    KERNELS[kernel], RANGES[range_]))
+
+            # Other packets, such as the periodic ones, are let through
+            if packet[0] == CMD_BENCHMARK:
+                data += bytes(packet[1:])
+
+        return RESULT.unpack(bytes(data[:RESULT.size]))
+
+
+def run(command):
+    try:
+        return subprocess.run(command, check=True, capture_output=True, text=True).stdout
+    except (OSError, subprocess.CalledProcessError) as error:
+        sys.exit("Could not run {}: {}".format(command[0], error))
+
+
+def find_calls(objdump, elf):
+    """Returns {routine: set of functions calling it} for the FixedPoint routines in the image.
+
+    A routine missing from the image was inlined everywhere, or not used.
+    """
+    addresses = {}
+
+    for line in run([objdump, "-t", elf]).splitlines():
+        match = SYMBOL_RE.match(line)
+
+        if match and match.group(2) in ROUTINES.values():
+            # A Thumb function is called at its address with bit 0 set
+            addresses[int(match.group(1), 16) | 1] = match.group(2)
+
+    callers = {routine: set() for routine in addresses.values()}
+    function = None
+
+    for line in run([objdump, "-d", "--no-show-raw-insn", elf]).splitlines():
+        match = FUNCTION_RE.match(line)
+
+        if match:
+            function = match.group(1)
+            continue
+
+        match = CALL_RE.search(line)
+
+        if match and match.group(1) in callers and match.group(1) != function:
+            callers[match.group(1)].add(function)
+            continue
+
+        match = WORD_RE.search(line)
+
+        if match and int(match.group(1), 16) in addresses:
+            routine = addresses[int(match.group(1), 16)]
+
+            # Its own address is not a call
+            if routine != function:
+                callers[routine].add(function)
+
+    return callers
+
+
+def inlining(callers, kernel):
+    """Returns whether the routine a kernel times is inlined everywhere: yes, no, or empty if unknown."""
+    routine = ROUTINES.get(kernel)
+
+    if callers is None or routine is None:
+        return ""
+
+    if routine not in callers or not callers[routine]:
+        return "yes"
+
+    return "no"
+
+
+def report_inlining(callers):
+    print("{:<26} {:<8} {}".format("Routine", "Inlined", "Called from"))
+
+    for kernel, routine in ROUTINES.items():
+        print("{:<26} {:<8} {}".format(routine, inlining(callers, kernel),
+                                       ", ".join(sorted(callers.get(routine, ()))) or "-"))
+
+
+def build_name():
+    """Returns the commit the image was built from, as git describes it, or empty if unknown."""
+    try:
+        return subprocess.run(["git", "describe", "--always", "--dirty"], check=True, capture_output=True,
+                              text=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return ""
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--port", help="serial port of the tower, e.g. /dev/ttyUSB0")
+    parser.add_argument("--baud", type=int, default=115200, choices=sorted(BAUDS))
+    parser.add_argument("--timeout", type=float, default=2.0, help="seconds to wait for each result")
+    parser.add_argument("--csv", help="file to add the results to; they are written to the output if not given")
+    parser.add_argument("--elf", help="linked image to check the inlining of the FixedPoint routines in")
+    parser.add_argument("--objdump", default="arm-none-eabi-objdump")
+    parser.add_argument("--kernel", choices=KERNELS, action="append", help="kernel to run; all if not given")
+    args = parser.parse_args()
+
+    if not args.port and not args.elf:
+        parser.error("give --port to run the benchmarks, --elf to check the inlining, or both")
+
+    callers = find_calls(args.objdump, args.elf) if args.elf else None
+
+    if not args.port:
+        report_inlining(callers)
+        return
+
+    tower = Tower(args.port, args.baud, args.timeout)
+    stamp = time.strftime("%Y-%m-%dT%H:%M:%S")
+    build = build_name()
+    rows = []
+
+    try:
+        for kernel in args.kernel or KERNELS:
+            for range_ in RANGES:
+                _, _, operations, best, worst, overhead, clock = tower.benchmark(KERNELS.index(kernel),
+                                                                                 RANGES.index(range_))
+                rows.append({
+                    "time": stamp,
+                    "build": build,
+                    "kernel": kernel,
+                    "range": range_,
+                    "operations": operations,
+                    "cycles_per_op": "{:.2f}".format(best / operations),
+                    "worst_cycles_per_op": "{:.2f}".format(worst / operations),
+                    "ns_per_op": "{:.1f}".format(best * 1e9 / operations / clock),
+                    "overhead_cycles": overhead,
+                    "inlined": inlining(callers, kernel),
+                })
+    finally:
+        tower.close()
+
+    new = not args.csv or not os.path.exists(args.csv) or os.path.getsize(args.csv) == 0
+    out = open(args.csv, "a", newline="") if args.csv else sys.stdout
+
+    try:
+        writer = csv.DictWriter(out, fieldnames=FIELDS)
+
+        if new:
+            writer.writeheader()
+
+        writer.writerows(rows)
+    finally:
+        if args.csv:
+            out.close()
+
+
+if __name__ == "__main__":
+    main()
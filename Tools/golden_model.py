@@ -0,0 +1,329 @@
+#!/usr/bin/env python3
+"""Golden model of the DEM metering arithmetic, for the self-test vectors in Sources/SelfTest.c.
+
+Works each vector out twice: bit-exact, following the 32Q16 routines of FixedPoint.c, the
+scaling of Conditioning.c with a unity gain trim, the per-cycle arithmetic of Calc.c and
+the cycle to frequency conversion of Frequency.c step by step, and exactly, with
+rationals. The bit-exact results are what the self-test expects; the exact ones show how
+far the fixed-point arithmetic is from the true value.
+
+    python3 Tools/golden_model.py            # print the error of each cycle vector
+    python3 Tools/golden_model.py --c        # print the vector tables for SelfTest.c
+
+A change to FixedPoint.c, or to the arithmetic of Conditioning.c, Calc.c or Frequency.c,
+that changes a result must change this model too, and the tables must be made again; the self-test fails until they are.
+"""
+
+import argparse
+import math
+from fractions import Fraction
+
+NB_SAMPLES_LOG2 = 4
+NB_SAMPLES = 1 << NB_SAMPLES_LOG2
+
+# Calc.c
+MAX_ADC_OUTPUT_32Q16 = (1 << 31) - (1 << 16)
+ADC_VOLTAGE_RANGE_32Q16 = 10 << 16
+VOLTAGE_RAW_ADC_RATIO = 100
+CURRENT_RAW_ADC_RATIO = 1
+SECONDS_PER_NS_Q56 = 72057594
+
+# Conditioning.h and Conditioning.c
+INPUT_FRACTION_BITS = 4
+FRACTION_BITS = 12
+
+# Tariff.h
+WS_PER_WH = 3600 << 16
+COST_PER_CENT = 3600000 << 32
+
+RATE = 1671168                  # 25.5 cents/kWh, 32Q16, the rate the cycles are billed at
+
+SAMPLE_PERIOD_NS = 1250000      # 16 samples of a 50 Hz cycle
+SQUARE_ROOT_ITERATIONS = 15     # as for the first cycle in Calc_Vrms and Calc_Irms
+NB_CARRY_CYCLES = 3600          # cycles of energy carried into Wh
+NB_COST_CYCLES = 36000          # cycles of imported energy billed, enough to carry whole cents
+
+# (name, volts RMS, amps RMS, degrees the current lags by, 3rd harmonic of the current in percent)
+CYCLES = [
+    ("230 V, 5 A, unity", 230, 5, 0, 0),
+    ("240 V, 3 A, lagging 60", 240, 3, 60, 0),
+    ("207 V sag, 2 A, exporting", 207, 2, 180, 0),
+    ("253 V swell, 4 A, 30% 3rd harmonic", 253, 4, 0, 30),
+]
+
+# Lengths of mains cycles in ns, for the frequency: 50 and 60 Hz, the ends of the tracked range,
+# and cycles either side of 50 Hz
+FREQUENCIES = [20000000, 16666667, 22222222, 15384615, 19999999, 20000001, 21052631]
+
+# (operation, a, b); a square root of a 64-bit radicand takes its high and low words
+MUL, MULU, DIV, DIVU, SQRT, SQRTU64 = range(6)
+OPERATIONS = ["SELFTEST_MULTIPLY", "SELFTEST_MULTIPLY_U", "SELFTEST_DIVIDE", "SELFTEST_DIVIDE_U",
+              "SELFTEST_SQUARE_ROOT", "SELFTEST_SQUARE_ROOT_U64"]
+
+PRIMITIVES = [
+    (MUL, 3 << 16, 5 << 16),
+    (MUL, -(3 << 16), 5 << 16),
+    (MUL, -(1 << 15), 1),
+    (MUL, 0x7FFFFFFF, 1 << 16),
+    (MUL, 23 << 16 | 0x8000, -(23 << 16 | 0x8000)),
+    (MULU, 0xFFFFFFFF, 1 << 15),
+    (MULU, 230 << 16, 3 << 16),
+    (DIV, 1 << 16, 3 << 16),
+    (DIV, -(1 << 16), 3 << 16),
+    (DIV, 325 << 16, -(10 << 16)),
+    (DIV, 7, 1 << 16),
+    (DIVU, 0xFFFFFFFF, 0x7FFFFFFF),
+    (DIVU, 1000 << 16, 3 << 16),
+    (SQRT, 529 << 16, 1 << 16),
+    (SQRT, 2 << 16, 1 << 16),
+    (SQRT, 2500 << 16, 50 << 16),
+    (SQRTU64, 0, 2),
+    (SQRTU64, 225, 0),
+    (SQRTU64, 0x0000FFFF, 0xFFFFFFFF),
+    (SQRTU64, 0x3FFFFFFF, 0xFFFFFFFF),
+]
+
+
+def int32(value):
+    """Wraps a value to int32_t, as a cast does."""
+    value &= 0xFFFFFFFF
+    return value - (1 << 32) if value & 0x80000000 else value
+
+
+def uint32(value):
+    return value & 0xFFFFFFFF
+
+
+def uint64(value):
+    return value & 0xFFFFFFFFFFFFFFFF
+
+
+def int64(value):
+    value = uint64(value)
+    return value - (1 << 64) if value & (1 << 63) else value
+
+
+def c_divide(dividend, divisor):
+    """Divides, rounding towards zero as C does."""
+    quotient = abs(dividend) // abs(divisor)
+    return quotient if (dividend < 0) == (divisor < 0) else -quotient
+
+
+# FixedPoint.c, bit for bit; >> on a negative value is arithmetic, as GCC does for the Cortex-M4
+def multiply(a, b):
+    return int32((a * b) >> 16)
+
+
+def multiply_u(a, b):
+    return uint32((uint64(a) * uint64(b)) >> 16)
+
+
+def divide(a, b):
+    return int32(c_divide(a << 16, b))
+
+
+def divide_u(a, b):
+    return uint32(uint64(uint64(a) << 16) // b)
+
+
+def square_root(radicand, guess, iterations):
+    x = guess
+
+    for _ in range(iterations):
+        x = int32(divide(radicand, x) + x) >> 1
+
+    return x
+
+
+def c_mean(total, count):
+    """Follows Calc_CycleMean: a shift for a power of two samples, otherwise a C division."""
+    if count & (count - 1) == 0:
+        return int32(total >> (count.bit_length() - 1))
+
+    return int32(c_divide(total, count))
+
+
+def nominal_gain(ratio):
+    """Follows the nominal gain Calc_Init gives Conditioning_Init, in V or A per count, Q32."""
+    return int32((ADC_VOLTAGE_RANGE_32Q16 * (ratio << 16)) // (MAX_ADC_OUTPUT_32Q16 >> 16))
+
+
+def scale_nominal(counts, ratio):
+    """Follows Conditioning_ScaleNominal for a sample in whole ADC counts."""
+    sample = (counts << INPUT_FRACTION_BITS) << (FRACTION_BITS - INPUT_FRACTION_BITS)
+    return int32((sample * nominal_gain(ratio)) >> (16 + FRACTION_BITS))
+
+
+def frequency_times10(cycle_ns):
+    """Follows Frequency_Times10FromCycle."""
+    return 1000000000 // (cycle_ns // 10)
+
+
+def square_root_u64(radicand):
+    return math.isqrt(radicand)
+
+
+def primitive(operation, a, b):
+    if operation == MUL:
+        return multiply(a, b)
+    if operation == MULU:
+        return multiply_u(a, b)
+    if operation == DIV:
+        return divide(a, b)
+    if operation == DIVU:
+        return divide_u(a, b)
+    if operation == SQRT:
+        return square_root(a, b, SQUARE_ROOT_ITERATIONS)
+    return square_root_u64(uint32(a) << 32 | uint32(b))
+
+
+def samples(volts, amps, lag, harmonic):
+    """Returns a cycle of voltage and current ADC counts, rounded to the nearest count."""
+    counts_per_volt = 32767 / 10
+    voltage, current = [], []
+
+    for n in range(NB_SAMPLES):
+        angle = 2 * math.pi * n / NB_SAMPLES
+        fundamental = math.sin(angle - math.radians(lag))
+        third = harmonic / 100 * math.sin(3 * angle)
+        scale = math.sqrt(1 + (harmonic / 100) ** 2)
+
+        voltage.append(round(volts * math.sqrt(2) / VOLTAGE_RAW_ADC_RATIO * math.sin(angle) * counts_per_volt))
+        current.append(round(amps * math.sqrt(2) * (fundamental + third) / scale * counts_per_volt))
+
+    return voltage, current
+
+
+def carry(amount, unit, cycles):
+    """Follows FixedPoint_AccumulateCarry over a number of cycles; returns the whole units and the remainder."""
+    whole = remainder = 0
+
+    for _ in range(cycles):
+        remainder += amount
+
+        if remainder >= unit:
+            whole += remainder // unit
+            remainder %= unit
+
+    return whole, remainder
+
+
+def fixed_cycle(voltage_adc, current_adc):
+    """Follows Conditioning_ScaleNominal and the Calc helpers for one cycle, as SelfTest.c does."""
+    sum_volts = sum_amps = sum_power = 0
+
+    for v_adc, i_adc in zip(voltage_adc, current_adc):
+        v = scale_nominal(v_adc, VOLTAGE_RAW_ADC_RATIO)
+        i = scale_nominal(i_adc, CURRENT_RAW_ADC_RATIO)
+
+        # Calc_VoltageSquared and Calc_CurrentSquared
+        v_scaled = divide(v, 10 << 16)
+        i_scaled = multiply(i, 10 << 16)
+
+        sum_volts += multiply(v_scaled, v_scaled)
+        sum_amps += multiply(i_scaled, i_scaled)
+        sum_power += multiply(v, i)
+
+    # Calc_RootMeanSquare from the first guess, then Calc_VrmsFromRoot and Calc_IrmsFromRoot
+    vrms = multiply(square_root(c_mean(sum_volts, NB_SAMPLES), 1 << 16, SQUARE_ROOT_ITERATIONS), 10 << 16)
+    irms = divide(square_root(c_mean(sum_amps, NB_SAMPLES), 1 << 16, SQUARE_ROOT_ITERATIONS), 10 << 16)
+    power = c_mean(sum_power, NB_SAMPLES)
+
+    # Calc_CycleEnergy
+    period_seconds = (SAMPLE_PERIOD_NS * SECONDS_PER_NS_Q56) >> 24
+    energy = int64(sum_power * period_seconds) >> 32
+
+    # The energy carried into Wh over an hour of cycles, and the cost of the imported energy as Calc_CycleCost bills it
+    wh, remainder = carry(abs(energy), WS_PER_WH, NB_CARRY_CYCLES)
+    cents, cost_remainder = carry(uint64(RATE * max(energy, 0)), COST_PER_CENT, NB_COST_CYCLES)
+
+    return vrms, irms, power, energy, wh, remainder, cents, cost_remainder
+
+
+def exact_cycle(voltage_adc, current_adc):
+    """Works out the same cycle exactly from the same ADC counts."""
+    volts_per_count = Fraction(ADC_VOLTAGE_RANGE_32Q16, MAX_ADC_OUTPUT_32Q16)
+    volts = [volts_per_count * VOLTAGE_RAW_ADC_RATIO * v for v in voltage_adc]
+    amps = [volts_per_count * i for i in current_adc]
+
+    mean_volts = sum(v * v for v in volts) / NB_SAMPLES
+    mean_amps = sum(i * i for i in amps) / NB_SAMPLES
+    power = sum(v * i for v, i in zip(volts, amps)) / NB_SAMPLES
+    energy = power * NB_SAMPLES * Fraction(SAMPLE_PERIOD_NS, 10 ** 9)
+
+    return math.sqrt(mean_volts), math.sqrt(mean_amps), float(power), float(energy)
+
+
+def c_table():
+    print("static const TSelfTestPrimitive Primitives[] =")
+    print("{")
+
+    for operation, a, b in PRIMITIVES:
+        expected = primitive(operation, a, b)
+        print("  {{ {}, {}, {}, {} }},".format(OPERATIONS[operation], c_int(a), c_int(b), c_int(expected)))
+
+    print("};")
+    print()
+    print("static const TSelfTestCycle Cycles[] =")
+    print("{")
+
+    for name, volts, amps, lag, harmonic in CYCLES:
+        voltage, current = samples(volts, amps, lag, harmonic)
+        vrms, irms, power, energy, wh, remainder, cents, cost_remainder = fixed_cycle(voltage, current)
+
+        print("  // {}".format(name))
+        print("  {")
+        print("    {{ {} }},".format(", ".join(str(v) for v in voltage)))
+        print("    {{ {} }},".format(", ".join(str(i) for i in current)))
+        print("    {}, {}, {}, {}LL, {}, {}ULL, {}, {}ULL".format(vrms, irms, power, energy, wh, remainder,
+                                                                cents, cost_remainder))
+        print("  },")
+
+    print("};")
+    print()
+    print("static const TSelfTestFrequency Frequencies[] =")
+    print("{")
+
+    for cycle_ns in FREQUENCIES:
+        print("  {{ {}, {} }},".format(cycle_ns, frequency_times10(cycle_ns)))
+
+    print("};")
+
+
+def c_int(value):
+    """Writes a 32-bit value the way the C table needs it."""
+    if value < -0x7FFFFFFF or value > 0x7FFFFFFF:
+        return "(int32_t) 0x{:08X}".format(uint32(value))
+
+    return str(value)
+
+
+def report():
+    print("{:<36} {:>10} {:>10} {:>10} {:>10} {:>12}".format("Cycle", "Vrms", "Irms", "P", "E Ws", "Error ppm"))
+
+    for name, volts, amps, lag, harmonic in CYCLES:
+        voltage, current = samples(volts, amps, lag, harmonic)
+        vrms, irms, power, energy = fixed_cycle(voltage, current)[:4]
+        exact = exact_cycle(voltage, current)
+        fixed = (vrms / 65536, irms / 65536, power / 65536, energy / 65536)
+
+        # The worst relative error of the four, against the exact value
+        error = max(abs(f - e) / abs(e) for f, e in zip(fixed, exact) if e) * 1e6
+
+        print("{:<36} {:>10.4f} {:>10.4f} {:>10.3f} {:>10.5f} {:>12.0f}".format(name, *fixed, error))
+        print("{:<36} {:>10.4f} {:>10.4f} {:>10.3f} {:>10.5f}".format("  exact", *exact))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--c", action="store_true", help="print the vector tables for SelfTest.c")
+    args = parser.parse_args()
+
+    if args.c:
+        c_table()
+    else:
+        report()
+
+
+if __name__ == "__main__":
+    main()
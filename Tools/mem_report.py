@@ -0,0 +1,246 @@
+#!/usr/bin/env python3
+"""Memory map and RAM budget report for the DEM image.
+
+Reads the map the linker writes for the image (-Wl,-Map) and reports how full each
+memory region is, how much Flash and RAM each module takes, and the largest objects.
+
+    python3 Tools/mem_report.py [--map Debug/Project.map] [--top 15] [--modules]
+
+Initialised data and functions run from RAM take room in both: their image is kept in
+the Flash and copied at startup. With -ffunction-sections and -fdata-sections each
+object has its own input section, so the largest objects are named from those; COMMON
+blocks are listed by module.
+
+Exits with status 1 if a region is over its budget, so the build fails; the budgets
+below can be overridden with --budget REGION=BYTES.
+"""
+
+import argparse
+import os
+import re
+import sys
+
+# Most each region may hold, in bytes. The thread stacks and capture buffers live in m_data,
+# so it keeps 4 KB spare for the next feature; m_data_20000000 holds the functions run from RAM.
+BUDGETS = {
+    "m_text": 0x00070000,
+    "m_data": 0x0000F000,
+    "m_data_20000000": 0x0000F000,
+}
+
+# Output sections that take no room on the target
+NOT_ALLOCATED_RE = re.compile(r"^\.(debug|comment|stab|ARM\.attributes)")
+
+REGION_RE = re.compile(r"^(\S+)\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S+)$")
+PLACEMENT_RE = re.compile(r"^\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)(?:\s+(.*))?$")
+LOAD_RE = re.compile(r"load address 0x([0-9a-f]+)")
+SUFFIX_RE = re.compile(r"\.\d+$")
+
+# Sections the startup copies or clears, named by the prefix GCC gives each object's section
+DATA_PREFIXES = (".text.", ".rodata.", ".data.", ".bss.", ".ramfunc.")
+
+
+def read_map(path):
+    """Returns the regions {name: (origin, length, attributes)} and the list of allocated input sections.
+
+    Each input section is (output section, name, address, size, load address or None, object).
+    """
+    try:
+        with open(path, errors="replace") as mapfile:
+            lines = mapfile.read().splitlines()
+    except OSError as error:
+        sys.exit("Could not read {}: {}".format(path, error))
+
+    regions = {}
+    sections = []
+    output = None
+    load = None
+    pending = None
+    state = None
+
+    for line in lines:
+        if line.startswith("Memory Configuration"):
+            state = "regions"
+            continue
+
+        if line.startswith("Linker script and memory map"):
+            state = "sections"
+            continue
+
+        if state == "regions":
+            match = REGION_RE.match(line)
+
+            if match and match.group(1) != "*default*":
+                regions[match.group(1)] = (int(match.group(2), 16), int(match.group(3), 16), match.group(4))
+
+            continue
+
+        if state != "sections" or not line.strip():
+            continue
+
+        # A long section name is put on a line of its own, with its placement on the next line;
+        # a line like " *(.data*)" is the linker script's pattern, not a section
+        if not line.startswith("  ") and len(line.split()) == 1 and not line.lstrip().startswith("*"):
+            pending = line
+            continue
+
+        match = PLACEMENT_RE.match(line) if pending is not None else None
+
+        if match:
+            fields = [pending.strip()] + list(match.groups())
+            top = not pending.startswith(" ")
+            pending = None
+        else:
+            pending = None
+
+            fields = line.split(None, 3)
+
+            if len(fields) < 3 or not fields[1].startswith("0x") or not fields[2].startswith("0x"):
+                continue
+
+            fields = [fields[0], fields[1][2:], fields[2][2:], fields[3] if len(fields) > 3 else None]
+            top = not line.startswith(" ")
+
+        name, address, size, rest = fields[0], int(fields[1], 16), int(fields[2], 16), fields[3] or ""
+
+        if top:
+            output = None if NOT_ALLOCATED_RE.match(name) else name
+            match = LOAD_RE.search(rest)
+            load = int(match.group(1), 16) - address if match else None
+            continue
+
+        if output is None or size == 0:
+            continue
+
+        # Only initialised sections have an image to load; .bss is given a load address it never uses
+        image = address + load if load and output not in (".bss", "._user_heap_stack") else None
+
+        sections.append((output, name, address, size, image, rest.strip()))
+
+    if not regions:
+        sys.exit("No memory configuration in {}; is it a linker map?".format(path))
+
+    return regions, sections
+
+
+def region_of(regions, address):
+    """Returns the name of the region holding an address, or None."""
+    for name, (origin, length, _) in regions.items():
+        if origin <= address < origin + length:
+            return name
+
+    return None
+
+
+def module_of(output, name, obj):
+    """Returns a short name for the module an input section came from."""
+    if name == "*fill*":
+        return "(stack)" if output == "._user_heap_stack" else "(fill)"
+
+    if not obj:
+        return "(linker)"
+
+    # Archive members are reported by their archive, e.g. libOS.a
+    obj = obj.replace("\\", "/")
+    archive = obj.split("(", 1)[0]
+
+    return os.path.basename(archive if archive != obj else obj)
+
+
+def object_of(name, obj):
+    """Returns the object an input section holds, from its name, or the section and the file it came from."""
+    for prefix in DATA_PREFIXES:
+        if name.startswith(prefix):
+            return SUFFIX_RE.sub("", name[len(prefix):])
+
+    # A whole section of an object built without -ffunction-sections, e.g. the libraries
+    member = obj.replace("\\", "/").rstrip(")").split("(")[-1]
+
+    return "{} ({})".format(name, os.path.basename(member))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--map", default=os.path.join("Debug", "Project.map"), help="linker map of the image")
+    parser.add_argument("--top", type=int, default=15, help="number of the largest objects to list")
+    parser.add_argument("--modules", action="store_true", help="list the Flash and RAM taken by each module")
+    parser.add_argument("--budget", action="append", default=[], metavar="REGION=BYTES",
+                        help="most a region may hold, e.g. m_data=0xE000")
+    args = parser.parse_args()
+
+    budgets = dict(BUDGETS)
+
+    for budget in args.budget:
+        region, _, size = budget.partition("=")
+
+        try:
+            budgets[region] = int(size, 0)
+        except ValueError:
+            sys.exit("Bad budget {}; use REGION=BYTES".format(budget))
+
+    regions, sections = read_map(args.map)
+
+    used = dict.fromkeys(regions, 0)
+    flash = {}
+    ram = {}
+    objects = []
+
+    for output, name, address, size, image, obj in sections:
+        region = region_of(regions, address)
+        module = module_of(output, name, obj)
+
+        if region is None:
+            continue
+
+        used[region] += size
+
+        # Code regions are in the Flash, the rest in RAM
+        usage = flash if "x" in regions[region][2] else ram
+        usage[module] = usage.get(module, 0) + size
+
+        if image is not None:
+            image_region = region_of(regions, image)
+
+            if image_region is not None:
+                used[image_region] += size
+                flash[module] = flash.get(module, 0) + size
+
+        if name != "*fill*":
+            objects.append((size, object_of(name, obj), module, region))
+
+    over = []
+
+    print("{:<18} {:>10} {:>10} {:>10} {:>10} {:>6}".format("Region", "Length", "Used", "Free", "Budget", "Used%"))
+
+    for region, (_, length, _) in regions.items():
+        budget = budgets.get(region, length)
+        percent = 100.0 * used[region] / length if length else 0.0
+        note = ""
+
+        if used[region] > budget:
+            over.append(region)
+            note = "  OVER by {}".format(used[region] - budget)
+
+        print("{:<18} {:>10} {:>10} {:>10} {:>10} {:>5.1f}%{}".format(
+            region, length, used[region], length - used[region], budget, percent, note))
+
+    if args.modules:
+        print()
+        print("{:<24} {:>10} {:>10}".format("Module", "Flash", "RAM"))
+
+        for module in sorted(set(flash) | set(ram), key=lambda m: -(flash.get(m, 0) + ram.get(m, 0))):
+            print("{:<24} {:>10} {:>10}".format(module, flash.get(module, 0), ram.get(module, 0)))
+
+    if args.top > 0:
+        print()
+        print("{:<40} {:>8}  {:<18} {}".format("Object", "Bytes", "Region", "Module"))
+
+        for size, label, module, region in sorted(objects, reverse=True)[:args.top]:
+            print("{:<40} {:>8}  {:<18} {}".format(label, size, region, module))
+
+    if over:
+        sys.exit("Over budget: " + ", ".join(over))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,189 @@
+#!/usr/bin/env python3
+"""Worst-case stack report for the DEM threads.
+
+Reads the frame sizes that -fstack-usage writes next to each object (*.su) and the
+call graph from the disassembly of the linked image, then walks the graph from each
+thread entry to find its deepest call chain.
+
+    python3 Tools/stack_report.py [--build Debug] [--elf Debug/Project.elf]
+
+Indirect calls (through a function pointer) and recursion cannot be followed, so
+chains that contain them are marked and need checking by hand; the HMI state
+functions are called through a pointer from HMI_DisplayCurrentState, for example.
+Interrupts stack onto the running thread, so each thread also needs room for one
+exception frame on top of the figure given here.
+"""
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+
+# Thread entry points and the array each one's stack is
+THREADS = {
+    "ReceiveThread": "ReceiveThreadStack",
+    "TransmitThread": "TransmitThreadStack",
+    "Calc_CalculationThread": "CalculationThreadStack",
+    "RTCThread": "RTCThreadStack",
+    "PacketReceiveThread": "PacketReceiveThreadStack",
+    "HarmonicThread": "HarmonicThreadStack",
+    "IdleThread": "IdleThreadStack",
+}
+
+# Largest exception frame: 8 core registers and 18 FPU words, with alignment; "Need" is the
+# deepest chain plus this, in words, to compare with the size of the stack array
+EXCEPTION_FRAME_BYTES = 108
+
+FUNCTION_RE = re.compile(r"^[0-9a-f]+ <([^>]+)>:$")
+SYMBOL_RE = re.compile(r"^[0-9a-f]+ .{7} \S+\t([0-9a-f]+) (\S+)$")
+CALL_RE = re.compile(r"\tbl(?:x)?\s+[0-9a-f]+ <([^>+]+)>")
+INDIRECT_RE = re.compile(r"\tblx\s+r\d+")
+
+
+def read_frames(build_dir):
+    """Returns {function: (bytes, qualifier)} from every .su file under the build directory."""
+    frames = {}
+
+    for root, _, files in os.walk(build_dir):
+        for name in files:
+            if not name.endswith(".su"):
+                continue
+
+            with open(os.path.join(root, name)) as su:
+                for line in su:
+                    fields = line.rstrip("\n").split("\t")
+
+                    if len(fields) != 3:
+                        continue
+
+                    function = fields[0].rsplit(":", 1)[-1]
+                    size = int(fields[1])
+
+                    # Keep the larger frame if a static function name is used in two files
+                    if size >= frames.get(function, (0, ""))[0]:
+                        frames[function] = (size, fields[2])
+
+    return frames
+
+
+def read_sizes(objdump, elf):
+    """Returns {symbol: size in bytes} from the symbol table of the linked image."""
+    try:
+        table = subprocess.run([objdump, "-t", elf], check=True, capture_output=True, text=True).stdout
+    except (OSError, subprocess.CalledProcessError) as error:
+        sys.exit("Could not read the symbols of {}: {}".format(elf, error))
+
+    sizes = {}
+
+    for line in table.splitlines():
+        match = SYMBOL_RE.match(line)
+
+        if match:
+            sizes[match.group(2)] = int(match.group(1), 16)
+
+    return sizes
+
+
+def read_calls(objdump, elf):
+    """Returns {function: set of callees} and the set of functions making indirect calls."""
+    try:
+        listing = subprocess.run([objdump, "-d", "--no-show-raw-insn", elf],
+                                 check=True, capture_output=True, text=True).stdout
+    except (OSError, subprocess.CalledProcessError) as error:
+        sys.exit("Could not disassemble {}: {}".format(elf, error))
+
+    calls = {}
+    indirect = set()
+    function = None
+
+    for line in listing.splitlines():
+        match = FUNCTION_RE.match(line)
+
+        if match:
+            function = match.group(1)
+            calls.setdefault(function, set())
+            continue
+
+        if function is None:
+            continue
+
+        match = CALL_RE.search(line)
+
+        if match:
+            calls[function].add(match.group(1))
+        elif INDIRECT_RE.search(line):
+            indirect.add(function)
+
+    return calls, indirect
+
+
+def deepest(function, frames, calls, indirect, path, memo):
+    """Returns (bytes, chain, flags) of the deepest call chain from a function."""
+    if function in memo:
+        return memo[function]
+
+    size, qualifier = frames.get(function, (0, "unknown"))
+    flags = set()
+
+    if qualifier != "static":
+        flags.add("{} frame in {}".format(qualifier, function))
+
+    if function in indirect:
+        flags.add("indirect call in {}".format(function))
+
+    best = (0, [], set())
+
+    for callee in sorted(calls.get(function, ())):
+        if callee in path:
+            flags.add("recursion through {}".format(callee))
+            continue
+
+        result = deepest(callee, frames, calls, indirect, path | {callee}, memo)
+
+        if result[0] > best[0]:
+            best = result
+
+        flags |= result[2]
+
+    memo[function] = (size + best[0], [function] + best[1], flags)
+    return memo[function]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--build", default="Debug", help="build directory holding the .su files")
+    parser.add_argument("--elf", default=None, help="linked image; defaults to <build>/Project.elf")
+    parser.add_argument("--objdump", default="arm-none-eabi-objdump")
+    parser.add_argument("--chains", action="store_true", help="print the deepest call chain of each thread")
+    args = parser.parse_args()
+
+    elf = args.elf or os.path.join(args.build, "Project.elf")
+    frames = read_frames(args.build)
+
+    if not frames:
+        sys.exit("No .su files under {}; build with -fstack-usage".format(args.build))
+
+    calls, indirect = read_calls(args.objdump, elf)
+    sizes = read_sizes(args.objdump, elf)
+    memo = {}
+
+    print("{:<24} {:>8} {:>8} {:>8}  {}".format("Thread", "Bytes", "Need", "Size", "Notes"))
+
+    for thread, stack in THREADS.items():
+        used, chain, flags = deepest(thread, frames, calls, indirect, {thread}, memo)
+        words = (used + EXCEPTION_FRAME_BYTES + 3) // 4
+        size_words = sizes.get(stack, 0) // 4
+        note = "OVER" if words > size_words else ""
+
+        if flags:
+            note = (note + " " if note else "") + "check: " + "; ".join(sorted(flags))
+
+        print("{:<24} {:>8} {:>8} {:>8}  {}".format(thread, used, words, size_words, note))
+
+        if args.chains:
+            print("    " + " -> ".join(chain))
+
+
+if __name__ == "__main__":
+    main()